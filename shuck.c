@@ -21,11 +21,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "shuck_builtins.h"
+#include "shuck_cache.h"
+#include "shuck_compile.h"
+#include "shuck_coproc.h"
 #include "shuck_io.h"
+#include "shuck_lex.h"
+#include "shuck_procsub.h"
 #include "shuck_helper.h"
+#include "shuck_history.h"
+#include "shuck_mem.h"
+#include "shuck_profile.h"
+#include "shuck_rc.h"
+#include "shuck_read.h"
+#include "shuck_spawner.h"
+#include "shuck_reader.h"
+#include "shuck_replay.h"
+#include "shuck_table.h"
+#include "shuck_vars.h"
+#include "shuck_watch.h"
 
 #define LAST_COMMAND -1
 
@@ -36,6 +53,13 @@
 //
 static const char *const INTERACTIVE_PROMPT = "shuck& ";
 
+//
+// Continuation prompt:
+//     Displayed in `interactive' mode while reading the rest of a
+//     command that needs more lines, such as a `for' loop.
+//
+static const char *const CONTINUATION_PROMPT = "> ";
+
 //
 // Default path:
 //     If no `$PATH' variable is set in Shuck's environment, we fall
@@ -43,6 +67,21 @@ static const char *const INTERACTIVE_PROMPT = "shuck& ";
 //
 static const char *const DEFAULT_PATH = "/bin:/usr/bin";
 
+//
+// Batch mode:
+//     The number of lines read ahead by `--batch' without a number,
+//     and the size of the buffer output is collected in.
+//
+static const int DEFAULT_BATCH_AHEAD = 16;
+static const size_t BATCH_OUTPUT_BUFFER = 64 * 1024;
+
+//
+// Timeout grace period:
+//     How long a command that has run out of time is given to exit
+//     after SIGTERM before it is sent SIGKILL.
+//
+static const long DEFAULT_KILL_AFTER_MS = 5000;
+
 //
 // Default history shown:
 //     The number of history items shown by default; overridden by the
@@ -52,90 +91,761 @@ static const char *const DEFAULT_PATH = "/bin:/usr/bin";
 static const int DEFAULT_HISTORY_SHOWN __attribute__((unused)) = 10;
 
 //
-// Input line length:
-//     The length of the longest line of input we can read.
+// Pathname length:
+//     The size of the buffers pathnames are built in. Lines of input
+//     may be any length.
 //
 static const size_t MAX_LINE_CHARS = 1024;
 
 //
-// Special characters:
-//     Characters that `tokenize' will return as words by themselves.
-//
-static const char *const SPECIAL_CHARS = "!><|";
-
+// Function nesting:
+//     How deeply function calls may nest before a call fails, to stop
+//     runaway recursion from overflowing the stack.
 //
-// Word separators:
-//     Characters that `tokenize' will use to delimit words.
-//
-static const char *const WORD_SEPARATORS = " \t\r\n";
-
-
-static void execute_command(char **words, char **path, char **environment);
-static void do_exit(char **words, char **path);
-static char **tokenize(char *s, char *separators, char *special_chars);
+static const int MAX_FUNCTION_DEPTH = 1000;
+
+
+static struct reader *start_batch_mode(int ahead);
+static char **tokenize_line(char *line);
+static void replay_line(char *line);
+static const char *run_startup_file(void);
+static double elapsed_ms(struct timespec *since, clockid_t clock);
+static void free_shell(void);
+static char **use_reader_line(struct reader_line *ahead);
+static int execute_line(char **words);
+static void run_plan(struct plan *plan, char **line);
+static void refresh_path(void);
+static void call_function(struct plan *function, char **args, char **line);
+static void execute_pipeline(struct instruction *in, char **words, 
+                             char **line);
+static int run_group(struct plan *body, char **line, int forked);
+static void free_function(void *function);
+static void execute_command(char **words, char **line, char **path,
+                            char **environment);
+static void record_history(char **line);
+static void start_line(void);
+static void finish_line(void);
+static void do_exit(char **words, char **line, char **path);
+static void register_builtins(void);
+static void do_cd(char **glob_words, char **line, char **path, char **env);
+static void do_pwd(char **glob_words, char **line, char **path, char **env);
+static void do_set(char **glob_words, char **line, char **path, char **env);
+static void do_enable(char **glob_words, char **line, char **path, 
+                      char **env);
+static void do_batch(char **glob_words, char **line, char **path, 
+                     char **env);
+static void do_history(char **glob_words, char **line, char **path, 
+                       char **env);
+static void do_history_run(char **glob_words, char **line, char **path, 
+                           char **env);
+static void do_memstats(char **glob_words, char **line, char **path, 
+                        char **env);
+static void do_cache(char **glob_words, char **line, char **path, 
+                     char **env);
+static void do_ulimit(char **glob_words, char **line, char **path, 
+                      char **env);
+static void do_coproc(char **glob_words, char **line, char **path, 
+                      char **env);
+static void do_cowrite(char **glob_words, char **line, char **path, 
+                       char **env);
+static void do_coread(char **glob_words, char **line, char **path, 
+                      char **env);
+static void do_coclose(char **glob_words, char **line, char **path, 
+                       char **env);
+static void do_on_change(char **glob_words, char **line, char **path, 
+                         char **env);
+static void do_read(char **glob_words, char **line, char **path, 
+                    char **env);
+static char **tokenize(char *s, char *separators);
 static void free_tokens(char **tokens);
 
 static FILE *read_shuck_hist();
-static void execute_nth_command(FILE *f, int n, char **path, char **env);
+static void execute_nth_command(FILE *f, int n);
 static int is_integer(char *word);
-static int validate(char **glob_words);
+static int set_timeout(char **glob_words);
 static int check_program(char **glob_words, char **path, char **env, 
                          char *program, char *input_file);
+static int spawn_program(char *pathname, char **env, char **glob_words, 
+                         char **path, char *input_file);
 
-int main (void)
+//
+// Environment variables are pointed to by `environ', an array of
+// strings terminated by a NULL value -- something like:
+//     { "VAR1=value", "VAR2=value", NULL }
+// Assigning to an environment variable may move the array, so it is
+// always read from here rather than passed down.
+//
+extern char **environ;
+
+//
+// Search path:
+//     The directories of `$PATH', rebuilt whenever `$PATH' is assigned,
+//     and the value they were built from.
+//
+static char **search_path = NULL;
+static char *search_path_value = NULL;
+
+//
+// Functions:
+//     The compiled body of every function defined, by name, and how
+//     deeply the function currently running is nested.
+//
+static struct table *functions = NULL;
+static int function_depth = 0;
+
+//
+// Shell process:
+//     The pid of the shell itself, so that a child forked for a group
+//     or subshell can tell that an `exit' is only its own.
+//
+static pid_t shell_pid = 0;
+
+int main (int argc, char *argv[])
 {
-    // Ensure `stdout' is line-buffered for autotesting.
-    setlinebuf(stdout);
+    // Everything before `main' is loading the shell, which takes CPU
+    // time but does not wait for anything, so the CPU time used so far
+    // is the time since it was exec'd
+    struct timespec main_started;
+    struct timespec cpu_started = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &main_started);
+    double before_main_ms = elapsed_ms(&cpu_started, 
+                                       CLOCK_PROCESS_CPUTIME_ID);
+
+    // `shuck-replay ARGS' is `shuck --replay ARGS'
+    char *name = strrchr(argv[0], '/');
+    name = name != NULL ? name + 1 : argv[0];
+    int replay = !strcmp(name, "shuck-replay") ? 1 : 0;
+
+    // `--batch[=N]': read ahead up to N commands while each one runs
+    // `--startup-time': report how long the shell took to start
+    int batch_ahead = 0;
+    bool startup_time = false;
+    for (int i = 1; i < argc && !replay; i++) {
+        if (i == 1 && !strcmp(argv[i], "--replay")) {
+            replay = 2;
+        } else if (!strcmp(argv[i], "--batch")) {
+            batch_ahead = DEFAULT_BATCH_AHEAD;
+        } else if (!strncmp(argv[i], "--batch=", 8) && atoi(argv[i] + 8) > 0) {
+            batch_ahead = atoi(argv[i] + 8);
+        } else if (!strcmp(argv[i], "--startup-time")) {
+            startup_time = true;
+        } else {
+            fprintf(stderr, "usage: %s [--batch[=N]] [--startup-time] | "
+                    "--replay FILE ...\n", argv[0]);
+            return 2;
+        }
+    }
 
-    // Environment variables are pointed to by `environ', an array of
-    // strings terminated by a NULL value -- something like:
-    //     { "VAR1=value", "VAR2=value", NULL }
-    extern char **environ;
+    shell_pid = getpid();
+
+    // The spawn helper is forked while the shell is still small, and
+    // before it has started any threads
+    start_spawner();
 
     // Grab the `PATH' environment variable for our path.
     // If it isn't set, use the default path defined above.
-    char *pathp;
-    if ((pathp = getenv("PATH")) == NULL) {
-        pathp = (char *) DEFAULT_PATH;
+    refresh_path();
+    register_builtins();
+
+    if (replay) {
+        int status = replay_history(&argv[replay], tokenize_line, 
+                                    replay_line);
+        free_shell();
+        return status;
     }
-    char **path = tokenize(pathp, ":", "");
+
+    // Run `~/.shuckrc', which may change `$PATH' for the reader below
+    const char *startup_source = run_startup_file();
 
     // Should this shell be interactive?
     bool interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
 
+    struct reader *reader = NULL;
+    if (batch_ahead > 0) {
+        reader = start_batch_mode(batch_ahead);
+    } else {
+        // Ensure `stdout' is line-buffered for autotesting.
+        setlinebuf(stdout);
+    }
+
+    // Lines of a command that is not finished yet, e.g. a `for' loop
+    // still waiting for its `done'
+    char *pending = NULL;
+
+    // Lines are read whole, however long they are
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+
+    if (startup_time) {
+        fprintf(stderr, "startup: %.3f ms (%.3f ms loading, %s)\n", 
+                before_main_ms + elapsed_ms(&main_started, CLOCK_MONOTONIC),
+                before_main_ms, startup_source);
+    }
+
     // Main loop: print prompt, read line, execute command
     while (1) {
         // If `stdout' is a terminal (i.e., we're an interactive shell),
         // print a prompt before reading a line of input.
-        if (interactive) {
-            fputs(INTERACTIVE_PROMPT, stdout);
+        if (interactive && reader == NULL) {
+            fputs(pending == NULL ? INTERACTIVE_PROMPT : CONTINUATION_PROMPT,
+                  stdout);
             fflush(stdout);
         }
 
-        char line[MAX_LINE_CHARS];
-        if (fgets(line, MAX_LINE_CHARS, stdin) == NULL)
+        char *line = NULL;
+        struct reader_line *ahead = NULL;
+        if (reader != NULL) {
+            ahead = next_line(reader);
+            line = ahead != NULL ? ahead->line : NULL;
+        } else if (getline(&buffer, &buffer_size, stdin) != -1) {
+            line = buffer;
+        }
+        if (line == NULL) {
+            if (pending != NULL) {
+                fprintf(stderr, "syntax error: unexpected end of file\n");
+                free(pending);
+            }
             break;
+        }
 
         // Tokenise and execute the input line.
-        char **command_words =
-            tokenize(line, (char *) WORD_SEPARATORS, (char *) SPECIAL_CHARS);
-        execute_command(command_words, path, environ);
-        free_tokens(command_words);
+        // Continued lines are joined as if separated by `;'
+        char **command_words;
+        if (pending != NULL) {
+            char *joined = malloc(strlen(pending) + strlen(line) + 4);
+            assert(joined != NULL);
+            sprintf(joined, "%s ; %s", pending, line);
+            free(pending);
+            pending = joined;
+            command_words = tokenize_line(pending);
+        } else if (ahead != NULL) {
+            command_words = use_reader_line(ahead);
+        } else {
+            command_words = tokenize_line(line);
+        }
+
+        // A line with a quote left open is an error, and so is a
+        // command it was continuing
+        int result = COMPILE_ERROR;
+        if (command_words != NULL) {
+            result = execute_line(command_words);
+            free_tokens(command_words);
+        } else {
+            set_exit_status(2);
+        }
+
+        if (result != COMPILE_INCOMPLETE) {
+            free(pending);
+            pending = NULL;
+        } else if (pending == NULL) {
+            pending = strdup(line);
+        }
+        free_reader_line(ahead);
     }
 
-    free_tokens(path);
+    free(buffer);
+    free_reader(reader);
+    free_shell();
     return 0;
 }
 
 
 //
-// Execute a command, and wait until it finishes.
+// Free everything the shell has allocated, before it exits. With
+// `$SHUCK_MEMSTATS' set, what is still allocated after that is
+// reported, which is anything leaked.
+//
+static void free_shell(void)
+{
+    bool report = get_var("SHUCK_MEMSTATS") != NULL;
+
+    free_tokens(search_path);
+    search_path = NULL;
+    free(search_path_value);
+    search_path_value = NULL;
+    free_vars();
+    clear_executable_cache();
+    free_startup_programs();
+    table_free(functions, free_function);
+    functions = NULL;
+    free_builtins();
+    free_history_index();
+    free_coprocs();
+    free_read_buffer();
+    stop_spawner();
+
+    if (report) {
+        print_memstats(stderr);
+    }
+}
+
+
+//
+// Start batch mode: the shell's input is read by a reader thread,
+// which keeps up to `ahead' lines tokenized, with their programs
+// looked up, while commands run. Commands get /dev/null as their
+// standard input, since the shell's input has been read ahead, and
+// output is fully buffered, flushed before each command is spawned.
+//
+static struct reader *start_batch_mode(int ahead)
+{
+    int input = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    int null = open("/dev/null", O_RDONLY);
+    if (input == -1 || null == -1) {
+        perror("batch");
+        exit(1);
+    }
+    dup2(null, STDIN_FILENO);
+    close(null);
+
+    setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+    return start_reader(input, ahead, tokenize_line, search_path_value);
+}
+
+
+//
+// Split a line of input into words, as described in shuck_lex.h.
+// Returns NULL, having printed an error, if a quote is not closed.
+//
+static char **tokenize_line(char *line)
+{
+    profile_begin(PROFILE_TOKENIZE);
+    char **words = lex_words(line);
+    profile_end();
+    return words;
+}
+
+
+//
+// Run a line for `shuck-replay', picking up the `$PATH' it has set.
+//
+static void replay_line(char *line)
+{
+    refresh_path();
+    char **words = tokenize_line(line);
+    if (words != NULL) {
+        execute_line(words);
+        free_tokens(words);
+    }
+}
+
+
+//
+// Run the commands of the startup file, `~/.shuckrc', compiled or
+// from its snapshot (shuck_rc.h), then fill the executable cache.
+// They are not recorded in the history. Returns where the commands
+// came from, for `--startup-time'.
+//
+static const char *run_startup_file(void)
+{
+    struct startup *startup = load_startup(tokenize_line);
+    if (startup == NULL) {
+        return "no " RC_FILE;
+    }
+    const char *source = startup->from_snapshot ? 
+                         RC_FILE " from snapshot" : RC_FILE " compiled";
+    for (int i = 0; i < startup->num_plans; i++) {
+        start_line();
+        run_plan(&startup->plans[i], NULL);
+        finish_line();
+    }
+    finish_startup(startup, search_path_value, search_path);
+    return source;
+}
+
+
+//
+// Milliseconds of `clock' since `since'.
+//
+static double elapsed_ms(struct timespec *since, clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + 
+           (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+
+//
+// Take the words of a line that was read ahead, and cache where its
+// program was found if `$PATH' has not changed since.
+//
+static char **use_reader_line(struct reader_line *ahead)
+{
+    if (ahead->pathname != NULL && 
+        !strcmp(ahead->path_value, search_path_value)) {
+        cache_executable_path(ahead->program, ahead->pathname);
+    }
+    char **words = ahead->words;
+    ahead->words = NULL;
+    return words;
+}
+
+
+//
+// The line currently being executed: whether it has been written to
+// the history file yet (a command list is only ever recorded once),
+// and when and where it started, for the stats written after it.
+//
+struct line_state {
+    bool recorded;
+    bool finished;
+    struct timespec started;
+    struct history_stats stats;
+};
+static struct line_state current_line;
+
+//
+// Execute a command line. The line is compiled once into a plan, in
+// which `;', `&&', `||', `if', `for', `while' and `until' are jumps
+// between its commands, and the plan is then run.
 //
 //  * `words': a NULL-terminated array of words from the input command line
+//
+// Returns COMPILE_INCOMPLETE, without running anything, if the line
+// needs more input to finish a command.
+//
+static int execute_line(char **words)
+{
+    assert(words != NULL);
+
+    struct plan plan;
+    profile_begin(PROFILE_VALIDATE);
+    int result = compile_line(words, &plan);
+    profile_end();
+    if (result == COMPILE_ERROR) {
+        set_exit_status(2);
+    }
+    if (result != COMPILE_OK) {
+        return result;
+    }
+
+    // A line may be executed from inside another (e.g. by `!'),
+    // in which case it gets its own history entry
+    struct line_state outer_line = current_line;
+    start_line();
+
+    run_plan(&plan, words);
+
+    finish_line();
+    current_line = outer_line;
+    free_plan(&plan);
+    return result;
+}
+
+
+//
+// Run the instructions of a compiled plan. Only variable expansion
+// (and globbing) is redone each time an instruction runs.
+//
+//  * `plan': the compiled line
+//  * `line': the words the plan was compiled from, for history
+//
+static void run_plan(struct plan *plan, char **line)
+{
+    // The items and position of each for loop
+    struct loop_state {
+        char **items;
+        int next;
+    } *loops = calloc(plan->num_loops, sizeof *loops);
+
+    int pc = 0;
+    while (pc < plan->size) {
+        struct instruction *in = &plan->code[pc];
+        pc++;
+
+        switch (in->op) {
+        case OP_COMMAND:
+        case OP_ASSIGN: {
+            char **words = expand_words(in->words);
+            if (words == NULL) {
+                set_exit_status(1);
+                break;
+            }
+            if (in->op == OP_ASSIGN) {
+                unquote_words(words);
+                assign_words(words);
+                refresh_path();
+                set_exit_status(0);
+                record_history(line);
+            } else {
+                // Process substitutions run alongside the command
+                struct substitutions *subs = 
+                    start_substitutions(words, tokenize_line, search_path, 
+                                        environ);
+                execute_command(words, line, search_path, environ);
+                finish_substitutions(subs);
+            }
+            free_array(words);
+            break;
+        }
+        case OP_JUMP:
+            pc = in->target;
+            break;
+        case OP_JUMP_IF_FAIL:
+            if (get_exit_status() != 0) {
+                pc = in->target;
+            }
+            break;
+        case OP_JUMP_IF_OK:
+            if (get_exit_status() == 0) {
+                pc = in->target;
+            }
+            break;
+        case OP_STATUS:
+            set_exit_status(in->value);
+            break;
+        case OP_FOR_INIT: {
+            struct loop_state *loop = &loops[in->slot];
+            free_array(loop->items);
+            loop->items = NULL;
+            loop->next = 0;
+            char **words = expand_words(in->words);
+            if (words != NULL) {
+                loop->items = init_glob_words(words);
+                unquote_words(loop->items);
+                free_array(words);
+            }
+            set_exit_status(0);
+            break;
+        }
+        case OP_FOR_NEXT: {
+            struct loop_state *loop = &loops[in->slot];
+            if (loop->items == NULL || loop->items[loop->next] == NULL) {
+                pc = in->target;
+            } else {
+                set_var(in->name, loop->items[loop->next]);
+                loop->next++;
+            }
+            break;
+        }
+        case OP_FUNCTION:
+            if (functions == NULL) {
+                functions = table_new();
+            }
+            in->body->refs++;
+            free_function(table_set(functions, in->name, in->body));
+            set_exit_status(0);
+            record_history(line);
+            break;
+        case OP_RETURN:
+            if (in->value >= 0) {
+                set_exit_status(in->value);
+            }
+            pc = plan->size;
+            break;
+        case OP_PIPELINE: {
+            char **words = expand_words(in->words);
+            if (words == NULL) {
+                set_exit_status(1);
+                break;
+            }
+            struct substitutions *subs = 
+                start_substitutions(words, tokenize_line, search_path, 
+                                    environ);
+            execute_pipeline(in, words, line);
+            finish_substitutions(subs);
+            free_array(words);
+            break;
+        }
+        }
+    }
+
+    for (int i = 0; i < plan->num_loops; i++) {
+        free_array(loops[i].items);
+    }
+    free(loops);
+}
+
+
+//
+// Call a function, running its body with `args' as the positional
+// parameters. The body stays alive while it runs, even if it
+// redefines the function.
+//
+static void call_function(struct plan *function, char **args, char **line)
+{
+    if (function_depth >= MAX_FUNCTION_DEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", 
+                args[0]);
+        set_exit_status(1);
+        return;
+    }
+
+    function->refs++;
+    function_depth++;
+    char **outer_args = set_positional(args);
+
+    run_plan(function, line);
+
+    set_positional(outer_args);
+    function_depth--;
+    release_plan(function);
+}
+
+
+//
+// Run a pipeline with groups of commands among its stages, and wait
+// until it finishes. The line is recorded in the history first, so
+// that the commands of the groups, which may run in a child of the
+// shell, do not record it again.
+//
+//  * `in': the OP_PIPELINE instruction, with the pipeline's groups
+//  * `words': the pipeline's words, expanded
+//  * `line': the whole command list `words' came from, for history
+//
+static void execute_pipeline(struct instruction *in, char **words, 
+                             char **line)
+{
+    profile_begin(PROFILE_GLOB);
+    char **glob_words = init_glob_words(words);
+    profile_end();
+    if (glob_words == NULL) {
+        set_exit_status(1);
+        return;
+    }
+    unquote_plain_words(glob_words);
+    record_history(line);
+
+    // The pipeline's stages may read the shell's input, or a group
+    // may have its own
+    release_read_buffer();
+
+    if (set_timeout(glob_words)) {
+        set_exit_status(2);
+    } else {
+        profile_begin(PROFILE_SPAWN);
+        int result = run_pipeline(glob_words, in->groups, in->value, 
+                                  run_group, line, search_path, environ);
+        profile_end();
+        if (result != 1) {
+            set_exit_status(1);
+        }
+    }
+    free_array(glob_words);
+}
+
+
+//
+// Run the commands of a group in a pipeline, returning their exit
+// status. A group forked into a child of the shell has nothing to
+// add to the history when it finishes; its parent does that.
+//
+static int run_group(struct plan *body, char **line, int forked)
+{
+    if (forked) {
+        current_line.finished = true;
+    }
+    run_plan(body, line);
+    return get_exit_status();
+}
+
+
+//
+// Free a function body that is no longer defined.
+//
+static void free_function(void *function)
+{
+    if (function != NULL) {
+        release_plan(function);
+    }
+}
+
+
+//
+// Rebuild the search path if `$PATH' has changed since it was built.
+// Cached executable pathnames are forgotten along with the old path.
+//
+static void refresh_path(void)
+{
+    // If `$PATH' isn't set, use the default path defined above.
+    char *pathp;
+    if ((pathp = get_var("PATH")) == NULL) {
+        pathp = (char *) DEFAULT_PATH;
+    }
+    if (search_path_value != NULL && !strcmp(search_path_value, pathp)) {
+        return;
+    }
+
+    if (search_path != NULL) {
+        free_tokens(search_path);
+        free(search_path_value);
+        clear_executable_cache();
+    }
+    search_path_value = strdup(pathp);
+    search_path = tokenize(pathp, ":");
+}
+
+
+//
+// Append the current line to the history, if it has not been already.
+// Builtins run as stages of a pipeline have no `line', the pipeline
+// being recorded once it has finished.
+//
+static void record_history(char **line)
+{
+    if (line == NULL || current_line.recorded) {
+        return;
+    }
+
+    current_line.recorded = true;
+    profile_begin(PROFILE_HISTORY);
+    add_to_history(line);
+    profile_end();
+}
+
+
+//
+// Note when and where the current line started.
+//
+static void start_line(void)
+{
+    current_line.recorded = false;
+    current_line.finished = false;
+    clock_gettime(CLOCK_MONOTONIC, &current_line.started);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    current_line.stats.start = now.tv_sec + now.tv_nsec / 1e9;
+    current_line.stats.cwd = getcwd(NULL, 0);
+}
+
+
+//
+// Append how long the current line took and how it finished to the
+// history, once, if the line was recorded there.
+//
+static void finish_line(void)
+{
+    if (!current_line.finished && current_line.recorded) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        current_line.stats.duration_ms = 
+            (now.tv_sec - current_line.started.tv_sec) * 1000 +
+            (now.tv_nsec - current_line.started.tv_nsec) / 1000000;
+        current_line.stats.status = get_exit_status();
+        profile_begin(PROFILE_HISTORY);
+        add_history_stats(&current_line.stats);
+        profile_end();
+    }
+    if (!current_line.finished) {
+        free(current_line.stats.cwd);
+        current_line.stats.cwd = NULL;
+    }
+    current_line.finished = true;
+}
+
+
+//
+// Execute a command, and wait until it finishes.
+//
+//  * `words': a NULL-terminated array of words from the command
+//  * `line': the whole command list `words' came from, for history
 //  * `path': a NULL-terminated array of directories to search in;
 //  * `environment': a NULL-terminated array of environment variables.
 //
-static void execute_command(char **words, char **path, char **environment)
+static void execute_command(char **words, char **line, char **path,
+                            char **environment)
 {
     assert(words != NULL);
     assert(path != NULL);
@@ -149,116 +859,145 @@ static void execute_command(char **words, char **path, char **environment)
     }
     
     if (strcmp(program, "exit") == 0) {
-        add_to_history(words);
-        do_exit(words, path);
+        record_history(line);
+        finish_line();
+        do_exit(words, line, path);
         // `do_exit' will only return if there was an error.
         return;
     }
 
     // Expand pattern words
+    profile_begin(PROFILE_GLOB);
     char **glob_words = init_glob_words(words);
+    profile_end();
     if (glob_words == NULL) {
+        set_exit_status(1);
         return;
     }
 
+    // Quoted words are used as they are from here on, except quoted
+    // operators, which must not be taken for real ones until they
+    // are passed to a program
+    unquote_plain_words(glob_words);
+
     // First word could have been pattern
     // so need to update new program
     program = glob_words[0];
 
-    // Ensures that command line has valid I/O redirections
-    // pipes and if there are builtin commands in command line, that they
-    // do not have I/O redirections and pipes aswell
-    if (validate(glob_words)) {
+    // Bound how long the command may run, either with the `timeout'
+    // builtin or `$SHUCK_CMD_TIMEOUT'
+    if (set_timeout(glob_words)) {
+        set_exit_status(2);
         free_array(glob_words);
         return;
     }
-    
-
-    // Change directory
-    if (!strcmp(program, "cd")) {
-        if (change_directory(glob_words)) {
-            add_to_history(words);
-        }
+    program = glob_words[0];
+    if (program == NULL) {
+        fprintf(stderr, "timeout: command required\n");
+        set_exit_status(2);
         free_array(glob_words);
         return;
     }
 
-    // Show current directory
-    if (!strcmp(program, "pwd")) {
-        if (current_directory(glob_words)) {
-            add_to_history(words);
-        }
+    // I/O redirections and pipes were validated when the command
+    // was compiled
+
+    // Builtins, including those loaded by `enable', which may take
+    // their input from a file
+    char *name = program;
+    if (!strcmp(program, "<") && glob_words[1] != NULL) {
+        name = glob_words[2];
+    }
+    struct builtin *builtin = find_builtin(name);
+
+    // Anything but a builtin that only reads its arguments may read the
+    // shell's input, so `read' gives back what it has buffered of it
+    if (builtin == NULL || builtin->plugin != NULL || 
+        builtin->redirects || (builtin->pipes && builtin->run != do_read)) {
+        release_read_buffer();
+    }
+    int piped = name != program || first_output(glob_words) != -1;
+    for (int i = 0; !piped && glob_words[i] != NULL; i++) {
+        piped = !strcmp(glob_words[i], "|");
+    }
+    if (builtin != NULL && builtin->plugin != NULL && !piped) {
+        unquote_words(glob_words);
+        set_exit_status(run_plugin(builtin, glob_words, environment, 
+                                   STDIN_FILENO, STDOUT_FILENO));
+        refresh_path();
+        record_history(line);
         free_array(glob_words);
         return;
     }
-
-    // Check if progam is executable
-    int prog = check_program(glob_words, path, environment, program, NULL);
-    if (prog) { // Program is executable
-        add_to_history(words);
+    if (builtin != NULL && builtin->pipes && piped) {
+        // Run on a thread of the shell, or forked (BUILTIN_FORKS),
+        // connected to the rest of the pipeline and to the files it
+        // reads from or writes to
+        profile_begin(PROFILE_SPAWN);
+        int result = run_pipeline(glob_words, NULL, 0, NULL, NULL, 
+                                  path, environment);
+        profile_end();
+        if (result != 1) {
+            set_exit_status(1);
+        }
+        record_history(line);
         free_array(glob_words);
         return;
     }
-
-    // Print nth last history commands
-    if (!strcmp(program, "history")) {
-        // Check if valid argument size
-        if (array_size(glob_words) > 2) {
-            fprintf(stderr, "history: too many arguments\n");
-            free_array(glob_words);
-            add_to_history(words);
-            return;
+    if (builtin != NULL) {
+        if (!builtin->redirects) {
+            unquote_words(glob_words);
         }
+        builtin->run(glob_words, line, path, environment);
+        free_array(glob_words);
+        return;
+    }
 
-        FILE *f = read_shuck_hist();
-
-        if (words[1] == NULL) {
-            // Get path to shuck_history file
-            // Print last 10 commands in 
-            // history file
-            if (f != NULL) {
-                print_nth_history(f, DEFAULT_HISTORY_SHOWN);
-                fclose(f);
-            }
-        }
-        else {
-            int n;
-            if ((n = is_integer(words[1])) > 0 && f != NULL) {
-                print_nth_history(f, n);
+    // Run a shell function in the shell itself
+    struct plan *function = NULL;
+    if (functions != NULL) {
+        function = table_get(functions, program);
+    }
+    if (function != NULL) {
+        record_history(line);
+        for (int i = 0; glob_words[i] != NULL; i++) {
+            if (!strcmp(glob_words[i], "|") || !strcmp(glob_words[i], "<") ||
+                !strcmp(glob_words[i], ">")) {
+                fprintf(stderr, 
+                        "%s: I/O redirection not permitted for functions\n", 
+                        program);
+                set_exit_status(1);
+                free_array(glob_words);
+                return;
             }
         }
+        unquote_words(glob_words);
+        call_function(function, glob_words, line);
         free_array(glob_words);
-        add_to_history(words);
         return;
     }
 
-    // Execute last nth program from shuck_history
-    if (!strcmp(program, "!")) {
-        // Check if valid arguments size
-        if (array_size(glob_words) > 2) {
-            fprintf(stderr, "!: too many arguments\n");
-            free_array(glob_words);
-            return;
-        }
+    // Scheduling prefixes are applied when the program is spawned,
+    // so the program to run is the word after them
+    int prefix = sched_prefix_length(glob_words);
+    if (prefix < 0) {
+        // Parse it again to report what is wrong with it
+        free_sched_options(parse_sched_prefix(glob_words, -1, &prefix));
+        set_exit_status(2);
+        free_array(glob_words);
+        return;
+    }
+    if (prefix > 0) {
+        program = glob_words[prefix];
+    }
 
-        FILE *f = read_shuck_hist();
-        // Execute last command in history
-        if (f == NULL) {
-            fprintf(stderr, "!: invalid history reference\n");
-        } 
-        // Execute last command
-        else if (words[1] == NULL) {
-            execute_nth_command(f, LAST_COMMAND, path, environment);
-            fclose(f);
-        }
-        // Execute nth command in history if valid
-        else {
-            int n;
-            if ((n = is_integer(words[1])) >= 0) {
-                execute_nth_command(f, n, path, environment);
-                fclose(f);
-            }
+    // Check if progam is executable
+    int prog = check_program(glob_words, path, environment, program, NULL);
+    if (prog) { // Program is executable
+        if (prog != 1) {
+            set_exit_status(1);
         }
+        record_history(line);
         free_array(glob_words);
         return;
     }
@@ -266,20 +1005,26 @@ static void execute_command(char **words, char **path, char **environment)
     // Input redirection
     if (!strcmp(program, "<")) {
         char *filename = glob_words[1];
+        unquote_word(filename);
         struct stat s;
 
         // Check filename is valid
         if (stat(filename, &s) != 0) {
             perror(filename);
+            set_exit_status(1);
             free_array(glob_words);
             return;
         }
-        // Progam is at glob_words[2] 
-        program = glob_words[2];
+        // Progam is at glob_words[2], after any scheduling prefix
+        prefix = sched_prefix_length(&glob_words[2]);
+        program = glob_words[2 + (prefix > 0 ? prefix : 0)];
         int p = check_program(glob_words, path, environment, program, 
                               filename);
         if (p) { // Program is executable
-            add_to_history(words);
+            if (p != 1) {
+                set_exit_status(1);
+            }
+            record_history(line);
             free_array(glob_words);
             return;
         }
@@ -287,12 +1032,395 @@ static void execute_command(char **words, char **path, char **environment)
 
     // Command could not be executed
     fprintf(stderr, "%s: command not found\n", program);
+    set_exit_status(127);
     free_array(glob_words);
-    add_to_history(words);
+    record_history(line);
     return;
 }
 
 
+//
+// Add the builtins that are part of the shell to the table they are
+// dispatched from. `exit' and `timeout' are handled before the
+// command's words are expanded, so are not in it.
+//
+static void register_builtins(void)
+{
+    register_builtin("cd", do_cd, 0);
+    register_builtin("pwd", do_pwd, BUILTIN_PIPES);
+    register_builtin("set", do_set, BUILTIN_PIPES | BUILTIN_FORKS);
+    register_builtin("enable", do_enable, BUILTIN_PIPES | BUILTIN_FORKS);
+    register_builtin("batch", do_batch, BUILTIN_REDIRECTS);
+    register_builtin("history", do_history, BUILTIN_PIPES);
+    register_builtin("!", do_history_run, 0);
+    register_builtin("memstats", do_memstats, BUILTIN_PIPES);
+    register_builtin("cache", do_cache, BUILTIN_PIPES | BUILTIN_FORKS);
+    register_builtin("ulimit", do_ulimit, BUILTIN_PIPES | BUILTIN_FORKS);
+    register_builtin("coproc", do_coproc, BUILTIN_REDIRECTS);
+    register_builtin("cowrite", do_cowrite, 0);
+    register_builtin("coread", do_coread, BUILTIN_PIPES);
+    register_builtin("coclose", do_coclose, 0);
+    register_builtin("on-change", do_on_change, BUILTIN_REDIRECTS);
+    register_builtin("read", do_read, BUILTIN_PIPES);
+}
+
+
+//
+// Implement the `cd' shell built-in, which changes directory.
+//
+static void do_cd(char **glob_words, char **line, char **path, char **env)
+{
+    (void) path;
+    (void) env;
+    int changed = change_directory(glob_words);
+    if (changed) {
+        record_history(line);
+    }
+    set_exit_status(!changed);
+}
+
+
+//
+// Implement the `pwd' shell built-in, which shows the current directory.
+//
+static void do_pwd(char **glob_words, char **line, char **path, char **env)
+{
+    (void) path;
+    (void) env;
+    int shown = current_directory(glob_words);
+    if (shown) {
+        record_history(line);
+    }
+    set_exit_status(!shown);
+}
+
+
+//
+// Implement the `set' shell built-in, which changes shell options.
+//
+static void do_set(char **glob_words, char **line, char **path, char **env)
+{
+    (void) path;
+    (void) env;
+    int changed = set_option(glob_words);
+    if (changed) {
+        record_history(line);
+    }
+    set_exit_status(!changed);
+}
+
+
+//
+// Implement the `enable' shell built-in, which loads builtins from
+// shared libraries.
+//
+// Synopsis: enable [-f library name... | -d name...]
+//
+static void do_enable(char **glob_words, char **line, char **path, 
+                      char **env)
+{
+    (void) path;
+    (void) env;
+    int enabled = enable_builtins(glob_words);
+    record_history(line);
+    set_exit_status(!enabled);
+}
+
+
+//
+// Implement the `batch' shell built-in, which runs a program as many
+// times as its arguments need.
+//
+static void do_batch(char **glob_words, char **line, char **path, 
+                     char **env)
+{
+    int result = run_batched(glob_words, path, env);
+    if (result == 0) {
+        fprintf(stderr, "%s: command not found\n", glob_words[1]);
+        set_exit_status(127);
+    } else if (result == 2) {
+        set_exit_status(1);
+    }
+    record_history(line);
+}
+
+
+//
+// Implement the `history' shell built-in, which prints the nth last
+// history commands, or answers a query about how long they took and
+// how they finished.
+//
+// Synopsis: history [n] | history --slowest [n] | history --stats
+//           | history --failed [n]
+//
+static void do_history(char **glob_words, char **line, char **path, 
+                       char **env)
+{
+    (void) path;
+    (void) env;
+    if (glob_words[1] != NULL && !strncmp(glob_words[1], "--", 2)) {
+        set_exit_status(query_history(glob_words) ? 0 : 1);
+        record_history(line);
+        return;
+    }
+
+    // Check if valid argument size
+    if (array_size(glob_words) > 2) {
+        fprintf(stderr, "history: too many arguments\n");
+        set_exit_status(1);
+        record_history(line);
+        return;
+    }
+
+    FILE *f = read_shuck_hist();
+    set_exit_status(0);
+
+    if (glob_words[1] == NULL) {
+        // Get path to shuck_history file
+        // Print last 10 commands in 
+        // history file
+        if (f != NULL) {
+            print_nth_history(f, DEFAULT_HISTORY_SHOWN);
+            fclose(f);
+        }
+    }
+    else {
+        int n;
+        if ((n = is_integer(glob_words[1])) > 0 && f != NULL) {
+            print_nth_history(f, n);
+        } else if (n < 0) {
+            set_exit_status(1);
+        }
+        if (f != NULL) {
+            fclose(f);
+        }
+    }
+    record_history(line);
+}
+
+
+//
+// Implement the `!' shell built-in, which executes the last or nth
+// program from the history.
+//
+static void do_history_run(char **glob_words, char **line, char **path, 
+                           char **env)
+{
+    (void) line;
+    (void) path;
+    (void) env;
+    // Check if valid arguments size
+    if (array_size(glob_words) > 2) {
+        fprintf(stderr, "!: too many arguments\n");
+        set_exit_status(1);
+        return;
+    }
+
+    FILE *f = read_shuck_hist();
+    // Execute last command in history
+    if (f == NULL) {
+        fprintf(stderr, "!: invalid history reference\n");
+        set_exit_status(1);
+    } 
+    // Execute last command
+    else if (glob_words[1] == NULL) {
+        execute_nth_command(f, LAST_COMMAND);
+        fclose(f);
+    }
+    // Execute nth command in history if valid
+    else {
+        int n;
+        if ((n = is_integer(glob_words[1])) >= 0) {
+            execute_nth_command(f, n);
+            fclose(f);
+        } else {
+            set_exit_status(1);
+        }
+    }
+}
+
+
+//
+// Implement the `memstats' shell built-in, which prints the bytes and
+// blocks each subsystem of the shell has allocated and not yet freed,
+// how many allocations it has made in all, and the resident set size.
+// Unless the shell was built to count allocations (shuck_mem.h), only
+// the bytes allocated in all are known.
+//
+static void do_memstats(char **glob_words, char **line, char **path, 
+                        char **env)
+{
+    (void) path;
+    (void) env;
+    if (glob_words[1] != NULL) {
+        fprintf(stderr, "memstats: too many arguments\n");
+        set_exit_status(1);
+        record_history(line);
+        return;
+    }
+    print_memstats(builtin_stdout());
+    set_exit_status(0);
+    record_history(line);
+}
+
+
+//
+// Implement the `cache' shell built-in, which runs a command only if
+// its output is not already in the cache (shuck_cache.h).
+//
+// Synopsis: cache [--key-files file... --] command [arg...]
+// Examples:
+//     % cache wc -l big.log
+//     % cache --key-files Makefile src/main.c -- make -n | grep cc
+//
+static void do_cache(char **glob_words, char **line, char **path, 
+                     char **env)
+{
+    set_exit_status(run_cached(glob_words, path, env));
+    record_history(line);
+}
+
+
+//
+// Implement the `ulimit' shell built-in, which shows or sets the
+// resource limits of the shell, and so of every program it runs. A
+// single command is limited with the `limit' prefix (shuck_sched.h).
+//
+// Synopsis: ulimit [-HS] [-a | -cdfnstuv [limit]]
+// Examples:
+//     % ulimit -a
+//     % ulimit -n 4096
+//     % ulimit -S -v unlimited
+//
+static void do_ulimit(char **glob_words, char **line, char **path, 
+                      char **env)
+{
+    (void) path;
+    (void) env;
+    int status = run_ulimit(glob_words, builtin_stdout());
+    if (status == 0) {
+        sync_spawner_limits();
+    }
+    set_exit_status(status);
+    record_history(line);
+}
+
+
+//
+// Implement the `coproc' shell built-in, which starts a command that
+// keeps running, with its standard input and output connected to the
+// shell, or lists those running (shuck_coproc.h).
+//
+// Synopsis: coproc [NAME command [arg...] [| command...]]
+// Examples:
+//     % coproc calc bc -l
+//     % coproc words tr a-z A-Z | cat -u
+//     % coproc
+//
+static void do_coproc(char **glob_words, char **line, char **path, 
+                      char **env)
+{
+    set_exit_status(run_coproc(glob_words, path, env, builtin_stdout()));
+    record_history(line);
+}
+
+
+//
+// Implement the `cowrite' shell built-in, which writes its words as
+// one line to a coprocess.
+//
+// Synopsis: cowrite NAME [word...]
+// Examples:
+//     % cowrite calc 2^64
+//     % cowrite calc "s(1) * $x"
+//
+static void do_cowrite(char **glob_words, char **line, char **path, 
+                       char **env)
+{
+    (void) path;
+    (void) env;
+    set_exit_status(run_cowrite(glob_words));
+    record_history(line);
+}
+
+
+//
+// Implement the `coread' shell built-in, which reads one line of a
+// coprocess's output into a variable, or prints it.
+//
+// Synopsis: coread [-t time] NAME [VAR]
+// Examples:
+//     % coread calc answer
+//     % coread -t 2s calc
+//
+static void do_coread(char **glob_words, char **line, char **path, 
+                      char **env)
+{
+    (void) path;
+    (void) env;
+    set_exit_status(run_coread(glob_words, builtin_stdout()));
+    record_history(line);
+}
+
+
+//
+// Implement the `coclose' shell built-in, which closes a coprocess's
+// input and output and waits for it, taking its exit status.
+//
+// Synopsis: coclose NAME
+// Examples:
+//     % coclose calc
+//
+static void do_coclose(char **glob_words, char **line, char **path, 
+                       char **env)
+{
+    (void) path;
+    (void) env;
+    set_exit_status(run_coclose(glob_words));
+    record_history(line);
+}
+
+
+//
+// Implement the `on-change' shell built-in, which runs a command and
+// runs it again whenever the files given change (shuck_watch.h).
+//
+// Synopsis: on-change [--debounce time] [--cancel | --queue] path... -- 
+//               command
+// Examples:
+//     % on-change src Makefile -- make
+//     % on-change --cancel --debounce 300 *.md -- ./publish | tail -1
+//
+static void do_on_change(char **glob_words, char **line, char **path, 
+                         char **env)
+{
+    // The history is written first, since the command runs until the
+    // shell is interrupted
+    record_history(line);
+    set_exit_status(run_on_change(glob_words, path, env));
+}
+
+
+//
+// Implement the `read' shell built-in, which reads a line of its
+// input into variables (shuck_read.h).
+//
+// Synopsis: read [-r] [NAME...]
+// Examples:
+//     % read answer
+//     % < big.log { while read date time rest ; do ... ; done ; }
+//     % head -1 data.csv | read header
+//
+static void do_read(char **glob_words, char **line, char **path, 
+                    char **env)
+{
+    (void) path;
+    (void) env;
+    set_exit_status(run_read(glob_words));
+    record_history(line);
+}
+
+
 //
 // Implement the `exit' shell built-in, which exits the shell.
 //
@@ -301,7 +1429,7 @@ static void execute_command(char **words, char **path, char **environment)
 //     % exit
 //     % exit 1
 //
-static void do_exit(char **words, char **path)
+static void do_exit(char **words, char **line, char **path)
 {
     assert(words != NULL);
     assert(strcmp(words[0], "exit") == 0);
@@ -323,8 +1451,21 @@ static void do_exit(char **words, char **path)
         return;
     }
 
-    free_tokens(words);
-    free_tokens(path);
+    // A child forked for a group or subshell shares the shell's input,
+    // coprocesses and spawn helper, which are the shell's to tear down,
+    // so it leaves as it would at the end of the group
+    if (getpid() != shell_pid) {
+        fflush(stdout);
+        _exit(exit_status);
+    }
+
+    // `path' is the search path, which is freed with the rest
+    (void) path;
+    free_array(words);
+    if (line != NULL) {
+        free_tokens(line);
+    }
+    free_shell();
     
     exit(exit_status);
 }
@@ -336,7 +1477,7 @@ static void do_exit(char **words, char **path)
 // The array itself, and the strings, are allocated with `malloc(3)';
 // the provided `free_token' function can deallocate this.
 //
-static char **tokenize(char *s, char *separators, char *special_chars)
+static char **tokenize(char *s, char *separators)
 {
     size_t n_tokens = 0;
 
@@ -358,15 +1499,7 @@ static char **tokenize(char *s, char *separators, char *special_chars)
         }
 
         // Now, `s' points at one or more characters we want to keep.
-        // The number of non-separator characters is the token length.
         size_t length = strcspn(s, separators);
-        size_t length_without_specials = strcspn(s, special_chars);
-        if (length_without_specials == 0) {
-            length_without_specials = 1;
-        }
-        if (length_without_specials < length) {
-            length = length_without_specials;
-        }
 
         // Allocate a copy of the token.
         char *token = strndup(s, length);
@@ -409,26 +1542,32 @@ static FILE *read_shuck_hist() {
 }
 
 // Execute nth command from shuck_history
-static void execute_nth_command(FILE *f, int n, char **path, char **env) {
+static void execute_nth_command(FILE *f, int n) {
     // nth command from history
     char *command = find_nth_history(f, n);
 
     // If given n, is greater than number in history
     if (command == NULL) {
         fprintf(stderr, "!: invalid history reference\n");
+        set_exit_status(1);
         return;
     }
 
     fprintf(stdout, "%s", command);
 
     // Tokenise the command
-    char **last_words = 
-        tokenize(command, (char *) WORD_SEPARATORS, (char *) SPECIAL_CHARS);
+    char **last_words = tokenize_line(command);
+    free(command);
+    if (last_words == NULL) {
+        set_exit_status(2);
+        return;
+    }
     
-    execute_command(last_words, path, env);
+    if (execute_line(last_words) == COMPILE_INCOMPLETE) {
+        fprintf(stderr, "syntax error: unexpected end of command\n");
+    }
 
     free_tokens(last_words);
-    free(command);
 }
 
 // Check if given word is a valid integer
@@ -445,18 +1584,52 @@ static int is_integer(char *word) {
     return n; 
 }
 
-// Validate command given
-static int validate(char **glob_words) {
-    int valid = 1;
-    if (valid_input_redir(glob_words) ||
-        valid_output_redir(glob_words) ||
-        valid_pipes(glob_words) ||
-        valid_io(glob_words)) {
-        valid = 0;
-        if (!valid) {
+// Implement the `timeout' builtin, which limits how long a command
+// (or every process of a pipeline) may run:
+//     timeout [-k KILL_AFTER] DURATION command...
+// The `timeout' words are removed from the command. Commands without
+// it are limited by `$SHUCK_CMD_TIMEOUT', if set.
+// Returns 1 if the arguments are invalid
+static int set_timeout(char **glob_words) {
+    long timeout_ms = 0;
+    long kill_after_ms = DEFAULT_KILL_AFTER_MS;
+
+    char *default_timeout = get_var("SHUCK_CMD_TIMEOUT");
+    if (default_timeout != NULL && default_timeout[0] != '\0') {
+        timeout_ms = parse_duration(default_timeout);
+        if (timeout_ms < 0) {
+            fprintf(stderr, "SHUCK_CMD_TIMEOUT: %s: invalid duration\n", 
+                    default_timeout);
             return 1;
         }
     }
+
+    if (strcmp(glob_words[0], "timeout") == 0) {
+        int i = 1;
+        if (glob_words[i] != NULL && !strcmp(glob_words[i], "-k")) {
+            if (glob_words[i+1] == NULL ||
+                (kill_after_ms = parse_duration(glob_words[i+1])) < 0) {
+                fprintf(stderr, "timeout: -k: invalid duration\n");
+                return 1;
+            }
+            i += 2;
+        }
+        if (glob_words[i] == NULL || 
+            (timeout_ms = parse_duration(glob_words[i])) < 0) {
+            fprintf(stderr, "timeout: invalid duration\n");
+            return 1;
+        }
+        i++;
+
+        // Remove `timeout' and its arguments from the command
+        for (int j = 0; j < i; j++) {
+            free(glob_words[j]);
+        }
+        memmove(glob_words, &glob_words[i], 
+                (array_size(&glob_words[i]) + 1) * sizeof *glob_words);
+    }
+
+    set_command_timeout(timeout_ms, kill_after_ms);
     return 0;
 }
 
@@ -467,7 +1640,7 @@ static int check_program(char **glob_words, char **path, char **env,
                          char *program, char *input_file) {
     // Check if relative path
     if (strstr(program, "/") && is_executable(program)) {
-        return run_program(program, env, glob_words, path, input_file);
+        return spawn_program(program, env, glob_words, path, input_file);
     }
     // Search through paths to find if given program
     // is executable
@@ -475,9 +1648,21 @@ static int check_program(char **glob_words, char **path, char **env,
         char pathname[MAX_LINE_CHARS];
         // Check for possible paths with the program that
         // may be executable
-        if (executable_path(program, path, pathname)) {
-            return run_program(pathname, env, glob_words, path, input_file);
+        profile_begin(PROFILE_LOOKUP);
+        int found = executable_path(program, path, pathname);
+        profile_end();
+        if (found) {
+            return spawn_program(pathname, env, glob_words, path, input_file);
         }
     }
     return 0;
-}
\ No newline at end of file
+}
+
+// Run a program found by check_program, timing it as spawning
+static int spawn_program(char *pathname, char **env, char **glob_words, 
+                         char **path, char *input_file) {
+    profile_begin(PROFILE_SPAWN);
+    int result = run_program(pathname, env, glob_words, path, input_file);
+    profile_end();
+    return result;
+}
@@ -1,10 +1,37 @@
+#include <dlfcn.h>
+
 #include "shuck_builtins.h"
+#include "shuck_history.h"
+#include "shuck_vars.h"
 
 #define MAX_CHARS 1024
 #define LAST_COMMAND -1
 
+// Every builtin by name, so finding one takes the same time
+// however many there are
+static struct table *builtins = NULL;
+
+// Shell options that `set' can turn on and off
+static char *option_names[] = {
+    "pipefail",     // A pipeline fails if any of its stages fail
+    "pipekill",     // A failing stage stops the rest of its pipeline
+    NULL
+};
+static int option_values[sizeof(option_names)/sizeof(option_names[0])];
+
+// Where builtins run by this thread read and write, when they are
+// a stage of a pipeline: see `set_builtin_io'
+static __thread FILE *builtin_out = NULL;
+static __thread int builtin_in = -1;
+
 // Helper functions
 static int num_file_lines(FILE *f);
+static int find_option(char *name);
+static int load_builtin(char *library, char *name);
+static void list_builtin(const char *name, void *builtin, void *ctx);
+static void free_builtin(void *builtin);
+static const char *plugin_get_var(const char *name);
+static void plugin_set_var(const char *name, const char *value);
 
 // Change the directory
 int change_directory(char **glob_words) {
@@ -47,10 +74,45 @@ int current_directory(char **glob_words) {
         perror("getcwd");
         return 0;
     }
-    fprintf(stdout, "current directory is \'%s\'\n", pathname);
+    fprintf(builtin_stdout(), "current directory is \'%s\'\n", pathname);
+    return 1;
+}
+
+// Turn shell options on and off
+int set_option(char **glob_words) {
+    int size = array_size(glob_words);
+
+    // List the options and whether they are on
+    if (size == 2 && (strcmp(glob_words[1], "-o") == 0 || 
+                      strcmp(glob_words[1], "+o") == 0)) {
+        for (int i = 0; option_names[i] != NULL; i++) {
+            fprintf(builtin_stdout(), "%-12s%s\n", option_names[i], 
+                    option_values[i] ? "on" : "off");
+        }
+        return 1;
+    }
+
+    if (size != 3 || (strcmp(glob_words[1], "-o") != 0 && 
+                      strcmp(glob_words[1], "+o") != 0)) {
+        fprintf(stderr, "usage: set [-o|+o] [option]\n");
+        return 0;
+    }
+
+    int option = find_option(glob_words[2]);
+    if (option == -1) {
+        fprintf(stderr, "set: %s: invalid option name\n", glob_words[2]);
+        return 0;
+    }
+    option_values[option] = glob_words[1][0] == '-';
     return 1;
 }
 
+// Check whether an option is on
+int shell_option(char *name) {
+    int option = find_option(name);
+    return option != -1 && option_values[option];
+}
+
 // Find the nth history command in shuck_history
 // file and return it
 char *find_nth_history(FILE *f, int n) {
@@ -68,6 +130,7 @@ char *find_nth_history(FILE *f, int n) {
     // Find nth command in file
     char line[MAX_CHARS];
     while (fgets(line, sizeof line, f) != NULL) {
+        if (is_history_stats(line)) continue;
         if (i == n) {
             command = strdup(line);
         }
@@ -95,8 +158,9 @@ void print_nth_history(FILE *f, int n) {
 
     char line[MAX_CHARS];
     while (fgets(line, sizeof line, f) != NULL) {
+        if (is_history_stats(line)) continue;
         if (i >= print_lines) {
-            fprintf(stdout, "%d: %s", i, line);
+            fprintf(builtin_stdout(), "%d: %s", i, line);
         }
         i++;
     }
@@ -116,16 +180,15 @@ void add_to_history(char **words) {
         return;
     }
     
-    // Concatenate the words into single line
-    // to append to file
-    char arg[MAX_CHARS];
-    strcpy(arg, words[0]);
+    // Join the words into a single line, which may be longer
+    // than any one line of input if it was continued
+    fputs(words[0], f);
     for (int i = 1; words[i] != NULL; i++) {
-        strcat(arg, " ");
-        strcat(arg, words[i]);
+        fputc(' ', f);
+        fputs(words[i], f);
     }
 
-    fprintf(f, "%s\n", arg);
+    fputc('\n', f);
     fclose(f);
     return;
 }
@@ -143,7 +206,199 @@ static int num_file_lines(FILE *f) {
     int lines = 0;
     char line[MAX_CHARS];
     while (fgets(line, sizeof line, f) != NULL) {
-        lines++;
+        if (!is_history_stats(line)) lines++;
     }
     return lines;
 }
+
+// Add a builtin that is part of the shell
+void register_builtin(char *name, builtin_fn run, int flags) {
+    if (builtins == NULL) {
+        builtins = table_new();
+    }
+    struct builtin *builtin = calloc(1, sizeof(*builtin));
+    builtin->run = run;
+    builtin->redirects = (flags & BUILTIN_REDIRECTS) != 0;
+    builtin->pipes = (flags & BUILTIN_PIPES) != 0;
+    builtin->forks = (flags & BUILTIN_FORKS) != 0;
+    free_builtin(table_set(builtins, name, builtin));
+}
+
+// Find a builtin
+struct builtin *find_builtin(char *name) {
+    if (builtins == NULL) {
+        return NULL;
+    }
+    return table_get(builtins, name);
+}
+
+// Where builtins write their output
+FILE *builtin_stdout(void) {
+    return builtin_out != NULL ? builtin_out : stdout;
+}
+
+// Where builtins read their input
+int builtin_stdin(void) {
+    return builtin_in != -1 ? builtin_in : STDIN_FILENO;
+}
+
+// Set where this thread's builtins read and write
+void set_builtin_io(FILE *out, int in_fd) {
+    builtin_out = out;
+    builtin_in = in_fd;
+}
+
+// Set where this thread's builtins read
+int set_builtin_stdin(int in_fd) {
+    int old_in = builtin_in;
+    builtin_in = in_fd;
+    return old_in;
+}
+
+// Check whether this thread's builtins read the shell's input
+int builtin_reads_shell_input(void) {
+    return builtin_in == -1;
+}
+
+// Load, remove or list builtins
+int enable_builtins(char **glob_words) {
+    if (glob_words[1] == NULL) {
+        table_foreach(builtins, list_builtin, NULL);
+        return 1;
+    }
+
+    int loading = !strcmp(glob_words[1], "-f");
+    int removing = !strcmp(glob_words[1], "-d");
+    if ((!loading && !removing) || glob_words[2] == NULL ||
+        (loading && glob_words[3] == NULL)) {
+        fprintf(stderr, "usage: enable [-f library name... | -d name...]\n");
+        return 0;
+    }
+
+    int enabled = 1;
+    if (loading) {
+        for (int i = 3; glob_words[i] != NULL; i++) {
+            enabled &= load_builtin(glob_words[2], glob_words[i]);
+        }
+        return enabled;
+    }
+
+    for (int i = 2; glob_words[i] != NULL; i++) {
+        struct builtin *builtin = find_builtin(glob_words[i]);
+        if (builtin == NULL || builtin->plugin == NULL) {
+            fprintf(stderr, "enable: %s: not a loaded builtin\n", 
+                    glob_words[i]);
+            enabled = 0;
+            continue;
+        }
+        free_builtin(table_remove(builtins, glob_words[i]));
+    }
+    return enabled;
+}
+
+// Run a loaded builtin
+int run_plugin(struct builtin *builtin, char **words, char **environment,
+               int in_fd, int out_fd) {
+    struct shuck_env env = {
+        .get_var = plugin_get_var,
+        .set_var = plugin_set_var,
+        .environ = environment
+    };
+
+    // The builtin writes to the file descriptor, so anything the
+    // shell has buffered must come out first
+    fflush(stdout);
+    return builtin->plugin->run(array_size(words), words, &env, 
+                                in_fd, out_fd);
+}
+
+// Free every builtin
+void free_builtins(void) {
+    table_free(builtins, free_builtin);
+    builtins = NULL;
+}
+
+// Find the index of a named option, or -1 if there is no such option
+static int find_option(char *name) {
+    for (int i = 0; option_names[i] != NULL; i++) {
+        if (strcmp(option_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Load the builtin `name' from the shared library, replacing any
+// builtin already called that
+static int load_builtin(char *library, char *name) {
+    void *handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "enable: %s\n", dlerror());
+        return 0;
+    }
+
+    char symbol[MAX_CHARS];
+    snprintf(symbol, sizeof symbol, "%s_builtin", name);
+    struct shuck_builtin *plugin = dlsym(handle, symbol);
+    if (plugin == NULL) {
+        fprintf(stderr, "enable: %s: no %s in %s\n", name, symbol, library);
+        dlclose(handle);
+        return 0;
+    }
+    if (plugin->version != SHUCK_PLUGIN_VERSION || plugin->run == NULL) {
+        fprintf(stderr, "enable: %s: built for plugin version %d, not %d\n", 
+                name, plugin->version, SHUCK_PLUGIN_VERSION);
+        dlclose(handle);
+        return 0;
+    }
+
+    if (builtins == NULL) {
+        builtins = table_new();
+    }
+    struct builtin *builtin = calloc(1, sizeof(*builtin));
+    builtin->plugin = plugin;
+    builtin->library = handle;
+    builtin->pipes = 1;
+    free_builtin(table_set(builtins, name, builtin));
+    return 1;
+}
+
+// Print a builtin's name, and its usage if it was loaded
+static void list_builtin(const char *name, void *builtin, void *ctx) {
+    (void) ctx;
+    struct builtin *b = builtin;
+    FILE *out = builtin_stdout();
+    if (b->plugin != NULL && b->plugin->usage != NULL) {
+        fprintf(out, "%s (loaded): %s\n", name, b->plugin->usage);
+    } else {
+        fprintf(out, "%s\n", name);
+    }
+}
+
+// Free a builtin, unloading its library
+static void free_builtin(void *builtin) {
+    struct builtin *b = builtin;
+    if (b == NULL) {
+        return;
+    }
+    if (b->library != NULL) {
+        dlclose(b->library);
+    }
+    free(b);
+}
+
+// Loaded builtins in a pipeline run on threads alongside other
+// builtins that use the variables
+static const char *plugin_get_var(const char *name) {
+    lock_vars();
+    const char *value = get_var((char *) name);
+    unlock_vars();
+    return value;
+}
+
+static void plugin_set_var(const char *name, const char *value) {
+    lock_vars();
+    set_var((char *) name, (char *) value);
+    unlock_vars();
+}
+
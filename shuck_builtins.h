@@ -1,5 +1,9 @@
 // Functions that handle how the builtin commands
-// operate (cd, pwd, history and !)
+// operate (cd, pwd, history, ! and set), and the table
+// builtins are found in, including those loaded by `enable'
+
+#ifndef SHUCK_BUILTINS_H
+#define SHUCK_BUILTINS_H
 
 #include <stdio.h>
 #include <unistd.h>
@@ -7,6 +11,39 @@
 #include <stdlib.h>
 
 #include "shuck_helper.h"
+#include "shuck_plugin.h"
+
+// Runs a builtin that is part of the shell, given the words of the
+// command, the whole line for history, the search path and the
+// environment
+typedef void (*builtin_fn)(char **glob_words, char **line, char **path, 
+                           char **environment);
+
+// Flags for `register_builtin':
+// The builtin handles its own I/O redirection
+#define BUILTIN_REDIRECTS 1
+// The builtin only reads and writes its standard input and output,
+// through `builtin_stdin' and `builtin_stdout', so it can be a stage
+// of a pipeline or have its I/O redirected, run on a thread of the
+// shell rather than in a process of its own
+#define BUILTIN_PIPES 2
+// The builtin changes the state of the shell, so when it is a stage
+// of a pipeline alongside others it runs in a child of the shell,
+// forked but not exec'd as a subshell is, and its changes go with it
+#define BUILTIN_FORKS 4
+
+// A builtin command: either part of the shell (`run'), or loaded
+// from the shared library `library' (`plugin'). Builtins that handle
+// their own I/O redirection have `redirects' set, those that can be
+// in a pipeline `pipes', and those forked there `forks'
+struct builtin {
+    builtin_fn run;
+    struct shuck_builtin *plugin;
+    void *library;
+    int redirects;
+    int pipes;
+    int forks;
+};
 
 // Change the directory given an directory, if no
 // given directory, change to $HOME directory 
@@ -33,4 +70,70 @@ void add_to_history(char **words);
 
 
 // Get the shuck_history path
-void get_shuck_hist_path(char *shuck_hist);
\ No newline at end of file
+void get_shuck_hist_path(char *shuck_hist);
+
+
+// Turn shell options on (`set -o NAME') or off (`set +o NAME'),
+// or list them (`set -o'). Returns 1 on success, 0 on error
+int set_option(char **glob_words);
+
+
+// Check whether the named shell option is turned on
+int shell_option(char *name);
+
+
+// Add a builtin that is part of the shell, with BUILTIN_* `flags'
+void register_builtin(char *name, builtin_fn run, int flags);
+
+
+// The stream builtins write their output to: standard output, unless
+// the calling thread is running a builtin as a stage of a pipeline
+FILE *builtin_stdout(void);
+
+
+// The file descriptor builtins read their input from: standard
+// input, unless the calling thread is running a builtin as a stage
+// of a pipeline
+int builtin_stdin(void);
+
+
+// Set where builtins run by the calling thread read from and write
+// to. A NULL `out' is standard output, and an `in_fd' of -1 standard
+// input
+void set_builtin_io(FILE *out, int in_fd);
+
+
+// Set where builtins run by the calling thread read from, as
+// `set_builtin_io' does, returning where they read from before
+int set_builtin_stdin(int in_fd);
+
+
+// Check whether builtins run by the calling thread read the shell's
+// own standard input, which its commands are read from, rather than
+// input redirected for them
+int builtin_reads_shell_input(void);
+
+
+// Find the builtin with the given name, or NULL if there is none
+struct builtin *find_builtin(char *name);
+
+
+// Load builtins from a plugin (`enable -f library names...'), remove
+// loaded builtins (`enable -d names...') or list the builtins
+// (`enable'). Returns 1 on success, 0 on error
+int enable_builtins(char **glob_words);
+
+
+// Run a loaded builtin, given the words of the command, which have
+// been unquoted, reading from `in_fd' and writing to `out_fd'. Loaded
+// builtins can be piped (BUILTIN_PIPES), so a command with pipes or
+// redirections runs them as a stage of a pipeline does. Returns the
+// builtin's exit status
+int run_plugin(struct builtin *builtin, char **words, char **environment,
+               int in_fd, int out_fd);
+
+
+// Free every builtin, unloading the plugins
+void free_builtins(void);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shuck_cache.h"
+#include "shuck_builtins.h"
+#include "shuck_helper.h"
+#include "shuck_io.h"
+#include "shuck_wait.h"
+
+#define COPY_BUFFER_SIZE 65536
+#define MAX_CACHE_PATH_CHARS 4096
+// The size of the buffers `executable_path' puts pathnames in
+#define MAX_PATHNAME_CHARS 1024
+// A hash written out: 128 bits in hexadecimal, and a NUL
+#define HASH_CHARS 33
+// Changes whenever what goes into a key does, so old entries are
+// never taken for new ones
+#define KEY_VERSION "shuck-cache 1"
+
+// A 128-bit hash being taken of a stream of bytes, in two lanes of
+// 64 bits, 8 bytes at a time
+struct hasher {
+    uint64_t a;
+    uint64_t b;
+    uint64_t length;
+    unsigned char tail[8];
+    int num_tail;
+};
+
+// An entry of the store, when deciding which ones to remove
+struct cache_entry {
+    char *name;
+    char *object;
+    long long size;
+    struct timespec used;
+};
+
+// Helper functions
+static int parse_cache_words(char **words, char ***key_files,
+                             char ***command);
+static int cache_dir(char *dir);
+static long long cache_max(void);
+static int key_command(char **command, char *pathname, char **key_files,
+                       char **env, int in, char *key);
+static int replay_entry(const char *dir, const char *key, FILE *out,
+                        int *status);
+static int run_and_store(const char *dir, const char *key, char *pathname,
+                         char **command, char **env, int in, FILE *out);
+static int write_entry(const char *dir, const char *key, int status,
+                       const char *object, long long size);
+static void evict_entries(const char *dir, long long max);
+static int read_entry(const char *pathname, int *status, char *object,
+                      long long *size);
+static int compare_entries(const void *a, const void *b);
+static int store_path(char *pathname, const char *dir, const char *sub,
+                      const char *name);
+static void hash_init(struct hasher *h);
+static void hash_bytes(struct hasher *h, const void *data, size_t n);
+static void hash_field(struct hasher *h, const void *data, size_t n);
+static void hash_string(struct hasher *h, const char *s);
+static void hash_file(struct hasher *h, const struct stat *st);
+static void hash_word(struct hasher *h, uint64_t w);
+static void hash_hex(struct hasher *h, char *hex);
+static uint64_t mix(uint64_t x);
+
+
+// FUNCTIONS FOR SHUCK_CACHE
+
+// Run a command through the store
+int run_cached(char **words, char **path, char **env) {
+    char **key_files;
+    char **command;
+    if (parse_cache_words(words, &key_files, &command)) {
+        fprintf(stderr, "usage: cache [--key-files FILE... --] "
+                "command [arg...]\n");
+        return 2;
+    }
+
+    // Find the program as it would be run, since which program it is
+    // is part of the key
+    char pathname[MAX_PATHNAME_CHARS];
+    if (strchr(command[0], '/') != NULL) {
+        if (strlen(command[0]) >= MAX_PATHNAME_CHARS ||
+            !is_executable(command[0])) {
+            fprintf(stderr, "%s: command not found\n", command[0]);
+            return 127;
+        }
+        strcpy(pathname, command[0]);
+    } else if (!executable_path(command[0], path, pathname)) {
+        fprintf(stderr, "%s: command not found\n", command[0]);
+        return 127;
+    }
+
+    FILE *out = builtin_stdout();
+    int in = builtin_stdin();
+    char dir[MAX_CACHE_PATH_CHARS];
+    char key[HASH_CHARS];
+    int keyed = !cache_dir(dir) &&
+                !key_command(command, pathname, key_files, env, in, key);
+    // Its exit status is reported as any program's is, whether it was
+    // run or replayed
+    int status;
+    if (!keyed || !replay_entry(dir, key, out, &status)) {
+        status = run_and_store(keyed ? dir : NULL, key, pathname, command,
+                               env, in, out);
+        if (status == -1) {
+            return 1;
+        }
+        report_exit_status(pathname, status, 0, NULL, NULL);
+        return exit_code(status);
+    }
+    report_exit_status(pathname, (status & 0xff) << 8, 0, NULL, NULL);
+    return status;
+}
+
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Split the words into the key files, which `--key-files' gives up to
+// a `--', and the command, both NULL-terminated. The `--' is made
+// NULL. Returns 1 if there is no command
+static int parse_cache_words(char **words, char ***key_files,
+                             char ***command) {
+    static char *no_files[] = { NULL };
+    int i = 1;
+    *key_files = no_files;
+    if (words[i] != NULL && !strcmp(words[i], "--key-files")) {
+        *key_files = &words[i+1];
+        for (i++; words[i] != NULL && strcmp(words[i], "--"); i++) {
+        }
+        if (words[i] == NULL) {
+            return 1;
+        }
+        words[i] = NULL;
+        i++;
+    }
+    *command = &words[i];
+    return words[i] == NULL;
+}
+
+// Put the store's directory in `dir', making it and its directories
+// if they do not exist yet. Returns 1 if it cannot be used
+static int cache_dir(char *dir) {
+    char *base = getenv("SHUCK_CACHE_DIR");
+    int length;
+    if (base != NULL && base[0] != '\0') {
+        length = snprintf(dir, MAX_CACHE_PATH_CHARS, "%s", base);
+    } else if (getenv("HOME") != NULL) {
+        length = snprintf(dir, MAX_CACHE_PATH_CHARS, "%s/%s",
+                          getenv("HOME"), CACHE_DIR);
+    } else {
+        return 1;
+    }
+    // Room is left for the longest pathname in the store
+    if (length < 0 || length >= MAX_CACHE_PATH_CHARS - 64) {
+        fprintf(stderr, "cache: %s: %s\n", base != NULL && base[0] != '\0' ?
+                base : getenv("HOME"), strerror(ENAMETOOLONG));
+        return 1;
+    }
+
+    char sub[MAX_CACHE_PATH_CHARS];
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+    if (store_path(sub, dir, "entries", NULL) ||
+        (mkdir(sub, 0700) != 0 && errno != EEXIST)) {
+        perror(sub);
+        return 1;
+    }
+    if (store_path(sub, dir, "objects", NULL) ||
+        (mkdir(sub, 0700) != 0 && errno != EEXIST)) {
+        perror(sub);
+        return 1;
+    }
+    return 0;
+}
+
+// The most the outputs in the store may add up to
+static long long cache_max(void) {
+    char *value = getenv("SHUCK_CACHE_MAX");
+    if (value == NULL) {
+        return DEFAULT_CACHE_MAX;
+    }
+    char *end;
+    long long max = strtoll(value, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        max *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        max *= 1024 * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        max *= 1024 * 1024 * 1024;
+        end++;
+    }
+    if (end == value || *end != '\0' || max < 0) {
+        return DEFAULT_CACHE_MAX;
+    }
+    return max;
+}
+
+// Put the key of a command in `key'. Returns 1 if it cannot be keyed,
+// because its input is redirected from a pipe
+static int key_command(char **command, char *pathname, char **key_files,
+                       char **env, int in, char *key) {
+    struct stat st;
+    struct hasher h;
+    hash_init(&h);
+    hash_string(&h, KEY_VERSION);
+
+    // Each list is preceded by how long it is, so that words cannot
+    // move from one list to the next
+    int n = array_size(command);
+    hash_field(&h, &n, sizeof(n));
+    for (int i = 0; i < n; i++) {
+        hash_string(&h, command[i]);
+    }
+    hash_string(&h, pathname);
+    hash_file(&h, stat(pathname, &st) == 0 ? &st : NULL);
+
+    char *cwd = getcwd(NULL, 0);
+    hash_string(&h, cwd != NULL ? cwd : "");
+    free(cwd);
+
+    n = array_size(env);
+    hash_field(&h, &n, sizeof(n));
+    for (int i = 0; i < n; i++) {
+        hash_string(&h, env[i]);
+    }
+
+    n = array_size(key_files);
+    hash_field(&h, &n, sizeof(n));
+    for (int i = 0; i < n; i++) {
+        hash_string(&h, key_files[i]);
+        hash_file(&h, stat(key_files[i], &st) == 0 ? &st : NULL);
+    }
+
+    // Only input redirected for the command is part of the key: the
+    // shell's own, a terminal or the script being run, is not. A file
+    // read part of the way through is read from where it is now; a
+    // device is only its identity
+    if (in != STDIN_FILENO) {
+        if (fstat(in, &st) != 0 || S_ISFIFO(st.st_mode) ||
+            S_ISSOCK(st.st_mode)) {
+            return 1;
+        }
+        hash_file(&h, &st);
+        if (S_ISREG(st.st_mode)) {
+            long long offset = lseek(in, 0, SEEK_CUR);
+            hash_field(&h, &offset, sizeof(offset));
+        } else {
+            long long rdev = st.st_rdev;
+            hash_field(&h, &rdev, sizeof(rdev));
+        }
+    }
+
+    hash_hex(&h, key);
+    return 0;
+}
+
+// Write the output of the entry for `key' to `out', and set `*status'
+// to its exit status, marking the entry as just used. Returns 1 if
+// there was an entry with its output still in the store
+static int replay_entry(const char *dir, const char *key, FILE *out,
+                        int *status) {
+    char entry[MAX_CACHE_PATH_CHARS];
+    char object[HASH_CHARS];
+    char pathname[MAX_CACHE_PATH_CHARS];
+    long long size;
+    if (store_path(entry, dir, "entries", key) ||
+        read_entry(entry, status, object, &size) ||
+        store_path(pathname, dir, "objects", object)) {
+        return 0;
+    }
+    int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    ssize_t n;
+    while ((n = read(fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror(pathname);
+            break;
+        }
+        if (fwrite(buffer, 1, n, out) != (size_t) n) {
+            break;
+        }
+    }
+    fflush(out);
+    free(buffer);
+    close(fd);
+    utimensat(AT_FDCWD, entry, NULL, 0);
+    return 1;
+}
+
+// Run the command, copying its output to `out' and, unless `dir' is
+// NULL, into the store as the entry for `key'. Returns its wait
+// status, or -1 (having printed an error) if it could not be run
+static int run_and_store(const char *dir, const char *key, char *pathname,
+                         char **command, char **env, int in, FILE *out) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    if (in != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in, 0);
+    }
+    fflush(out);
+    fflush(stdout);
+    pid_t pid;
+    int error = posix_spawn(&pid, pathname, &actions, NULL, command, env);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", pathname, strerror(error));
+        close(fds[0]);
+        return -1;
+    }
+
+    // The output is written to a file of its own while it is hashed,
+    // and only named by its hash once the command has finished
+    char temporary[MAX_CACHE_PATH_CHARS];
+    int store = -1;
+    if (dir != NULL && !store_path(temporary, dir, "objects", ".new-XXXXXX")) {
+        store = mkostemp(temporary, O_CLOEXEC);
+    }
+
+    // Whoever reads the output may stop early; the command still runs
+    // to the end, so that all of its output is stored
+    struct hasher h;
+    hash_init(&h);
+    long long size = 0;
+    int out_failed = 0;
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    ssize_t n;
+    while ((n = read(fds[0], buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            break;
+        }
+        if (!out_failed && fwrite(buffer, 1, n, out) != (size_t) n) {
+            out_failed = 1;
+        }
+        if (store != -1) {
+            hash_bytes(&h, buffer, n);
+            for (ssize_t done = 0; done < n; ) {
+                ssize_t w = write(store, buffer + done, n - done);
+                if (w == -1 && errno == EINTR) continue;
+                if (w <= 0) {
+                    close(store);
+                    unlink(temporary);
+                    store = -1;
+                    break;
+                }
+                done += w;
+            }
+        }
+        size += n;
+    }
+    free(buffer);
+    close(fds[0]);
+    fflush(out);
+
+    int wait_status;
+    if (wait_processes(&pid, 1, &wait_status, 0, 0, 0) == -1) {
+        wait_status = 1 << 8;
+    }
+    if (store != -1) {
+        char object[HASH_CHARS];
+        char pathname[MAX_CACHE_PATH_CHARS];
+        hash_hex(&h, object);
+        if (close(store) != 0 || !WIFEXITED(wait_status) ||
+            store_path(pathname, dir, "objects", object) ||
+            rename(temporary, pathname) != 0) {
+            unlink(temporary);
+        } else if (!write_entry(dir, key, exit_code(wait_status), object,
+                                size)) {
+            evict_entries(dir, cache_max());
+        }
+    }
+    return wait_status;
+}
+
+// Write the entry for `key'. Returns 1 if it could not be written
+static int write_entry(const char *dir, const char *key, int status,
+                       const char *object, long long size) {
+    char entry[MAX_CACHE_PATH_CHARS];
+    char temporary[MAX_CACHE_PATH_CHARS];
+    if (store_path(entry, dir, "entries", key) ||
+        store_path(temporary, dir, "entries", ".new-XXXXXX")) {
+        return 1;
+    }
+    int fd = mkostemp(temporary, O_CLOEXEC);
+    if (fd == -1) {
+        return 1;
+    }
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        unlink(temporary);
+        return 1;
+    }
+    fprintf(f, "%d %s %lld\n", status, object, size);
+    if (ferror(f) | fclose(f) || rename(temporary, entry) != 0) {
+        unlink(temporary);
+        return 1;
+    }
+    return 0;
+}
+
+// Remove the least recently used entries until their outputs add up
+// to no more than `max' bytes, then any outputs no entry uses
+static void evict_entries(const char *dir, long long max) {
+    char pathname[MAX_CACHE_PATH_CHARS];
+    if (store_path(pathname, dir, "entries", NULL)) {
+        return;
+    }
+    DIR *entries = opendir(pathname);
+    if (entries == NULL) {
+        return;
+    }
+    struct cache_entry *list = NULL;
+    int num = 0;
+    int capacity = 0;
+    long long total = 0;
+    struct dirent *d;
+    while ((d = readdir(entries)) != NULL) {
+        if (d->d_name[0] == '.') {
+            continue;
+        }
+        struct cache_entry e;
+        char object[HASH_CHARS];
+        int status;
+        struct stat st;
+        if (store_path(pathname, dir, "entries", d->d_name) ||
+            stat(pathname, &st) != 0 ||
+            read_entry(pathname, &status, object, &e.size)) {
+            continue;
+        }
+        if (num == capacity) {
+            capacity = capacity == 0 ? 64 : 2*capacity;
+            list = realloc(list, capacity*sizeof(*list));
+        }
+        e.name = strdup(d->d_name);
+        e.object = strdup(object);
+        e.used = st.st_mtim;
+        list[num++] = e;
+        total += e.size;
+    }
+    closedir(entries);
+
+    if (total > max) {
+        qsort(list, num, sizeof(*list), compare_entries);
+        int kept = 0;
+        for (int i = 0; i < num; i++) {
+            if (total > max) {
+                if (!store_path(pathname, dir, "entries", list[i].name)) {
+                    unlink(pathname);
+                }
+                total -= list[i].size;
+                free(list[i].name);
+                free(list[i].object);
+            } else {
+                list[kept++] = list[i];
+            }
+        }
+        num = kept;
+
+        // Outputs are shared between entries, so only those that no
+        // entry left uses are removed
+        struct table *used = table_new();
+        for (int i = 0; i < num; i++) {
+            table_set(used, list[i].object, "");
+        }
+        DIR *objects = store_path(pathname, dir, "objects", NULL) ? NULL :
+                       opendir(pathname);
+        while (objects != NULL && (d = readdir(objects)) != NULL) {
+            if (d->d_name[0] != '.' && table_get(used, d->d_name) == NULL &&
+                !store_path(pathname, dir, "objects", d->d_name)) {
+                unlink(pathname);
+            }
+        }
+        if (objects != NULL) {
+            closedir(objects);
+        }
+        table_free(used, NULL);
+    }
+
+    for (int i = 0; i < num; i++) {
+        free(list[i].name);
+        free(list[i].object);
+    }
+    free(list);
+}
+
+// Read an entry: its exit status, output and the output's size.
+// Returns 1 if it cannot be read
+static int read_entry(const char *pathname, int *status, char *object,
+                      long long *size) {
+    FILE *f = fopen(pathname, "re");
+    if (f == NULL) {
+        return 1;
+    }
+    int fields = fscanf(f, "%d %32[0-9a-f] %lld", status, object, size);
+    fclose(f);
+    return fields != 3 || strlen(object) != HASH_CHARS - 1;
+}
+
+// Order entries from the least recently used
+static int compare_entries(const void *a, const void *b) {
+    const struct cache_entry *x = a;
+    const struct cache_entry *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    if (x->used.tv_nsec != y->used.tv_nsec) {
+        return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+// Put the pathname of `name' in the store's `sub' directory (`entries'
+// or `objects'), or of the directory itself if `name' is NULL, in
+// `pathname'. Returns 1 (with errno set) if it does not fit
+static int store_path(char *pathname, const char *dir, const char *sub,
+                      const char *name) {
+    int length = snprintf(pathname, MAX_CACHE_PATH_CHARS, "%s/%s%s%s", dir,
+                          sub, name != NULL ? "/" : "",
+                          name != NULL ? name : "");
+    if (length < 0 || length >= MAX_CACHE_PATH_CHARS) {
+        errno = ENAMETOOLONG;
+        return 1;
+    }
+    return 0;
+}
+
+// Start a hash
+static void hash_init(struct hasher *h) {
+    h->a = 0x243f6a8885a308d3ULL;
+    h->b = 0x13198a2e03707344ULL;
+    h->length = 0;
+    h->num_tail = 0;
+}
+
+// Add bytes to a hash
+static void hash_bytes(struct hasher *h, const void *data, size_t n) {
+    const unsigned char *p = data;
+    h->length += n;
+    while (n > 0 && h->num_tail > 0) {
+        h->tail[h->num_tail++] = *p++;
+        n--;
+        if (h->num_tail == 8) {
+            uint64_t w;
+            memcpy(&w, h->tail, 8);
+            hash_word(h, w);
+            h->num_tail = 0;
+        }
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        hash_word(h, w);
+    }
+    memcpy(h->tail + h->num_tail, p, n);
+    h->num_tail += n;
+}
+
+// Add a field to a hash, preceded by its length, so that the end of
+// one field cannot be taken for the start of the next
+static void hash_field(struct hasher *h, const void *data, size_t n) {
+    uint64_t length = n;
+    hash_bytes(h, &length, sizeof(length));
+    hash_bytes(h, data, n);
+}
+
+// Add a string to a hash
+static void hash_string(struct hasher *h, const char *s) {
+    hash_field(h, s, strlen(s));
+}
+
+// Add the identity of a file, or NULL if it does not exist, to a hash:
+// which file it is, how big it is and when it last changed
+static void hash_file(struct hasher *h, const struct stat *st) {
+    long long fields[6] = { -1, -1, -1, -1, -1, -1 };
+    if (st != NULL) {
+        fields[0] = st->st_dev;
+        fields[1] = st->st_ino;
+        fields[2] = st->st_size;
+        fields[3] = st->st_mtim.tv_sec;
+        fields[4] = st->st_mtim.tv_nsec;
+        fields[5] = st->st_mode;
+    }
+    hash_field(h, fields, sizeof(fields));
+}
+
+// Add 8 bytes to both lanes of a hash
+static void hash_word(struct hasher *h, uint64_t w) {
+    h->a ^= w;
+    h->a *= 0x9e3779b97f4a7c15ULL;
+    h->a = (h->a << 27) | (h->a >> 37);
+    h->b += w;
+    h->b *= 0xc2b2ae3d27d4eb4fULL;
+    h->b ^= h->b >> 31;
+}
+
+// Finish a hash, writing it in hexadecimal to `hex'
+static void hash_hex(struct hasher *h, char *hex) {
+    uint64_t w = 0;
+    memcpy(&w, h->tail, h->num_tail);
+    hash_word(h, w);
+    hash_word(h, h->length);
+    uint64_t a = mix(h->a + h->b);
+    uint64_t b = mix(h->b + a);
+    snprintf(hex, HASH_CHARS, "%016llx%016llx", (unsigned long long) a,
+             (unsigned long long) b);
+}
+
+// Spread every bit of a word over all of it
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
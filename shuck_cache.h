@@ -0,0 +1,49 @@
+// The `cache' builtin: run a command whose output depends only on its
+// arguments, environment and input files, and keep its output, so
+// that running it again with none of them changed replays the output
+// and exit status instead of running the command.
+//
+//     cache [--key-files FILE... --] command [arg...]
+//
+// A command's key is a hash of its arguments, the program that was
+// found for it (including its size, modification time and inode), the
+// current directory, the whole environment, the size, modification
+// time and inode of each FILE, and those of its standard input if that
+// is redirected from a file. A command whose input is piped into it
+// cannot be keyed, so it is run without being cached; one that reads
+// the shell's own input is not told apart by it. Only standard output
+// is kept: standard
+// error is passed through as the command writes it, and commands
+// killed by a signal are not kept.
+//
+// The store is `$SHUCK_CACHE_DIR', or `~/.shuck_cache', in which
+// `objects' holds each distinct output once, named by the hash of its
+// contents, and `entries' maps each key to an output and exit status.
+// Once the outputs of the entries add up to more than
+// `$SHUCK_CACHE_MAX' bytes (a number, optionally followed by K, M or
+// G; 256M by default), the least recently used entries are removed,
+// with any outputs no entry uses any more.
+//
+// The hash is not cryptographic: the store is a cache for one user,
+// not something to be trusted with others' input.
+
+#ifndef SHUCK_CACHE_H
+#define SHUCK_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_DIR ".shuck_cache"
+#define DEFAULT_CACHE_MAX (256LL * 1024 * 1024)
+
+// Run `words', which start with `cache', from the store if it has
+// them or else by spawning them, writing the output to
+// `builtin_stdout' and reading `builtin_stdin' (shuck_builtins.h),
+// and report its exit status as a program's is (report_exit_status in
+// shuck_io.h). Returns the command's exit status, 127 if it was not
+// found, 1 (having printed an error) if it could not be run, or 2
+// (having printed an error) if the words are not a valid `cache'
+int run_cached(char **words, char **path, char **env);
+
+#endif
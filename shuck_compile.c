@@ -0,0 +1,655 @@
+#include "shuck_compile.h"
+#include "shuck_vars.h"
+
+// A loop being compiled, so `break' and `continue' know where to jump
+struct loop {
+    int continue_target;
+    int *breaks;
+    int num_breaks;
+    struct loop *outer;
+};
+
+// State of the compiler as it works through the words of a line
+struct compiler {
+    char **words;
+    int pos;
+    struct plan *plan;
+    int status;
+    struct loop *loop;
+    // Number of function bodies being compiled, inside which
+    // `return' can be used
+    int functions;
+};
+
+// Words that end the list of commands inside a compound command
+static char *const THEN_STOPS[] = { "then", NULL };
+static char *const IF_BODY_STOPS[] = { "elif", "else", "fi", NULL };
+static char *const ELSE_STOPS[] = { "fi", NULL };
+static char *const DO_STOPS[] = { "do", NULL };
+static char *const DONE_STOPS[] = { "done", NULL };
+static char *const BRACE_STOPS[] = { "}", NULL };
+static char *const PAREN_STOPS[] = { ")", NULL };
+static char *const NO_STOPS[] = { NULL };
+
+// Words that can only appear where a compound command expects them
+static char *const RESERVED_WORDS[] = { 
+    "then", "elif", "else", "fi", "do", "done", "}", NULL 
+};
+
+// Helper functions
+static void compile_list(struct compiler *c, char *const *stops);
+static void compile_and_or(struct compiler *c);
+static void compile_element(struct compiler *c);
+static void compile_pipeline(struct compiler *c);
+static void compile_group(struct compiler *c, struct group *group);
+static void compile_simple(struct compiler *c, char **words);
+static void compile_if(struct compiler *c);
+static void compile_for(struct compiler *c);
+static void compile_while(struct compiler *c, enum opcode exit_op);
+static void compile_loop_body(struct compiler *c, struct loop *loop, 
+                              int top);
+static void compile_break(struct compiler *c);
+static int function_name_length(struct compiler *c);
+static void compile_function(struct compiler *c, int name_length);
+static void compile_return(struct compiler *c);
+static int emit(struct compiler *c, enum opcode op);
+static void expect(struct compiler *c, char *word);
+static void syntax_error(struct compiler *c);
+static int ends_command(char *word);
+static int in_list(char *word, char *const *list);
+static int starts_group(char *word);
+static char **copy_words(char **words, int start, int end);
+static void add_word(char ***words, int *num_words, char *word);
+static void free_groups(struct group *groups, int num_stages);
+
+
+// Compile a command line
+int compile_line(char **words, struct plan *plan) {
+    plan->code = NULL;
+    plan->size = 0;
+    plan->capacity = 0;
+    plan->num_loops = 0;
+    plan->refs = 0;
+
+    struct compiler c = {
+        .words = words, .pos = 0, .plan = plan, 
+        .status = COMPILE_OK, .loop = NULL, .functions = 0
+    };
+    compile_list(&c, NO_STOPS);
+    if (c.status == COMPILE_OK && words[c.pos] != NULL) {
+        syntax_error(&c);
+    }
+
+    if (c.status != COMPILE_OK) {
+        free_plan(plan);
+    }
+    return c.status;
+}
+
+// Free a plan
+void free_plan(struct plan *plan) {
+    for (int i = 0; i < plan->size; i++) {
+        free_array(plan->code[i].words);
+        free(plan->code[i].name);
+        if (plan->code[i].body != NULL) {
+            release_plan(plan->code[i].body);
+        }
+        if (plan->code[i].groups != NULL) {
+            free_groups(plan->code[i].groups, plan->code[i].value);
+        }
+    }
+    free(plan->code);
+    plan->code = NULL;
+    plan->size = 0;
+    plan->capacity = 0;
+}
+
+// Release a function body
+void release_plan(struct plan *plan) {
+    plan->refs--;
+    if (plan->refs == 0) {
+        free_plan(plan);
+        free(plan);
+    }
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Compile commands separated by `;' until the end of the line
+// or one of the stop words
+static void compile_list(struct compiler *c, char *const *stops) {
+    while (c->status == COMPILE_OK) {
+        // Empty commands are skipped, which also lets lines joined
+        // by `;' continue after `do', `then' etc.
+        while (c->words[c->pos] != NULL && !strcmp(c->words[c->pos], ";")) {
+            c->pos++;
+        }
+        char *word = c->words[c->pos];
+        if (word == NULL || in_list(word, stops)) {
+            return;
+        }
+        compile_and_or(c);
+    }
+}
+
+// Compile commands joined by `&&' and `||'. Each operator skips the
+// next command depending on the exit status of the one before it
+static void compile_and_or(struct compiler *c) {
+    compile_element(c);
+    while (c->status == COMPILE_OK && c->words[c->pos] != NULL) {
+        char *word = c->words[c->pos];
+        enum opcode op;
+        if (!strcmp(word, "&&")) {
+            op = OP_JUMP_IF_FAIL;
+        } else if (!strcmp(word, "||")) {
+            op = OP_JUMP_IF_OK;
+        } else {
+            return;
+        }
+        c->pos++;
+        // The next command may be on the next line
+        while (c->words[c->pos] != NULL && !strcmp(c->words[c->pos], ";")) {
+            c->pos++;
+        }
+        int skip = emit(c, op);
+        compile_element(c);
+        c->plan->code[skip].target = c->plan->size;
+    }
+}
+
+// Compile a single simple or compound command
+static void compile_element(struct compiler *c) {
+    char *word = c->words[c->pos];
+    int name_length;
+    if (word == NULL) {
+        c->status = COMPILE_INCOMPLETE;
+    }
+    else if ((name_length = function_name_length(c)) > 0) {
+        compile_function(c, name_length);
+    }
+    else if (c->functions > 0 && !strcmp(word, "return")) {
+        compile_return(c);
+    }
+    else if (!strcmp(word, "if")) {
+        compile_if(c);
+    }
+    else if (!strcmp(word, "for")) {
+        compile_for(c);
+    }
+    else if (!strcmp(word, "while")) {
+        compile_while(c, OP_JUMP_IF_FAIL);
+    }
+    else if (!strcmp(word, "until")) {
+        compile_while(c, OP_JUMP_IF_OK);
+    }
+    else if (c->loop != NULL && 
+             (!strcmp(word, "break") || !strcmp(word, "continue"))) {
+        compile_break(c);
+    }
+    else if (ends_command(word) || in_list(word, RESERVED_WORDS)) {
+        syntax_error(c);
+    }
+    else {
+        compile_pipeline(c);
+    }
+}
+
+// Compile a pipeline, whose stages are separated by `|'. A stage is
+// a simple command, or a group of commands, `( list )' or `{ list; }',
+// which has redirections around it like a program. A pipeline of
+// simple commands is a single command for `execute_command'
+static void compile_pipeline(struct compiler *c) {
+    char **words = NULL;
+    int num_words = 0;
+    struct group *groups = NULL;
+    int num_stages = 0;
+    int has_groups = 0;
+
+    while (c->status == COMPILE_OK) {
+        groups = realloc(groups, (num_stages+1)*sizeof(*groups));
+        groups[num_stages].body = NULL;
+        groups[num_stages].subshell = 0;
+        num_stages++;
+
+        // An input redirection comes before the group it is for
+        int group = c->pos;
+        if (c->words[group] != NULL && !strcmp(c->words[group], "<") &&
+            c->words[group+1] != NULL) {
+            group += 2;
+        }
+        if (c->words[group] != NULL && starts_group(c->words[group])) {
+            while (c->pos < group) {
+                add_word(&words, &num_words, c->words[c->pos++]);
+            }
+            add_word(&words, &num_words, c->words[group]);
+            compile_group(c, &groups[num_stages-1]);
+            if (c->status != COMPILE_OK) break;
+            has_groups = 1;
+
+            // Only output redirections can follow a group
+            char *word = c->words[c->pos];
+            if (word != NULL && !ends_command(word) && strcmp(word, "|") && 
+                strcmp(word, ">")) {
+                syntax_error(c);
+                break;
+            }
+        }
+
+        while (c->words[c->pos] != NULL && !ends_command(c->words[c->pos]) &&
+               strcmp(c->words[c->pos], "|")) {
+            // `(' can only start a command
+            if (!strcmp(c->words[c->pos], "(")) {
+                syntax_error(c);
+                break;
+            }
+            add_word(&words, &num_words, c->words[c->pos++]);
+        }
+        if (c->words[c->pos] == NULL || strcmp(c->words[c->pos], "|")) {
+            break;
+        }
+        add_word(&words, &num_words, c->words[c->pos++]);
+    }
+
+    // A lone `&' would be a background job, which is not supported
+    if (c->status == COMPILE_OK && c->words[c->pos] != NULL && 
+        !strcmp(c->words[c->pos], "&")) {
+        syntax_error(c);
+    }
+    if (c->status != COMPILE_OK || !has_groups) {
+        free_groups(groups, num_stages);
+        if (c->status == COMPILE_OK) {
+            compile_simple(c, words);
+        } else {
+            free_array(words);
+        }
+        return;
+    }
+
+    // The group stands in for a program, so the pipeline's
+    // redirections are checked as they are for commands
+    if (validate_command(words)) {
+        free_groups(groups, num_stages);
+        free_array(words);
+        c->status = COMPILE_ERROR;
+        return;
+    }
+    int pipeline = emit(c, OP_PIPELINE);
+    c->plan->code[pipeline].words = words;
+    c->plan->code[pipeline].groups = groups;
+    c->plan->code[pipeline].value = num_stages;
+}
+
+// ( list ) or { list; }
+// The group's commands are compiled into a plan of their own, which
+// is run as a stage of the pipeline the group is in
+static void compile_group(struct compiler *c, struct group *group) {
+    int subshell = !strcmp(c->words[c->pos], "(");
+    c->pos++;
+
+    struct plan *body = calloc(1, sizeof(*body));
+    body->refs = 1;
+    struct compiler inner = {
+        .words = c->words, .pos = c->pos, .plan = body, 
+        .status = COMPILE_OK, .loop = NULL, .functions = c->functions
+    };
+    compile_list(&inner, subshell ? PAREN_STOPS : BRACE_STOPS);
+    // A group needs at least one command
+    if (inner.status == COMPILE_OK && body->size == 0 && 
+        c->words[inner.pos] != NULL) {
+        syntax_error(&inner);
+    }
+    expect(&inner, subshell ? ")" : "}");
+    c->pos = inner.pos;
+    c->status = inner.status;
+    if (c->status != COMPILE_OK) {
+        release_plan(body);
+        return;
+    }
+    group->body = body;
+    group->subshell = subshell;
+}
+
+// Compile the words of a simple command, or pipeline of them, that
+// will be run by `execute_command'
+static void compile_simple(struct compiler *c, char **words) {
+    // Commands made only of assignments set shell variables
+    int assignments = 1;
+    for (int i = 0; words[i] != NULL; i++) {
+        if (!is_assignment(words[i])) assignments = 0;
+    }
+    if (assignments) {
+        int command = emit(c, OP_ASSIGN);
+        c->plan->code[command].words = words;
+        return;
+    }
+
+    // Redirections and pipes are checked once here, rather than
+    // every time the command runs
+    if (validate_command(words)) {
+        free_array(words);
+        c->status = COMPILE_ERROR;
+        return;
+    }
+    int command = emit(c, OP_COMMAND);
+    c->plan->code[command].words = words;
+}
+
+// if list; then list; [elif list; then list;]... [else list;] fi
+static void compile_if(struct compiler *c) {
+    int *ends = NULL;
+    int num_ends = 0;
+    int has_else = 0;
+
+    do {
+        // Skip `if' or `elif'
+        c->pos++;
+        compile_list(c, THEN_STOPS);
+        expect(c, "then");
+        int next = emit(c, OP_JUMP_IF_FAIL);
+        compile_list(c, IF_BODY_STOPS);
+        if (c->status != COMPILE_OK) break;
+
+        ends = realloc(ends, (num_ends+1)*sizeof(*ends));
+        ends[num_ends++] = emit(c, OP_JUMP);
+        c->plan->code[next].target = c->plan->size;
+    } while (c->words[c->pos] != NULL && !strcmp(c->words[c->pos], "elif"));
+
+    if (c->status == COMPILE_OK && c->words[c->pos] != NULL && 
+        !strcmp(c->words[c->pos], "else")) {
+        c->pos++;
+        has_else = 1;
+        compile_list(c, ELSE_STOPS);
+    }
+    expect(c, "fi");
+
+    // If no branch was taken the exit status is 0
+    if (!has_else) {
+        int status = emit(c, OP_STATUS);
+        c->plan->code[status].value = 0;
+    }
+    for (int i = 0; i < num_ends; i++) {
+        c->plan->code[ends[i]].target = c->plan->size;
+    }
+    free(ends);
+}
+
+// for NAME in words...; do list; done
+static void compile_for(struct compiler *c) {
+    c->pos++;
+    char *name = c->words[c->pos];
+    if (name == NULL) {
+        c->status = COMPILE_INCOMPLETE;
+        return;
+    }
+    char *assignment = malloc(strlen(name) + 2);
+    sprintf(assignment, "%s=", name);
+    int valid_name = is_assignment(assignment);
+    free(assignment);
+    if (!valid_name) {
+        syntax_error(c);
+        return;
+    }
+    c->pos++;
+    expect(c, "in");
+    if (c->status != COMPILE_OK) return;
+
+    int start = c->pos;
+    while (c->words[c->pos] != NULL && !ends_command(c->words[c->pos])) {
+        c->pos++;
+    }
+    char **items = copy_words(c->words, start, c->pos);
+    while (c->words[c->pos] != NULL && !strcmp(c->words[c->pos], ";")) {
+        c->pos++;
+    }
+    expect(c, "do");
+    if (c->status != COMPILE_OK) {
+        free_array(items);
+        return;
+    }
+
+    int slot = c->plan->num_loops++;
+    int init = emit(c, OP_FOR_INIT);
+    c->plan->code[init].words = items;
+    c->plan->code[init].slot = slot;
+
+    int top = emit(c, OP_FOR_NEXT);
+    c->plan->code[top].name = strdup(name);
+    c->plan->code[top].slot = slot;
+
+    struct loop loop = { .continue_target = top };
+    compile_loop_body(c, &loop, top);
+    c->plan->code[top].target = c->plan->size;
+    for (int i = 0; i < loop.num_breaks; i++) {
+        c->plan->code[loop.breaks[i]].target = c->plan->size;
+    }
+    free(loop.breaks);
+}
+
+// while list; do list; done
+// until list; do list; done
+static void compile_while(struct compiler *c, enum opcode exit_op) {
+    c->pos++;
+    int top = c->plan->size;
+    compile_list(c, DO_STOPS);
+    expect(c, "do");
+    if (c->status != COMPILE_OK) return;
+
+    int leave = emit(c, exit_op);
+    struct loop loop = { .continue_target = top };
+    compile_loop_body(c, &loop, top);
+
+    // The condition failing is how the loop normally ends,
+    // which is not a failure of the loop itself
+    c->plan->code[leave].target = c->plan->size;
+    int status = emit(c, OP_STATUS);
+    c->plan->code[status].value = 0;
+    for (int i = 0; i < loop.num_breaks; i++) {
+        c->plan->code[loop.breaks[i]].target = c->plan->size;
+    }
+    free(loop.breaks);
+}
+
+// Compile `do list; done' and the jump back to the top of the loop
+static void compile_loop_body(struct compiler *c, struct loop *loop, 
+                              int top) {
+    loop->outer = c->loop;
+    c->loop = loop;
+    compile_list(c, DONE_STOPS);
+    expect(c, "done");
+    c->loop = loop->outer;
+    int jump = emit(c, OP_JUMP);
+    c->plan->code[jump].target = top;
+}
+
+// `break' and `continue' jump out of or back to the top of
+// the innermost loop
+static void compile_break(struct compiler *c) {
+    char *word = c->words[c->pos];
+    c->pos++;
+    if (c->words[c->pos] != NULL && !ends_command(c->words[c->pos])) {
+        fprintf(stderr, "%s: too many arguments\n", word);
+        c->status = COMPILE_ERROR;
+        return;
+    }
+
+    int jump = emit(c, OP_JUMP);
+    if (!strcmp(word, "continue")) {
+        c->plan->code[jump].target = c->loop->continue_target;
+    } else {
+        struct loop *loop = c->loop;
+        loop->breaks = realloc(loop->breaks, 
+                               (loop->num_breaks+1)*sizeof(*loop->breaks));
+        loop->breaks[loop->num_breaks++] = jump;
+    }
+}
+
+// If the command is a function definition, `NAME()' or `NAME ()',
+// return the length of NAME
+static int function_name_length(struct compiler *c) {
+    char *word = c->words[c->pos];
+    char *next = c->words[c->pos + 1];
+    if (next == NULL || strcmp(next, "(") || c->words[c->pos + 2] == NULL ||
+        strcmp(c->words[c->pos + 2], ")")) {
+        return 0;
+    }
+    int length = strlen(word);
+
+    // NAME must be a valid variable name
+    char *assignment = malloc(length + 2);
+    sprintf(assignment, "%.*s=", length, word);
+    int valid_name = is_assignment(assignment);
+    free(assignment);
+    return valid_name ? length : 0;
+}
+
+// NAME() { list; }
+// The body is compiled once into a plan of its own, which the
+// function keeps for as long as it is defined
+static void compile_function(struct compiler *c, int name_length) {
+    char *name = strndup(c->words[c->pos], name_length);
+    // Skip NAME and its `(' and `)'
+    c->pos += 3;
+    while (c->words[c->pos] != NULL && !strcmp(c->words[c->pos], ";")) {
+        c->pos++;
+    }
+    expect(c, "{");
+    if (c->status != COMPILE_OK) {
+        free(name);
+        return;
+    }
+
+    struct plan *body = calloc(1, sizeof(*body));
+    body->refs = 1;
+    struct compiler inner = {
+        .words = c->words, .pos = c->pos, .plan = body, 
+        .status = COMPILE_OK, .loop = NULL, .functions = c->functions + 1
+    };
+    compile_list(&inner, BRACE_STOPS);
+    expect(&inner, "}");
+    c->pos = inner.pos;
+    c->status = inner.status;
+    if (c->status != COMPILE_OK) {
+        release_plan(body);
+        free(name);
+        return;
+    }
+
+    int function = emit(c, OP_FUNCTION);
+    c->plan->code[function].name = name;
+    c->plan->code[function].body = body;
+}
+
+// return [n]
+static void compile_return(struct compiler *c) {
+    c->pos++;
+    int value = -1;
+    char *word = c->words[c->pos];
+    if (word != NULL && !ends_command(word)) {
+        char *end;
+        long n = strtol(word, &end, 10);
+        if (*end != '\0' || n < 0 || n > 255) {
+            fprintf(stderr, "return: %s: numeric argument required\n", 
+                    word);
+            c->status = COMPILE_ERROR;
+            return;
+        }
+        value = n;
+        c->pos++;
+        if (c->words[c->pos] != NULL && !ends_command(c->words[c->pos])) {
+            fprintf(stderr, "return: too many arguments\n");
+            c->status = COMPILE_ERROR;
+            return;
+        }
+    }
+
+    int leave = emit(c, OP_RETURN);
+    c->plan->code[leave].value = value;
+}
+
+// Add an instruction to the plan, returning its index. The plan may
+// move, so instructions are always referred to by index
+static int emit(struct compiler *c, enum opcode op) {
+    struct plan *plan = c->plan;
+    if (plan->size == plan->capacity) {
+        plan->capacity = plan->capacity == 0 ? 8 : plan->capacity * 2;
+        plan->code = realloc(plan->code, 
+                             plan->capacity*sizeof(*plan->code));
+    }
+    struct instruction *in = &plan->code[plan->size];
+    in->op = op;
+    in->words = NULL;
+    in->name = NULL;
+    in->target = 0;
+    in->slot = 0;
+    in->value = 0;
+    in->body = NULL;
+    in->groups = NULL;
+    return plan->size++;
+}
+
+// Consume the given word, which the command requires next
+static void expect(struct compiler *c, char *word) {
+    if (c->status != COMPILE_OK) {
+        return;
+    }
+    if (c->words[c->pos] == NULL) {
+        c->status = COMPILE_INCOMPLETE;
+    } else if (strcmp(c->words[c->pos], word)) {
+        syntax_error(c);
+    } else {
+        c->pos++;
+    }
+}
+
+static void syntax_error(struct compiler *c) {
+    fprintf(stderr, "syntax error near unexpected token `%s'\n", 
+            c->words[c->pos]);
+    c->status = COMPILE_ERROR;
+}
+
+// Check if word ends a simple command
+static int ends_command(char *word) {
+    return is_list_operator(word) || !strcmp(word, "&") || 
+           !strcmp(word, ")");
+}
+
+// Check if word is one of a NULL-terminated list of words
+static int in_list(char *word, char *const *list) {
+    for (int i = 0; list[i] != NULL; i++) {
+        if (!strcmp(word, list[i])) return 1;
+    }
+    return 0;
+}
+
+// Check if word starts a group of commands
+static int starts_group(char *word) {
+    return !strcmp(word, "(") || !strcmp(word, "{");
+}
+
+// Copy words[start] to words[end-1] into a new NULL-terminated array
+static char **copy_words(char **words, int start, int end) {
+    char **copy = malloc((end - start + 1)*sizeof(*copy));
+    for (int i = start; i < end; i++) {
+        copy[i - start] = strdup(words[i]);
+    }
+    copy[end - start] = NULL;
+    return copy;
+}
+
+// Append a copy of word to a NULL-terminated array of `*num_words'
+// words
+static void add_word(char ***words, int *num_words, char *word) {
+    *words = realloc(*words, (*num_words + 2)*sizeof(**words));
+    (*words)[(*num_words)++] = strdup(word);
+    (*words)[*num_words] = NULL;
+}
+
+// Free the stages of a pipeline, with the plans of its groups
+static void free_groups(struct group *groups, int num_stages) {
+    for (int i = 0; i < num_stages; i++) {
+        if (groups[i].body != NULL) {
+            release_plan(groups[i].body);
+        }
+    }
+    free(groups);
+}
@@ -0,0 +1,95 @@
+// Compiles a tokenized command line into a plan: a flat array of
+// instructions that the shell executes. Command lists, `if', `for',
+// `while' and `until' become jumps between commands, so a loop body
+// is tokenized, parsed and validated once however often it runs.
+// Function bodies, and groups of commands `( list )' and `{ list; }',
+// are compiled into plans of their own.
+
+#ifndef SHUCK_COMPILE_H
+#define SHUCK_COMPILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shuck_helper.h"
+
+// Results of `compile_line'
+#define COMPILE_OK 0
+#define COMPILE_ERROR 1
+#define COMPILE_INCOMPLETE 2
+
+enum opcode {
+    // Run the command in `words' (after expanding it)
+    OP_COMMAND,
+    // Set the NAME=value assignments in `words'
+    OP_ASSIGN,
+    // Continue at `target'
+    OP_JUMP,
+    // Continue at `target' if the last exit status was non-zero
+    OP_JUMP_IF_FAIL,
+    // Continue at `target' if the last exit status was zero
+    OP_JUMP_IF_OK,
+    // Set the exit status to `value'
+    OP_STATUS,
+    // Expand `words' into the items of for loop `slot'
+    OP_FOR_INIT,
+    // Set `name' to the next item of for loop `slot', or continue
+    // at `target' if there are none left
+    OP_FOR_NEXT,
+    // Define function `name' to run the plan `body'
+    OP_FUNCTION,
+    // Leave the function, with the exit status `value' if it is
+    // not negative
+    OP_RETURN,
+    // Run the pipeline in `words', of `value' stages, some of which
+    // are the groups in `groups'
+    OP_PIPELINE,
+};
+
+// A stage of a pipeline with groups in it. In the pipeline's words
+// each group is the single word `(' or `{', with any redirections
+// around it as there would be around a program
+struct group {
+    // The group's commands, or NULL if the stage is a program
+    struct plan *body;
+    // `( list )', run in a child of the shell, rather than
+    // `{ list; }', run in the shell itself
+    int subshell;
+};
+
+struct instruction {
+    enum opcode op;
+    char **words;
+    char *name;
+    int target;
+    int slot;
+    int value;
+    struct plan *body;
+    struct group *groups;
+};
+
+struct plan {
+    struct instruction *code;
+    int size;
+    int capacity;
+    // Number of for loops, each of which needs its own state
+    // while the plan runs
+    int num_loops;
+    // Number of users of a function body, which is freed by
+    // `release_plan' when the last one is done with it
+    int refs;
+};
+
+// Compile the words of a command line into the plan.
+// Returns COMPILE_OK, COMPILE_ERROR (having printed an error) or
+// COMPILE_INCOMPLETE if more input is needed to finish a command
+int compile_line(char **words, struct plan *plan);
+
+// Free the instructions of a plan
+void free_plan(struct plan *plan);
+
+// Give up a reference to a function body, freeing it with the last
+void release_plan(struct plan *plan);
+
+#endif
@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shuck_coproc.h"
+#include "shuck_helper.h"
+#include "shuck_io.h"
+#include "shuck_lex.h"
+#include "shuck_table.h"
+#include "shuck_vars.h"
+#include "shuck_wait.h"
+
+// How long coprocesses are given to finish once their input is closed
+// as the shell exits, before they are sent SIGTERM, then SIGKILL
+#define EXIT_GRACE_MS 1000
+
+// A running coprocess
+struct coproc {
+    // Its command, for listing
+    char *command;
+    // Every process of its pipeline, the last of which it answers from
+    pid_t *pids;
+    int num_pids;
+    // The shell that started it, the only process that can wait for
+    // it: a child forked for a group or subshell only has copies of its
+    // descriptors
+    pid_t owner;
+    // The shell's ends of the pipes to its input and from its output
+    int to;
+    int from;
+    // Output read but not yet returned by `coread', from `start' up
+    // to `end'
+    char *buffer;
+    size_t size;
+    size_t start;
+    size_t end;
+};
+
+// Coprocesses by name
+static struct table *coprocs = NULL;
+// Held by `coread', which may be one of several stages of a pipeline
+// run on threads of their own
+static pthread_mutex_t coread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper functions
+static struct coproc *find_coproc(char *builtin, char *name);
+static int is_name(char *word);
+static char *join_words(char **words);
+static int read_line(struct coproc *c, long timeout_ms, char **line);
+static int fill_buffer(struct coproc *c, struct timespec *deadline);
+static void print_coproc(const char *name, void *value, void *ctx);
+static void close_coproc(const char *name, void *value, void *ctx);
+static int wait_coproc(struct coproc *c, long timeout_ms);
+static void wait_coproc_entry(const char *name, void *value, void *ctx);
+static void free_coproc(void *value);
+
+
+// FUNCTIONS FOR SHUCK_COPROC
+
+// Start a coprocess, or list them
+int run_coproc(char **words, char **path, char **env, FILE *out) {
+    if (words[1] == NULL) {
+        if (coprocs != NULL) {
+            table_foreach(coprocs, print_coproc, out);
+        }
+        return 0;
+    }
+
+    char *name = strdup(words[1]);
+    unquote_word(name);
+    int valid_name = is_name(name);
+    if (!valid_name || words[2] == NULL) {
+        if (!valid_name) {
+            fprintf(stderr, "coproc: `%s': not a valid name\n", name);
+        } else {
+            fprintf(stderr, "usage: coproc NAME command [arg...]\n");
+        }
+        free(name);
+        return 1;
+    }
+    if (coprocs != NULL && table_get(coprocs, name) != NULL) {
+        fprintf(stderr, "coproc: %s: already running\n", name);
+        free(name);
+        return 1;
+    }
+
+    // Its input and output are the pipes, so only pipes are allowed
+    char **command = &words[2];
+    for (int i = 0; command[i] != NULL; i++) {
+        if (!strcmp(command[i], "<") || !strcmp(command[i], ">") ||
+            !strcmp(command[i], ">>")) {
+            fprintf(stderr, "coproc: %s: I/O redirection not permitted\n",
+                    name);
+            free(name);
+            return 1;
+        }
+    }
+    if (validate_command(command)) {
+        free(name);
+        return 1;
+    }
+
+    // The shell's ends are close-on-exec, so that only the coprocess
+    // holds its pipes open, and sees the end of its input when they
+    // are closed
+    int to[2];
+    int from[2];
+    if (pipe2(to, O_CLOEXEC) == -1) {
+        perror("coproc: pipe");
+        free(name);
+        return 1;
+    }
+    if (pipe2(from, O_CLOEXEC) == -1) {
+        perror("coproc: pipe");
+        close(to[0]);
+        close(to[1]);
+        free(name);
+        return 1;
+    }
+
+    // The listing shows the command as it was given
+    char *joined = join_words(command);
+
+    pid_t *pids = NULL;
+    int num_pids = start_command(command, path, env, to[0], from[1], &pids,
+                                 NULL);
+    if (num_pids < 0) {
+        close(to[1]);
+        close(from[0]);
+        free(joined);
+        free(name);
+        return 1;
+    }
+
+    struct coproc *c = calloc(1, sizeof(*c));
+    c->command = joined;
+    c->pids = pids;
+    c->num_pids = num_pids;
+    c->owner = getpid();
+    c->to = to[1];
+    c->from = from[0];
+    c->size = COPROC_BUFFER_SIZE;
+    c->buffer = malloc(c->size);
+
+    if (coprocs == NULL) {
+        coprocs = table_new();
+    }
+    table_set(coprocs, name, c);
+
+    // `$NAME_PID' is the process it answers from
+    char *pid_name = malloc(strlen(name) + 5);
+    sprintf(pid_name, "%s_PID", name);
+    char pid[32];
+    snprintf(pid, sizeof(pid), "%d", (int) pids[num_pids - 1]);
+    set_var(pid_name, pid);
+    free(pid_name);
+    free(name);
+    return 0;
+}
+
+// Write a line to a coprocess
+int run_cowrite(char **words) {
+    if (words[1] == NULL) {
+        fprintf(stderr, "usage: cowrite NAME [word...]\n");
+        return 2;
+    }
+    struct coproc *c = find_coproc("cowrite", words[1]);
+    if (c == NULL) {
+        return 2;
+    }
+
+    // The whole line is written at once, so a coprocess reading it
+    // never sees part of a request
+    char *line = join_words(&words[2]);
+    size_t length = strlen(line);
+    line[length++] = '\n';
+
+    // A coprocess that has finished fails the write with EPIPE rather
+    // than killing the shell; the SIGPIPE it raised for this thread is
+    // taken before the signal is unblocked
+    sigset_t pipe_signal;
+    sigset_t old_mask;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+
+    int status = 0;
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(c->to, line + written, length - written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) {
+                struct timespec now = { 0, 0 };
+                sigtimedwait(&pipe_signal, NULL, &now);
+            } else {
+                perror("cowrite");
+            }
+            status = 1;
+            break;
+        }
+        written += n;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    free(line);
+    return status;
+}
+
+// Read a line from a coprocess
+int run_coread(char **words, FILE *out) {
+    long timeout_ms = 0;
+    int i = 1;
+    if (words[i] != NULL && !strcmp(words[i], "-t")) {
+        if (words[i+1] == NULL ||
+            (timeout_ms = parse_duration(words[i+1])) <= 0) {
+            fprintf(stderr, "coread: -t: invalid time\n");
+            return 2;
+        }
+        i += 2;
+    }
+    if (words[i] == NULL || (words[i+1] != NULL && words[i+2] != NULL)) {
+        fprintf(stderr, "usage: coread [-t time] NAME [VAR]\n");
+        return 2;
+    }
+    struct coproc *c = find_coproc("coread", words[i]);
+    if (c == NULL) {
+        return 2;
+    }
+
+    char *var = words[i+1];
+    if (var != NULL && !is_name(var)) {
+        fprintf(stderr, "coread: `%s': not a valid name\n", var);
+        return 2;
+    }
+
+    char *line = NULL;
+    pthread_mutex_lock(&coread_lock);
+    int status = read_line(c, timeout_ms, &line);
+    pthread_mutex_unlock(&coread_lock);
+    if (status != 0) {
+        return status;
+    }
+    if (var != NULL) {
+        lock_vars();
+        set_var(var, line);
+        unlock_vars();
+    } else {
+        fputs(line, out);
+        fputc('\n', out);
+    }
+    free(line);
+    return 0;
+}
+
+// Close a coprocess and wait for it
+int run_coclose(char **words) {
+    if (words[1] == NULL || words[2] != NULL) {
+        fprintf(stderr, "usage: coclose NAME\n");
+        return 2;
+    }
+    struct coproc *c = find_coproc("coclose", words[1]);
+    if (c == NULL) {
+        return 2;
+    }
+    table_remove(coprocs, words[1]);
+
+    // A forked child only closes its copies of the descriptors, which
+    // leaves the coprocess running for the shell that started it
+    close_coproc(words[1], c, NULL);
+    int status = c->owner == getpid() ? wait_coproc(c, 0) : 0;
+    free_coproc(c);
+    return status;
+}
+
+// Close and wait for every coprocess
+void free_coprocs(void) {
+    if (coprocs == NULL) {
+        return;
+    }
+
+    // Every coprocess is told to finish before any is waited for, so
+    // that they finish together
+    table_foreach(coprocs, close_coproc, NULL);
+    table_foreach(coprocs, wait_coproc_entry, NULL);
+    table_free(coprocs, free_coproc);
+    coprocs = NULL;
+}
+
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Find the coprocess called `name', printing an error for `builtin'
+// if there is none
+static struct coproc *find_coproc(char *builtin, char *name) {
+    struct coproc *c = coprocs != NULL ? table_get(coprocs, name) : NULL;
+    if (c == NULL) {
+        fprintf(stderr, "%s: %s: no such coprocess\n", builtin, name);
+    }
+    return c;
+}
+
+// Check if word can be the name of a variable
+static int is_name(char *word) {
+    char *assignment = malloc(strlen(word) + 2);
+    sprintf(assignment, "%s=", word);
+    int valid = strchr(word, '=') == NULL && is_assignment(assignment);
+    free(assignment);
+    return valid;
+}
+
+// Join words with spaces into a new string, with their quote marks
+// taken out and room for one more character
+static char *join_words(char **words) {
+    size_t length = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        length += strlen(words[i]) + 1;
+    }
+    char *joined = malloc(length + 2);
+    size_t k = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        if (i > 0) {
+            joined[k++] = ' ';
+        }
+        for (char *s = words[i]; *s != '\0'; s++) {
+            if (*s != QUOTE_MARK) {
+                joined[k++] = *s;
+            }
+        }
+    }
+    joined[k] = '\0';
+    return joined;
+}
+
+// Take the next line of the coprocess's output, without its newline,
+// reading more of it as needed. A last line without a newline is
+// still a line. Returns 0 with the line in `line', 1 at the end of the
+// output, or TIMEOUT_EXIT_STATUS if `timeout_ms' is positive and no
+// whole line came in that long
+static int read_line(struct coproc *c, long timeout_ms, char **line) {
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    // Only what was read since the last look is searched; `scanned'
+    // is counted from `start', since filling the buffer moves it
+    size_t scanned = 0;
+    char *newline;
+    while ((newline = memchr(c->buffer + c->start + scanned, '\n',
+                             c->end - c->start - scanned)) == NULL) {
+        scanned = c->end - c->start;
+        int result = fill_buffer(c, timeout_ms > 0 ? &deadline : NULL);
+        if (result == 0) {
+            if (c->start == c->end) {
+                return 1;
+            }
+            newline = c->buffer + c->end;
+            break;
+        } else if (result < 0) {
+            return result == -2 ? TIMEOUT_EXIT_STATUS : 1;
+        }
+    }
+
+    size_t length = newline - (c->buffer + c->start);
+    *line = strndup(c->buffer + c->start, length);
+    c->start += length;
+    if (c->start < c->end) {
+        c->start++;
+    }
+    if (c->start == c->end) {
+        c->start = c->end = 0;
+    }
+    return 0;
+}
+
+// Read more of the coprocess's output into its buffer, moving what is
+// still buffered to the start and growing the buffer if it is full.
+// Returns the number of bytes read, 0 at the end of the output, -2 if
+// `deadline' passed first, or -1 (having printed an error) if it
+// could not be read
+static int fill_buffer(struct coproc *c, struct timespec *deadline) {
+    if (c->start > 0) {
+        memmove(c->buffer, c->buffer + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+    if (c->end == c->size) {
+        c->size *= 2;
+        c->buffer = realloc(c->buffer, c->size);
+    }
+
+    while (1) {
+        if (deadline != NULL) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long remaining_ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+                                (deadline->tv_nsec - now.tv_nsec) / 1000000;
+            if (remaining_ms <= 0) {
+                return -2;
+            }
+            struct pollfd pfd = { .fd = c->from, .events = POLLIN };
+            int ready = poll(&pfd, 1, remaining_ms);
+            if (ready == -1 && errno != EINTR) {
+                perror("coread: poll");
+                return -1;
+            }
+            if (ready <= 0) {
+                continue;
+            }
+        }
+        ssize_t n = read(c->from, c->buffer + c->end, c->size - c->end);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("coread");
+            return -1;
+        }
+        c->end += n;
+        return n;
+    }
+}
+
+// Print one coprocess for `coproc' with no arguments
+static void print_coproc(const char *name, void *value, void *ctx) {
+    struct coproc *c = value;
+    fprintf(ctx, "%s %d %s\n", name, (int) c->pids[c->num_pids - 1],
+            c->command);
+}
+
+// Close the shell's ends of a coprocess's pipes, so that it sees the
+// end of its input. Output it had not been asked for is discarded
+static void close_coproc(const char *name, void *value, void *ctx) {
+    (void) name;
+    (void) ctx;
+    struct coproc *c = value;
+    if (c->to != -1) close(c->to);
+    if (c->from != -1) close(c->from);
+    c->to = c->from = -1;
+}
+
+// Wait for a closed coprocess to finish, for at most `timeout_ms' if it
+// is positive, returning the exit status of its last process
+static int wait_coproc(struct coproc *c, long timeout_ms) {
+    int *statuses = calloc(c->num_pids, sizeof(*statuses));
+    wait_processes(c->pids, c->num_pids, statuses, timeout_ms,
+                   timeout_ms, 0);
+    int status = exit_code(statuses[c->num_pids - 1]);
+    free(statuses);
+    return status;
+}
+
+// Wait for one of the coprocesses as the shell exits, unless it was
+// started by another process: a child forked for a group or subshell
+// that exits leaves the shell's coprocesses to it
+static void wait_coproc_entry(const char *name, void *value, void *ctx) {
+    (void) name;
+    (void) ctx;
+    struct coproc *c = value;
+    if (c->owner == getpid()) {
+        wait_coproc(c, EXIT_GRACE_MS);
+    }
+}
+
+// Free a coprocess, which has been waited for
+static void free_coproc(void *value) {
+    struct coproc *c = value;
+    free(c->command);
+    free(c->pids);
+    free(c->buffer);
+    free(c);
+}
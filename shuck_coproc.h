@@ -0,0 +1,62 @@
+// Coprocesses: long-lived commands the shell starts once and then talks
+// to, a line at a time, through pipes to their standard input and from
+// their standard output. A tool with a request loop, such as bc(1) or a
+// language server, pays for its exec and initialisation once rather
+// than once per request.
+//
+//     coproc NAME command [arg...] [| command...]
+//     cowrite NAME word...
+//     coread [-t TIME] NAME [VAR]
+//     coclose NAME
+//
+// The command is started the way a pipeline is (start_command in
+// shuck_io.h), so it may be a pipeline or have a `sched', `affinity'
+// or `limit' prefix, and `$NAME_PID' is set to the pid of its last
+// process. The shell's ends of the pipes are close-on-exec, so no
+// other command holds them open. Responses are read through a buffer
+// kept for each coprocess, so a line costs one read(2) however long
+// it is, and a response split across reads is joined up. The command
+// must write each response as soon as it has it rather than buffer
+// its output, as most programs do when it is a pipe (e.g. `sed -u' or
+// `python3 -u').
+
+#ifndef SHUCK_COPROC_H
+#define SHUCK_COPROC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COPROC_BUFFER_SIZE 65536
+
+// Start the coprocess given by `words', which start with `coproc',
+// or list the running coprocesses to `out' if there are no other
+// words. The words are still quoted (BUILTIN_REDIRECTS), so that a
+// `|' reaches the command. Returns 0 if it was started, or 1 (having
+// printed an error) if it could not be
+int run_coproc(char **words, char **path, char **env, FILE *out);
+
+// Write the words after `cowrite NAME', separated by spaces, as one
+// line to the coprocess's input. Returns 0, 1 if the coprocess is no
+// longer reading, or 2 (having printed an error) for a usage error
+int run_cowrite(char **words);
+
+// Read one line of the coprocess's output, without its newline, into
+// the variable given, or write it to `out'. With `-t TIME', give up
+// after that long (parse_duration in shuck_wait.h). Returns 0, 1 at
+// the end of its output, TIMEOUT_EXIT_STATUS if it timed out, or 2
+// (having printed an error) for a usage error
+int run_coread(char **words, FILE *out);
+
+// Close the coprocess's input and wait for it to finish. Returns its
+// exit status, or 2 (having printed an error) for a usage error. In a
+// child forked for a group or subshell, only the child's copies of
+// the pipes are closed, and 0 is returned
+int run_coclose(char **words);
+
+// Close every coprocess's input and wait briefly for them to finish,
+// then stop those that have not, as the shell exits. In a child forked
+// for a group or subshell, the coprocesses are only forgotten
+void free_coprocs(void);
+
+#endif
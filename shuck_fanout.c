@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shuck_fanout.h"
+#include "shuck_lex.h"
+#include "shuck_vars.h"
+
+#define COPY_BUFFER_SIZE 65536
+
+struct fanout {
+    // The pipe the command writes to, and how much it holds
+    int src[2];
+    int pipe_size;
+    // Written to by `finish_fanout' to tell the thread to stop once
+    // it has copied what is left in the pipe
+    int stop[2];
+    // The targets. All but the last are given their copy of the data
+    // through a pipe of their own, which `tee' fills
+    int num_targets;
+    int *fds;
+    char **names;
+    int (*copies)[2];
+    // Bytes written to each target, and whether writing to it failed
+    long long *bytes;
+    int *failed;
+    pthread_t thread;
+    struct timespec start;
+};
+
+// Helper functions
+static int open_target(char *filename, int append);
+static void *copy_output(void *arg);
+static ssize_t copy_round(struct fanout *f, int flags);
+static void send_target(struct fanout *f, int target, int from, size_t n);
+static ssize_t copy_bytes(int from, int to, size_t n, int *error);
+static void print_stats(struct fanout *f);
+static void free_fanout(struct fanout *f);
+
+
+// Find the first output redirection
+int first_output(char **glob_words) {
+    for (int i = 0; glob_words[i] != NULL; i++) {
+        if (!strcmp(glob_words[i], ">")) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Open the output targets of a command
+int open_outputs(char **glob_words, struct fanout **fanout) {
+    *fanout = NULL;
+    struct fanout *f = calloc(1, sizeof(*f));
+    f->src[0] = f->src[1] = f->stop[0] = f->stop[1] = -1;
+
+    int i = first_output(glob_words);
+    while (i != -1 && glob_words[i] != NULL) {
+        int append = !strcmp(glob_words[i+1], ">");
+        // The words stay quoted, so a file named `|' is not taken
+        // for a pipe when they are read again
+        char *filename = strdup(glob_words[i+1+append]);
+        unquote_word(filename);
+        int fd = open_target(filename, append);
+        if (fd == -1) {
+            free(filename);
+            free_fanout(f);
+            return -1;
+        }
+        int n = f->num_targets++;
+        f->fds = realloc(f->fds, f->num_targets*sizeof(*f->fds));
+        f->names = realloc(f->names, f->num_targets*sizeof(*f->names));
+        f->fds[n] = fd;
+        f->names[n] = filename;
+        i += 2+append;
+    }
+
+    // A single target is written to directly
+    if (f->num_targets == 1) {
+        int fd = f->fds[0];
+        f->num_targets = 0;
+        free(f->names[0]);
+        free_fanout(f);
+        return fd;
+    }
+
+    f->copies = calloc(f->num_targets - 1, sizeof(*f->copies));
+    f->bytes = calloc(f->num_targets, sizeof(*f->bytes));
+    f->failed = calloc(f->num_targets, sizeof(*f->failed));
+    for (int t = 0; t < f->num_targets - 1; t++) {
+        f->copies[t][0] = f->copies[t][1] = -1;
+    }
+    if (pipe2(f->src, O_CLOEXEC) == -1 || pipe2(f->stop, O_CLOEXEC) == -1) {
+        perror("pipe");
+        free_fanout(f);
+        return -1;
+    }
+    f->pipe_size = fcntl(f->src[0], F_GETPIPE_SZ);
+    for (int t = 0; t < f->num_targets - 1; t++) {
+        if (pipe2(f->copies[t], O_CLOEXEC) == -1) {
+            perror("pipe");
+            free_fanout(f);
+            return -1;
+        }
+        // Each copy pipe must be able to take everything in the
+        // command's pipe at once
+        fcntl(f->copies[t][0], F_SETPIPE_SZ, f->pipe_size);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &f->start);
+    int error = pthread_create(&f->thread, NULL, copy_output, f);
+    if (error != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        free_fanout(f);
+        return -1;
+    }
+    *fanout = f;
+
+    // The command gets its own copy of the write end, so the shell
+    // closing it does not stop the copying
+    return dup(f->src[1]);
+}
+
+// Finish copying a command's output
+void finish_fanout(struct fanout *f) {
+    if (f == NULL) {
+        return;
+    }
+    if (write(f->stop[1], "", 1) == -1) {
+        perror("write");
+    }
+    pthread_join(f->thread, NULL);
+    if (get_var("SHUCK_FANOUT_STATS") != NULL) {
+        print_stats(f);
+    }
+    free_fanout(f);
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+static int open_target(char *filename, int append) {
+    int flags = O_CREAT|O_WRONLY|O_CLOEXEC|(append ? O_APPEND : O_TRUNC);
+    int fd = open(filename, flags, 0644);
+    if (fd == -1) {
+        perror(filename);
+    }
+    return fd;
+}
+
+// Thread that copies the command's output to the targets until the
+// end of the output, or until told to stop and the pipe is empty
+static void *copy_output(void *arg) {
+    struct fanout *f = arg;
+
+    // A target that is a pipe with no reader fails with EPIPE
+    // rather than killing the shell
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    struct pollfd fds[2] = {
+        { .fd = f->src[0], .events = POLLIN },
+        { .fd = f->stop[0], .events = POLLIN },
+    };
+    int stopping = 0;
+    while (1) {
+        if (!stopping) {
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            stopping = fds[1].revents != 0;
+        }
+        if (copy_round(f, stopping ? SPLICE_F_NONBLOCK : 0) <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Copy what is in the command's pipe to every target. Returns the
+// number of bytes copied, 0 at the end of the output, or -1 if
+// there was nothing to copy without blocking
+static ssize_t copy_round(struct fanout *f, int flags) {
+    int last = f->num_targets - 1;
+
+    // Duplicate the data into the copy pipes without using it up.
+    // The copy pipes are empty, and as big as the command's pipe
+    ssize_t n;
+    do {
+        n = tee(f->src[0], f->copies[0][1], f->pipe_size, flags);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return n;
+    }
+    for (int t = 1; t < last; t++) {
+        ssize_t copied;
+        do {
+            copied = tee(f->src[0], f->copies[t][1], n, 0);
+        } while (copied == -1 && errno == EINTR);
+    }
+
+    for (int t = 0; t < last; t++) {
+        send_target(f, t, f->copies[t][0], n);
+    }
+    // The last target takes the data out of the command's pipe
+    send_target(f, last, f->src[0], n);
+    return n;
+}
+
+// Move n bytes from a pipe to a target. The bytes are still taken
+// from the pipe if writing to the target has failed
+static void send_target(struct fanout *f, int target, int from, size_t n) {
+    while (n > 0) {
+        int error = 0;
+        ssize_t moved;
+        if (f->failed[target]) {
+            moved = copy_bytes(from, -1, n, &error);
+        } else {
+            moved = splice(from, NULL, f->fds[target], NULL, n, SPLICE_F_MOVE);
+            if (moved == -1) error = errno;
+            // Not every file can be spliced to, e.g. ones opened to append
+            if (error == EINVAL) {
+                error = 0;
+                moved = copy_bytes(from, f->fds[target], n, &error);
+            }
+        }
+
+        if (error == EINTR) {
+            continue;
+        }
+        if (error != 0 && !f->failed[target]) {
+            if (error != EPIPE) {
+                fprintf(stderr, "%s: %s\n", f->names[target], strerror(error));
+            }
+            f->failed[target] = 1;
+            // Whatever was read before the write failed is used up
+            if (moved > 0) n -= moved;
+            continue;
+        }
+        if (moved <= 0) {
+            return;
+        }
+        if (!f->failed[target]) {
+            f->bytes[target] += moved;
+        }
+        n -= moved;
+    }
+}
+
+// Copy up to n bytes through a buffer, discarding them if `to' is -1.
+// Returns the number of bytes read, or -1 if none could be, setting
+// `error' if reading or writing failed
+static ssize_t copy_bytes(int from, int to, size_t n, int *error) {
+    char buffer[COPY_BUFFER_SIZE];
+    ssize_t got = read(from, buffer, n < sizeof buffer ? n : sizeof buffer);
+    if (got == -1) {
+        *error = errno;
+    }
+    if (got <= 0 || to == -1) {
+        return got;
+    }
+    for (ssize_t written = 0; written < got; ) {
+        ssize_t w = write(to, buffer + written, got - written);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            *error = errno;
+            break;
+        }
+        written += w;
+    }
+    return got;
+}
+
+static void print_stats(struct fanout *f) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - f->start.tv_sec) +
+                     (end.tv_nsec - f->start.tv_nsec) / 1e9;
+    for (int t = 0; t < f->num_targets; t++) {
+        double rate = seconds > 0 ? f->bytes[t] / seconds / (1 << 20) : 0;
+        fprintf(stderr, "%s: %lld bytes, %.1f MiB/s%s\n", f->names[t],
+                f->bytes[t], rate, f->failed[t] ? " (failed)" : "");
+    }
+}
+
+static void free_fanout(struct fanout *f) {
+    for (int t = 0; t < f->num_targets; t++) {
+        close(f->fds[t]);
+        free(f->names[t]);
+        if (t < f->num_targets - 1 && f->copies != NULL) {
+            if (f->copies[t][0] != -1) close(f->copies[t][0]);
+            if (f->copies[t][1] != -1) close(f->copies[t][1]);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (f->src[i] != -1) close(f->src[i]);
+        if (f->stop[i] != -1) close(f->stop[i]);
+    }
+    free(f->fds);
+    free(f->names);
+    free(f->copies);
+    free(f->bytes);
+    free(f->failed);
+    free(f);
+}
@@ -0,0 +1,37 @@
+// Output to more than one target, as in `cmd > a > b > > c'. The
+// command writes into a pipe, and a thread copies the pipe to every
+// target with tee(2) and splice(2), so the data stays in the kernel's
+// pipe buffers rather than passing through the shell. A target can be
+// a process substitution, `> >(cmd)', to send the output to another
+// command as well as to files.
+
+#ifndef SHUCK_FANOUT_H
+#define SHUCK_FANOUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shuck_helper.h"
+
+// Output being copied to several targets
+struct fanout;
+
+// Find the first `>' in the words, or return -1 if there is none
+int first_output(char **glob_words);
+
+// Open the output targets of a command: every `> file' and `> > file'
+// from the first `>' to the end of the words. Returns the file
+// descriptor the command should write to, or -1 (having printed an
+// error) if a target cannot be opened. If there is more than one
+// target, `fanout' is set to the copying that has been started,
+// otherwise it is set to NULL
+int open_outputs(char **glob_words, struct fanout **fanout);
+
+// Once the command has finished, copy the rest of its output and
+// close the targets. With `$SHUCK_FANOUT_STATS' set, the bytes
+// written to each target and the rate they were written at are
+// printed to stderr. Does nothing if `fanout' is NULL
+void finish_fanout(struct fanout *fanout);
+
+#endif
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "shuck_glob.h"
+
+// Size of the buffer each thread reads directory entries into
+#define DIRENT_BUFFER_SIZE (128 * 1024)
+
+// Layout of the records returned by getdents64(2)
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A directory still to be read, and the pattern component to match
+// its entries against
+struct task {
+    char *dir;
+    int component;
+    struct task *next;
+};
+
+// A pattern being expanded, shared by all of its threads
+struct expansion {
+    char **components;
+    int num_components;
+    int dirs_only;
+    int flags;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct task *tasks;
+    int active;
+
+    char **matches;
+    int num_matches;
+    int max_matches;
+    glob_callback add;
+    void *ctx;
+};
+
+// Helper functions
+static char *expand_tilde(const char *pattern);
+static int split_pattern(struct expansion *e, char *pattern);
+static void *worker(void *arg);
+static void process(struct expansion *e, char *buffer, char *dir, 
+                    int component);
+static void enter_dir(struct expansion *e, char *dir, int component);
+static void push_task(struct expansion *e, char *dir, int component);
+static void add_match(struct expansion *e, char *dir, char *name, 
+                      int is_dir);
+static void record_match(struct expansion *e, char *path);
+static char *join_path(const char *dir, const char *name);
+static int entry_is_dir(char *dir, struct linux_dirent64 *entry, 
+                        int follow);
+static int compare_matches(const void *a, const void *b);
+static void unescape(char *s);
+
+
+// Expand a pattern
+int shuck_glob(const char *pattern, int flags, int threads, 
+               glob_callback add, void *ctx) {
+    char *expanded = expand_tilde(pattern);
+
+    // Words without pattern characters need no directory reads at all
+    if (!is_glob_pattern(expanded)) {
+        int found = strcmp(expanded, pattern) != 0;
+        if (flags & GLOB_QUOTED) {
+            unescape(expanded);
+        }
+        if (found) {
+            add(expanded, ctx);
+        }
+        free(expanded);
+        return found;
+    }
+
+    struct expansion e = { .flags = flags, .add = add, .ctx = ctx };
+    char *start = expanded[0] == '/' ? "/" : "";
+    int recursive = split_pattern(&e, expanded);
+    pthread_mutex_init(&e.lock, NULL);
+    pthread_cond_init(&e.changed, NULL);
+
+    enter_dir(&e, strdup(start), 0);
+
+    // Only `**' reads enough directories to be worth extra threads
+    if (!recursive || threads < 1) {
+        threads = 1;
+    }
+    pthread_t *pool = malloc(threads*sizeof(*pool));
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&pool[i], NULL, worker, &e) != 0) {
+            threads = i;
+            break;
+        }
+    }
+    // The calling thread is always one of the workers
+    worker(&e);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    free(pool);
+
+    int num_matches = e.num_matches;
+    if (!(flags & GLOB_UNSORTED) && num_matches > 0) {
+        qsort(e.matches, e.num_matches, sizeof(*e.matches), compare_matches);
+        for (int i = 0; i < e.num_matches; i++) {
+            add(e.matches[i], ctx);
+            free(e.matches[i]);
+        }
+    }
+    free(e.matches);
+
+    pthread_mutex_destroy(&e.lock);
+    pthread_cond_destroy(&e.changed);
+    free(e.components);
+    free(expanded);
+    return num_matches;
+}
+
+// Check for `*', `?' and `['
+int is_glob_pattern(const char *word) {
+    return strpbrk(word, "*?[") != NULL;
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Return a copy of the pattern with a leading `~' or `~user'
+// replaced by the home directory
+static char *expand_tilde(const char *pattern) {
+    if (pattern[0] != '~') {
+        return strdup(pattern);
+    }
+    const char *rest = strchr(pattern, '/');
+    if (rest == NULL) {
+        rest = pattern + strlen(pattern);
+    }
+
+    char *home = NULL;
+    if (rest == pattern + 1) {
+        home = getenv("HOME");
+    } else {
+        char *user = strndup(pattern + 1, rest - (pattern + 1));
+        struct passwd *pw = getpwnam(user);
+        free(user);
+        if (pw != NULL) {
+            home = pw->pw_dir;
+        }
+    }
+    if (home == NULL) {
+        return strdup(pattern);
+    }
+
+    char *expanded = malloc(strlen(home) + strlen(rest) + 1);
+    strcpy(expanded, home);
+    strcat(expanded, rest);
+    return expanded;
+}
+
+// Split the pattern into its `/' separated components, in place.
+// Returns 1 if the pattern contains `**'
+static int split_pattern(struct expansion *e, char *pattern) {
+    size_t len = strlen(pattern);
+    if (len > 1 && pattern[len-1] == '/') {
+        e->dirs_only = 1;
+    }
+
+    e->components = malloc((len/2 + 2)*sizeof(*e->components));
+    int recursive = 0;
+    char *saveptr;
+    for (char *c = strtok_r(pattern, "/", &saveptr); c != NULL; 
+         c = strtok_r(NULL, "/", &saveptr)) {
+        // Components matched by name alone have no fnmatch(3) to
+        // take their backslashes off
+        if ((e->flags & GLOB_QUOTED) && !is_glob_pattern(c)) {
+            unescape(c);
+        }
+        int globstar = !strcmp(c, "**");
+        // `**/**' matches the same as `**'
+        if (globstar && e->num_components > 0 && 
+            !strcmp(e->components[e->num_components-1], "**")) {
+            continue;
+        }
+        recursive |= globstar;
+        e->components[e->num_components++] = c;
+    }
+    return recursive;
+}
+
+// Take directories off the queue until there are none left and
+// no other thread could add any more
+static void *worker(void *arg) {
+    struct expansion *e = arg;
+    char *buffer = malloc(DIRENT_BUFFER_SIZE);
+
+    pthread_mutex_lock(&e->lock);
+    while (1) {
+        while (e->tasks == NULL && e->active > 0) {
+            pthread_cond_wait(&e->changed, &e->lock);
+        }
+        if (e->tasks == NULL) {
+            break;
+        }
+        struct task *t = e->tasks;
+        e->tasks = t->next;
+        e->active++;
+        pthread_mutex_unlock(&e->lock);
+
+        process(e, buffer, t->dir, t->component);
+        free(t->dir);
+        free(t);
+
+        pthread_mutex_lock(&e->lock);
+        e->active--;
+        if (e->active == 0 && e->tasks == NULL) {
+            pthread_cond_broadcast(&e->changed);
+        }
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    free(buffer);
+    return NULL;
+}
+
+// Match the entries of a directory against a pattern component
+static void process(struct expansion *e, char *buffer, char *dir, 
+                    int component) {
+    char *pattern = e->components[component];
+    int last = component == e->num_components-1;
+
+    // Components without pattern characters are followed without
+    // reading the directory; only the final pathname has to exist
+    if (!is_glob_pattern(pattern)) {
+        char *path = join_path(dir, pattern);
+        if (!last) {
+            enter_dir(e, path, component+1);
+            return;
+        }
+        struct stat s;
+        if (lstat(path, &s) == 0) {
+            add_match(e, dir, pattern, S_ISDIR(s.st_mode));
+        }
+        free(path);
+        return;
+    }
+
+    int globstar = !strcmp(pattern, "**");
+    // The component `**' matches zero directories as well, so the
+    // entries are also matched against the component after it
+    char *next = globstar && !last ? e->components[component+1] : NULL;
+    int next_last = component+1 == e->num_components-1;
+
+    int fd = open(dir[0] == '\0' ? "." : dir, 
+                  O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd == -1) {
+        // Unreadable directories are skipped, as by glob(3)
+        return;
+    }
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER_SIZE)) > 0) {
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *entry = (void *) (buffer + pos);
+            pos += entry->d_reclen;
+            char *name = entry->d_name;
+            if (!strcmp(name, ".") || !strcmp(name, "..")) {
+                continue;
+            }
+
+            if (globstar) {
+                // Hidden directories are not searched, and symbolic
+                // links are not followed so there can be no cycles
+                int hidden = name[0] == '.';
+                int is_dir = entry_is_dir(dir, entry, 0);
+                if (last && !hidden) {
+                    add_match(e, dir, name, is_dir);
+                }
+                else if (next != NULL && 
+                         fnmatch(next, name, FNM_PERIOD) == 0) {
+                    if (next_last) {
+                        add_match(e, dir, name, 
+                                  entry_is_dir(dir, entry, 1));
+                    } else if (entry_is_dir(dir, entry, 1)) {
+                        enter_dir(e, join_path(dir, name), component+2);
+                    }
+                }
+                if (is_dir && !hidden) {
+                    push_task(e, join_path(dir, name), component);
+                }
+            }
+            else if (fnmatch(pattern, name, FNM_PERIOD) == 0) {
+                if (last) {
+                    add_match(e, dir, name, 
+                              e->dirs_only ? entry_is_dir(dir, entry, 1) : 0);
+                } else if (entry_is_dir(dir, entry, 1)) {
+                    enter_dir(e, join_path(dir, name), component+1);
+                }
+            }
+        }
+    }
+    close(fd);
+}
+
+// Queue a directory to be matched against a component, taking
+// ownership of `dir'. A final `**/' matches zero directories as well,
+// so the directory it starts from is one of its matches, unless that
+// is the current directory. Components without pattern characters
+// are followed without reading anything, so it may not exist
+static void enter_dir(struct expansion *e, char *dir, int component) {
+    struct stat s;
+    if (e->dirs_only && component == e->num_components-1 && 
+        !strcmp(e->components[component], "**") && dir[0] != '\0' &&
+        stat(dir, &s) == 0 && S_ISDIR(s.st_mode)) {
+        record_match(e, join_path(dir, ""));
+    }
+    push_task(e, dir, component);
+}
+
+// Queue a directory to be read, taking ownership of `dir'
+static void push_task(struct expansion *e, char *dir, int component) {
+    struct task *t = malloc(sizeof(*t));
+    t->dir = dir;
+    t->component = component;
+
+    pthread_mutex_lock(&e->lock);
+    t->next = e->tasks;
+    e->tasks = t;
+    pthread_cond_signal(&e->changed);
+    pthread_mutex_unlock(&e->lock);
+}
+
+// Record a matching pathname, passing it straight to the callback
+// if results are not being sorted
+static void add_match(struct expansion *e, char *dir, char *name, 
+                      int is_dir) {
+    if (e->dirs_only && !is_dir) {
+        return;
+    }
+    char *path = join_path(dir, name);
+    if (e->dirs_only) {
+        path = realloc(path, strlen(path) + 2);
+        strcat(path, "/");
+    }
+    record_match(e, path);
+}
+
+// Add a matching pathname to the results, taking ownership of it
+static void record_match(struct expansion *e, char *path) {
+    pthread_mutex_lock(&e->lock);
+    e->num_matches++;
+    if (e->flags & GLOB_UNSORTED) {
+        e->add(path, e->ctx);
+        free(path);
+    } else {
+        if (e->num_matches > e->max_matches) {
+            e->max_matches = e->max_matches == 0 ? 16 : e->max_matches * 2;
+            e->matches = realloc(e->matches, 
+                                 e->max_matches*sizeof(*e->matches));
+        }
+        e->matches[e->num_matches-1] = path;
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+// Join a directory and a name, where "" is the current directory
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    char *path = malloc(dir_len + strlen(name) + 2);
+    strcpy(path, dir);
+    if (dir_len > 0 && dir[dir_len-1] != '/') {
+        strcat(path, "/");
+    }
+    strcat(path, name);
+    return path;
+}
+
+// Check if an entry is a directory, only calling stat(2) if the
+// file system did not report its type (or it is a symbolic link
+// that should be followed)
+static int entry_is_dir(char *dir, struct linux_dirent64 *entry, 
+                        int follow) {
+    if (entry->d_type == DT_DIR) {
+        return 1;
+    }
+    if (entry->d_type != DT_UNKNOWN && 
+        !(entry->d_type == DT_LNK && follow)) {
+        return 0;
+    }
+    char *path = join_path(dir, entry->d_name);
+    struct stat s;
+    int is_dir = (follow ? stat(path, &s) : lstat(path, &s)) == 0 && 
+                 S_ISDIR(s.st_mode);
+    free(path);
+    return is_dir;
+}
+
+// Sort matches in the same order as glob(3)
+static int compare_matches(const void *a, const void *b) {
+    return strcoll(*(char *const *) a, *(char *const *) b);
+}
+
+// Take the backslashes out of a pattern, in place, keeping the
+// characters they escape
+static void unescape(char *s) {
+    char *out = s;
+    for (; *s != '\0'; s++) {
+        if (*s == '\\' && s[1] != '\0') {
+            s++;
+        }
+        *out++ = *s;
+    }
+    *out = '\0';
+}
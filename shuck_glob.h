@@ -0,0 +1,31 @@
+// The shell's own pathname expansion. Directories are read with large
+// getdents64(2) buffers, and the type each entry reports is used so
+// that entries are only stat'ed when their type is unknown. `**'
+// matches any number of directories, including none, so `a/**/'
+// matches `a/' itself, and is expanded by a pool of worker threads.
+
+#include <stdlib.h>
+
+// Pass matches to the callback as they are found, rather than
+// sorting them all at the end
+#define GLOB_UNSORTED 1
+
+// A backslash in the pattern makes the character after it match only
+// itself, as in fnmatch(3), including where the pattern has no
+// pattern characters
+#define GLOB_QUOTED 2
+
+// Called for every pathname that matches. Calls are never concurrent,
+// even when directories are read by several threads
+typedef void (*glob_callback)(const char *pathname, void *ctx);
+
+// Expand the pattern, calling `add' for each matching pathname.
+// `~' and `~user' at the start of the pattern are expanded, and
+// `threads' is the number of threads used to expand `**'.
+// Returns the number of matches. If there are none, nothing is added
+// and the caller decides what to do with the pattern
+int shuck_glob(const char *pattern, int flags, int threads, 
+               glob_callback add, void *ctx);
+
+// Check if the word contains any pattern characters
+int is_glob_pattern(const char *word);
@@ -1,10 +1,26 @@
 #include "shuck_helper.h"
+#include "shuck_builtins.h"
+#include "shuck_glob.h"
+#include "shuck_lex.h"
+#include "shuck_vars.h"
 
-#define APPEND 2
-#define OVERWRITE 1
 #define MAX_CHARS 1024
 
+// Pathnames found by `executable_path', keyed on program name
+static struct table *executable_cache = NULL;
+static int (*program_index)(const char *program, char *pathname) = NULL;
+
+// A growing array of words
+struct word_array {
+    char **words;
+    int size;
+    int max_size;
+};
+
 // Helper functions to shuck_helper functions
+static void add_glob_word(const char *word, void *ctx);
+static int glob_flags(void);
+static int glob_threads(void);
 static int invalid_input();
 static int invalid_output();
 static int invalid_pipes();
@@ -17,44 +33,32 @@ static int check_io_command(char *program);
 
 // Initialise an array with all expanded patterns
 char **init_glob_words(char **words) {
-    glob_t pattern;
-    int k = 0;
-    int words_size = array_size(words);
-    int glob_size = words_size+1;
-
-    // Create an array size of words to hold the expanded patterns
-    char **glob_words = malloc((glob_size)*sizeof(*glob_words));
-    for (int j = 0; j < words_size; j++) {
-        // Create a buffer to hold the word
-        char line[MAX_CHARS];
-        strcpy(line, words[j]);
-        // Glob will create an array of expanded words if a pattern is 
-        // detected
-        int pattern_result = glob(line, GLOB_NOCHECK|GLOB_TILDE, NULL,
-                                &pattern);
-        if (pattern_result != 0) {
-            perror("");
-            return NULL;
-        } else {
-            int patt_argc = (int)pattern.gl_pathc;
-            // Check if words are expanded, if so need to malloc more 
-            // memory for the array
-            if (patt_argc > 1) {
-                glob_size += patt_argc;
-                glob_words = realloc(glob_words, glob_size*sizeof(*glob_words)); 
-            }
-            for (int t = 0; t < patt_argc; t++) {
-                // Need to create a duplicate of the word since it will be freed
-                glob_words[k] = strdup(pattern.gl_pathv[t]);
-                k++;
-            }
+    struct word_array glob_words = { .words = NULL, .size = 0, .max_size = 0 };
+    int flags = glob_flags();
+    int threads = glob_threads();
+
+    for (int j = 0; words[j] != NULL; j++) {
+        // Quoted parts of a word only match themselves
+        char *pattern = words[j];
+        int pattern_flags = flags;
+        if (strchr(words[j], QUOTE_MARK) != NULL) {
+            pattern = quoted_glob_pattern(words[j]);
+            pattern_flags |= GLOB_QUOTED;
         }
-        globfree(&pattern);
-    }
 
-    glob_words[k] = NULL;
+        // Patterns are expanded into every matching pathname, and
+        // words that match nothing are kept as they are
+        if (pattern == NULL || shuck_glob(pattern, pattern_flags, threads, 
+                                          add_glob_word, &glob_words) == 0) {
+            add_glob_word(words[j], &glob_words);
+        }
+        if (pattern != words[j]) {
+            free(pattern);
+        }
+    }
+    add_glob_word(NULL, &glob_words);
 
-    return glob_words;
+    return glob_words.words;
 }
 
 // Free all memory allocated to char array
@@ -120,44 +124,36 @@ int valid_input_redir(char **glob_words) {
     return 0;
 }
 
-// Validate output redirection command
+// Validate output redirection command. Output may go to several
+// targets, each `> file' or `> > file', which end the command
 int valid_output_redir(char **glob_words) {
-    int num_output_redir = 0;
-    int output_method = 0;
-    for (int i = 0; glob_words[i] != NULL; i++) {
-        // Found an output redirection symbol
-        if (!strcmp(glob_words[i], ">")) {
-            num_output_redir++;
-            // No output file
-            if (glob_words[i+1] == NULL) {
-                return invalid_output();
-            }
-            // Cannot exist at start of command
-            else if (i == 0) {
-                return invalid_output();
-            }
-            // Output redirection occurs more than once
-            else if (num_output_redir > 1 && output_method == OVERWRITE) {
-                return invalid_output();
-            }
-            // Output redirection occurs more than twice given that an
-            // append redirection was found
-            else if (num_output_redir > 2 && output_method == APPEND) {
-                return invalid_output();
-            }
-            // Found the first occurence input redirection is append 
-            else if (!strcmp(glob_words[i+1], ">") && output_method == 0) {
-                output_method = APPEND;
-            }
-            // First occurence of input redirection is overwrite
-            else if (output_method == 0) {
-                output_method = OVERWRITE;
-            }
-            // Check if next word is not a pipe
-            else if (!strcmp(glob_words[i+1], "|")) {
-                return invalid_output();
-            }
+    int i = 0;
+    while (glob_words[i] != NULL && strcmp(glob_words[i], ">")) {
+        i++;
+    }
+    if (glob_words[i] == NULL) {
+        return 0;
+    }
+    // Cannot exist at start of command
+    if (i == 0) {
+        return invalid_output();
+    }
+
+    while (glob_words[i] != NULL) {
+        // Only more output targets can follow an output target
+        if (strcmp(glob_words[i], ">")) {
+            return invalid_output();
+        }
+        i++;
+        if (glob_words[i] != NULL && !strcmp(glob_words[i], ">")) {
+            i++;
+        }
+        // No output file
+        if (glob_words[i] == NULL || !strcmp(glob_words[i], ">") ||
+            !strcmp(glob_words[i], "|") || !strcmp(glob_words[i], "<")) {
+            return invalid_output();
         }
+        i++;
     }
     return 0;
 }
@@ -184,6 +180,24 @@ int valid_pipes(char **glob_words) {
     return 0;
 }
 
+// Check if word is `;', `&&' or `||'
+int is_list_operator(char *word) {
+    return !strcmp(word, ";") || !strcmp(word, "&&") || 
+           !strcmp(word, "||");
+}
+
+
+// Validate redirections, pipes and builtin commands
+int validate_command(char **words) {
+    if (valid_input_redir(words) ||
+        valid_output_redir(words) ||
+        valid_pipes(words) ||
+        valid_io(words)) {
+        return 1;
+    }
+    return 0;
+}
+
 
 // Validate IO and builtin commands
 int valid_io(char **glob_words) {
@@ -251,19 +265,94 @@ int is_executable(char *pathname) {
 
 // Find the full path that the program is executable
 int executable_path(char *program, char **path, char *pathname) {
+    if (executable_cache == NULL) {
+        executable_cache = table_new();
+    }
+    // Programs already found are not searched for again, unless they
+    // have since been removed or moved
+    char *cached = table_get(executable_cache, program);
+    if (cached != NULL) {
+        if (access(cached, X_OK) == 0) {
+            strcpy(pathname, cached);
+            return 1;
+        }
+        free(table_remove(executable_cache, program));
+    }
+    if (program_index != NULL && program_index(program, pathname) &&
+        access(pathname, X_OK) == 0) {
+        cache_executable_path(program, pathname);
+        return 1;
+    }
+
     for (int i = 0; path[i] != NULL; i++) {
         // Get the full pathname including the program
         get_pathname(pathname, program, path[i]);
 
         if (is_executable(pathname)) {
+            cache_executable_path(program, pathname);
             return 1;
         }
     }
     return 0;
 }
 
+// Add to the cache
+void cache_executable_path(char *program, char *pathname) {
+    if (executable_cache == NULL) {
+        executable_cache = table_new();
+    }
+    free(table_set(executable_cache, program, strdup(pathname)));
+}
+
+// Forget the cached pathnames
+void clear_executable_cache(void) {
+    table_free(executable_cache, free);
+    executable_cache = NULL;
+    program_index = NULL;
+}
+
+// Set where programs already found are looked up
+void set_program_index(int (*find)(const char *program, char *pathname)) {
+    program_index = find;
+}
+
 // HELPER FUNCTIONS FOR ABOVE FUNCTIONS
 
+// Append a copy of the word to a word array, or its NULL terminator
+static void add_glob_word(const char *word, void *ctx) {
+    struct word_array *a = ctx;
+    if (a->size == a->max_size) {
+        a->max_size = a->max_size == 0 ? 8 : a->max_size * 2;
+        a->words = realloc(a->words, a->max_size*sizeof(*a->words));
+    }
+    a->words[a->size++] = word != NULL ? strdup(word) : NULL;
+}
+
+// Pathnames are sorted unless $SHUCK_GLOB_UNSORTED is set, in which
+// case they are added in the order directories are read
+static int glob_flags(void) {
+    char *unsorted = get_var("SHUCK_GLOB_UNSORTED");
+    if (unsorted != NULL && unsorted[0] != '\0') {
+        return GLOB_UNSORTED;
+    }
+    return 0;
+}
+
+// Number of threads used to expand `**': $SHUCK_GLOB_THREADS,
+// or one per online CPU. The CPUs are counted once, since every
+// command's words are expanded and counting them reads sysfs
+static int glob_threads(void) {
+    static long cpus = 0;
+    char *threads = get_var("SHUCK_GLOB_THREADS");
+    if (threads != NULL && atoi(threads) > 0) {
+        return atoi(threads);
+    }
+    if (cpus == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return cpus > 0 ? (int) cpus : 1;
+}
+
 // Returns stderr outputs for respective errors
 static int invalid_input() {
     fprintf(stderr, "invalid input redirection\n");
@@ -287,18 +376,10 @@ static int io_error(char *program) {
     return 1;
 }
 
-// Check if word is a builtin command
+// Check if word is a builtin command that cannot be redirected
 static int check_builtin_command(char *program) {
-    if (strcmp(program, "history") == 0) {
-        return 1;
-    } else if (strcmp(program, "!") == 0) {
-        return 1;
-    } else if (strcmp(program, "pwd") == 0) {
-        return 1;
-    } else if (strcmp(program, "cd") == 0) {
-        return 1;
-    }
-    return 0;
+    struct builtin *builtin = find_builtin(program);
+    return builtin != NULL && !builtin->redirects && !builtin->pipes;
 }
 
 // Check if word is an IO command
@@ -7,10 +7,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
-#include <glob.h>
+
+#include "shuck_table.h"
 
 // Return a copy of given array of words
-// such that all patterns are expanded
+// such that all patterns are expanded (including `**').
+// Quoted characters only match themselves, and words
+// that are not expanded keep their quote marks
 char **init_glob_words(char **words);
 
 // Free given char array given
@@ -36,6 +39,13 @@ int valid_output_redir(char **glob_words);
 // Check if command has valid pipes redirection
 int valid_pipes(char **glob_words);
 
+// Check if word separates commands in a command list
+int is_list_operator(char *word);
+
+// Check that a command has valid I/O redirections and pipes, 
+// returning 1 (having printed an error) if it does not
+int validate_command(char **words);
+
 // Since shell does not support IO redirection with builtin
 // commands, need to validate that none exists when IO commands
 // exist
@@ -45,5 +55,20 @@ int valid_io(char **glob_words);
 int is_executable(char *pathname);
 
 // Check if given program is executable by checking if program is an
-// executable relative path or it can be executed through a path
-int executable_path(char *program, char **path, char *pathname);
\ No newline at end of file
+// executable relative path or it can be executed through a path.
+// Found pathnames are cached until `clear_executable_cache' is called,
+// and searched for again if they are no longer executable
+int executable_path(char *program, char **path, char *pathname);
+
+// Add a pathname found for a program to the cache, e.g. one that
+// was looked up ahead of time
+void cache_executable_path(char *program, char *pathname);
+
+// Forget all cached executable pathnames, e.g. when $PATH changes
+void clear_executable_cache(void);
+
+// Programs already found in the current $PATH, e.g. by the startup
+// file's snapshot (shuck_rc.h): `find' sets `pathname' and returns 1
+// if it knows where `program' is. It is asked before $PATH is searched,
+// and forgotten when the cache is cleared
+void set_program_index(int (*find)(const char *program, char *pathname));
\ No newline at end of file
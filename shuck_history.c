@@ -0,0 +1,333 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "shuck_history.h"
+#include "shuck_builtins.h"
+#include "shuck_table.h"
+
+#define MAX_PATH_CHARS 1024
+#define DEFAULT_QUERY_SIZE 10
+
+// A command in the history file, and its stats if they were recorded
+struct history_entry {
+    char *command;
+    int has_stats;
+    struct history_stats stats;
+};
+
+// Totals for one program, for `history --stats'
+struct program_stats {
+    const char *program;
+    int count;
+    int failures;
+    long total_ms;
+    long max_ms;
+};
+
+// The commands of the history file. Only what has been added to the
+// file since it was last read is read to bring it up to date
+static struct {
+    struct history_entry *entries;
+    int size;
+    int capacity;
+    // How much of the file has been read
+    off_t loaded;
+} history_index;
+
+// Helper functions
+static int update_index(void);
+static void add_entry(char *command);
+static int parse_stats(char *line, struct history_stats *stats);
+static void clear_index(void);
+static int query_size(char *word, int *n);
+static void print_slowest(int n);
+static void print_failed(int n);
+static void print_program_stats(void);
+static void add_program_stats(const char *program, void *value, void *ctx);
+static void free_program_stats(void *value);
+static int compare_duration(const void *a, const void *b);
+static int compare_total(const void *a, const void *b);
+
+
+// Check if a line holds stats
+int is_history_stats(char *line) {
+    return strncmp(line, HISTORY_STATS_PREFIX,
+                   strlen(HISTORY_STATS_PREFIX)) == 0;
+}
+
+// Append the stats of the last command
+void add_history_stats(struct history_stats *stats) {
+    char history_path[MAX_PATH_CHARS];
+    get_shuck_hist_path(history_path);
+
+    FILE *f = fopen(history_path, "a");
+    if (f == NULL) {
+        perror("fopen");
+        return;
+    }
+    fprintf(f, "%s%.3f %ld %d %s\n", HISTORY_STATS_PREFIX, stats->start,
+            stats->duration_ms, stats->status,
+            stats->cwd != NULL ? stats->cwd : "");
+    fclose(f);
+}
+
+// Query the history
+int query_history(char **glob_words) {
+    char *query = glob_words[1];
+    int n = DEFAULT_QUERY_SIZE;
+
+    if (!strcmp(query, "--stats")) {
+        if (glob_words[2] != NULL) {
+            fprintf(stderr, "history: too many arguments\n");
+            return 0;
+        }
+    } else if (!strcmp(query, "--slowest") || !strcmp(query, "--failed")) {
+        if (glob_words[2] != NULL && glob_words[3] != NULL) {
+            fprintf(stderr, "history: too many arguments\n");
+            return 0;
+        }
+        if (glob_words[2] != NULL && !query_size(glob_words[2], &n)) {
+            return 0;
+        }
+    } else {
+        fprintf(stderr, "history: %s: invalid option\n", query);
+        return 0;
+    }
+
+    if (!update_index()) {
+        return 1;
+    }
+    if (!strcmp(query, "--slowest")) {
+        print_slowest(n);
+    } else if (!strcmp(query, "--failed")) {
+        print_failed(n);
+    } else {
+        print_program_stats();
+    }
+    return 1;
+}
+
+// Free the history index
+void free_history_index(void) {
+    clear_index();
+    free(history_index.entries);
+    history_index.entries = NULL;
+    history_index.capacity = 0;
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Read what has been added to the history file since it was last
+// read, starting again if the file has shrunk. Returns 0 if there is
+// no history file
+static int update_index(void) {
+    char history_path[MAX_PATH_CHARS];
+    get_shuck_hist_path(history_path);
+
+    struct stat s;
+    if (stat(history_path, &s) != 0) {
+        clear_index();
+        return 0;
+    }
+    if (s.st_size < history_index.loaded) {
+        clear_index();
+    }
+    if (s.st_size == history_index.loaded) {
+        return 1;
+    }
+
+    FILE *f = fopen(history_path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    fseeko(f, history_index.loaded, SEEK_SET);
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, f)) > 0) {
+        // A line still being written is read next time
+        if (line[length-1] != '\n') {
+            break;
+        }
+        line[length-1] = '\0';
+        history_index.loaded += length;
+
+        if (!is_history_stats(line)) {
+            add_entry(line);
+            continue;
+        }
+        // The stats belong to the command before them
+        if (history_index.size > 0) {
+            struct history_entry *last = 
+                &history_index.entries[history_index.size - 1];
+            if (!last->has_stats) {
+                last->has_stats = parse_stats(line, &last->stats);
+            }
+        }
+    }
+    free(line);
+    fclose(f);
+    return 1;
+}
+
+static void add_entry(char *command) {
+    if (history_index.size == history_index.capacity) {
+        history_index.capacity = history_index.capacity == 0 ?
+                                 64 : history_index.capacity * 2;
+        history_index.entries = realloc(history_index.entries,
+            history_index.capacity*sizeof(*history_index.entries));
+    }
+    struct history_entry *entry = &history_index.entries[history_index.size];
+    entry->command = strdup(command);
+    entry->has_stats = 0;
+    history_index.size++;
+}
+
+// Parse a stats line, returning 0 if it is malformed
+static int parse_stats(char *line, struct history_stats *stats) {
+    int cwd_start = 0;
+    if (sscanf(line + strlen(HISTORY_STATS_PREFIX), "%lf %ld %d %n",
+               &stats->start, &stats->duration_ms, &stats->status,
+               &cwd_start) < 3) {
+        return 0;
+    }
+    stats->cwd = strdup(line + strlen(HISTORY_STATS_PREFIX) + cwd_start);
+    return 1;
+}
+
+static void clear_index(void) {
+    for (int i = 0; i < history_index.size; i++) {
+        free(history_index.entries[i].command);
+        if (history_index.entries[i].has_stats) {
+            free(history_index.entries[i].stats.cwd);
+        }
+    }
+    history_index.size = 0;
+    history_index.loaded = 0;
+}
+
+// Parse the number of entries a query shows
+static int query_size(char *word, int *n) {
+    char *end;
+    long value = strtol(word, &end, 10);
+    if (*end != '\0' || value <= 0) {
+        fprintf(stderr, "history: %s: positive number required\n", word);
+        return 0;
+    }
+    *n = value;
+    return 1;
+}
+
+// Print the n commands that took longest, slowest first
+static void print_slowest(int n) {
+    struct history_entry **timed = malloc(
+        (history_index.size + 1)*sizeof(*timed));
+    int num_timed = 0;
+    for (int i = 0; i < history_index.size; i++) {
+        if (history_index.entries[i].has_stats) {
+            timed[num_timed++] = &history_index.entries[i];
+        }
+    }
+    qsort(timed, num_timed, sizeof(*timed), compare_duration);
+
+    FILE *out = builtin_stdout();
+    for (int i = 0; i < num_timed && i < n; i++) {
+        fprintf(out, "%ld: %.3fs (exit %d) %s\n",
+                (long) (timed[i] - history_index.entries),
+                timed[i]->stats.duration_ms / 1000.0,
+                timed[i]->stats.status, timed[i]->command);
+    }
+    free(timed);
+}
+
+// Print the last n commands that failed, oldest first
+static void print_failed(int n) {
+    int first = history_index.size;
+    for (int found = 0; first > 0 && found < n; ) {
+        first--;
+        struct history_entry *entry = &history_index.entries[first];
+        if (entry->has_stats && entry->stats.status != 0) found++;
+    }
+    FILE *out = builtin_stdout();
+    for (int i = first; i < history_index.size; i++) {
+        struct history_entry *entry = &history_index.entries[i];
+        if (entry->has_stats && entry->stats.status != 0) {
+            fprintf(out, "%d: (exit %d) %s\n", i, entry->stats.status,
+                    entry->command);
+        }
+    }
+}
+
+// Print the number of runs, failures and time taken of every program,
+// the one that took the most time in total first
+static void print_program_stats(void) {
+    struct table *programs = table_new();
+    for (int i = 0; i < history_index.size; i++) {
+        struct history_entry *entry = &history_index.entries[i];
+        if (!entry->has_stats) {
+            continue;
+        }
+        // The program is the first word of the command
+        size_t length = strcspn(entry->command, " ");
+        char *program = strndup(entry->command, length);
+        struct program_stats *p = table_get(programs, program);
+        if (p == NULL) {
+            p = calloc(1, sizeof(*p));
+            table_set(programs, program, p);
+        }
+        free(program);
+        p->count++;
+        p->failures += entry->stats.status != 0;
+        p->total_ms += entry->stats.duration_ms;
+        if (entry->stats.duration_ms > p->max_ms) {
+            p->max_ms = entry->stats.duration_ms;
+        }
+    }
+
+    // Collect the totals with their names to sort them
+    struct program_stats **totals = malloc(
+        (table_size(programs) + 1)*sizeof(*totals));
+    int num_totals = 0;
+    void *collect[2] = { totals, &num_totals };
+    table_foreach(programs, add_program_stats, collect);
+    qsort(totals, num_totals, sizeof(*totals), compare_total);
+
+    FILE *out = builtin_stdout();
+    fprintf(out, "%-16s %6s %6s %10s %10s %10s\n", "program", "runs",
+            "failed", "total", "mean", "max");
+    for (int i = 0; i < num_totals; i++) {
+        struct program_stats *p = totals[i];
+        fprintf(out, "%-16s %6d %6d %9.3fs %9.3fs %9.3fs\n", p->program,
+                p->count, p->failures, p->total_ms / 1000.0,
+                p->total_ms / 1000.0 / p->count, p->max_ms / 1000.0);
+    }
+    free(totals);
+    table_free(programs, free_program_stats);
+}
+
+static void add_program_stats(const char *program, void *value, void *ctx) {
+    void **collect = ctx;
+    struct program_stats **totals = collect[0];
+    int *num_totals = collect[1];
+    struct program_stats *p = value;
+    p->program = program;
+    totals[(*num_totals)++] = p;
+}
+
+static void free_program_stats(void *value) {
+    free(value);
+}
+
+static int compare_duration(const void *a, const void *b) {
+    const struct history_entry *x = *(struct history_entry *const *) a;
+    const struct history_entry *y = *(struct history_entry *const *) b;
+    return (x->stats.duration_ms < y->stats.duration_ms) -
+           (x->stats.duration_ms > y->stats.duration_ms);
+}
+
+static int compare_total(const void *a, const void *b) {
+    const struct program_stats *x = *(struct program_stats *const *) a;
+    const struct program_stats *y = *(struct program_stats *const *) b;
+    return (x->total_ms < y->total_ms) - (x->total_ms > y->total_ms);
+}
@@ -0,0 +1,45 @@
+// How long the commands in the history took and how they finished,
+// and the queries over them: `history --slowest N', `history --stats'
+// and `history --failed [N]'.
+//
+// In the history file, each command may be followed by a line
+//     #+START DURATION STATUS CWD
+// giving when it started (seconds since the epoch), how long it took
+// in milliseconds, its exit status and the directory it ran in. The
+// command is written when it starts and the line when it finishes.
+// Commands without one were recorded by older versions of shuck, or
+// were still running when the shell exited.
+
+#ifndef SHUCK_HISTORY_H
+#define SHUCK_HISTORY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HISTORY_STATS_PREFIX "#+"
+
+// Timing and outcome of a command
+struct history_stats {
+    double start;
+    long duration_ms;
+    int status;
+    char *cwd;
+};
+
+// Check if a line of the history file holds the stats of the
+// command before it, rather than a command
+int is_history_stats(char *line);
+
+// Append the stats of the command last added to the history file
+void add_history_stats(struct history_stats *stats);
+
+// Run `history --slowest N', `history --stats' or `history --failed [N]'.
+// Returns 1 on success, 0 (having printed an error) if the query
+// is invalid
+int query_history(char **glob_words);
+
+// Free the history index
+void free_history_index(void);
+
+#endif
@@ -1,22 +1,88 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
 #include "shuck_io.h"
+#include "shuck_builtins.h"
+#include "shuck_lex.h"
+#include "shuck_profile.h"
+#include "shuck_read.h"
+#include "shuck_spawner.h"
+#include "shuck_vars.h"
 
-#define OVERWRITE 1
-#define APPEND 2
 #define MAX_CHARS 1024
+#define MAX_STATUS_CHARS 5
+
+// Linux limits on the arguments of a new program: the longest single
+// argument, and ARG_MAX if sysconf cannot tell us
+#define MAX_ARG_CHARS (32 * 4096)
+#define DEFAULT_ARG_MAX (128 * 1024)
+#define ARG_HEADROOM 2048
+
+// Exit status of the last command. Builtins that are stages of a
+// pipeline run on threads of their own, each with its own status
+static __thread int last_exit_status = 0;
+
+// Time limit of the command being run, and the grace period between
+// SIGTERM and SIGKILL once it runs out
+static long command_timeout_ms = 0;
+static long command_kill_after_ms = 0;
+
+// The groups of commands among the stages of a pipeline, and what
+// runs them
+struct stage_groups {
+    struct group *groups;
+    group_fn run;
+    char **line;
+};
+
+// A builtin that is a stage of a pipeline, run on a thread of the
+// shell that reads and writes the stage's ends of the pipes
+struct builtin_stage {
+    pthread_t thread;
+    int started;
+    struct builtin *builtin;
+    char **args;
+    char **path;
+    char **env;
+    int fds[2];
+    int status;
+};
 
 // Helper function
-static int output_redirection_exists(char **glob_words, int *output_index);
 static int pipes_exist(char **glob_words);
+static void set_pipestatus(int *exit_statuses, int n, int timed_out);
 static int pipelines(char **glob_words, char **path, char **env, 
-                     int *rfd, int *wfd, int num_pipes);
+                     int *rfd, int *wfd, int num_pipes, 
+                     struct stage_groups *groups);
+static int spawn_pipeline(char ***args, char **pathnames, 
+                          struct sched_options **sched, char **env, 
+                          int rfd, int wfd, int num_pipes, pid_t *pid,
+                          struct stage_groups *groups, int *in_shell, 
+                          int (*shell_fds)[2], struct builtin **builtins,
+                          char **path);
+static int run_in_shell(struct stage_groups *groups, int stage, 
+                        int *here_fds);
+static void start_builtin_stage(struct builtin_stage *stage);
+static void *run_builtin_stage(void *arg);
+static void ignore_signal(int sig);
 static int close_pipe(posix_spawn_file_actions_t *a, int fd);
 static int pipe_to_stdout(posix_spawn_file_actions_t *a, int fd);
 static int pipe_to_stdin(posix_spawn_file_actions_t *a, int fd);
 static char *process_exec(char *process, char **path);
 static void free_args(char ***args, int size);
-static char *init_args_pathnames(char ***args, char **pathnames, 
-                                 char **glob_words, int *output_idx, 
-                                 int num_process, char **path);
+static size_t args_size(char **args);
+static size_t args_limit(void);
+static int args_fit(char **args, char **env);
+static int batch_fixed_words(char **words);
+static int spawn_batch(char *pathname, char **args, char **env, 
+                       int write_fd, pid_t *pid);
+static int init_args_pathnames(char ***args, char **pathnames, 
+                               struct sched_options **sched,
+                               char **glob_words, int *output_idx, 
+                               int num_process, char **path,
+                               struct group *groups, 
+                               struct builtin **builtins);
 
 
 // Run program
@@ -31,6 +97,15 @@ int run_program(char *pathname, char **env, char **glob_words, char **path,
     int write_fd = 0;
     int read_exists = 0;
 
+    // Everything allocated below is freed at `done', whichever way
+    // the program finishes or fails
+    int result = 2;
+    struct fanout *fanout = NULL;
+    posix_spawn_file_actions_t actions;
+    int actions_ready = 0;
+    char **args = NULL;
+    struct sched_options *sched = NULL;
+
     // Initialise the read file descriptor and connect it
     // to the program's standard input 
     if (!strcmp(glob_words[0], "<")) {
@@ -43,42 +118,40 @@ int run_program(char *pathname, char **env, char **glob_words, char **path,
         
     }
 
-    int output_index = 0;
-    int output_exists = output_redirection_exists(glob_words, &output_index);
+    // Output can go to several targets, which are copied to as the
+    // program writes
+    int output_exists = first_output(glob_words) != -1;
     if (output_exists) {
-        if (output_exists == APPEND) {
-            // File descriptor appends to file
-            write_fd = open(glob_words[output_index+1], O_CREAT|O_WRONLY|O_APPEND, 0644);
-        } else {
-            // File descriptor overwrites file
-            write_fd = open(glob_words[output_index+1], O_CREAT|O_WRONLY|O_TRUNC, 0644);
-        }
+        write_fd = open_outputs(glob_words, &fanout);
         if (write_fd == -1) {
-            perror("open");
-            return 2;
+            write_fd = 0;
+            goto done;
         }
     }
 
     // Check if there are pipes in the command
     int num_pipes = pipes_exist(glob_words);
     if (num_pipes) {
-        // Configure pipelines for the programs/processes
-        return pipelines(glob_words, path, env, &read_fd, &write_fd, num_pipes);
+        // Configure pipelines for the programs/processes, which
+        // take over the file descriptors
+        result = pipelines(glob_words, path, env, &read_fd, &write_fd, 
+                           num_pipes, NULL);
+        read_fd = write_fd = 0;
+        goto done;
     }
 
 
-    posix_spawn_file_actions_t actions;
-
     if (posix_spawn_file_actions_init(&actions) != 0) {
         perror("posix_spawn_file_actions_init");
-        return 2;
+        goto done;
     }
+    actions_ready = 1;
 
     // Connect read file descriptor to standard input of program
     if (read_exists) {
         if (posix_spawn_file_actions_adddup2(&actions, read_fd, 0) != 0) {
             perror("posix_spawn_file_actions_adddup2");
-            return 2;
+            goto done;
         }
     }
 
@@ -86,13 +159,13 @@ int run_program(char *pathname, char **env, char **glob_words, char **path,
     if (output_exists) {
         if (posix_spawn_file_actions_adddup2(&actions, write_fd, 1) != 0) {
             perror("posix_spawn_file_actions_adddup2");
-            return 2;
+            goto done;
         }
     }
 
     // Create a NULL terminated char array to hold the program and its 
     // arguments
-    char **args = malloc((array_size(glob_words)+1)*sizeof(*args));
+    args = malloc((array_size(glob_words)+1)*sizeof(*args));
     int j = 0;
     int i = 0;
     // If input redirection exists, skip the filename
@@ -105,39 +178,139 @@ int run_program(char *pathname, char **env, char **glob_words, char **path,
             break;
         }
         else {
+            unquote_word(glob_words[i]);
             args[j] = glob_words[i];
             j++;
         }
     }
     args[j] = NULL; 
 
+    // Take any scheduling prefix off the front of the program
+    int prefix;
+    sched = parse_sched_prefix(args, -1, &prefix);
+    if (prefix < 0) {
+        goto done;
+    }
+    char **argv = &args[prefix];
+
     pid_t pid;
 
-    if (posix_spawn(&pid, pathname, &actions, NULL, args, env) != 0) {
-        perror("spawn");
-        return 2;
+    // Catch argument lists the kernel would refuse, so that the user
+    // is told why instead of getting a bare spawn error
+    if (!args_fit(argv, env)) {
+        fprintf(stderr, "%s: argument list too long (try `batch %s ...')\n",
+                argv[0], argv[0]);
+        goto done;
+    }
+
+    // Output the shell has buffered must come before the child's
+    fflush(stdout);
+
+    // A program the shell need not set up itself is started by the
+    // spawn helper, if there is one
+    int spawn_error = -1;
+    if (sched == NULL) {
+        spawn_error = spawner_spawn(&pid, pathname, read_fd, 
+                                    output_exists ? write_fd : 1, argv, env);
+    }
+    if (spawn_error == -1) {
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        if (sched_spawnattr(sched, &attr) || sched_before_spawn(sched)) {
+            posix_spawnattr_destroy(&attr);
+            goto done;
+        }
+        spawn_error = posix_spawn(&pid, pathname, &actions, &attr, argv, env);
+        posix_spawnattr_destroy(&attr);
+        if (sched != NULL) {
+            sched_after_spawn(sched, spawn_error == 0 ? pid : -1);
+        }
+    }
+    if (spawn_error != 0) {
+        fprintf(stderr, "%s: %s\n", pathname, strerror(spawn_error));
+        goto done;
     }
 
     // Close the unused file descriptors
     if (read_fd != 0) close(read_fd);
     if (write_fd != 0) close(write_fd);
+    read_fd = write_fd = 0;
 
     // Wait for child process to finish execution
     int exit_status;
-    if (waitpid(pid, &exit_status, 0) == -1) {
-        perror("waitpid");
-        return 2;
+    struct rusage usage;
+    int timed_out = wait_processes_usage(&pid, 1, &exit_status, &usage, 
+                                         command_timeout_ms, 
+                                         command_kill_after_ms, 0);
+    if (timed_out == -1) {
+        goto done;
     }
+    finish_fanout(fanout);
+    fanout = NULL;
     
-    fprintf(stdout, "%s exit status = %d\n", pathname, 
-            WEXITSTATUS(exit_status));
+    report_exit_status(pathname, exit_status, timed_out, sched, &usage);
+    set_pipestatus(&exit_status, 1, timed_out);
+    result = 1;
 
+done:
     // Free allocated memory
-    posix_spawn_file_actions_destroy(&actions);
-
+    if (actions_ready) posix_spawn_file_actions_destroy(&actions);
     free(args);
+    free_sched_options(sched);
+    if (read_fd != 0) close(read_fd);
+    if (write_fd != 0) close(write_fd);
+    finish_fanout(fanout);
+    return result;
+}
+
+
+// Run a pipeline with groups of commands among its stages
+// Successfully ran pipeline = 1
+// Encountered error = 2
+int run_pipeline(char **glob_words, struct group *groups, int num_stages,
+                 group_fn run_group, char **line, char **path, char **env) {
+    int num_pipes = pipes_exist(glob_words);
+    // The stages were found when the pipeline was compiled, so a `|'
+    // that comes from expanding a word cannot add another
+    if (groups != NULL && num_pipes+1 != num_stages) {
+        fprintf(stderr, "syntax error: unexpected `|' in expanded word\n");
+        return 2;
+    }
+
+    int read_fd = 0;
+    int write_fd = 0;
+    struct fanout *fanout = NULL;
+    int result = 2;
 
-    return 1;
+    if (!strcmp(glob_words[0], "<")) {
+        unquote_word(glob_words[1]);
+        read_fd = open(glob_words[1], O_RDONLY);
+        if (read_fd == -1) {
+            perror(glob_words[1]);
+            return 2;
+        }
+    }
+    if (first_output(glob_words) != -1) {
+        write_fd = open_outputs(glob_words, &fanout);
+        if (write_fd == -1) {
+            write_fd = 0;
+            goto done;
+        }
+    }
+
+    // The pipeline takes over the file descriptors
+    struct stage_groups stage_groups = {
+        .groups = groups, .run = run_group, .line = line
+    };
+    result = pipelines(glob_words, path, env, &read_fd, &write_fd, 
+                       num_pipes, groups != NULL ? &stage_groups : NULL);
+    read_fd = write_fd = 0;
+
+done:
+    if (read_fd != 0) close(read_fd);
+    if (write_fd != 0) close(write_fd);
+    finish_fanout(fanout);
+    return result;
 }
 
 
@@ -145,188 +318,760 @@ int run_program(char *pathname, char **env, char **glob_words, char **path,
 // Return 1 if successfully create pipelines between child processes
 // and executed it.
 // Returns 2 if an error is encountered
+// Stages that are groups of commands are run as described for 
+// `run_pipeline' when `groups' is not NULL. Stages that are builtins
+// which can be piped are run on threads of the shell
 static int pipelines(char **glob_words, char **path, char **env, 
-                     int *rfd, int *wfd, int num_pipes) {
+                     int *rfd, int *wfd, int num_pipes, 
+                     struct stage_groups *groups) {
     // Each pipe connects two processes
     int num_process = num_pipes+1;
+    int result = 2;
+
+    // Stages run by the shell rather than by a process, and their
+    // standard input and output
+    int *in_shell = calloc(num_process, sizeof(*in_shell));
+    int (*shell_fds)[2] = malloc(num_process*sizeof(*shell_fds));
+    for (int i = 0; i < num_process; i++) {
+        shell_fds[i][0] = shell_fds[i][1] = -1;
+    }
+    struct builtin **builtins = calloc(num_process, sizeof(*builtins));
+    struct builtin_stage *stages = calloc(num_process, sizeof(*stages));
+    int here = -1;
     
     // Create an array to hold the pathnames
-    char **pathnames = malloc((num_process+1)*sizeof(*pathnames));
+    char **pathnames = calloc(num_process+1, sizeof(*pathnames));
     // Create an array of array of words to hold the program and its 
     // arguments
-    char ***args = malloc(num_process*sizeof(**args));
+    char ***args = calloc(num_process, sizeof(**args));
+    // Create an array of scheduling options for each process
+    struct sched_options **sched = calloc(num_process, sizeof(*sched));
+    // Create an array of pids for the child processes
+    pid_t *pid = malloc(num_process*sizeof(*pid));
+    int *exit_statuses = NULL;
+    struct rusage *usages = NULL;
     int output_idx = 0;
 
-    char *proc = init_args_pathnames(args, pathnames, 
-                                     glob_words, &output_idx, 
-                                     num_process, path);
-    if (proc != NULL) 
-    {
-        // One of the processes is not executable
-        fprintf(stderr, "%s: command not found\n", proc);
-        return 2;
+    if (init_args_pathnames(args, pathnames, sched, glob_words, 
+                            &output_idx, num_process, path, 
+                            groups != NULL ? groups->groups : NULL,
+                            builtins)) {
+        // One of the processes is not executable, so the pipeline
+        // never takes the file descriptors
+        if (*rfd != 0) close(*rfd);
+        if (*wfd != 0) close(*wfd);
+        goto done;
     }
 
-    // Initialise the pipes
-    int **fd = malloc(num_pipes*sizeof(*fd));
+    // Builtins run alongside the rest of the pipeline, on threads of
+    // the shell unless they change its state and have other stages to
+    // race with. The last brace group is run by the shell itself,
+    // unless there are builtins on threads, which must not see the
+    // shell's state change under them
+    int num_builtins = 0;
+    for (int i = 0; i < num_process; i++) {
+        if (builtins[i] != NULL && 
+            !(builtins[i]->forks && num_process > 1)) {
+            in_shell[i] = 1;
+            num_builtins++;
+        }
+    }
+    for (int i = 0; num_builtins == 0 && groups != NULL && 
+                    i < num_process; i++) {
+        if (groups->groups[i].body != NULL && !groups->groups[i].subshell) {
+            here = i;
+        }
+    }
+    if (here != -1) {
+        in_shell[here] = 1;
+    }
+
+    // The commands of the group run in the shell may change the time
+    // limit, so the one for the pipeline is kept
+    long timeout_ms = command_timeout_ms;
+    long kill_after_ms = command_kill_after_ms;
+    if (spawn_pipeline(args, pathnames, sched, env, *rfd, *wfd, num_pipes, 
+                       pid, groups, in_shell, shell_fds, builtins, path)) {
+        goto done;
+    }
+
+    // The stages run in the shell take the place of their processes,
+    // with their exit statuses made into wait statuses
+    exit_statuses = malloc(num_process*sizeof(*exit_statuses));
+    usages = calloc(num_process, sizeof(*usages));
+    if (here != -1) {
+        stages[here].status = run_in_shell(groups, here, shell_fds[here]);
+    }
+    int flags = shell_option("pipekill") ? WAIT_TEARDOWN : 0;
+    for (int i = 0; i < num_process; i++) {
+        if (builtins[i] != NULL && in_shell[i]) {
+            stages[i].builtin = builtins[i];
+            stages[i].args = args[i];
+            stages[i].path = path;
+            stages[i].env = env;
+            stages[i].fds[0] = shell_fds[i][0];
+            stages[i].fds[1] = shell_fds[i][1];
+            start_builtin_stage(&stages[i]);
+        }
+    }
+    int num_waiting = 0;
+    for (int i = 0; i < num_process; i++) {
+        if (!in_shell[i]) {
+            pid[num_waiting++] = pid[i];
+        }
+    }
 
+    // Need to wait for all the child processes to finish executing,
+    // all of which share the time limit. They are reaped as they finish,
+    // and with `set -o pipekill' the first failure stops the rest. A
+    // builtin can be stuck writing to a process until the process is
+    // stopped, so the builtins are only waited for after the processes
+    int timed_out = wait_processes_usage(pid, num_waiting, exit_statuses, 
+                                         usages, timeout_ms, kill_after_ms, 
+                                         flags);
+    for (int i = 0; i < num_process; i++) {
+        if (stages[i].started) {
+            pthread_join(stages[i].thread, NULL);
+        }
+    }
+    if (timed_out == -1) {
+        result = 2;
+        goto done;
+    }
+    for (int i = num_process-1, j = num_waiting-1; i >= 0; i--) {
+        if (in_shell[i]) {
+            exit_statuses[i] = (stages[i].status & 0xff) << 8;
+        } else {
+            usages[i] = usages[j];
+            exit_statuses[i] = exit_statuses[j--];
+        }
+    }
+
+    // The pipeline's status is that of its last stage, or with
+    // `set -o pipefail' its last stage that failed
+    int reported = num_process-1;
+    if (shell_option("pipefail")) {
+        for (int i = num_process-1; i >= 0; i--) {
+            if (exit_code(exit_statuses[i]) != 0) {
+                reported = i;
+                break;
+            }
+        }
+    }
+    if (builtins[reported] != NULL ||
+        (groups != NULL && groups->groups[reported].body != NULL)) {
+        // The commands of a group have reported their own statuses,
+        // and builtins have none to report
+        set_exit_status(timed_out ? TIMEOUT_EXIT_STATUS : 
+                                    exit_code(exit_statuses[reported]));
+    } else {
+        report_exit_status(pathnames[reported], exit_statuses[reported], 
+                           timed_out, sched[reported], &usages[reported]);
+    }
+    set_pipestatus(exit_statuses, num_process, timed_out);
+    result = 1;
+    
+done:
+    // Free all the allocated memory (arrays)
+    for(int i = 0; i < num_process; i++) {
+        free_sched_options(sched[i]);
+    }
+    free(sched);
+    free(pid);
+    free(exit_statuses);
+    free(usages);
+    free(in_shell);
+    free(shell_fds);
+    free(builtins);
+    free(stages);
+
+    free_array(pathnames);
+    free_args(args, num_process);
+
+    return result;
+}
+
+
+// Spawn the processes of a pipeline, connecting each one's standard
+// output to the next one's standard input. The first reads from `rfd'
+// and the last writes to `wfd' if they are not 0, which are closed
+// whether or not the processes could be spawned.
+// Returns 0 if every process was spawned, or 2 if there was an error,
+// in which case any processes already spawned have been stopped.
+// Groups, and the `builtins' not in `in_shell', are forked rather
+// than spawned. The stages in `in_shell' are left for the shell to
+// run: their `shell_fds' are set to their standard input and output,
+// or -1 where they are the shell's own
+static int spawn_pipeline(char ***args, char **pathnames, 
+                          struct sched_options **sched, char **env, 
+                          int rfd, int wfd, int num_pipes, pid_t *pid,
+                          struct stage_groups *groups, int *in_shell, 
+                          int (*shell_fds)[2], struct builtin **builtins,
+                          char **path) {
+    int num_process = num_pipes+1;
+    int result = 0;
+    // Stages started so far, including those left for the shell
+    int spawned = 0;
+
+    // Initialise the pipes. Ends that have been closed are set to -1
+    int **fd = malloc(num_pipes*sizeof(*fd));
     for (int i = 0; i < num_pipes; i++) {
         fd[i] = malloc(2*sizeof(int));
-
+        fd[i][0] = fd[i][1] = -1;
+    }
+    for (int i = 0; i < num_pipes && result == 0; i++) {
         if (pipe(fd[i]) == -1) {
             perror("pipe");
-            return 2;
+            fd[i][0] = fd[i][1] = -1;
+            result = 2;
         }
     }
-    // Create an array of pids for the child processes
-    pid_t *pid = malloc(num_process*sizeof(*pid));
-
-    // Create an array of file actions to manage the pipes of the child processes
-    posix_spawn_file_actions_t *actions = malloc(num_process*sizeof(*actions));
 
     // Execute the child processes and configure the pipes
-    for (int i = 0; i < num_process; i++) {
-        if (posix_spawn_file_actions_init(&actions[i]) != 0) {
-            perror("posix_spawn_file_actions_init");
-            return 2;
+    for (int i = 0; i < num_process && result == 0; i++) {
+        if (in_shell != NULL && in_shell[i]) {
+            // The shell keeps the ends of the pipes the stage uses,
+            // which must not be inherited by the programs spawned
+            int *here_fds = shell_fds[i];
+            here_fds[0] = i == 0 ? (rfd != 0 ? rfd : -1) : fd[i-1][0];
+            here_fds[1] = i == num_pipes ? (wfd != 0 ? wfd : -1) : fd[i][1];
+            for (int k = 0; k < 2; k++) {
+                if (here_fds[k] != -1) {
+                    fcntl(here_fds[k], F_SETFD, FD_CLOEXEC);
+                }
+            }
+            if (i == 0) rfd = 0; else fd[i-1][0] = -1;
+            if (i == num_pipes) wfd = 0; else fd[i][1] = -1;
+            spawned++;
+            continue;
         }
-        if (i == 0 && *rfd != 0) {
-            printf("%d\n", *rfd);
-            if (posix_spawn_file_actions_adddup2(&actions[i], *rfd, 0) != 0) {
-                perror("posix_spawn_file_actions_adddup2");
-                return 2;
+        int forked_builtin = builtins != NULL && builtins[i] != NULL;
+        if (forked_builtin || 
+            (groups != NULL && groups->groups[i].body != NULL)) {
+            fflush(stdout);
+            pid[i] = fork();
+            if (pid[i] == -1) {
+                perror("fork");
+                result = 2;
+                break;
             }
-        } 
-        // Close and create stdin/stdout respective pipes for each
-        // process
-        // Will return 2 if encountered an error with opening and
-        // closing pipes
-        for (int j = 0; j < num_pipes; j++) {
-            if (i == 0) {
-                // First process only needs its standard output
-                // to be connected to the first pipe's write end
-                // Close all the other unused pipes
-                if (close_pipe(&actions[i], fd[j][0])) {
-                    return 2;
+            if (pid[i] == 0) {
+                // The child keeps only its standard input and output
+                int in = i == 0 ? rfd : fd[i-1][0];
+                int out = i == num_pipes ? wfd : fd[i][1];
+                if (in > 0) dup2(in, 0);
+                if (out > 0) dup2(out, 1);
+                for (int j = 0; j < num_pipes; j++) {
+                    if (fd[j][0] != -1) close(fd[j][0]);
+                    if (fd[j][1] != -1) close(fd[j][1]);
                 }
-                if (j == 0) {
-                    if (pipe_to_stdout(&actions[i], fd[j][1])) {
-                        return 2;
+                if (rfd != 0) close(rfd);
+                if (wfd != 0) close(wfd);
+                for (int j = 0; j < i; j++) {
+                    for (int k = 0; in_shell[j] && k < 2; k++) {
+                        if (shell_fds[j][k] != -1) close(shell_fds[j][k]);
                     }
                 }
-                if (close_pipe(&actions[i], fd[j][1])) {
-                    return 2;
+                signal(SIGPIPE, SIG_DFL);
+                int status;
+                if (forked_builtin) {
+                    set_exit_status(0);
+                    builtins[i]->run(args[i], NULL, path, env);
+                    status = get_exit_status();
+                } else {
+                    status = groups->run(groups->groups[i].body, 
+                                         groups->line, 1);
                 }
-            } else {
-                // For other processes connect to the previous pipes
-                // read end for standard input and the connect its standard
-                // output for the next pipe's write end
-                // Close pipes that are not used by child process
-                if (j == i-1) {
-                    if (pipe_to_stdin(&actions[i], fd[j][0])) {
-                        return 0;
-                    }
+                fflush(stdout);
+                _exit(status);
+            }
+            spawned++;
+        } else {
+            posix_spawn_file_actions_t actions;
+            if (posix_spawn_file_actions_init(&actions) != 0) {
+                perror("posix_spawn_file_actions_init");
+                result = 2;
+                break;
+            }
+            if (i == 0 && rfd != 0) {
+                if (posix_spawn_file_actions_adddup2(&actions, rfd, 0) != 0) {
+                    perror("posix_spawn_file_actions_adddup2");
+                    result = 2;
                 }
-                if (j+1 >= i) {
-                    if (close_pipe(&actions[i], fd[j][0])) {
-                        return 2;
+            } 
+            // Close and create stdin/stdout respective pipes for each
+            // process
+            for (int j = 0; j < num_pipes && result == 0; j++) {
+                if (i == 0) {
+                    // First process only needs its standard output
+                    // to be connected to the first pipe's write end
+                    // Close all the other unused pipes
+                    if (close_pipe(&actions, fd[j][0]) ||
+                        (j == 0 && pipe_to_stdout(&actions, fd[j][1])) ||
+                        close_pipe(&actions, fd[j][1])) {
+                        result = 2;
                     }
-                }
-                if (j == i) {
-                    if (pipe_to_stdout(&actions[i], fd[j][1])) {
-                        return 2;
+                } else {
+                    // For other processes connect to the previous pipes
+                    // read end for standard input and the connect its standard
+                    // output for the next pipe's write end
+                    // Close pipes that are not used by child process
+                    if ((j == i-1 && pipe_to_stdin(&actions, fd[j][0])) ||
+                        (j+1 >= i && close_pipe(&actions, fd[j][0])) ||
+                        (j == i && pipe_to_stdout(&actions, fd[j][1])) ||
+                        (j >= i && close_pipe(&actions, fd[j][1]))) {
+                        result = 2;
                     }
                 }
-                if (j >= i) {
-                    if (close_pipe(&actions[i], fd[j][1])) {
-                        return 2;
-                    }
+            }
+            // The last process will connect its output to the 
+            // write file descriptor, for output redirection if 
+            // it exists
+            if (result == 0 && i == num_process-1 && wfd != 0) {
+                if (posix_spawn_file_actions_adddup2(&actions, wfd, 1) != 0) {
+                    perror("posix_spawn_file_actions_adddup2");
+                    result = 2;
                 }
-                // The last process will connect its output to the 
-                // write file descriptor, for output redirection if 
-                // it exists
-                if (i == num_process-1 && *wfd != 0) {
-                    printf("%d\n", *wfd); 
-                    if (posix_spawn_file_actions_adddup2(&actions[i], *wfd, 1)
-                                                        != 0)
-                    {
-                        perror("posix_spawn_file_actions_adddup2");
-                        return 2;
-                    }
+            }
+
+            if (result == 0 && !args_fit(args[i], env)) {
+                fprintf(stderr, "%s: argument list too long\n", args[i][0]);
+                result = 2;
+            }
+            // The spawn helper, if there is one, starts programs the
+            // shell need not set up itself
+            int spawn_error = -1;
+            if (result == 0 && sched[i] == NULL) {
+                int in = i == 0 ? rfd : fd[i-1][0];
+                int out = i == num_pipes ? (wfd != 0 ? wfd : 1) : fd[i][1];
+                fflush(stdout);
+                spawn_error = spawner_spawn(&pid[i], pathnames[i], in, out, 
+                                            args[i], env);
+            }
+            posix_spawnattr_t attr;
+            posix_spawnattr_init(&attr);
+            if (result == 0 && spawn_error == -1 && 
+                (sched_spawnattr(sched[i], &attr) || 
+                 sched_before_spawn(sched[i]))) {
+                result = 2;
+            }
+            if (result == 0 && spawn_error == -1) {
+                fflush(stdout);
+                spawn_error = posix_spawn(&pid[i], pathnames[i], &actions, 
+                                          &attr, args[i], env);
+                sched_after_spawn(sched[i], spawn_error == 0 ? pid[i] : -1);
+            }
+            if (result == 0) {
+                if (spawn_error != 0) {
+                    fprintf(stderr, "%s: %s\n", pathnames[i], 
+                            strerror(spawn_error));
+                    result = 2;
+                } else {
+                    spawned++;
                 }
             }
+            posix_spawnattr_destroy(&attr);
+            posix_spawn_file_actions_destroy(&actions);
         }
-
-        if (posix_spawn(&pid[i], pathnames[i], &actions[i], NULL, args[i], 
-                        env) != 0) {
-            fprintf(stderr, "%s\n", pathnames[i]);
-            perror("spawn");
-            return 2;
+        if (result != 0) {
+            break;
         }
 
         // Need to close the pipes that were just used, since we don't need
         // it for the next child processes
-        if (i > 0) close(fd[i-1][0]);
-        if (i < num_pipes) close(fd[i][1]);
+        if (i > 0) {
+            close(fd[i-1][0]);
+            fd[i-1][0] = -1;
+        }
+        if (i < num_pipes) {
+            close(fd[i][1]);
+            fd[i][1] = -1;
+        }
         // Close unused file descriptors
-        if (i == 0 && *rfd != 0)  close(*rfd);
-        if (i == num_process-1 && *wfd != 0)  close(*wfd);
+        if (i == 0 && rfd != 0) {
+            close(rfd);
+            rfd = 0;
+        }
+        if (i == num_process-1 && wfd != 0) {
+            close(wfd);
+            wfd = 0;
+        }
     }
 
-    int final_exit_status;
-    // Need to wait for all the child processes to finish executing
-    for (int i = 0; i < num_process; i++) {
-        int exit_status;
+    // If not every process was spawned, close what is left
+    if (rfd != 0) close(rfd);
+    if (wfd != 0) close(wfd);
+    for (int i = 0; i < num_pipes; i++) {
+        if (fd[i][0] != -1) close(fd[i][0]);
+        if (fd[i][1] != -1) close(fd[i][1]);
+        free(fd[i]);
+    }
+    free(fd);
+    for (int i = 0; in_shell != NULL && result != 0 && i < spawned; i++) {
+        for (int k = 0; in_shell[i] && k < 2; k++) {
+            if (shell_fds[i][k] != -1) close(shell_fds[i][k]);
+            shell_fds[i][k] = -1;
+        }
+    }
+
+    // The processes already spawned would otherwise be left running,
+    // possibly waiting for input that will never come
+    for (int i = 0; i < spawned && result != 0; i++) {
+        if (in_shell != NULL && in_shell[i]) continue;
+        kill(pid[i], SIGTERM);
+        while (waitpid(pid[i], NULL, 0) == -1 && errno == EINTR) {
+        }
+    }
+    return result;
+}
 
-        if (waitpid(pid[i], &exit_status, 0) == -1) {
-            perror("waitpid");
-            return 0;
+
+// Run stage `stage' of a pipeline, a brace group, in the shell, with
+// its standard input and output the descriptors in `here_fds' (which
+// are closed) for as long as it runs. Returns its exit status
+static int run_in_shell(struct stage_groups *groups, int stage, 
+                        int *here_fds) {
+    // Output already buffered goes where the shell's output went
+    fflush(stdout);
+    int saved[2] = { -1, -1 };
+    for (int k = 0; k < 2; k++) {
+        if (here_fds[k] != -1) {
+            saved[k] = fcntl(k, F_DUPFD_CLOEXEC, 3);
+            dup2(here_fds[k], k);
+            close(here_fds[k]);
         }
+    }
 
-        if (i == num_process-1) final_exit_status = exit_status;
+    // A group with its own input has the shell's input to itself, so
+    // `read' may buffer it (shuck_read.h) until it is put back
+    int old_in = -1;
+    if (saved[0] != -1) {
+        old_in = set_builtin_stdin(STDIN_FILENO);
     }
 
-    fprintf(stdout, "%s exit status = %d\n", pathnames[num_process-1], 
-            WEXITSTATUS(final_exit_status));
-    
-    // Free all the allocated memory (arrays)
+    // Writing to a stage that has already finished fails with EPIPE
+    // rather than killing the shell. Programs the group runs are
+    // exec'd, so go back to the default action
+    struct sigaction catch_pipe = { .sa_handler = ignore_signal };
+    struct sigaction old_pipe;
+    sigemptyset(&catch_pipe.sa_mask);
+    sigaction(SIGPIPE, &catch_pipe, &old_pipe);
 
-    for(int i = 0; i < num_process; i++) {
-        posix_spawn_file_actions_destroy(&actions[i]);
+    int status = groups->run(groups->groups[stage].body, groups->line, 0);
+
+    fflush(stdout);
+    clearerr(stdout);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    if (saved[0] != -1) {
+        release_read_buffer();
+        set_builtin_stdin(old_in);
     }
-    free(actions);
-    free(pid);
+    for (int k = 0; k < 2; k++) {
+        if (saved[k] != -1) {
+            dup2(saved[k], k);
+            close(saved[k]);
+        }
+    }
+    return status;
+}
 
-    free_array(pathnames);
-    free_args(args, num_process);
+// Signal handler that does nothing, so the signal only interrupts
+static void ignore_signal(int sig) {
+    (void) sig;
+}
 
-    for(int i = 0; i < num_pipes; i++) {
-        free(fd[i]);
+// Start the thread that runs a builtin stage of a pipeline. If it
+// cannot be started, the stage fails without running
+static void start_builtin_stage(struct builtin_stage *stage) {
+    int error = pthread_create(&stage->thread, NULL, run_builtin_stage, 
+                               stage);
+    if (error != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        for (int k = 0; k < 2; k++) {
+            if (stage->fds[k] != -1) close(stage->fds[k]);
+        }
+        stage->status = 1;
+        return;
     }
-    free(fd);
+    stage->started = 1;
+}
+
+// Thread that runs a builtin stage of a pipeline with its standard
+// input and output the stage's `fds', closing them when it finishes
+static void *run_builtin_stage(void *arg) {
+    struct builtin_stage *stage = arg;
+
+    // Writing to a stage that has already finished fails with EPIPE
+    // rather than killing the shell
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    // A loaded builtin is given the descriptors themselves
+    if (stage->builtin->plugin != NULL) {
+        int in_fd = stage->fds[0] != -1 ? stage->fds[0] : STDIN_FILENO;
+        int out_fd = stage->fds[1] != -1 ? stage->fds[1] : STDOUT_FILENO;
+        stage->status = run_plugin(stage->builtin, stage->args, stage->env,
+                                   in_fd, out_fd);
+        for (int k = 0; k < 2; k++) {
+            if (stage->fds[k] != -1) {
+                close(stage->fds[k]);
+            }
+        }
+        return NULL;
+    }
+
+    FILE *out = NULL;
+    if (stage->fds[1] != -1) {
+        out = fdopen(stage->fds[1], "w");
+        if (out == NULL) {
+            perror("fdopen");
+            close(stage->fds[1]);
+            if (stage->fds[0] != -1) close(stage->fds[0]);
+            stage->status = 1;
+            return NULL;
+        }
+    }
+
+    // The builtin is given no line, since the pipeline is recorded in
+    // the history by the shell
+    set_builtin_io(out, stage->fds[0]);
+    set_exit_status(0);
+    stage->builtin->run(stage->args, NULL, stage->path, stage->env);
+    stage->status = get_exit_status();
+    set_builtin_io(NULL, -1);
 
-    return 1;
+    if (out != NULL) {
+        fclose(out);
+    } else {
+        fflush(stdout);
+    }
+    if (stage->fds[0] != -1) close(stage->fds[0]);
+    return NULL;
 }
 
 
-// Check if output redirection exists, stores the output index and 
-// returns the write to file method
-static int output_redirection_exists(char **glob_words, int *output_index) {
-    int exists = 0;
-    for (int i = 0; glob_words[i] != NULL; i++) {
-        if (!strcmp(glob_words[i], ">")) {
-            if (!strcmp(glob_words[i+1], ">")) {
-                exists = APPEND;
-                *output_index = i+1;
+// Start a command, which may be a pipeline, without waiting for it
+int start_command(char **words, char **path, char **env, 
+                  int in_fd, int out_fd, pid_t **pids, char **pathname) {
+    int num_pipes = pipes_exist(words);
+    int num_process = num_pipes+1;
+    char **pathnames = calloc(num_process+1, sizeof(*pathnames));
+    char ***args = calloc(num_process, sizeof(**args));
+    struct sched_options **sched = calloc(num_process, sizeof(*sched));
+    int output_idx = 0;
+
+    *pids = malloc(num_process*sizeof(**pids));
+    int started = 0;
+    if (init_args_pathnames(args, pathnames, sched, words, &output_idx, 
+                            num_process, path, NULL, NULL)) {
+        // The command never got as far as taking the descriptors
+        if (in_fd != 0) close(in_fd);
+        if (out_fd != 0) close(out_fd);
+    } else {
+        started = !spawn_pipeline(args, pathnames, sched, env, 
+                                  in_fd, out_fd, num_pipes, *pids, 
+                                  NULL, NULL, NULL, NULL, NULL);
+    }
+
+    for (int i = 0; i < num_process; i++) {
+        free_sched_options(sched[i]);
+    }
+    free(sched);
+    free_args(args, num_process);
+    if (started && pathname != NULL) {
+        *pathname = strdup(pathnames[num_process-1]);
+    }
+    free_array(pathnames);
+    if (!started) {
+        free(*pids);
+        *pids = NULL;
+        return -1;
+    }
+    return num_process;
+}
+
+
+// Run program given in chunks of arguments, xargs style
+// Successfully ran program = 1
+// Encountered error = 2
+// Program not executable = 0
+int run_batched(char **words, char **path, char **env) {
+    // Parse `-P n', the number of chunks to run at once
+    int parallel = 1;
+    int i = 1;
+    if (words[i] != NULL && !strcmp(words[i], "-P")) {
+        if (words[i+1] == NULL || (parallel = atoi(words[i+1])) < 1) {
+            fprintf(stderr, "batch: -P: positive number required\n");
+            return 2;
+        }
+        i += 2;
+    }
+    char **command = &words[i];
+    if (command[0] == NULL) {
+        fprintf(stderr, "batch: command required\n");
+        return 2;
+    }
+    if (pipes_exist(command)) {
+        fprintf(stderr, "batch: pipes not supported\n");
+        return 2;
+    }
+
+    char *pathname = process_exec(command[0], path);
+    if (pathname == NULL) {
+        return 0;
+    }
+
+    // Output of every chunk goes to the same redirection
+    int write_fd = 0;
+    struct fanout *fanout = NULL;
+    int num_words = array_size(command);
+    int output_index = first_output(command);
+    if (output_index != -1) {
+        write_fd = open_outputs(command, &fanout);
+        if (write_fd == -1) {
+            free(pathname);
+            return 2;
+        }
+        // Leave out the redirection, which starts at the first `>'
+        num_words = output_index;
+    }
+    for (int j = 0; j < num_words; j++) {
+        unquote_word(command[j]);
+    }
+
+    // The command and its options are repeated in every chunk,
+    // the remaining words are shared out between the chunks
+    int fixed = batch_fixed_words(command);
+    if (fixed > num_words) fixed = num_words;
+    size_t budget = args_limit();
+    size_t fixed_size = args_size(env) + sizeof(char *);
+    for (int j = 0; j < fixed; j++) {
+        fixed_size += strlen(command[j]) + 1 + sizeof(char *);
+    }
+
+    char **args = malloc((num_words+1)*sizeof(*args));
+    memcpy(args, command, fixed*sizeof(*args));
+    pid_t *running = malloc(parallel*sizeof(*running));
+    int num_running = 0;
+    int status = 0;
+    int result = 1;
+
+    int next = fixed;
+    do {
+        // Fill a chunk with as many words as fit
+        int k = fixed;
+        size_t size = fixed_size;
+        while (next < num_words) {
+            size_t word_size = strlen(command[next]) + 1 + sizeof(char *);
+            if (size + word_size > budget || 
+                strlen(command[next]) + 1 > MAX_ARG_CHARS) {
+                break;
             }
-            else {
-                exists = OVERWRITE;
-                *output_index = i;
+            size += word_size;
+            args[k++] = command[next++];
+        }
+        args[k] = NULL;
+        if (k == fixed && next < num_words) {
+            fprintf(stderr, "%s: argument too long\n", command[next]);
+            result = 2;
+            break;
+        }
+
+        // Wait for the oldest chunk if too many are running
+        if (num_running == parallel) {
+            int exit_status;
+            if (waitpid(running[0], &exit_status, 0) != -1 &&
+                exit_code(exit_status) > status) {
+                status = exit_code(exit_status);
             }
-            return exists;
+            memmove(running, running+1, (--num_running)*sizeof(*running));
+        }
+        if (spawn_batch(pathname, args, env, write_fd, 
+                        &running[num_running])) {
+            result = 2;
+            break;
+        }
+        num_running++;
+    } while (next < num_words);
+
+    // Exit status is the highest of the chunks' exit statuses
+    for (int j = 0; j < num_running; j++) {
+        int exit_status;
+        if (waitpid(running[j], &exit_status, 0) != -1 &&
+            exit_code(exit_status) > status) {
+            status = exit_code(exit_status);
         }
     }
-    return exists;
+    if (write_fd != 0) close(write_fd);
+    finish_fanout(fanout);
+
+    if (result == 1) {
+        fprintf(stdout, "%s exit status = %d\n", pathname, status);
+        set_exit_status(status);
+    }
+
+    free(running);
+    free(args);
+    free(pathname);
+    return result;
+}
+
+
+// Get the exit status of the last command
+int get_exit_status(void) {
+    return last_exit_status;
+}
+
+// Set the exit status of the last command
+void set_exit_status(int status) {
+    last_exit_status = status;
+}
+
+
+// Set the time limit of the next commands
+void set_command_timeout(long timeout_ms, long kill_after_ms) {
+    command_timeout_ms = timeout_ms;
+    command_kill_after_ms = kill_after_ms;
+}
+
+
+// Print and record how a program finished, and whether it was stopped
+// by a time limit or the limits of its `limit' prefix
+void report_exit_status(char *pathname, int exit_status, int timed_out, 
+                        struct sched_options *sched, struct rusage *usage) {
+    if (timed_out) {
+        fprintf(stdout, "%s timed out, exit status = %d\n", pathname, 
+                TIMEOUT_EXIT_STATUS);
+        set_exit_status(TIMEOUT_EXIT_STATUS);
+        return;
+    }
+    char *limit = limit_exceeded(sched, exit_status, usage);
+    if (limit != NULL) {
+        fprintf(stdout, "%s %s, exit status = %d\n", pathname, limit, 
+                exit_code(exit_status));
+        set_exit_status(exit_code(exit_status));
+        return;
+    }
+    fprintf(stdout, "%s exit status = %d\n", pathname, 
+            exit_code(exit_status));
+    set_exit_status(exit_code(exit_status));
+}
+
+
+// Set $PIPESTATUS to the exit status of every stage of the pipeline
+static void set_pipestatus(int *exit_statuses, int n, int timed_out) {
+    char *pipestatus = malloc(n*MAX_STATUS_CHARS + 1);
+    pipestatus[0] = '\0';
+    for (int i = 0; i < n; i++) {
+        int status = timed_out ? TIMEOUT_EXIT_STATUS : 
+                                 exit_code(exit_statuses[i]);
+        sprintf(pipestatus + strlen(pipestatus), i == 0 ? "%d" : " %d", 
+                status);
+    }
+    set_var("PIPESTATUS", pipestatus);
+    free(pipestatus);
 }
 
 
@@ -380,7 +1125,10 @@ static char *process_exec(char *process, char **path) {
         char pathname[MAX_CHARS];
         // Check for possible paths with the process that
         // may be executable
-        if (executable_path(process, path, pathname)) {
+        profile_begin(PROFILE_LOOKUP);
+        int found = executable_path(process, path, pathname);
+        profile_end();
+        if (found) {
             process_path = strdup(pathname);
             return process_path;
         }
@@ -397,16 +1145,95 @@ static void free_args(char ***args, int size) {
     free(args);
 }
 
+// Bytes an argument array takes up when passed to a new program
+static size_t args_size(char **args) {
+    size_t size = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        size += strlen(args[i]) + 1 + sizeof(char *);
+    }
+    return size + sizeof(char *);
+}
+
+// Space available for arguments and environment, leaving some
+// headroom as xargs does
+static size_t args_limit(void) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) arg_max = DEFAULT_ARG_MAX;
+    return arg_max - ARG_HEADROOM;
+}
+
+// Check if the kernel will accept the arguments and environment
+static int args_fit(char **args, char **env) {
+    for (int i = 0; args[i] != NULL; i++) {
+        if (strlen(args[i]) + 1 > MAX_ARG_CHARS) return 0;
+    }
+    return args_size(args) + args_size(env) <= args_limit();
+}
+
+// Number of words at the start of a batched command that every chunk
+// needs: the program, and any options before its operands
+static int batch_fixed_words(char **words) {
+    int i = 1;
+    while (words[i] != NULL && words[i][0] == '-' && words[i][1] != '\0' &&
+           strcmp(words[i], ">")) {
+        if (!strcmp(words[i], "--")) {
+            return i+1;
+        }
+        i++;
+    }
+    return i;
+}
+
+// Start one chunk of a batched command
+static int spawn_batch(char *pathname, char **args, char **env, 
+                       int write_fd, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        perror("posix_spawn_file_actions_init");
+        return 1;
+    }
+    if (write_fd != 0 && pipe_to_stdout(&actions, write_fd)) {
+        posix_spawn_file_actions_destroy(&actions);
+        return 1;
+    }
+    fflush(stdout);
+    int spawn_error = posix_spawn(pid, pathname, &actions, NULL, args, env);
+    posix_spawn_file_actions_destroy(&actions);
+    if (spawn_error != 0) {
+        fprintf(stderr, "%s: %s\n", pathname, strerror(spawn_error));
+        return 1;
+    }
+    return 0;
+}
+
 // Initialise the array of array of programs and arguments, array of pathnames,
-// and find if there is a output redirection
-static char *init_args_pathnames(char ***args, char **pathnames, 
-                                 char **glob_words, int *output_idx, 
-                                 int num_process, char **path) 
+// scheduling options, and find if there is a output redirection
+// Returns 1 (having printed an error) if a process cannot be executed
+static int init_args_pathnames(char ***args, char **pathnames, 
+                               struct sched_options **sched,
+                               char **glob_words, int *output_idx, 
+                               int num_process, char **path,
+                               struct group *groups, 
+                               struct builtin **builtins) 
 {
     int glob_index = 0;
     // Ignore the input redirection
     if (!strcmp(glob_words[glob_index], "<")) glob_index = 2;
     for (int i = 0; i < num_process; i++) {
+        // A group's word only stands in for a program
+        if (groups != NULL && groups[i].body != NULL) {
+            args[i] = calloc(1, sizeof(*args[i]));
+            pathnames[i] = strdup(glob_words[glob_index]);
+            glob_index++;
+            if (glob_words[glob_index] != NULL && 
+                !strcmp(glob_words[glob_index], "|")) {
+                glob_index++;
+            } else if (glob_words[glob_index] != NULL) {
+                *output_idx = glob_index;
+            }
+            continue;
+        }
+
         int max_size = 3;
         int size = 0;
         int k = 0;
@@ -426,29 +1253,13 @@ static char *init_args_pathnames(char ***args, char **pathnames,
                 break;
             }
 
-            // At process, need to check if executable, if so
-            // save the pathnames and program name
-            if (k == 0) {
-                pathnames[i] = process_exec(glob_words[glob_index], path);
-
-                if (pathnames[i] != NULL) {
-                     args[i][k] = glob_words[glob_index];
-                } 
-                else {
-                    // Process cannot be executed
-                    free_args(args, num_process);
-                    free_array(pathnames);
-                    return glob_words[glob_index];
-                }
-            }
-            else {
-                if (size == max_size) {
-                    // Double the array size for storing program and its arguments
-                    max_size *= 2;
-                    args[i] = realloc(args[i], max_size*sizeof(*args[i]));
-                }
-                args[i][k] = glob_words[glob_index];
+            if (size == max_size) {
+                // Double the array size for storing program and its arguments
+                max_size *= 2;
+                args[i] = realloc(args[i], max_size*sizeof(*args[i]));
             }
+            unquote_word(glob_words[glob_index]);
+            args[i][k] = glob_words[glob_index];
             k++;
             glob_index++;
             size++;
@@ -458,8 +1269,36 @@ static char *init_args_pathnames(char ***args, char **pathnames,
             args[i] = realloc(args[i], (max_size+1)*sizeof(*args[i]));
         }
         args[i][k] = NULL;
+
+        // Take any scheduling prefix off the front of the process
+        int prefix;
+        sched[i] = parse_sched_prefix(args[i], i, &prefix);
+        if (prefix < 0) {
+            return 1;
+        }
+        memmove(args[i], args[i]+prefix, (k-prefix+1)*sizeof(*args[i]));
+
+        // Builtins that can be piped are run by the shell, unless they
+        // have a scheduling prefix, which only a process can have
+        struct builtin *builtin = NULL;
+        if (builtins != NULL && prefix == 0 && args[i][0] != NULL) {
+            builtin = find_builtin(args[i][0]);
+        }
+        if (builtin != NULL && builtin->pipes) {
+            builtins[i] = builtin;
+            pathnames[i] = strdup(args[i][0]);
+            continue;
+        }
+
+        // At process, need to check if executable, if so
+        // save the pathnames
+        pathnames[i] = process_exec(args[i][0], path);
+        if (pathnames[i] == NULL) {
+            // Process cannot be executed
+            fprintf(stderr, "%s: command not found\n", args[i][0]);
+            return 1;
+        }
     }
     pathnames[num_process] = NULL;
-    return NULL;
+    return 0;
 }
-
@@ -9,11 +9,75 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "shuck_compile.h"
+#include "shuck_fanout.h"
 #include "shuck_helper.h"
+#include "shuck_sched.h"
+#include "shuck_wait.h"
 
 
 // Run the program given by spawning a child process, also handles
 // the input and output of the given program
 int run_program(char *pathname, char **env, char **glob_words, 
                 char **path, char *input_file);
+
+// Runs the commands of a group in a pipeline, returning their exit
+// status. `forked' is set when it runs in a child of the shell, which
+// exits with that status afterwards
+typedef int (*group_fn)(struct plan *body, char **line, int forked);
+
+// Run a pipeline of `num_stages' stages, some of which are the groups
+// of commands in `groups' (see OP_PIPELINE), each run by `run_group'.
+// A subshell runs in a child of the shell, forked but not exec'd, so
+// it starts with everything the shell has set up. The last brace
+// group runs in the shell itself, with its standard input and output
+// connected to the rest of the pipeline until it finishes; any other
+// brace group is forked as a subshell is. Redirections are opened
+// once, for the whole group. `groups' may be NULL if no stage is a
+// group. Builtins that can be piped (BUILTIN_PIPES) run on threads of
+// the shell, writing to and reading from their pipes directly, with
+// brace groups then all forked. Those that change the shell's state
+// (BUILTIN_FORKS) are forked instead, unless they are the only stage.
+// Returns as run_program does
+int run_pipeline(char **glob_words, struct group *groups, int num_stages,
+                 group_fn run_group, char **line, char **path, char **env);
+
+// Start a command, which may be a pipeline, without waiting for it.
+// Its standard input is `in_fd' and its standard output `out_fd',
+// unless they are 0; both are closed once the command has them.
+// Returns the number of processes started, whose pids are stored in
+// a new array in `pids', or -1 (having printed an error) if the
+// command could not be started. Unless `pathname' is NULL, the
+// pathname of its last program is stored in it as a new string
+int start_command(char **words, char **path, char **env, 
+                  int in_fd, int out_fd, pid_t **pids, char **pathname);
+
+// Run the `batch [-P n] program args...' command: the program is run
+// as many times as needed for its arguments to fit within ARG_MAX,
+// up to n at once, and the highest exit status is reported
+int run_batched(char **words, char **path, char **env);
+
+
+// Exit status of the last command run by the shell, used by
+// `&&' and `||' to decide whether to run the next command
+int get_exit_status(void);
+
+// Set the exit status of the last command, for builtin commands
+// and commands that could not be run
+void set_exit_status(int status);
+
+// Print `<pathname> exit status = N' for a program that finished with
+// the wait status `exit_status', saying if it was stopped by a time
+// limit or, given its `sched' options and the resources it used in
+// `usage' (either may be NULL), by the limits of its `limit' prefix,
+// and set the exit status to N
+void report_exit_status(char *pathname, int exit_status, int timed_out, 
+                        struct sched_options *sched, struct rusage *usage);
+
+// Set the time limit for the commands that are run next: after
+// `timeout_ms' they are sent SIGTERM, and `kill_after_ms' later SIGKILL.
+// A `timeout_ms' of 0 means no limit
+void set_command_timeout(long timeout_ms, long kill_after_ms);
@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define LEX_SIMD 1
+#else
+#define LEX_SIMD 0
+#endif
+
+#include "shuck_lex.h"
+
+// Characters that are I/O redirections, pipes or command separators
+// when they make up a word
+#define OPERATOR_CHARS "<>|&;"
+
+// Returned when a quote is not closed
+#define UNCLOSED SIZE_MAX
+
+// Characters the lexer stops at: separators, special characters,
+// which are words by themselves (parentheses too, except in `$(( ))',
+// `<( )' and `>( )'), quotes and backslashes, and the `$' of
+// `$(( ))'. Every other character is part of a word
+#define SEPARATOR 1
+#define SPECIAL 2
+#define QUOTE 4
+#define OTHER_STOP 8
+
+static const unsigned char stop_class[256] = {
+    [' '] = SEPARATOR, ['\t'] = SEPARATOR, ['\r'] = SEPARATOR, 
+    ['\n'] = SEPARATOR,
+    ['!'] = SPECIAL, ['>'] = SPECIAL, ['<'] = SPECIAL, ['|'] = SPECIAL, 
+    [';'] = SPECIAL, ['&'] = SPECIAL, ['('] = SPECIAL, [')'] = SPECIAL,
+    ['\''] = QUOTE, ['"'] = QUOTE, ['\\'] = QUOTE,
+    ['$'] = OTHER_STOP,
+};
+
+// A line being lexed, with the positions of its stops in order,
+// ending with the length of the line. The lexer only moves forward,
+// so `next' is the first stop it has not passed yet
+struct lexer {
+    const char *line;
+    size_t length;
+    size_t *stops;
+    size_t next;
+    // The quote that was not closed
+    char unclosed;
+};
+
+// Helper functions
+static void classify(const char *s, size_t n, uint64_t *bits);
+static void classify_scalar(const char *s, size_t n, uint64_t *bits);
+#if LEX_SIMD
+static void classify_sse2(const char *s, size_t n, uint64_t *bits);
+static void classify_avx2(const char *s, size_t n, uint64_t *bits);
+#endif
+static size_t find_stops(struct lexer *lx);
+static size_t next_stop(struct lexer *lx, size_t pos);
+static size_t word_end(struct lexer *lx, size_t pos);
+static size_t skip_quoted(struct lexer *lx, size_t pos);
+static size_t match_paren(struct lexer *lx, size_t open);
+static int is_operator(const char *word);
+static int class_of(char c);
+
+
+// Split a line into tokens
+struct token *lex_line(const char *line, size_t length, size_t *num_tokens) {
+    struct lexer lx = { .line = line, .length = length };
+
+    // Every token starts at the start of the line, at a stop or just
+    // after one, so there are at most two tokens for each stop
+    size_t max_tokens = 2*find_stops(&lx) + 1;
+    size_t n = 0;
+    struct token *tokens = malloc(max_tokens*sizeof(*tokens));
+
+    size_t pos = 0;
+    while (1) {
+        while (pos < length && class_of(line[pos]) == SEPARATOR) {
+            pos++;
+        }
+        if (pos == length) {
+            break;
+        }
+
+        size_t end = word_end(&lx, pos);
+        if (end == UNCLOSED) {
+            fprintf(stderr, "syntax error: unmatched %c\n", lx.unclosed);
+            free(tokens);
+            tokens = NULL;
+            n = 0;
+            break;
+        }
+        tokens[n].offset = pos;
+        tokens[n].length = end - pos;
+        n++;
+        pos = end;
+    }
+
+    free(lx.stops);
+    *num_tokens = n;
+    return tokens;
+}
+
+// Split a line into words
+char **lex_words(const char *line) {
+    size_t num_tokens;
+    struct token *tokens = lex_line(line, strlen(line), &num_tokens);
+    if (tokens == NULL) {
+        return NULL;
+    }
+
+    char **words = malloc((num_tokens + 1)*sizeof(*words));
+    for (size_t i = 0; i < num_tokens; i++) {
+        words[i] = malloc(tokens[i].length + 1);
+        memcpy(words[i], line + tokens[i].offset, tokens[i].length);
+        words[i][tokens[i].length] = '\0';
+    }
+    words[num_tokens] = NULL;
+    free(tokens);
+    return words;
+}
+
+// Take the quote marks out of a word
+void unquote_word(char *word) {
+    char *in = strchr(word, QUOTE_MARK);
+    if (in == NULL) {
+        return;
+    }
+    char *out = in;
+    for (; *in != '\0'; in++) {
+        if (*in == QUOTE_MARK && *++in == '\0') {
+            break;
+        }
+        *out++ = *in;
+    }
+    *out = '\0';
+}
+
+// Take the quote marks out of every word
+void unquote_words(char **words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        unquote_word(words[i]);
+    }
+}
+
+// Take the quote marks out of every word that cannot be mistaken for
+// an operator without them
+void unquote_plain_words(char **words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        if (strchr(words[i], QUOTE_MARK) != NULL && !is_operator(words[i])) {
+            unquote_word(words[i]);
+        }
+    }
+}
+
+// Turn a word with quote marks into an escaped pattern
+char *quoted_glob_pattern(const char *word) {
+    int expands = word[0] == '~';
+    for (size_t i = 0; word[i] != '\0' && !expands; i++) {
+        if (word[i] == QUOTE_MARK) {
+            if (word[i+1] == '\0') break;
+            i++;
+        } else if (strchr("*?[", word[i]) != NULL) {
+            expands = 1;
+        }
+    }
+    if (!expands) {
+        return NULL;
+    }
+
+    // `/' separates directories even when quoted, so is never escaped
+    char *pattern = malloc(2*strlen(word) + 1);
+    size_t k = 0;
+    for (size_t i = 0; word[i] != '\0'; i++) {
+        if (word[i] == QUOTE_MARK) {
+            if (word[++i] == '\0') break;
+            if (word[i] != '/') pattern[k++] = '\\';
+        }
+        pattern[k++] = word[i];
+    }
+    pattern[k] = '\0';
+    return pattern;
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Set a bit in `bits' for every stop in the `n' characters of `s'.
+// A few other characters may be set too, which the lexer passes over
+static void classify(const char *s, size_t n, uint64_t *bits) {
+#if LEX_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        classify_avx2(s, n, bits);
+    } else {
+        classify_sse2(s, n, bits);
+    }
+#else
+    classify_scalar(s, n, bits);
+#endif
+}
+
+// A character at a time, for other CPUs and the ends of lines
+static void classify_scalar(const char *s, size_t n, uint64_t *bits) {
+    for (size_t i = 0; i < n; i += 64) {
+        size_t end = n - i < 64 ? n - i : 64;
+        uint64_t word = 0;
+        for (size_t j = 0; j < end; j++) {
+            word |= (uint64_t) (stop_class[(unsigned char) s[i+j]] != 0) << j;
+        }
+        bits[i/64] = word;
+    }
+}
+
+#if LEX_SIMD
+
+// 16 characters at a time. Most stops are at most `)', so everything
+// up to it is taken as a stop, which only adds `#', `%' and control
+// characters, and the rest are compared with one by one
+static void classify_sse2(const char *s, size_t n, uint64_t *bits) {
+    const __m128i last_low = _mm_set1_epi8(')');
+    const __m128i semicolon = _mm_set1_epi8(';');
+    const __m128i less = _mm_set1_epi8('<');
+    const __m128i greater = _mm_set1_epi8('>');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i bar = _mm_set1_epi8('|');
+
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t word = 0;
+        for (int part = 0; part < 4; part++) {
+            __m128i block = _mm_loadu_si128((const __m128i *) (s + i + 16*part));
+            __m128i found = _mm_cmpeq_epi8(_mm_min_epu8(block, last_low), 
+                                           block);
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, semicolon));
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, less));
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, greater));
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, backslash));
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, bar));
+            word |= (uint64_t) (uint16_t) _mm_movemask_epi8(found) << 16*part;
+        }
+        bits[i/64] = word;
+    }
+    classify_scalar(s + i, n - i, &bits[i/64]);
+}
+
+// 32 characters at a time. Each character's low and high nibbles are
+// looked up in a table each, and it is a stop when both entries have
+// a bit in common: the high nibble picks a column of the ASCII table,
+// and the low nibble the stops' rows within the columns
+__attribute__((target("avx2")))
+static void classify_avx2(const char *s, size_t n, uint64_t *bits) {
+    const __m256i low_table = _mm256_setr_epi8(
+        0x02, 0x02, 0x02, 0x00, 0x02, 0x00, 0x02, 0x02,
+        0x02, 0x03, 0x01, 0x04, 0x1c, 0x01, 0x04, 0x00,
+        0x02, 0x02, 0x02, 0x00, 0x02, 0x00, 0x02, 0x02,
+        0x02, 0x03, 0x01, 0x04, 0x1c, 0x01, 0x04, 0x00);
+    const __m256i high_table = _mm256_setr_epi8(
+        0x01, 0x00, 0x02, 0x04, 0x00, 0x08, 0x00, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x01, 0x00, 0x02, 0x04, 0x00, 0x08, 0x00, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t word = 0;
+        for (int part = 0; part < 2; part++) {
+            __m256i block =
+                _mm256_loadu_si256((const __m256i *) (s + i + 32*part));
+            __m256i low = _mm256_shuffle_epi8(low_table,
+                _mm256_and_si256(block, nibble));
+            __m256i high = _mm256_shuffle_epi8(high_table,
+                _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+            __m256i other = _mm256_cmpeq_epi8(_mm256_and_si256(low, high),
+                                              zero);
+            word |= (uint64_t) (uint32_t) ~_mm256_movemask_epi8(other)
+                    << 32*part;
+        }
+        bits[i/64] = word;
+    }
+    classify_scalar(s + i, n - i, &bits[i/64]);
+}
+
+#endif
+
+// Find the stops of the line, returning how many there are. They are
+// found as a bitmap, which is then turned into a list, so that the
+// lexer reads them in order rather than searching the bitmap
+static size_t find_stops(struct lexer *lx) {
+    size_t num_words = (lx->length + 63) / 64;
+    uint64_t *bits = malloc((num_words + 1)*sizeof(*bits));
+    classify(lx->line, lx->length, bits);
+
+    size_t num_stops = 0;
+    for (size_t w = 0; w < num_words; w++) {
+        num_stops += __builtin_popcountll(bits[w]);
+    }
+    lx->stops = malloc((num_stops + 1)*sizeof(*lx->stops));
+    size_t k = 0;
+    for (size_t w = 0; w < num_words; w++) {
+        for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+            lx->stops[k++] = w*64 + __builtin_ctzll(word);
+        }
+    }
+    lx->stops[k] = lx->length;
+    lx->next = 0;
+    free(bits);
+    return num_stops;
+}
+
+// Find the first stop at or after `pos', or the end of the line
+static size_t next_stop(struct lexer *lx, size_t pos) {
+    if (pos >= lx->length) {
+        return lx->length;
+    }
+    while (lx->stops[lx->next] < pos) {
+        lx->next++;
+    }
+    return lx->stops[lx->next];
+}
+
+// Find the end of the word starting at `pos'. A special character is
+// a word by itself, except for `&&' and `||', and `<( ... )' and
+// `>( ... )', which are kept whole, as is `$(( ... ))' in a word
+static size_t word_end(struct lexer *lx, size_t pos) {
+    const char *line = lx->line;
+    char c = line[pos];
+    if (class_of(c) == SPECIAL) {
+        if ((c == '&' || c == '|') && line[pos+1] == c) {
+            return pos + 2;
+        }
+        if ((c == '<' || c == '>') && line[pos+1] == '(') {
+            size_t close = match_paren(lx, pos + 1);
+            if (close == UNCLOSED) return UNCLOSED;
+            if (close != lx->length) return close + 1;
+        }
+        return pos + 1;
+    }
+
+    size_t i = pos;
+    while ((i = next_stop(lx, i)) < lx->length) {
+        c = line[i];
+        int class = class_of(c);
+        if (class == SEPARATOR || class == SPECIAL) {
+            break;
+        }
+        if (class == QUOTE) {
+            i = skip_quoted(lx, i);
+            if (i == UNCLOSED) return UNCLOSED;
+            continue;
+        }
+        if (c == '$' && line[i+1] == '(' && line[i+2] == '(') {
+            size_t close = match_paren(lx, i + 1);
+            if (close == UNCLOSED) return UNCLOSED;
+            if (close != lx->length) {
+                i = close + 1;
+                continue;
+            }
+        }
+        // Any other `$' is part of the word
+        i++;
+    }
+    return i;
+}
+
+// Skip the quoted string or escaped character at `pos'
+static size_t skip_quoted(struct lexer *lx, size_t pos) {
+    const char *line = lx->line;
+    if (line[pos] == '\\') {
+        return pos + 1 < lx->length ? pos + 2 : pos + 1;
+    }
+
+    if (line[pos] == '\'') {
+        const char *close = memchr(line + pos + 1, '\'', lx->length - pos - 1);
+        if (close == NULL) {
+            lx->unclosed = '\'';
+            return UNCLOSED;
+        }
+        return close - line + 1;
+    }
+
+    // Inside double quotes, a backslash still escapes a `"'
+    size_t i = pos + 1;
+    while ((i = next_stop(lx, i)) < lx->length) {
+        if (line[i] == '"') {
+            return i + 1;
+        }
+        i += line[i] == '\\' ? 2 : 1;
+    }
+    lx->unclosed = '"';
+    return UNCLOSED;
+}
+
+// Find the `)' matching the `(' at `open', or the end of the line if
+// there is none
+static size_t match_paren(struct lexer *lx, size_t open) {
+    int depth = 0;
+    size_t i = open;
+    while ((i = next_stop(lx, i)) < lx->length) {
+        char c = lx->line[i];
+        if (class_of(c) == QUOTE) {
+            i = skip_quoted(lx, i);
+            if (i == UNCLOSED) return UNCLOSED;
+            continue;
+        }
+        if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return i;
+        }
+        i++;
+    }
+    return lx->length;
+}
+
+// Check if a word with quote marks would be an operator without them
+static int is_operator(const char *word) {
+    int length = 0;
+    for (; *word != '\0'; word++) {
+        if (*word == QUOTE_MARK) {
+            continue;
+        }
+        if (strchr(OPERATOR_CHARS, *word) == NULL) {
+            return 0;
+        }
+        length++;
+    }
+    return length > 0;
+}
+
+static int class_of(char c) {
+    return stop_class[(unsigned char) c];
+}
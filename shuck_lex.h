@@ -0,0 +1,59 @@
+// The shell's lexer: splits a command line into words. Quotes and
+// backslash escapes keep separators and special characters inside a
+// word, and the word keeps its quotes, so it can be printed (e.g. to
+// the history file) and lexed again to the same word. The quotes are
+// taken off when the word is expanded (shuck_vars.h), which marks
+// every quoted character with QUOTE_MARK instead, so that a quoted
+// `|' or `*' is not taken for a pipe or a pattern. The marks are
+// removed when the word is finally used as an argument.
+//
+// Lines are classified 16 or 32 bytes at a time with SSE2 or AVX2
+// (whichever the CPU has, else a byte at a time), into a bitmap of
+// the characters that can end or quote a word, so the lexer only
+// looks at those. Very long lines, e.g. generated ones with many
+// thousands of arguments, are split at close to the speed they can
+// be read from memory.
+
+#ifndef SHUCK_LEX_H
+#define SHUCK_LEX_H
+
+#include <stdlib.h>
+
+// Put before a character of an expanded word that was quoted. A mark
+// with nothing after it is an empty quoted word, e.g. `""'
+#define QUOTE_MARK '\001'
+
+// A word of a line: where it is in the line and how long it is
+struct token {
+    size_t offset;
+    size_t length;
+};
+
+// Split the `length' characters of `line' into words, returning an
+// array of their tokens and setting `*num_tokens'. Returns NULL,
+// having printed an error, if a quote is not closed
+struct token *lex_line(const char *line, size_t length, size_t *num_tokens);
+
+// Split `line' into a NULL-terminated array of words, each a copy of
+// a token. Returns NULL, having printed an error, if a quote is not
+// closed
+char **lex_words(const char *line);
+
+// Take the quote marks out of an expanded word, in place
+void unquote_word(char *word);
+
+// Take the quote marks out of every word of an array
+void unquote_words(char **words);
+
+// Take the quote marks out of every word of an array except those
+// that would then read as I/O redirections, pipes or command
+// separators, which are only unquoted when given to a program
+void unquote_plain_words(char **words);
+
+// Turn a word with quote marks into a pattern for shuck_glob(), with
+// GLOB_QUOTED, in which the quoted pattern characters are escaped
+// with backslashes. Returns NULL if no unquoted part of the word
+// would be expanded, so that the word is used as it is
+char *quoted_glob_pattern(const char *word);
+
+#endif
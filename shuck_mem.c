@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shuck_mem.h"
+
+// The allocator is only replaced in builds asked for it, and never in
+// sanitizer builds, which bring their own allocator
+#if !defined(SHUCK_MEM_ACCOUNTING)
+#define MEM_ACCOUNTING 0
+#elif defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define MEM_ACCOUNTING 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define MEM_ACCOUNTING 0
+#endif
+#endif
+#ifndef MEM_ACCOUNTING
+#define MEM_ACCOUNTING 1
+#endif
+
+#define MEM_ALIGNMENT 16
+
+// Before every block. Its size keeps blocks aligned as malloc's are
+struct block {
+    size_t size;
+    // Which subsystem allocated the block
+    uint32_t kind;
+    // How far the block is from the start of what the C library
+    // allocated for it, which is more than the header when the block
+    // was asked to be aligned
+    uint32_t offset;
+};
+
+static struct mem_stats counts[NUM_MEM_KINDS];
+
+static const char *other_name = "other";
+
+// Helper functions
+#if MEM_ACCOUNTING
+static void count_alloc(struct block *b);
+static void count_free(struct block *b);
+static struct block *header(void *p);
+static void add(long long *count, long long n);
+static void *aligned_alloc_block(size_t alignment, size_t size);
+#endif
+
+
+// Check if allocations are being counted
+int mem_accounting(void) {
+    return MEM_ACCOUNTING;
+}
+
+// Get the counts of every subsystem
+void mem_stats(struct mem_stats stats[NUM_MEM_KINDS]) {
+    for (int k = 0; k < NUM_MEM_KINDS; k++) {
+        stats[k].live_bytes = __atomic_load_n(&counts[k].live_bytes,
+                                              __ATOMIC_RELAXED);
+        stats[k].live_blocks = __atomic_load_n(&counts[k].live_blocks,
+                                               __ATOMIC_RELAXED);
+        stats[k].allocs = __atomic_load_n(&counts[k].allocs,
+                                          __ATOMIC_RELAXED);
+        stats[k].bytes = __atomic_load_n(&counts[k].bytes, __ATOMIC_RELAXED);
+    }
+}
+
+// Get the counts of all subsystems together
+void mem_total(struct mem_stats *total) {
+    memset(total, 0, sizeof(*total));
+    if (!mem_accounting()) {
+        // Only the C library knows how much is allocated
+        struct mallinfo2 info = mallinfo2();
+        total->live_bytes = info.uordblks + info.hblkhd;
+        return;
+    }
+    struct mem_stats stats[NUM_MEM_KINDS];
+    mem_stats(stats);
+    for (int k = 0; k < NUM_MEM_KINDS; k++) {
+        total->live_bytes += stats[k].live_bytes;
+        total->live_blocks += stats[k].live_blocks;
+        total->allocs += stats[k].allocs;
+        total->bytes += stats[k].bytes;
+    }
+}
+
+// Get the resident set size
+long mem_rss_kb(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    long pages, resident;
+    int found = fscanf(f, "%ld %ld", &pages, &resident) == 2;
+    fclose(f);
+    return found ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+// Print the counts
+void print_memstats(FILE *out) {
+    if (!mem_accounting()) {
+        struct mem_stats total;
+        mem_total(&total);
+        fprintf(out, "allocated %lld bytes (not counted by subsystem in "
+                "this build)\n", total.live_bytes);
+    } else {
+        struct mem_stats stats[NUM_MEM_KINDS];
+        mem_stats(stats);
+        struct mem_stats total;
+        mem_total(&total);
+
+        fprintf(out, "%-12s %12s %10s %12s %14s\n", "subsystem",
+                "live bytes", "live", "allocs", "bytes");
+        for (int k = 0; k < NUM_MEM_KINDS; k++) {
+            fprintf(out, "%-12s %12lld %10lld %12lld %14lld\n",
+                    k == MEM_OTHER ? other_name : profile_phase_name(k),
+                    stats[k].live_bytes, stats[k].live_blocks,
+                    stats[k].allocs, stats[k].bytes);
+        }
+        fprintf(out, "%-12s %12lld %10lld %12lld %14lld\n", "total",
+                total.live_bytes, total.live_blocks, total.allocs,
+                total.bytes);
+    }
+    fprintf(out, "rss %ld KiB\n", mem_rss_kb());
+}
+
+#if MEM_ACCOUNTING
+
+// The C library's allocator, which the replacements below use
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size) {
+    if (size > SIZE_MAX - sizeof(struct block)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct block *b = __libc_malloc(sizeof(*b) + size);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->size = size;
+    b->offset = sizeof(*b);
+    count_alloc(b);
+    return b + 1;
+}
+
+void *calloc(size_t n, size_t size) {
+    if (size != 0 && n > (SIZE_MAX - sizeof(struct block)) / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct block *b = __libc_calloc(1, sizeof(*b) + n*size);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->size = n*size;
+    b->offset = sizeof(*b);
+    count_alloc(b);
+    return b + 1;
+}
+
+void *realloc(void *p, size_t size) {
+    if (p == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+    struct block *b = header(p);
+    if (b->offset != sizeof(*b)) {
+        // Aligned blocks are moved to an ordinary one
+        void *moved = malloc(size);
+        if (moved != NULL) {
+            memcpy(moved, p, b->size < size ? b->size : size);
+            free(p);
+        }
+        return moved;
+    }
+    if (size > SIZE_MAX - sizeof(*b)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // The block keeps the subsystem that first allocated it
+    struct block old = *b;
+    struct block *resized = __libc_realloc(b, sizeof(*b) + size);
+    if (resized == NULL) {
+        return NULL;
+    }
+    count_free(&old);
+    resized->size = size;
+    resized->kind = old.kind;
+    add(&counts[old.kind].live_bytes, size);
+    add(&counts[old.kind].live_blocks, 1);
+    add(&counts[old.kind].bytes, size > old.size ? size - old.size : 0);
+    return resized + 1;
+}
+
+void *reallocarray(void *p, size_t n, size_t size) {
+    if (size != 0 && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(p, n*size);
+}
+
+void free(void *p) {
+    if (p == NULL) {
+        return;
+    }
+    struct block *b = header(p);
+    count_free(b);
+    __libc_free((char *) b + sizeof(*b) - b->offset);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *block = aligned_alloc_block(alignment, size);
+    if (block == NULL) {
+        return ENOMEM;
+    }
+    *p = block;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return aligned_alloc_block(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc_block(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return aligned_alloc_block(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return aligned_alloc_block(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *p) {
+    return p == NULL ? 0 : header(p)->size;
+}
+
+#endif
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+#if MEM_ACCOUNTING
+
+// Count a new block under the subsystem the thread is in
+static void count_alloc(struct block *b) {
+    int phase = profile_phase();
+    b->kind = phase == -1 ? MEM_OTHER : (uint32_t) phase;
+    add(&counts[b->kind].live_bytes, b->size);
+    add(&counts[b->kind].live_blocks, 1);
+    add(&counts[b->kind].allocs, 1);
+    add(&counts[b->kind].bytes, b->size);
+}
+
+static void count_free(struct block *b) {
+    add(&counts[b->kind].live_bytes, -(long long) b->size);
+    add(&counts[b->kind].live_blocks, -1);
+}
+
+static struct block *header(void *p) {
+    return (struct block *) p - 1;
+}
+
+static void add(long long *count, long long n) {
+    __atomic_fetch_add(count, n, __ATOMIC_RELAXED);
+}
+
+// Allocate a block aligned more strictly than malloc's. The header
+// goes just before the block, in the padding in front of it
+static void *aligned_alloc_block(size_t alignment, size_t size) {
+    if (alignment <= MEM_ALIGNMENT) {
+        return malloc(size);
+    }
+    if (size > SIZE_MAX - alignment || alignment > UINT32_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    char *start = __libc_memalign(alignment, alignment + size);
+    if (start == NULL) {
+        return NULL;
+    }
+    struct block *b = (struct block *) (start + alignment) - 1;
+    b->size = size;
+    b->offset = alignment;
+    count_alloc(b);
+    return b + 1;
+}
+
+#endif
@@ -0,0 +1,51 @@
+// Allocation accounting for long-running shells. In a shell built with
+// -DSHUCK_MEM_ACCOUNTING, malloc(3) and its relatives are replaced by
+// versions that put a small header before every block, recording its
+// size and the phase (shuck_profile.h) the allocating thread was in.
+// So every allocation, including the C library's own on the shell's
+// behalf, is counted under the subsystem that made it, and is taken
+// off that subsystem's count when freed. That changes every
+// allocation in the process, the C library's and loaded builtins'
+// included, so it is only for finding leaks.
+//
+// Other builds, and sanitizer builds, which keep the sanitizer's
+// allocator, count nothing themselves: only the total the C library
+// reports as allocated (mallinfo2(3)) is known.
+
+#ifndef SHUCK_MEM_H
+#define SHUCK_MEM_H
+
+#include <stdio.h>
+
+#include "shuck_profile.h"
+
+// Allocations made outside any phase
+#define MEM_OTHER NUM_PROFILE_PHASES
+#define NUM_MEM_KINDS (NUM_PROFILE_PHASES + 1)
+
+// Allocations of one subsystem
+struct mem_stats {
+    long long live_bytes;       // Allocated and not yet freed
+    long long live_blocks;
+    long long allocs;           // Ever allocated
+    long long bytes;
+};
+
+// Check if allocations are being counted by subsystem
+int mem_accounting(void);
+
+// Copy the counts of every subsystem into `stats'
+void mem_stats(struct mem_stats stats[NUM_MEM_KINDS]);
+
+// Add up the counts of every subsystem, or without accounting get the
+// bytes the C library has allocated, and no counts of blocks
+void mem_total(struct mem_stats *total);
+
+// The shell's resident set size in KiB, or -1 if it cannot be read
+long mem_rss_kb(void);
+
+// Print the counts of every subsystem, their total, and the resident
+// set size
+void print_memstats(FILE *out);
+
+#endif
@@ -0,0 +1,54 @@
+// The interface for builtins loaded into shuck with
+//
+//     enable -f libfoo.so NAME...
+//
+// A plugin is a shared library that defines, for every builtin NAME
+// it provides, a variable
+//
+//     struct shuck_builtin NAME_builtin = {
+//         SHUCK_PLUGIN_VERSION, run_name, "NAME [args]"
+//     };
+//
+// and is built with e.g. `gcc -shared -fPIC -o libfoo.so foo.c'.
+//
+// A builtin runs inside the shell rather than in a process of its own,
+// so it skips fork and exec entirely, but it must not call exit(),
+// must free everything it allocates, and must not close the file
+// descriptors it is given. Its return value is its exit status. It
+// can be a stage of a pipeline, or have its input or output
+// redirected, when it runs on a thread of the shell of its own with
+// the stage's ends of the pipes, so it may run alongside other
+// builtins.
+//
+// The layout of these structures only changes along with
+// SHUCK_PLUGIN_VERSION, and shuck refuses builtins built for another
+// version.
+
+#ifndef SHUCK_PLUGIN_H
+#define SHUCK_PLUGIN_H
+
+#define SHUCK_PLUGIN_VERSION 1
+
+// The shell a builtin is running in
+struct shuck_env {
+    // Get a shell or environment variable, or NULL if it is not set
+    const char *(*get_var)(const char *name);
+    // Set a shell variable
+    void (*set_var)(const char *name, const char *value);
+    // The environment given to programs the shell runs
+    char **environ;
+};
+
+struct shuck_builtin {
+    // SHUCK_PLUGIN_VERSION when the plugin was built
+    int version;
+    // Run the builtin, with its arguments in argv[0] to argv[argc-1]
+    // (argv[argc] is NULL), reading from `in_fd' and writing to
+    // `out_fd'. Returns the exit status
+    int (*run)(int argc, char **argv, struct shuck_env *env,
+               int in_fd, int out_fd);
+    // How the builtin is used, shown by `enable'
+    const char *usage;
+};
+
+#endif
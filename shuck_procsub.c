@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shuck_procsub.h"
+#include "shuck_io.h"
+#include "shuck_spawner.h"
+#include "shuck_vars.h"
+
+#define MAX_FD_PATH_CHARS 32
+
+struct substitutions {
+    // The shell's ends of the pipes, named by the `/dev/fd/N' paths
+    int *fds;
+    int num_fds;
+    // Every process started for the substitutions
+    pid_t *pids;
+    int num_pids;
+};
+
+// Helper functions
+static void start_substitution(struct substitutions *subs, char **word,
+                               char **(*tokenize_line)(char *),
+                               char **path, char **env);
+
+
+// Check if word is a process substitution
+int is_substitution(char *word) {
+    size_t length = strlen(word);
+    return length >= 3 && (word[0] == '<' || word[0] == '>') &&
+           word[1] == '(' && word[length-1] == ')';
+}
+
+// Start the commands of the process substitutions
+struct substitutions *start_substitutions(char **words,
+                                          char **(*tokenize_line)(char *),
+                                          char **path, char **env) {
+    struct substitutions *subs = NULL;
+    for (int i = 0; words[i] != NULL; i++) {
+        if (!is_substitution(words[i])) {
+            continue;
+        }
+        if (subs == NULL) {
+            subs = calloc(1, sizeof(*subs));
+        }
+        start_substitution(subs, &words[i], tokenize_line, path, env);
+    }
+    if (subs == NULL) {
+        return NULL;
+    }
+
+    // The pipes are created close-on-exec so that no substitution's
+    // command holds another's pipe open; only the command using
+    // them gets them, including from the spawn helper
+    for (int i = 0; i < subs->num_fds; i++) {
+        fcntl(subs->fds[i], F_SETFD, 0);
+        share_spawn_fd(subs->fds[i]);
+    }
+    return subs;
+}
+
+// Wait for the commands of the process substitutions
+void finish_substitutions(struct substitutions *subs) {
+    if (subs == NULL) {
+        return;
+    }
+
+    // Closing the pipes lets the commands see the end of their input,
+    // or stop writing output nobody will read
+    for (int i = 0; i < subs->num_fds; i++) {
+        unshare_spawn_fd(subs->fds[i]);
+        close(subs->fds[i]);
+    }
+    for (int i = 0; i < subs->num_pids; i++) {
+        int status;
+        while (waitpid(subs->pids[i], &status, 0) == -1 && errno == EINTR) {
+        }
+    }
+    free(subs->fds);
+    free(subs->pids);
+    free(subs);
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Start the command of one substitution, replacing the word with
+// the `/dev/fd/N' path of the shell's end of its pipe. If the command
+// cannot be started the pipe is still made, and is empty
+static void start_substitution(struct substitutions *subs, char **word,
+                               char **(*tokenize_line)(char *),
+                               char **path, char **env) {
+    int reading = (*word)[0] == '<';
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return;
+    }
+    int shell_end = reading ? fds[0] : fds[1];
+    int command_end = reading ? fds[1] : fds[0];
+
+    // The command is between the `<(' or `>(' and the `)'
+    char *command = strndup(*word + 2, strlen(*word) - 3);
+    char **command_words = tokenize_line(command);
+    free(command);
+
+    // Its variables are expanded as it starts, like any command's
+    char **expanded = NULL;
+    if (command_words != NULL && command_words[0] != NULL && 
+        !validate_command(command_words)) {
+        expanded = expand_words(command_words);
+    }
+
+    pid_t *pids = NULL;
+    int num_pids = -1;
+    if (expanded != NULL && expanded[0] != NULL) {
+        num_pids = start_command(expanded, path, env,
+                                 reading ? 0 : command_end,
+                                 reading ? command_end : 0, &pids, NULL);
+    } else {
+        close(command_end);
+    }
+    free_array(expanded);
+    free_array(command_words);
+
+    if (num_pids > 0) {
+        subs->pids = realloc(subs->pids,
+                             (subs->num_pids + num_pids)*sizeof(*pids));
+        memcpy(&subs->pids[subs->num_pids], pids, num_pids*sizeof(*pids));
+        subs->num_pids += num_pids;
+        free(pids);
+    }
+
+    subs->fds = realloc(subs->fds, (subs->num_fds + 1)*sizeof(*subs->fds));
+    subs->fds[subs->num_fds++] = shell_end;
+
+    free(*word);
+    *word = malloc(MAX_FD_PATH_CHARS);
+    snprintf(*word, MAX_FD_PATH_CHARS, "/dev/fd/%d", shell_end);
+}
@@ -0,0 +1,36 @@
+// Process substitution: a word `<(command)' is replaced by a
+// `/dev/fd/N' that reads the command's output, and `>(command)' by
+// one that writes to the command's input. The commands run alongside
+// the command using them, connected by pipes, so nothing is written
+// to disk.
+
+#ifndef SHUCK_PROCSUB_H
+#define SHUCK_PROCSUB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "shuck_helper.h"
+
+// The commands started for the substitutions in one command
+struct substitutions;
+
+// Check if word is a process substitution
+int is_substitution(char *word);
+
+// Start a command for every process substitution in `words', replacing
+// each one with the `/dev/fd/N' path of its pipe. `tokenize_line'
+// splits a substitution's command into words. Only the pipe ends in
+// the `/dev/fd/N' paths are passed on to the programs run next.
+// Returns NULL if there are no substitutions
+struct substitutions *start_substitutions(char **words,
+                                          char **(*tokenize_line)(char *),
+                                          char **path, char **env);
+
+// Close the shell's ends of the pipes and wait for the substitutions'
+// commands to finish, once the command using them has
+void finish_substitutions(struct substitutions *subs);
+
+#endif
@@ -0,0 +1,101 @@
+#include <time.h>
+
+#include "shuck_profile.h"
+
+// Deeper than any nesting of phases in the shell
+#define MAX_PROFILE_DEPTH 16
+
+static const char *phase_names[NUM_PROFILE_PHASES] = {
+    "tokenize",
+    "validate",
+    "glob",
+    "lookup",
+    "history",
+    "spawn/wait",
+};
+
+// Whether time is being counted, and the time spent in each phase
+static struct {
+    int on;
+    long long totals[NUM_PROFILE_PHASES];
+} profile;
+
+// The phases each thread has entered and not yet left, innermost
+// last, and when the thread's time was last counted
+static __thread struct {
+    int depth;
+    enum profile_phase stack[MAX_PROFILE_DEPTH];
+    long long marked;
+} phases;
+
+// Helper functions
+static long long now_ns(void);
+static void count_time(void);
+
+
+// Turn timing on or off
+void profile_enable(int on) {
+    memset(&profile, 0, sizeof(profile));
+    profile.on = on;
+    phases.marked = now_ns();
+}
+
+// Enter a phase
+void profile_begin(enum profile_phase phase) {
+    if (profile.on) {
+        count_time();
+    }
+    if (phases.depth < MAX_PROFILE_DEPTH) {
+        phases.stack[phases.depth] = phase;
+    }
+    phases.depth++;
+}
+
+// Leave the innermost phase
+void profile_end(void) {
+    if (phases.depth == 0) {
+        return;
+    }
+    if (profile.on) {
+        count_time();
+    }
+    phases.depth--;
+}
+
+// Get the phase the thread is in
+int profile_phase(void) {
+    if (phases.depth == 0 || phases.depth > MAX_PROFILE_DEPTH) {
+        return -1;
+    }
+    return phases.stack[phases.depth - 1];
+}
+
+// Get the time spent in each phase
+void profile_totals(long long totals[NUM_PROFILE_PHASES]) {
+    memcpy(totals, profile.totals, sizeof(profile.totals));
+}
+
+// Get the name of a phase
+const char *profile_phase_name(enum profile_phase phase) {
+    return phase_names[phase];
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Count the time since it was last counted for the thread's
+// innermost phase
+static void count_time(void) {
+    long long now = now_ns();
+    int phase = profile_phase();
+    if (phase != -1) {
+        __atomic_fetch_add(&profile.totals[phase], now - phases.marked,
+                           __ATOMIC_RELAXED);
+    }
+    phases.marked = now;
+}
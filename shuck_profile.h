@@ -0,0 +1,46 @@
+// Where the shell spends its time running commands, by phase. Timing
+// is off unless turned on with `profile_enable'; while off, marking a
+// phase only notes which phase the thread is in, which is also what
+// allocations are counted under (shuck_mem.h).
+//
+// Phases can be nested (e.g. a pipeline looking up each of its
+// programs while it is being spawned): time spent in the inner phase
+// is only counted for that phase, not for the one around it.
+
+#ifndef SHUCK_PROFILE_H
+#define SHUCK_PROFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum profile_phase {
+    PROFILE_TOKENIZE,   // Splitting a line into words
+    PROFILE_VALIDATE,   // Checking and compiling a line into a plan
+    PROFILE_GLOB,       // Expanding patterns in a command's words
+    PROFILE_LOOKUP,     // Finding a program in `$PATH'
+    PROFILE_HISTORY,    // Appending to the history file
+    PROFILE_SPAWN,      // Starting a program and waiting for it
+    NUM_PROFILE_PHASES
+};
+
+// Turn timing on or off, and clear the totals
+void profile_enable(int on);
+
+// Enter a phase
+void profile_begin(enum profile_phase phase);
+
+// Leave the phase entered last
+void profile_end(void);
+
+// The phase the calling thread is in, or -1 if it is in none
+int profile_phase(void);
+
+// Copy the nanoseconds spent in each phase since timing was turned
+// on into `totals'
+void profile_totals(long long totals[NUM_PROFILE_PHASES]);
+
+// The name of a phase
+const char *profile_phase_name(enum profile_phase phase);
+
+#endif
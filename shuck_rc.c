@@ -0,0 +1,683 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shuck_rc.h"
+#include "shuck_helper.h"
+
+#define MAX_RC_PATH_CHARS 4096
+// The size of the buffers `executable_path' puts pathnames in
+#define MAX_PATHNAME_CHARS 1024
+
+// The start of every snapshot, which changes whenever its layout does
+#define SNAPSHOT_MAGIC "SHUCKRC1"
+#define SNAPSHOT_MAGIC_CHARS 8
+
+// A program found in the search path, in its directory `dir'
+struct program {
+    char *name;
+    int dir;
+};
+
+// The programs found in a search path, sorted by name. Each of its
+// directories' modification time is kept, to tell whether programs
+// have been added or removed since. The names point into `data', the
+// snapshot they were read from, or are allocated if it is NULL
+struct startup_programs {
+    char *path_value;
+    int num_dirs;
+    char **dir_names;
+    struct timespec *mtimes;
+    struct program *programs;
+    int num;
+    int capacity;
+    char *data;
+};
+
+// Where a snapshot is being read from. `bad' is set, and nothing more
+// is read, once it is found to be cut short or malformed
+struct cursor {
+    const char *p;
+    const char *end;
+    int bad;
+};
+
+// Helper functions
+static int startup_path(char *pathname, const char *file);
+static char *read_file(const char *pathname, size_t *size);
+static void compile_startup(struct startup *s, char *text,
+                            char **(*tokenize_line)(char *line));
+static void add_plan(struct startup *s, struct plan *plan);
+static int read_snapshot(struct startup *s, const char *pathname);
+static void write_snapshot(struct startup *s);
+static struct startup_programs *find_programs(char *path_value,
+                                              char **path);
+static void add_program(const char *name, void *value, void *ctx);
+static int compare_programs(const void *a, const void *b);
+static int programs_current(struct startup_programs *p, char *path_value,
+                            char **path);
+static int find_program(const char *program, char *pathname);
+static void free_programs(struct startup_programs *p);
+static void get_mtime(const char *pathname, struct timespec *mtime);
+static long long get_int(struct cursor *c);
+static char *get_string(struct cursor *c);
+static char **get_words(struct cursor *c);
+static void get_plan(struct cursor *c, struct plan *plan);
+static struct plan *get_body(struct cursor *c);
+static void put_int(FILE *f, long long n);
+static void put_string(FILE *f, const char *s);
+static void put_words(FILE *f, char **words);
+static void put_plan(FILE *f, struct plan *plan);
+static void put_body(FILE *f, struct plan *body);
+
+// The programs the executable cache is being filled from, if any
+static struct startup_programs *program_index = NULL;
+
+
+// FUNCTIONS FOR SHUCK_RC
+
+// Load the startup commands
+struct startup *load_startup(char **(*tokenize_line)(char *line)) {
+    char rc_name[MAX_RC_PATH_CHARS];
+    char snapshot_name[MAX_RC_PATH_CHARS];
+    struct stat st;
+    if (startup_path(rc_name, RC_FILE) ||
+        startup_path(snapshot_name, RC_SNAPSHOT_FILE) ||
+        stat(rc_name, &st) != 0) {
+        return NULL;
+    }
+
+    struct startup *s = calloc(1, sizeof(*s));
+    s->rc_mtime = st.st_mtim;
+    s->rc_size = st.st_size;
+    if (read_snapshot(s, snapshot_name)) {
+        s->from_snapshot = 1;
+        return s;
+    }
+
+    size_t size;
+    char *text = read_file(rc_name, &size);
+    if (text == NULL) {
+        perror(rc_name);
+        free(s);
+        return NULL;
+    }
+    compile_startup(s, text, tokenize_line);
+    free(text);
+    return s;
+}
+
+// Fill the executable cache, and rewrite the snapshot if it is stale
+void finish_startup(struct startup *s, char *path_value, char **path) {
+    int rewrite = !s->from_snapshot;
+    if (s->programs == NULL ||
+        !programs_current(s->programs, path_value, path)) {
+        free_programs(s->programs);
+        s->programs = find_programs(path_value, path);
+        rewrite = 1;
+    }
+    if (rewrite) {
+        write_snapshot(s);
+    }
+
+    // The cache takes each program from them as it is first run,
+    // rather than all of them now
+    struct startup_programs *p = s->programs;
+    p->dir_names = malloc((p->num_dirs + 1)*sizeof(*p->dir_names));
+    for (int i = 0; i < p->num_dirs; i++) {
+        p->dir_names[i] = strdup(path[i]);
+    }
+    p->dir_names[p->num_dirs] = NULL;
+    free_startup_programs();
+    program_index = p;
+    set_program_index(find_program);
+
+    for (int i = 0; i < s->num_plans; i++) {
+        free_plan(&s->plans[i]);
+    }
+    free(s->plans);
+    free(s);
+}
+
+// Free the programs found for the executable cache
+void free_startup_programs(void) {
+    free_programs(program_index);
+    program_index = NULL;
+}
+
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Put the pathname of `file' in the home directory in `pathname'.
+// Returns 1 if there is no home directory or the name is too long
+static int startup_path(char *pathname, const char *file) {
+    char *home = getenv("HOME");
+    if (home == NULL ||
+        snprintf(pathname, MAX_RC_PATH_CHARS, "%s/%s", home, file) >=
+        MAX_RC_PATH_CHARS) {
+        return 1;
+    }
+    return 0;
+}
+
+// Read a whole file into memory, NUL-terminated, setting `*size' to
+// its length. Returns NULL if it cannot be read
+static char *read_file(const char *pathname, size_t *size) {
+    int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    char *data = malloc(st.st_size + 1);
+    size_t length = 0;
+    while (length < (size_t) st.st_size) {
+        ssize_t n = read(fd, data + length, st.st_size - length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+    }
+    close(fd);
+    data[length] = '\0';
+    *size = length;
+    return data;
+}
+
+// Split the startup file into commands, and compile each one. A
+// command left unfinished by a line is continued on the next, joined
+// as if separated by `;'
+static void compile_startup(struct startup *s, char *text,
+                            char **(*tokenize_line)(char *line)) {
+    char *pending = NULL;
+    char *line = text;
+    while (*line != '\0') {
+        char *newline = strchr(line, '\n');
+        char *next = newline != NULL ? newline + 1 : line + strlen(line);
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+
+        char *start = line + strspn(line, " \t");
+        if (*start == '\0' || *start == '#') {
+            line = next;
+            continue;
+        }
+        if (pending != NULL) {
+            char *joined = malloc(strlen(pending) + strlen(line) + 4);
+            sprintf(joined, "%s ; %s", pending, line);
+            free(pending);
+            pending = joined;
+        } else {
+            pending = strdup(line);
+        }
+
+        char **words = tokenize_line(pending);
+        int result = COMPILE_ERROR;
+        struct plan plan;
+        if (words != NULL) {
+            result = compile_line(words, &plan);
+            free_array(words);
+        }
+        if (result == COMPILE_OK) {
+            add_plan(s, &plan);
+        }
+        if (result != COMPILE_INCOMPLETE) {
+            free(pending);
+            pending = NULL;
+        }
+        line = next;
+    }
+    if (pending != NULL) {
+        fprintf(stderr, "%s: syntax error: unexpected end of file\n",
+                RC_FILE);
+        free(pending);
+    }
+}
+
+// Add a compiled command to the startup commands
+static void add_plan(struct startup *s, struct plan *plan) {
+    s->plans = realloc(s->plans, (s->num_plans + 1)*sizeof(*s->plans));
+    s->plans[s->num_plans++] = *plan;
+}
+
+// Load the commands and programs from the snapshot, if it was made
+// from the startup file as it is now. Returns 1 if it was
+static int read_snapshot(struct startup *s, const char *pathname) {
+    size_t size;
+    char *data = read_file(pathname, &size);
+    if (data == NULL) {
+        return 0;
+    }
+    struct cursor c = { .p = data, .end = data + size, .bad = 0 };
+    if (size < SNAPSHOT_MAGIC_CHARS ||
+        memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_CHARS) != 0) {
+        free(data);
+        return 0;
+    }
+    c.p += SNAPSHOT_MAGIC_CHARS;
+    if (get_int(&c) != s->rc_mtime.tv_sec ||
+        get_int(&c) != s->rc_mtime.tv_nsec || get_int(&c) != s->rc_size) {
+        free(data);
+        return 0;
+    }
+
+    long long num_plans = get_int(&c);
+    for (long long i = 0; i < num_plans && !c.bad; i++) {
+        struct plan plan;
+        get_plan(&c, &plan);
+        add_plan(s, &plan);
+    }
+
+    struct startup_programs *p = calloc(1, sizeof(*p));
+    p->path_value = get_string(&c);
+    p->num_dirs = get_int(&c);
+    if (!c.bad && p->num_dirs >= 0 &&
+        p->num_dirs <= (c.end - c.p) / (long) (2*sizeof(int64_t))) {
+        p->mtimes = calloc(p->num_dirs + 1, sizeof(*p->mtimes));
+        for (int i = 0; i < p->num_dirs; i++) {
+            p->mtimes[i].tv_sec = get_int(&c);
+            p->mtimes[i].tv_nsec = get_int(&c);
+        }
+    } else {
+        c.bad = 1;
+    }
+
+    // The programs' names are used where they are in the snapshot,
+    // each followed by its NUL
+    long long num = get_int(&c);
+    if (!c.bad && num >= 0 && num <= c.end - c.p) {
+        p->programs = malloc((num + 1)*sizeof(*p->programs));
+        p->capacity = num;
+        for (; p->num < num && !c.bad; p->num++) {
+            struct program *program = &p->programs[p->num];
+            program->dir = get_int(&c);
+            long long length = get_int(&c);
+            if (c.bad || program->dir < 0 || program->dir >= p->num_dirs ||
+                length < 0 || length >= c.end - c.p || c.p[length] != '\0') {
+                c.bad = 1;
+                break;
+            }
+            program->name = (char *) c.p;
+            c.p += length + 1;
+        }
+    } else {
+        c.bad = 1;
+    }
+    p->data = data;
+    s->programs = p;
+
+    if (c.bad || p->path_value == NULL) {
+        for (int i = 0; i < s->num_plans; i++) {
+            free_plan(&s->plans[i]);
+        }
+        free(s->plans);
+        s->plans = NULL;
+        s->num_plans = 0;
+        free_programs(s->programs);
+        s->programs = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Write the commands and programs to the snapshot. It is written to
+// a file of its own and renamed into place, so a shell starting at
+// the same time reads either the old snapshot or the new one
+static void write_snapshot(struct startup *s) {
+    char snapshot_name[MAX_RC_PATH_CHARS];
+    char temporary[MAX_RC_PATH_CHARS + 32];
+    if (startup_path(snapshot_name, RC_SNAPSHOT_FILE)) {
+        return;
+    }
+    snprintf(temporary, sizeof temporary, "%s.%d", snapshot_name,
+             (int) getpid());
+    FILE *f = fopen(temporary, "we");
+    if (f == NULL) {
+        return;
+    }
+
+    fwrite(SNAPSHOT_MAGIC, 1, SNAPSHOT_MAGIC_CHARS, f);
+    put_int(f, s->rc_mtime.tv_sec);
+    put_int(f, s->rc_mtime.tv_nsec);
+    put_int(f, s->rc_size);
+    put_int(f, s->num_plans);
+    for (int i = 0; i < s->num_plans; i++) {
+        put_plan(f, &s->plans[i]);
+    }
+
+    struct startup_programs *p = s->programs;
+    put_string(f, p->path_value);
+    put_int(f, p->num_dirs);
+    for (int i = 0; i < p->num_dirs; i++) {
+        put_int(f, p->mtimes[i].tv_sec);
+        put_int(f, p->mtimes[i].tv_nsec);
+    }
+    put_int(f, p->num);
+    for (int i = 0; i < p->num; i++) {
+        size_t length = strlen(p->programs[i].name);
+        put_int(f, p->programs[i].dir);
+        put_int(f, length);
+        fwrite(p->programs[i].name, 1, length + 1, f);
+    }
+
+    if (ferror(f) | fclose(f) || rename(temporary, snapshot_name) != 0) {
+        unlink(temporary);
+    }
+}
+
+// Find every program in the search path, taking the first of each
+// name, as `executable_path' would
+static struct startup_programs *find_programs(char *path_value,
+                                              char **path) {
+    struct startup_programs *p = calloc(1, sizeof(*p));
+    p->path_value = strdup(path_value != NULL ? path_value : "");
+    p->num_dirs = array_size(path);
+    p->mtimes = calloc(p->num_dirs + 1, sizeof(*p->mtimes));
+
+    // Each program is looked for in the directories before its own
+    // first, so it is only found once
+    struct table *found = table_new();
+    char pathname[MAX_PATHNAME_CHARS];
+    for (int i = 0; i < p->num_dirs; i++) {
+        // The time is taken before the directory is read, so that a
+        // program added while it is being read makes it out of date
+        get_mtime(path[i], &p->mtimes[i]);
+        DIR *dir = opendir(path[i]);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR ||
+                table_get(found, entry->d_name) != NULL ||
+                strlen(path[i]) + strlen(entry->d_name) + 2 >
+                MAX_PATHNAME_CHARS) {
+                continue;
+            }
+            get_pathname(pathname, entry->d_name, path[i]);
+            if (is_executable(pathname)) {
+                table_set(found, entry->d_name, (void *) (intptr_t) (i + 1));
+            }
+        }
+        closedir(dir);
+    }
+    table_foreach(found, add_program, p);
+    table_free(found, NULL);
+    qsort(p->programs, p->num, sizeof(*p->programs), compare_programs);
+    return p;
+}
+
+// Add a program found in the search path
+static void add_program(const char *name, void *value, void *ctx) {
+    struct startup_programs *p = ctx;
+    if (p->num == p->capacity) {
+        p->capacity = p->capacity == 0 ? 256 : 2*p->capacity;
+        p->programs = realloc(p->programs, 
+                              p->capacity*sizeof(*p->programs));
+    }
+    p->programs[p->num].name = strdup(name);
+    p->programs[p->num].dir = (int) (intptr_t) value - 1;
+    p->num++;
+}
+
+// Order programs by name
+static int compare_programs(const void *a, const void *b) {
+    const struct program *x = a;
+    const struct program *y = b;
+    return strcmp(x->name, y->name);
+}
+
+// Check if the programs were found in this search path, none of whose
+// directories has changed since
+static int programs_current(struct startup_programs *p, char *path_value,
+                            char **path) {
+    if (strcmp(p->path_value, path_value != NULL ? path_value : "") != 0 ||
+        p->num_dirs != array_size(path)) {
+        return 0;
+    }
+    for (int i = 0; i < p->num_dirs; i++) {
+        struct timespec mtime;
+        get_mtime(path[i], &mtime);
+        if (mtime.tv_sec != p->mtimes[i].tv_sec ||
+            mtime.tv_nsec != p->mtimes[i].tv_nsec) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Look a program up in the programs found for the executable cache,
+// setting `pathname' to where it is. Returns 1 if it was found
+static int find_program(const char *program, char *pathname) {
+    struct program key = { .name = (char *) program };
+    struct startup_programs *p = program_index;
+    struct program *found = bsearch(&key, p->programs, p->num, 
+                                    sizeof(*p->programs), compare_programs);
+    if (found == NULL) {
+        return 0;
+    }
+    char *dir = p->dir_names[found->dir];
+    if (strlen(dir) + strlen(found->name) + 2 > MAX_PATHNAME_CHARS) {
+        return 0;
+    }
+    get_pathname(pathname, found->name, dir);
+    return 1;
+}
+
+// Free the programs found in a search path
+static void free_programs(struct startup_programs *p) {
+    if (p == NULL) {
+        return;
+    }
+    for (int i = 0; p->data == NULL && i < p->num; i++) {
+        free(p->programs[i].name);
+    }
+    free(p->programs);
+    free(p->data);
+    free_array(p->dir_names);
+    free(p->mtimes);
+    free(p->path_value);
+    free(p);
+}
+
+// Get the modification time of a file, or -1 seconds if it has none
+static void get_mtime(const char *pathname, struct timespec *mtime) {
+    struct stat st;
+    if (stat(pathname, &st) == 0) {
+        *mtime = st.st_mtim;
+    } else {
+        mtime->tv_sec = -1;
+        mtime->tv_nsec = 0;
+    }
+}
+
+// Read a number from the snapshot
+static long long get_int(struct cursor *c) {
+    int64_t n;
+    if (c->bad || c->end - c->p < (long) sizeof(n)) {
+        c->bad = 1;
+        return -1;
+    }
+    memcpy(&n, c->p, sizeof(n));
+    c->p += sizeof(n);
+    return n;
+}
+
+// Read a string from the snapshot, which may be NULL
+static char *get_string(struct cursor *c) {
+    long long length = get_int(c);
+    if (c->bad || length < 0) {
+        return NULL;
+    }
+    if (length > c->end - c->p) {
+        c->bad = 1;
+        return NULL;
+    }
+    char *s = strndup(c->p, length);
+    c->p += length;
+    return s;
+}
+
+// Read a NULL-terminated array of words from the snapshot, which may
+// itself be NULL
+static char **get_words(struct cursor *c) {
+    long long n = get_int(c);
+    if (c->bad || n < 0) {
+        return NULL;
+    }
+    if (n > c->end - c->p) {
+        c->bad = 1;
+        return NULL;
+    }
+    char **words = malloc((n + 1)*sizeof(*words));
+    for (long long i = 0; i < n; i++) {
+        words[i] = get_string(c);
+        if (words[i] == NULL) {
+            words[i] = strdup("");
+            c->bad = 1;
+        }
+    }
+    words[n] = NULL;
+    return words;
+}
+
+// Read a plan from the snapshot. A plan that is cut short still has
+// every instruction it has so far, so that it can be freed
+static void get_plan(struct cursor *c, struct plan *plan) {
+    long long size = get_int(c);
+    plan->num_loops = get_int(c);
+    plan->refs = 0;
+    plan->size = 0;
+    plan->capacity = 0;
+    plan->code = NULL;
+    if (c->bad || size < 0 || size > c->end - c->p || 
+        plan->num_loops < 0 || plan->num_loops > size) {
+        plan->num_loops = 0;
+        c->bad = 1;
+        return;
+    }
+    plan->capacity = size;
+    plan->code = calloc(size + 1, sizeof(*plan->code));
+    for (; plan->size < size && !c->bad; plan->size++) {
+        struct instruction *in = &plan->code[plan->size];
+        in->op = get_int(c);
+        in->target = get_int(c);
+        in->slot = get_int(c);
+        in->value = get_int(c);
+        in->words = get_words(c);
+        in->name = get_string(c);
+        in->body = get_body(c);
+        long long num_groups = get_int(c);
+        if (c->bad || num_groups < 0 || num_groups > c->end - c->p) {
+            c->bad = 1;
+        } else if (num_groups > 0) {
+            in->groups = calloc(num_groups, sizeof(*in->groups));
+            for (long long i = 0; i < num_groups; i++) {
+                in->groups[i].subshell = get_int(c);
+                in->groups[i].body = get_body(c);
+            }
+            // The groups are freed by their number of stages
+            if (in->value != num_groups) {
+                in->value = num_groups;
+                c->bad = 1;
+            }
+        }
+        // Each instruction has what running it needs
+        int needs_words = in->op == OP_COMMAND || in->op == OP_ASSIGN ||
+                          in->op == OP_FOR_INIT || in->op == OP_PIPELINE;
+        int needs_name = in->op == OP_FOR_NEXT || in->op == OP_FUNCTION;
+        int needs_slot = in->op == OP_FOR_INIT || in->op == OP_FOR_NEXT;
+        if (in->op < 0 || in->op > OP_PIPELINE ||
+            in->target < 0 || in->target > size || in->slot < 0 || 
+            (needs_slot && in->slot >= plan->num_loops) ||
+            (needs_words && in->words == NULL) ||
+            (needs_name && in->name == NULL) ||
+            (in->op == OP_FUNCTION && in->body == NULL) ||
+            (in->op == OP_PIPELINE && 
+             (num_groups == 0 || num_groups != in->value))) {
+            c->bad = 1;
+        }
+    }
+}
+
+// Read a function or group body from the snapshot, which may be NULL
+static struct plan *get_body(struct cursor *c) {
+    if (get_int(c) != 1) {
+        return NULL;
+    }
+    struct plan *body = malloc(sizeof(*body));
+    get_plan(c, body);
+    body->refs = 1;
+    return body;
+}
+
+// Write a number to the snapshot
+static void put_int(FILE *f, long long n) {
+    int64_t value = n;
+    fwrite(&value, sizeof(value), 1, f);
+}
+
+// Write a string, which may be NULL, to the snapshot
+static void put_string(FILE *f, const char *s) {
+    if (s == NULL) {
+        put_int(f, -1);
+        return;
+    }
+    size_t length = strlen(s);
+    put_int(f, length);
+    fwrite(s, 1, length, f);
+}
+
+// Write an array of words, which may be NULL, to the snapshot
+static void put_words(FILE *f, char **words) {
+    if (words == NULL) {
+        put_int(f, -1);
+        return;
+    }
+    put_int(f, array_size(words));
+    for (int i = 0; words[i] != NULL; i++) {
+        put_string(f, words[i]);
+    }
+}
+
+// Write a plan to the snapshot
+static void put_plan(FILE *f, struct plan *plan) {
+    put_int(f, plan->size);
+    put_int(f, plan->num_loops);
+    for (int i = 0; i < plan->size; i++) {
+        struct instruction *in = &plan->code[i];
+        put_int(f, in->op);
+        put_int(f, in->target);
+        put_int(f, in->slot);
+        put_int(f, in->value);
+        put_words(f, in->words);
+        put_string(f, in->name);
+        put_body(f, in->body);
+        int num_groups = in->groups != NULL ? in->value : 0;
+        put_int(f, num_groups);
+        for (int j = 0; j < num_groups; j++) {
+            put_int(f, in->groups[j].subshell);
+            put_body(f, in->groups[j].body);
+        }
+    }
+}
+
+// Write a function or group body, which may be NULL, to the snapshot
+static void put_body(FILE *f, struct plan *body) {
+    if (body == NULL) {
+        put_int(f, 0);
+        return;
+    }
+    put_int(f, 1);
+    put_plan(f, body);
+}
@@ -0,0 +1,59 @@
+// The startup file, `~/.shuckrc': command lines run when an
+// interactive (or scripted) shell starts, before its first prompt,
+// typically defining functions and setting variables such as `$PATH'.
+// Blank lines and lines starting with `#' are skipped, and a command
+// may be continued over several lines, as at the prompt.
+//
+// Lexing and compiling the file, and searching `$PATH' for programs,
+// is most of the work of starting the shell, so it is done once and
+// kept in a binary snapshot, `~/.shuckrc.snap': the compiled plans of
+// the file's commands, and every program in `$PATH' with where it was
+// found, to fill the executable cache (shuck_helper.h) with. The
+// snapshot is used while the file's modification time and size are
+// the ones it was made from, and rebuilt otherwise. Its programs are
+// only used if `$PATH' is the one they were found in and none of its
+// directories has changed since; if not, they are found again and the
+// snapshot is rewritten.
+
+#ifndef SHUCK_RC_H
+#define SHUCK_RC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shuck_compile.h"
+
+#define RC_FILE ".shuckrc"
+#define RC_SNAPSHOT_FILE ".shuckrc.snap"
+
+// The commands of the startup file, compiled
+struct startup {
+    struct plan *plans;
+    int num_plans;
+    // Whether they came from the snapshot
+    int from_snapshot;
+    // The startup file as it was when they were loaded
+    struct timespec rc_mtime;
+    long long rc_size;
+    // The snapshot's programs and the `$PATH' they were found in
+    struct startup_programs *programs;
+};
+
+// Load the commands of `~/.shuckrc' from its snapshot, or compile
+// them with `tokenize_line' if the snapshot is missing or out of
+// date. Returns NULL if there is no startup file. A command with a
+// syntax error is reported and left out
+struct startup *load_startup(char **(*tokenize_line)(char *line));
+
+// Once the commands have run: fill the executable cache for the
+// search path `path', whose value is `path_value', from the snapshot
+// if it still holds, else by searching it, rewriting the snapshot.
+// Frees the startup commands
+void finish_startup(struct startup *s, char *path_value, char **path);
+
+// Free the programs `finish_startup' filled the executable cache from
+void free_startup_programs(void);
+
+#endif
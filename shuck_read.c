@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shuck_read.h"
+#include "shuck_builtins.h"
+#include "shuck_vars.h"
+
+// A line being read
+struct line {
+    char *data;
+    size_t length;
+    size_t size;
+};
+
+// What has been read of the shell's standard input into the shell's
+// buffer, from `start' up to `end', of which the file's offset is at
+// the end. Only a thread running a group in the shell uses it
+struct read_buffer {
+    char *data;
+    size_t start;
+    size_t end;
+};
+
+static struct read_buffer buffer = { NULL, 0, 0 };
+
+// The pipe a pipe being read is peeked at through, kept for the next
+// `read' while nothing is left in it. A thread that finds it in use
+// makes its own
+static int peek_pipe[2] = { -1, -1 };
+static pthread_mutex_t peek_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper functions
+static int read_shell_input(struct line *line);
+static int read_buffered(int fd, struct line *line);
+static int read_seekable(int fd, struct line *line);
+static int read_pipe(int fd, struct line *line);
+static int read_blocks(int fd, struct line *line);
+static int read_bytes(int fd, struct line *line);
+static void append(struct line *line, const char *data, size_t n);
+static void assign_fields(char **names, char *line);
+static int is_name(char *word);
+
+
+// FUNCTIONS FOR SHUCK_READ
+
+// Read a line into variables
+int run_read(char **words) {
+    int i = 1;
+    while (words[i] != NULL && !strcmp(words[i], "-r")) {
+        i++;
+    }
+    char *reply[] = { "REPLY", NULL };
+    char **names = words[i] != NULL ? &words[i] : reply;
+    for (int j = 0; names[j] != NULL; j++) {
+        if (!is_name(names[j])) {
+            fprintf(stderr, "read: `%s': not a valid name\n", names[j]);
+            return 2;
+        }
+    }
+
+    struct line line = { NULL, 0, 0 };
+    int fd = builtin_stdin();
+    int found;
+    if (builtin_reads_shell_input()) {
+        found = read_shell_input(&line);
+    } else if (fd == STDIN_FILENO) {
+        // Only a group run in the shell has its own standard input
+        // redirected, and then it is the shell's to buffer
+        found = read_buffered(fd, &line);
+    } else {
+        found = read_seekable(fd, &line);
+    }
+    if (found == -1) {
+        free(line.data);
+        return 1;
+    }
+
+    // `read's that are stages of one pipeline run on threads of their
+    // own, and the shell's variables are not made to be set by several
+    // at once
+    append(&line, "", 1);
+    lock_vars();
+    assign_fields(names, line.data);
+    unlock_vars();
+    free(line.data);
+    return found ? 0 : 1;
+}
+
+// Give back what the buffer has not used
+void release_read_buffer(void) {
+    if (buffer.end > buffer.start) {
+        lseek(STDIN_FILENO, -(off_t) (buffer.end - buffer.start), SEEK_CUR);
+    }
+    buffer.start = buffer.end = 0;
+}
+
+// Free the buffer
+void free_read_buffer(void) {
+    release_read_buffer();
+    free(buffer.data);
+    buffer.data = NULL;
+    if (peek_pipe[0] != -1) {
+        close(peek_pipe[0]);
+        close(peek_pipe[1]);
+        peek_pipe[0] = peek_pipe[1] = -1;
+    }
+}
+
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Each of these reads a line, without its newline, returning 1 if it
+// ended with a newline, 0 at the end of the input, or -1 (having
+// printed an error) if the input could not be read
+
+// Read a line of the shell's own input, from the buffer the shell
+// reads its commands through
+static int read_shell_input(struct line *line) {
+    char *data = NULL;
+    size_t size = 0;
+    ssize_t n = getline(&data, &size, stdin);
+    if (n == -1) {
+        free(data);
+        return 0;
+    }
+    int found = data[n-1] == '\n';
+    append(line, data, found ? n-1 : n);
+    free(data);
+    return found;
+}
+
+// Read a line through the shell's buffer, if the input is a regular
+// file and so can be given back
+static int read_buffered(int fd, struct line *line) {
+    while (1) {
+        char *start = buffer.data + buffer.start;
+        char *newline = buffer.end > buffer.start ?
+                        memchr(start, '\n', buffer.end - buffer.start) :
+                        NULL;
+        if (newline != NULL) {
+            append(line, start, newline - start);
+            buffer.start += newline - start + 1;
+            return 1;
+        }
+        append(line, start, buffer.end - buffer.start);
+        buffer.start = buffer.end = 0;
+
+        // The input may be something else since the buffer was last
+        // filled, so it is only kept for a regular file
+        struct stat s;
+        if (fstat(fd, &s) == -1 || !S_ISREG(s.st_mode)) {
+            return read_seekable(fd, line);
+        }
+        if (buffer.data == NULL) {
+            buffer.data = malloc(READ_BLOCK_SIZE);
+        }
+        ssize_t n = read(fd, buffer.data, READ_BLOCK_SIZE);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        buffer.end = n;
+    }
+}
+
+// Read a line of input the shell does not buffer, by seeking back if
+// it can be, or else whichever way takes none of the next line
+static int read_seekable(int fd, struct line *line) {
+    struct stat s;
+    if (fstat(fd, &s) == -1) {
+        perror("read");
+        return -1;
+    }
+    if (S_ISFIFO(s.st_mode)) {
+        return read_pipe(fd, line);
+    }
+    if (!S_ISREG(s.st_mode)) {
+        return isatty(fd) ? read_blocks(fd, line) : read_bytes(fd, line);
+    }
+
+    char data[READ_AHEAD_SIZE];
+    while (1) {
+        ssize_t n = read(fd, data, sizeof(data));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        char *newline = memchr(data, '\n', n);
+        if (newline != NULL) {
+            append(line, data, newline - data);
+            lseek(fd, -(off_t) (n - (newline - data + 1)), SEEK_CUR);
+            return 1;
+        }
+        append(line, data, n);
+    }
+}
+
+// Read a line of a pipe: a block of what is in it is copied into a
+// pipe of the shell's with tee(2), leaving it in the pipe, and then
+// only as much as the line is read
+static int read_pipe(int fd, struct line *line) {
+    int peek[2];
+    int cached = pthread_mutex_trylock(&peek_lock) == 0;
+    if (cached && peek_pipe[0] == -1 && 
+        pipe2(peek_pipe, O_CLOEXEC) == -1) {
+        pthread_mutex_unlock(&peek_lock);
+        cached = 0;
+    }
+    if (cached) {
+        peek[0] = peek_pipe[0];
+        peek[1] = peek_pipe[1];
+    } else if (pipe2(peek, O_CLOEXEC) == -1) {
+        return read_bytes(fd, line);
+    }
+
+    char data[READ_AHEAD_SIZE];
+    int found = -1;
+    int clean = 1;
+    while (found == -1) {
+        ssize_t n = tee(fd, peek[1], sizeof(data), 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            // Not a pipe tee(2) can read after all
+            found = read_bytes(fd, line);
+            break;
+        }
+        if (n == 0) {
+            found = 0;
+            break;
+        }
+
+        // Everything copied is read back, so the pipe is empty for the
+        // next copy
+        ssize_t copied = 0;
+        while (copied < n) {
+            ssize_t m = read(peek[0], data + copied, n - copied);
+            if (m == -1 && errno == EINTR) continue;
+            if (m <= 0) break;
+            copied += m;
+        }
+        clean = copied == n;
+        char *newline = memchr(data, '\n', copied);
+        size_t wanted = newline != NULL ? newline - data + 1 : copied;
+
+        // Now take the line out of the input itself
+        size_t taken = 0;
+        while (taken < wanted) {
+            ssize_t m = read(fd, data + taken, wanted - taken);
+            if (m == -1 && errno == EINTR) continue;
+            if (m <= 0) break;
+            taken += m;
+        }
+        if (taken < wanted || !clean) {
+            append(line, data, taken);
+            found = 0;
+        } else if (newline != NULL) {
+            append(line, data, wanted - 1);
+            found = 1;
+        } else {
+            append(line, data, wanted);
+        }
+    }
+
+    if (cached && clean) {
+        pthread_mutex_unlock(&peek_lock);
+        return found;
+    }
+    close(peek[0]);
+    close(peek[1]);
+    if (cached) {
+        peek_pipe[0] = peek_pipe[1] = -1;
+        pthread_mutex_unlock(&peek_lock);
+    }
+    return found;
+}
+
+// Read a line of a terminal, a whole read(2) at a time
+static int read_blocks(int fd, struct line *line) {
+    char data[READ_AHEAD_SIZE];
+    while (1) {
+        ssize_t n = read(fd, data, sizeof(data));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (data[n-1] == '\n') {
+            append(line, data, n-1);
+            return 1;
+        }
+        append(line, data, n);
+    }
+}
+
+// Read a line a byte at a time, so that nothing after it is taken
+static int read_bytes(int fd, struct line *line) {
+    while (1) {
+        char c;
+        ssize_t n = read(fd, &c, 1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (c == '\n') {
+            return 1;
+        }
+        append(line, &c, 1);
+    }
+}
+
+// Add bytes to the end of a line
+static void append(struct line *line, const char *data, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (line->length + n > line->size) {
+        line->size = line->size > 0 ? line->size : 128;
+        while (line->length + n > line->size) {
+            line->size *= 2;
+        }
+        line->data = realloc(line->data, line->size);
+    }
+    memcpy(line->data + line->length, data, n);
+    line->length += n;
+}
+
+// Set each variable to a field of the line, split at spaces and tabs,
+// the last one to the rest of the line, and those there are no fields
+// for to nothing
+static void assign_fields(char **names, char *line) {
+    char *p = line + strspn(line, " \t");
+    for (int i = 0; names[i] != NULL; i++) {
+        char *end;
+        if (names[i+1] == NULL) {
+            end = p + strlen(p);
+            while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+                end--;
+            }
+        } else {
+            end = p + strcspn(p, " \t");
+        }
+        char *next = end + strspn(end, " \t");
+        *end = '\0';
+        set_var(names[i], p);
+        p = next;
+    }
+}
+
+// Check if word can be the name of a variable
+static int is_name(char *word) {
+    char *assignment = malloc(strlen(word) + 2);
+    sprintf(assignment, "%s=", word);
+    int valid = strchr(word, '=') == NULL && is_assignment(assignment);
+    free(assignment);
+    return valid;
+}
@@ -0,0 +1,59 @@
+// The `read' builtin: read a line of input into variables, a line at
+// a time, without taking any input that a command run after it should
+// get.
+//
+//     read [-r] [NAME...]
+//
+// How the line is read depends on what the input is:
+//  - The shell's own input, from which it reads its commands, is read
+//    through the same stdio buffer, so `read' takes the next line of
+//    a script or the terminal.
+//  - A regular file redirected to a group run in the shell, as in
+//    `< big.log { while read line; do ...; done; }', is read in large
+//    blocks into a buffer of the shell's, which later `read's take
+//    their lines from. Before anything else that might read the file
+//    runs, the shell gives back what it has not used by seeking back
+//    (`release_read_buffer'), so the file's offset is where the next
+//    line starts.
+//  - Any other regular file is read a block at a time, seeking back
+//    to the end of the line straight away.
+//  - A pipe is peeked at with tee(2), which copies what is in it
+//    without using it up, and then exactly the line is read from it,
+//    so a program sharing the pipe gets the rest.
+//  - A terminal returns at most a line per read(2) anyway; anything
+//    else is read a byte at a time.
+//
+// The line, without its newline, is split at spaces and tabs into
+// one field per NAME, the last NAME getting the rest of the line;
+// with no NAME it goes into `$REPLY'. Backslashes are not special, as
+// with `-r', which is accepted for scripts written for other shells.
+
+#ifndef SHUCK_READ_H
+#define SHUCK_READ_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes read at once into the shell's buffer
+#define READ_BLOCK_SIZE 65536
+// Bytes read at once from a file that is not buffered, which are
+// mostly given back, and peeked at a time from a pipe
+#define READ_AHEAD_SIZE 4096
+
+// Read a line from `builtin_stdin' (shuck_builtins.h) into the
+// variables given by `words', which start with `read'. Returns 0, 1 at
+// the end of the input (having set the variables to what there was of
+// a last line without a newline), or 2 (having printed an error) if
+// the words are not a valid `read'
+int run_read(char **words);
+
+// Give back what `read' has taken from the shell's standard input
+// into its buffer and not used, before a command that may read the
+// same input runs, or the input is changed
+void release_read_buffer(void);
+
+// Free the buffer, as the shell exits
+void free_read_buffer(void);
+
+#endif
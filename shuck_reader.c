@@ -0,0 +1,212 @@
+#include <unistd.h>
+
+#include "shuck_reader.h"
+#include "shuck_glob.h"
+
+// Size of each block read from the input
+#define READ_BLOCK_SIZE (1024 * 1024)
+#define MAX_PATHNAME_CHARS 4096
+
+struct reader {
+    int fd;
+    char **(*tokenize_line)(char *line);
+    char *path_value;
+    char **path;
+
+    // Lines that have been read ahead, in a ring buffer
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct reader_line **lines;
+    int ahead;
+    int head;
+    int count;
+    int finished;
+
+    pthread_t thread;
+    int started;
+};
+
+// Helper functions
+static void *read_lines(void *arg);
+static void add_line(struct reader *r, char *line, size_t length);
+static void resolve_program(struct reader *r, struct reader_line *l);
+static char **split_path(char *path_value);
+
+
+// Start the reader thread
+struct reader *start_reader(int fd, int ahead, 
+                            char **(*tokenize_line)(char *line), 
+                            char *path_value) {
+    struct reader *r = calloc(1, sizeof(*r));
+    r->fd = fd;
+    r->tokenize_line = tokenize_line;
+    r->path_value = strdup(path_value);
+    r->path = split_path(r->path_value);
+    r->ahead = ahead > 0 ? ahead : 1;
+    r->lines = malloc(r->ahead*sizeof(*r->lines));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+
+    if (pthread_create(&r->thread, NULL, read_lines, r) != 0) {
+        perror("pthread_create");
+        r->finished = 1;
+    } else {
+        r->started = 1;
+    }
+    return r;
+}
+
+// Take the next line
+struct reader_line *next_line(struct reader *r) {
+    pthread_mutex_lock(&r->lock);
+    while (r->count == 0 && !r->finished) {
+        pthread_cond_wait(&r->not_empty, &r->lock);
+    }
+    struct reader_line *l = NULL;
+    if (r->count > 0) {
+        l = r->lines[r->head];
+        r->head = (r->head + 1) % r->ahead;
+        r->count--;
+        pthread_cond_signal(&r->not_full);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return l;
+}
+
+// Free a line
+void free_reader_line(struct reader_line *l) {
+    if (l == NULL) return;
+    free(l->line);
+    free_array(l->words);
+    free(l->program);
+    free(l->pathname);
+    free(l);
+}
+
+// Free the reader after the end of its input
+void free_reader(struct reader *r) {
+    if (r == NULL) return;
+    if (r->started) {
+        pthread_join(r->thread, NULL);
+    }
+    for (int i = 0; i < r->count; i++) {
+        free_reader_line(r->lines[(r->head + i) % r->ahead]);
+    }
+    free(r->lines);
+    free_array(r->path);
+    free(r->path_value);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+    free(r);
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Body of the reader thread: read blocks and split them into lines
+static void *read_lines(void *arg) {
+    struct reader *r = arg;
+    char *block = malloc(READ_BLOCK_SIZE);
+    // Part of a line left at the end of the previous block
+    char *partial = NULL;
+    size_t partial_length = 0;
+
+    ssize_t n;
+    while ((n = read(r->fd, block, READ_BLOCK_SIZE)) > 0) {
+        char *start = block;
+        char *end = block + n;
+        char *newline;
+        while ((newline = memchr(start, '\n', end - start)) != NULL) {
+            size_t length = newline + 1 - start;
+            if (partial != NULL) {
+                partial = realloc(partial, partial_length + length);
+                memcpy(partial + partial_length, start, length);
+                add_line(r, partial, partial_length + length);
+                free(partial);
+                partial = NULL;
+                partial_length = 0;
+            } else {
+                add_line(r, start, length);
+            }
+            start = newline + 1;
+        }
+        if (start < end) {
+            partial = realloc(partial, partial_length + (end - start));
+            memcpy(partial + partial_length, start, end - start);
+            partial_length += end - start;
+        }
+    }
+    // A last line without a newline
+    if (partial != NULL) {
+        add_line(r, partial, partial_length);
+        free(partial);
+    }
+    free(block);
+
+    pthread_mutex_lock(&r->lock);
+    r->finished = 1;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Tokenize a line and queue it, waiting if enough lines are queued
+static void add_line(struct reader *r, char *line, size_t length) {
+    struct reader_line *l = calloc(1, sizeof(*l));
+    l->line = strndup(line, length);
+    l->words = r->tokenize_line(l->line);
+    l->path_value = r->path_value;
+    resolve_program(r, l);
+
+    pthread_mutex_lock(&r->lock);
+    while (r->count == r->ahead) {
+        pthread_cond_wait(&r->not_full, &r->lock);
+    }
+    r->lines[(r->head + r->count) % r->ahead] = l;
+    r->count++;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Look up the program of a plain command in the search path. Words
+// that need expanding depend on commands that have not run yet, so
+// they are left for the shell to look up itself, as are quoted ones
+static void resolve_program(struct reader *r, struct reader_line *l) {
+    if (l->words == NULL) {
+        return;
+    }
+    char *program = l->words[0];
+    if (program == NULL || strpbrk(program, "/$='\"\\") != NULL ||
+        is_glob_pattern(program)) {
+        return;
+    }
+    char pathname[MAX_PATHNAME_CHARS];
+    for (int i = 0; r->path[i] != NULL; i++) {
+        if (strlen(r->path[i]) + strlen(program) + 2 > sizeof pathname) {
+            continue;
+        }
+        get_pathname(pathname, program, r->path[i]);
+        if (is_executable(pathname)) {
+            l->program = strdup(program);
+            l->pathname = strdup(pathname);
+            return;
+        }
+    }
+}
+
+// Split `$PATH' into its directories
+static char **split_path(char *path_value) {
+    char *copy = strdup(path_value);
+    char **path = malloc((strlen(path_value)/2 + 2)*sizeof(*path));
+    int n = 0;
+    char *saveptr;
+    for (char *dir = strtok_r(copy, ":", &saveptr); dir != NULL; 
+         dir = strtok_r(NULL, ":", &saveptr)) {
+        path[n++] = strdup(dir);
+    }
+    path[n] = NULL;
+    free(copy);
+    return path;
+}
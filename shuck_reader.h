@@ -0,0 +1,48 @@
+// Read-ahead of commands for batch mode (`shuck --batch'). A reader
+// thread reads the shell's input in large blocks, and splits and
+// tokenizes the next few lines, looking up their programs in the
+// search path, while the current command runs.
+
+#ifndef SHUCK_READER_H
+#define SHUCK_READER_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shuck_helper.h"
+
+// A line read ahead of time
+struct reader_line {
+    // The line itself, including its newline
+    char *line;
+    // The words of the line, as tokenized by the reader
+    char **words;
+    // The line's program and where it was found in the search path,
+    // if it was found
+    char *program;
+    char *pathname;
+    // The `$PATH' the program was looked up in
+    char *path_value;
+};
+
+struct reader;
+
+// Start reading lines from fd on another thread, keeping up to
+// `ahead' lines tokenized and waiting. `tokenize_line' splits a line
+// into words, and `path_value' is the `$PATH' to look programs up in
+struct reader *start_reader(int fd, int ahead, 
+                            char **(*tokenize_line)(char *line), 
+                            char *path_value);
+
+// Wait for the next line, returning NULL at the end of input
+struct reader_line *next_line(struct reader *r);
+
+// Free a line returned by `next_line'
+void free_reader_line(struct reader_line *l);
+
+// Free a reader once `next_line' has returned NULL, waiting for its
+// thread to finish
+void free_reader(struct reader *r);
+
+#endif
@@ -0,0 +1,665 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shuck_replay.h"
+#include "shuck_builtins.h"
+#include "shuck_history.h"
+#include "shuck_io.h"
+#include "shuck_mem.h"
+#include "shuck_profile.h"
+#include "shuck_spawner.h"
+
+#define MAX_PATH_CHARS 1024
+#define MAX_SANDBOX_CHARS 512
+#define DEFAULT_RUNS 5
+#define DEFAULT_TOP 10
+#define MAX_OPEN_FDS 16
+#define SOAK_SAMPLES 20
+
+extern char **environ;
+
+// A line to replay, the programs it runs, and the time it took
+// through the shell and as bare spawns in each run. A line the shell
+// failed on did not run all its programs (the stubs never fail), so
+// it cannot be compared with spawning them
+struct replay_line {
+    char *text;
+    char **programs;
+    int num_programs;
+    long long *shell_ns;
+    long long *spawn_ns;
+    int failed;
+    // The median of its runs' overheads, in microseconds
+    double overhead_us;
+};
+
+// Memory use after some number of commands of a soak test
+struct soak_sample {
+    long long commands;
+    long rss_kb;
+    struct mem_stats memory;
+};
+
+struct replay {
+    struct replay_line *lines;
+    int num_lines;
+    int skipped;
+    int runs;
+    int top;
+    long long soak;
+    long ballast_mb;
+    struct soak_sample samples[SOAK_SAMPLES + 1];
+    int num_samples;
+    char sandbox[MAX_SANDBOX_CHARS];
+    char bin[MAX_SANDBOX_CHARS + 4];
+};
+
+// Words after which a new command, and so a program, starts
+static char *const COMMAND_STARTS[] = {
+    "|", ";", "&&", "||", "&", "if", "then", "else", "elif", "while",
+    "until", "do", "(", "{", NULL
+};
+
+// Reserved words that are first in a command but are not programs
+static char *const RESERVED_WORDS[] = {
+    "for", "done", "fi", "}", "return", NULL
+};
+
+// Lines that fail in different ways, mixed into a soak test so that
+// the shell's error paths are run as often as the rest
+static char *const FAILING_LINES[] = {
+    "shuck-replay-no-such-program",
+    "< shuck-replay-no-such-file cat",
+    "echo x > shuck-replay-no-such-dir/out",
+    "ls | shuck-replay-no-such-program",
+    "cd shuck-replay-no-such-dir",
+    "x=$((1/0))",
+    "fi",
+    NULL
+};
+
+// Builtins that would leave the shell or run other input
+static char *const UNSAFE_BUILTINS[] = {
+    "exit", "!", "batch", "enable", NULL
+};
+
+// Helper functions
+static int parse_replay_args(char **args, struct replay *r, char **file);
+static int load_lines(struct replay *r, char *file,
+                      char **(*tokenize_line)(char *));
+static int is_safe(char **words);
+static void find_programs(struct replay_line *line, char **words);
+static int is_program_name(char *word);
+static int in_list(char *word, char *const list[]);
+static int make_sandbox(struct replay *r);
+static char *find_stub_target(void);
+static void run_shell(struct replay *r, void (*run_line)(char *));
+static void run_spawns(struct replay *r);
+static void run_soak(struct replay *r, void (*run_line)(char *));
+static void take_sample(struct replay *r, long long commands);
+static void report(struct replay *r, FILE *out);
+static int report_soak(struct replay *r, FILE *out);
+static void overhead_range(struct replay *r, struct replay_line **lines,
+                           int n, double range[3]);
+static int compare_overhead(const void *a, const void *b);
+static int compare_double(const void *a, const void *b);
+static long long now_ns(void);
+static int remove_entry(const char *path, const struct stat *s, int type,
+                        struct FTW *ftw);
+static void free_replay(struct replay *r);
+
+
+// Replay a file of command lines
+int replay_history(char **args, char **(*tokenize_line)(char *),
+                   void (*run_line)(char *)) {
+    struct replay r = { .runs = DEFAULT_RUNS, .top = DEFAULT_TOP };
+    char *file = NULL;
+    if (!parse_replay_args(args, &r, &file)) {
+        fprintf(stderr, "usage: shuck-replay FILE [--runs=N] [--top=N] "
+                "[--soak=N] [--ballast=MiB]\n");
+        return 2;
+    }
+    if (!load_lines(&r, file, tokenize_line)) {
+        free_replay(&r);
+        return 1;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (!make_sandbox(&r)) {
+        free(cwd);
+        free_replay(&r);
+        return 1;
+    }
+
+    // Memory the shell holds and touches, standing in for the caches
+    // of a shell that has been running for a long time
+    char *ballast = NULL;
+    if (r.ballast_mb > 0) {
+        ballast = malloc(r.ballast_mb * 1024 * 1024);
+        if (ballast != NULL) {
+            memset(ballast, 1, r.ballast_mb * 1024 * 1024);
+        }
+    }
+
+    // The commands' output, and the shell's, is thrown away; the
+    // report goes to the original standard output
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    int err = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+
+    if (r.soak > 0) {
+        run_soak(&r, run_line);
+    } else {
+        run_shell(&r, run_line);
+        run_spawns(&r);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(err, STDERR_FILENO);
+    dup2(out, STDOUT_FILENO);
+    close(err);
+    close(out);
+
+    int status = 0;
+    if (r.soak > 0) {
+        status = report_soak(&r, stdout);
+    } else {
+        report(&r, stdout);
+    }
+    fflush(stdout);
+
+    if (cwd == NULL || chdir(cwd) != 0) {
+        perror("chdir");
+    }
+    nftw(r.sandbox, remove_entry, MAX_OPEN_FDS, FTW_DEPTH|FTW_PHYS);
+    free(ballast);
+    free(cwd);
+    free_replay(&r);
+    return status;
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+static int parse_replay_args(char **args, struct replay *r, char **file) {
+    for (int i = 0; args[i] != NULL; i++) {
+        if (!strncmp(args[i], "--runs=", 7) && atoi(args[i] + 7) > 0) {
+            r->runs = atoi(args[i] + 7);
+        } else if (!strncmp(args[i], "--top=", 6) && atoi(args[i] + 6) >= 0) {
+            r->top = atoi(args[i] + 6);
+        } else if (!strncmp(args[i], "--soak=", 7) && atoll(args[i] + 7) > 0) {
+            r->soak = atoll(args[i] + 7);
+        } else if (!strncmp(args[i], "--ballast=", 10) && 
+                   atol(args[i] + 10) > 0) {
+            r->ballast_mb = atol(args[i] + 10);
+        } else if (*file == NULL && args[i][0] != '-') {
+            *file = args[i];
+        } else {
+            return 0;
+        }
+    }
+    return *file != NULL;
+}
+
+// Read the lines to replay, leaving out the stats lines of a history
+// file and any line that could reach outside the sandbox
+static int load_lines(struct replay *r, char *file,
+                      char **(*tokenize_line)(char *)) {
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        perror(file);
+        return 0;
+    }
+
+    char *text = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&text, &size, f)) > 0) {
+        if (text[length-1] == '\n') text[length-1] = '\0';
+        if (is_history_stats(text)) {
+            continue;
+        }
+        char **words = tokenize_line(text);
+        if (words == NULL) {
+            r->skipped++;
+            continue;
+        }
+        if (words[0] == NULL) {
+            free_array(words);
+            continue;
+        }
+        if (!is_safe(words)) {
+            r->skipped++;
+            free_array(words);
+            continue;
+        }
+
+        r->lines = realloc(r->lines, (r->num_lines + 1)*sizeof(*r->lines));
+        struct replay_line *line = &r->lines[r->num_lines++];
+        memset(line, 0, sizeof(*line));
+        line->text = strdup(text);
+        line->shell_ns = calloc(r->runs, sizeof(*line->shell_ns));
+        line->spawn_ns = calloc(r->runs, sizeof(*line->spawn_ns));
+        find_programs(line, words);
+        free_array(words);
+    }
+    free(text);
+    fclose(f);
+
+    if (r->num_lines == 0) {
+        fprintf(stderr, "%s: no lines to replay\n", file);
+        return 0;
+    }
+    return 1;
+}
+
+static int is_safe(char **words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        // Quotes in front of an absolute path still leave it absolute
+        if (words[i][strspn(words[i], "'\"\\")] == '/' || 
+            strchr(words[i], '~') != NULL ||
+            strstr(words[i], "..") != NULL ||
+            in_list(words[i], UNSAFE_BUILTINS)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Find the programs the line runs: the first word of each command,
+// after any input redirection. Builtins are not programs
+static void find_programs(struct replay_line *line, char **words) {
+    int start = 1;
+    for (int i = 0; words[i] != NULL; i++) {
+        if (in_list(words[i], COMMAND_STARTS)) {
+            start = 1;
+            continue;
+        }
+        if (!start) {
+            continue;
+        }
+        if (!strcmp(words[i], "<")) {
+            if (words[i+1] != NULL) i++;
+            continue;
+        }
+        start = 0;
+        if (is_program_name(words[i]) && !in_list(words[i], RESERVED_WORDS) &&
+            find_builtin(words[i]) == NULL) {
+            line->programs = realloc(line->programs,
+                (line->num_programs + 1)*sizeof(*line->programs));
+            line->programs[line->num_programs++] = strdup(words[i]);
+        }
+    }
+}
+
+// Check if a word can name a stub in the sandbox
+static int is_program_name(char *word) {
+    if (word[0] == '.' || word[0] == '-') {
+        return 0;
+    }
+    for (int i = 0; word[i] != '\0'; i++) {
+        if (!isalnum((unsigned char) word[i]) &&
+            strchr("._+-", word[i]) == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int in_list(char *word, char *const list[]) {
+    for (int i = 0; list[i] != NULL; i++) {
+        if (!strcmp(word, list[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Make the sandbox directory, with a stub for every program the lines
+// run, and make it the shell's current directory, `$HOME' and `$PATH'
+static int make_sandbox(struct replay *r) {
+    char *target = find_stub_target();
+    if (target == NULL) {
+        fprintf(stderr, "shuck-replay: no `true' program to use as a stub\n");
+        return 0;
+    }
+
+    char *tmp = getenv("TMPDIR");
+    snprintf(r->sandbox, sizeof(r->sandbox), "%s/shuck-replay.XXXXXX",
+             tmp != NULL ? tmp : "/tmp");
+    if (mkdtemp(r->sandbox) == NULL) {
+        perror("mkdtemp");
+        free(target);
+        return 0;
+    }
+    snprintf(r->bin, sizeof(r->bin), "%s/bin", r->sandbox);
+    mkdir(r->bin, 0755);
+
+    for (int i = 0; i < r->num_lines; i++) {
+        for (int j = 0; j < r->lines[i].num_programs; j++) {
+            char stub[MAX_PATH_CHARS];
+            snprintf(stub, sizeof(stub), "%s/%s", r->bin,
+                     r->lines[i].programs[j]);
+            // Programs run by more than one line already have a stub
+            symlink(target, stub);
+        }
+    }
+    free(target);
+
+    setenv("PATH", r->bin, 1);
+    setenv("HOME", r->sandbox, 1);
+    if (chdir(r->sandbox) != 0) {
+        perror(r->sandbox);
+        return 0;
+    }
+    return 1;
+}
+
+// Find `true' in `$PATH', to link the stubs to
+static char *find_stub_target(void) {
+    char *path = getenv("PATH");
+    char *dirs = strdup(path != NULL ? path : "/bin:/usr/bin");
+    char *found = NULL;
+    for (char *dir = strtok(dirs, ":"); dir != NULL && found == NULL;
+         dir = strtok(NULL, ":")) {
+        char pathname[MAX_PATH_CHARS];
+        snprintf(pathname, sizeof(pathname), "%s/true", dir);
+        if (access(pathname, X_OK) == 0) {
+            found = strdup(pathname);
+        }
+    }
+    free(dirs);
+    return found;
+}
+
+// Run every line through the shell, timing each phase, and noting
+// the lines the shell failed on
+static void run_shell(struct replay *r, void (*run_line)(char *)) {
+    profile_enable(1);
+    for (int run = 0; run < r->runs; run++) {
+        for (int i = 0; i < r->num_lines; i++) {
+            // A line may have changed directory
+            if (chdir(r->sandbox) != 0) {
+                perror(r->sandbox);
+            }
+            long long start = now_ns();
+            run_line(r->lines[i].text);
+            r->lines[i].shell_ns[run] = now_ns() - start;
+            if (get_exit_status() != 0) {
+                r->lines[i].failed = 1;
+            }
+        }
+    }
+}
+
+// Run the lines, and the failing lines, over and over until `soak'
+// commands have run, taking samples of the shell's memory use. The
+// first two passes fill the shell's caches and buffers (a line may
+// only print anything once the first pass has run, e.g. `history'),
+// so samples start after them
+static void run_soak(struct replay *r, void (*run_line)(char *)) {
+    int num_failing = 0;
+    while (FAILING_LINES[num_failing] != NULL) num_failing++;
+    long long pass = r->num_lines + num_failing;
+    long long warmup = 2*pass;
+    long long interval = (r->soak - warmup) / SOAK_SAMPLES;
+    if (interval < 1) interval = 1;
+
+    for (long long n = 0; n < r->soak; n++) {
+        if (n == warmup || (n > warmup && (n - warmup) % interval == 0)) {
+            take_sample(r, n);
+        }
+        if (chdir(r->sandbox) != 0) {
+            perror(r->sandbox);
+        }
+        long long i = n % pass;
+        if (i < r->num_lines) {
+            run_line(r->lines[i].text);
+        } else {
+            // Lines run by the shell must be its own to change
+            char *text = strdup(FAILING_LINES[i - r->num_lines]);
+            run_line(text);
+            free(text);
+        }
+    }
+    take_sample(r, r->soak);
+}
+
+static void take_sample(struct replay *r, long long commands) {
+    if (r->num_samples == SOAK_SAMPLES + 1) {
+        // The last sample is always the one at the end
+        r->num_samples--;
+    }
+    struct soak_sample *sample = &r->samples[r->num_samples++];
+    sample->commands = commands;
+    sample->rss_kb = mem_rss_kb();
+    mem_total(&sample->memory);
+}
+
+// Run the programs of every line the shell ran them for with nothing
+// but posix_spawn(3) and waitpid(2), one after another
+static void run_spawns(struct replay *r) {
+    for (int run = 0; run < r->runs; run++) {
+        for (int i = 0; i < r->num_lines; i++) {
+            struct replay_line *line = &r->lines[i];
+            if (line->failed) {
+                continue;
+            }
+            long long start = now_ns();
+            for (int j = 0; j < line->num_programs; j++) {
+                char stub[MAX_PATH_CHARS];
+                snprintf(stub, sizeof(stub), "%s/%s", r->bin,
+                         line->programs[j]);
+                char *argv[] = { line->programs[j], NULL };
+                pid_t pid;
+                if (posix_spawn(&pid, stub, NULL, NULL, argv, environ) == 0) {
+                    waitpid(pid, NULL, 0);
+                }
+            }
+            line->spawn_ns[run] = now_ns() - start;
+        }
+    }
+}
+
+// Print the mean time per line through the shell and as bare spawns,
+// the shell's time in each phase, and the lines with most overhead.
+// Overheads are the median of the runs, with the lowest and highest,
+// as with few runs one slow run can outweigh the overhead itself
+static void report(struct replay *r, FILE *out) {
+    struct replay_line **sorted = malloc(r->num_lines*sizeof(*sorted));
+    int num_compared = 0;
+    long long shell_ns = 0, compared_shell_ns = 0, spawn_ns = 0;
+    for (int i = 0; i < r->num_lines; i++) {
+        struct replay_line *line = &r->lines[i];
+        for (int run = 0; run < r->runs; run++) {
+            shell_ns += line->shell_ns[run];
+            if (!line->failed) {
+                compared_shell_ns += line->shell_ns[run];
+                spawn_ns += line->spawn_ns[run];
+            }
+        }
+        if (!line->failed) {
+            sorted[num_compared++] = line;
+        }
+    }
+    long long count = (long long) r->num_lines * r->runs;
+    long long compared = (long long) num_compared * r->runs;
+
+    fprintf(out, "replayed %d lines x %d runs (%d skipped, %d failed)\n",
+            r->num_lines, r->runs, r->skipped, r->num_lines - num_compared);
+    fprintf(out, "shell rss %ld MiB (%ld MiB ballast), spawn helper %s\n",
+            mem_rss_kb() / 1024, r->ballast_mb, 
+            spawner_running() ? "on" : "off");
+    if (num_compared > 0) {
+        double range[3];
+        overhead_range(r, sorted, num_compared, range);
+        fprintf(out, "%-12s %10.1f us/line\n", "shell",
+                compared_shell_ns / 1000.0 / compared);
+        fprintf(out, "%-12s %10.1f us/line\n", "posix_spawn",
+                spawn_ns / 1000.0 / compared);
+        fprintf(out, "%-12s %10.1f us/line (%.1f to %.1f)\n\n", "overhead",
+                range[1], range[0], range[2]);
+    } else {
+        fprintf(out, "no line ran its programs, so none were compared\n\n");
+    }
+
+    // Time not in any phase is the rest of running the line:
+    // expanding variables, running builtins and the compiled plan
+    long long totals[NUM_PROFILE_PHASES];
+    profile_totals(totals);
+    long long other = shell_ns;
+    fprintf(out, "%-12s %10s %8s\n", "phase", "us/line", "share");
+    for (int p = 0; p < NUM_PROFILE_PHASES; p++) {
+        other -= totals[p];
+        fprintf(out, "%-12s %10.1f %7.1f%%\n", profile_phase_name(p),
+                totals[p] / 1000.0 / count,
+                shell_ns > 0 ? 100.0 * totals[p] / shell_ns : 0);
+    }
+    fprintf(out, "%-12s %10.1f %7.1f%%\n", "other", other / 1000.0 / count,
+            shell_ns > 0 ? 100.0 * other / shell_ns : 0);
+
+    if (r->top == 0) {
+        free(sorted);
+        return;
+    }
+    for (int i = 0; i < num_compared; i++) {
+        double range[3];
+        overhead_range(r, &sorted[i], 1, range);
+        sorted[i]->overhead_us = range[1];
+    }
+    qsort(sorted, num_compared, sizeof(*sorted), compare_overhead);
+    if (num_compared > 0) {
+        fprintf(out, "\n%10s %10s %10s %10s %10s  %s\n", "shell us", 
+                "spawn us", "overhead", "lowest", "highest", "line");
+    }
+    for (int i = 0; i < num_compared && i < r->top; i++) {
+        long long line_shell_ns = 0, line_spawn_ns = 0;
+        for (int run = 0; run < r->runs; run++) {
+            line_shell_ns += sorted[i]->shell_ns[run];
+            line_spawn_ns += sorted[i]->spawn_ns[run];
+        }
+        double range[3];
+        overhead_range(r, &sorted[i], 1, range);
+        fprintf(out, "%10.1f %10.1f %10.1f %10.1f %10.1f  %s\n",
+                line_shell_ns / 1000.0 / r->runs,
+                line_spawn_ns / 1000.0 / r->runs,
+                range[1], range[0], range[2], sorted[i]->text);
+    }
+
+    // The shell stopped these before running their programs, e.g. on
+    // a redirection from a file that does not exist
+    if (num_compared < r->num_lines) {
+        fprintf(out, "\nnot compared, as the shell failed on them:\n");
+    }
+    for (int i = 0, shown = 0; i < r->num_lines && shown < r->top; i++) {
+        if (r->lines[i].failed) {
+            fprintf(out, "  %s\n", r->lines[i].text);
+            shown++;
+        }
+    }
+    free(sorted);
+}
+
+// Print the memory use of every sample, and how much it grew from
+// the first sample to the last. Returns 1 if blocks that were
+// allocated were not freed, otherwise 0
+static int report_soak(struct replay *r, FILE *out) {
+    fprintf(out, "soak: %lld commands over %d lines\n", r->soak,
+            r->num_lines);
+    fprintf(out, "%12s %10s %12s %10s\n", "commands", "rss KiB",
+            "live bytes", "live");
+    for (int i = 0; i < r->num_samples; i++) {
+        struct soak_sample *sample = &r->samples[i];
+        fprintf(out, "%12lld %10ld %12lld %10lld\n", sample->commands,
+                sample->rss_kb, sample->memory.live_bytes,
+                sample->memory.live_blocks);
+    }
+    if (r->num_samples < 2) {
+        return 0;
+    }
+
+    struct soak_sample *first = &r->samples[0];
+    struct soak_sample *last = &r->samples[r->num_samples - 1];
+    fprintf(out, "rss grew %ld KiB, live memory grew %lld bytes in %lld "
+            "blocks\n", last->rss_kb - first->rss_kb, 
+            last->memory.live_bytes - first->memory.live_bytes,
+            last->memory.live_blocks - first->memory.live_blocks);
+    if (!mem_accounting()) {
+        print_memstats(out);
+        return 0;
+    }
+    // Values such as `$?' change length, but every block allocated
+    // for a command should have been freed
+    return last->memory.live_blocks > first->memory.live_blocks;
+}
+
+// The lowest, median and highest of the runs' overheads per line, in
+// microseconds, of the lines given
+static void overhead_range(struct replay *r, struct replay_line **lines,
+                           int n, double range[3]) {
+    double *overheads = malloc(r->runs*sizeof(*overheads));
+    for (int run = 0; run < r->runs; run++) {
+        long long ns = 0;
+        for (int i = 0; i < n; i++) {
+            ns += lines[i]->shell_ns[run] - lines[i]->spawn_ns[run];
+        }
+        overheads[run] = ns / 1000.0 / n;
+    }
+    qsort(overheads, r->runs, sizeof(*overheads), compare_double);
+    range[0] = overheads[0];
+    range[1] = (overheads[(r->runs - 1) / 2] + overheads[r->runs / 2]) / 2;
+    range[2] = overheads[r->runs - 1];
+    free(overheads);
+}
+
+static int compare_overhead(const void *a, const void *b) {
+    const struct replay_line *x = *(struct replay_line *const *) a;
+    const struct replay_line *y = *(struct replay_line *const *) b;
+    return (x->overhead_us < y->overhead_us) - 
+           (x->overhead_us > y->overhead_us);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int remove_entry(const char *path, const struct stat *s, int type,
+                        struct FTW *ftw) {
+    (void) s;
+    (void) type;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+static void free_replay(struct replay *r) {
+    for (int i = 0; i < r->num_lines; i++) {
+        free(r->lines[i].text);
+        for (int j = 0; j < r->lines[i].num_programs; j++) {
+            free(r->lines[i].programs[j]);
+        }
+        free(r->lines[i].programs);
+        free(r->lines[i].shell_ns);
+        free(r->lines[i].spawn_ns);
+    }
+    free(r->lines);
+}
@@ -0,0 +1,44 @@
+// `shuck --replay' (or `shuck-replay', a link to shuck): replay a
+// history file, or any file of command lines, through the shell to
+// measure how much time the shell itself adds to each command.
+//
+// The lines run in a sandbox: a new directory that is the current
+// directory and `$HOME', with `$PATH' set to stubs for the programs
+// the lines run, which exit straight away. Each line is also run as
+// bare posix_spawn(3)s of its programs' stubs, and the difference is
+// the shell's overhead, reported as the median of the runs with the
+// lowest and highest, and split into the phases of shuck_profile.h.
+// The stubs never fail, so a line the shell fails on (such as a
+// redirection from a missing file) did not run its programs, and is
+// listed rather than compared. Nothing outside the sandbox is run or written to:
+// lines using absolute paths, `~' or `..', and ones that would leave
+// the shell or run other input (`exit', `!', `batch', `enable'), are
+// skipped.
+
+#ifndef SHUCK_REPLAY_H
+#define SHUCK_REPLAY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Replay the file named in `args', which are the arguments after
+// `--replay':
+//     FILE [--runs=N] [--top=N] [--soak=N] [--ballast=MiB]
+// running each line N times (default 5) and listing the N lines with
+// the most overhead (default 10). `--ballast=MiB' makes the shell hold
+// that much more memory while it runs them, to show how the cost of
+// starting programs depends on the shell's size, with or without the
+// spawn helper (shuck_spawner.h). With `--soak=N', nothing is timed:
+// instead the lines, mixed with lines that fail in various ways, are
+// run until N commands have run, and the shell's resident set size
+// and the memory it has allocated are reported as they go, to show
+// that they stay flat. `tokenize_line' splits a line into
+// words as the shell does, and `run_line' runs a line in the shell.
+// Returns the shell's exit status, which for a soak test is 1 if
+// blocks the shell allocated were not freed, in a shell built to count
+// them (shuck_mem.h)
+int replay_history(char **args, char **(*tokenize_line)(char *),
+                   void (*run_line)(char *));
+
+#endif
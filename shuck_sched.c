@@ -0,0 +1,597 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "shuck_sched.h"
+#include "shuck_vars.h"
+#include "shuck_wait.h"
+
+// How far short of its CPU limit a program's reported CPU time may be
+// for the limit to still be what stopped it. The time reported when it
+// is reaped can lag the time the limit was checked against by a few
+// percent on a busy machine
+#define CPU_TIME_SLACK_MS 100
+
+// The shell's own limits `ulimit' knows, by option, and the unit
+// their values are given in
+struct ulimit {
+    char option;
+    int resource;
+    rlim_t unit;
+    char *name;
+};
+
+static const struct ulimit ulimits[] = {
+    { 'c', RLIMIT_CORE,   1024, "core file size (KiB)" },
+    { 'd', RLIMIT_DATA,   1024, "data segment size (KiB)" },
+    { 'f', RLIMIT_FSIZE,  1024, "file size (KiB)" },
+    { 'n', RLIMIT_NOFILE, 1,    "open files" },
+    { 's', RLIMIT_STACK,  1024, "stack size (KiB)" },
+    { 't', RLIMIT_CPU,    1,    "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC,  1,    "processes" },
+    { 'v', RLIMIT_AS,     1024, "virtual memory (KiB)" },
+};
+#define NUM_ULIMITS (int) (sizeof(ulimits)/sizeof(ulimits[0]))
+
+struct sched_options {
+    int set_policy;
+    int policy;
+    int priority;
+
+    int set_nice;
+    int nice;
+
+    int set_cpus;
+    cpu_set_t cpus;
+    cpu_set_t saved_cpus;
+
+    int set_mem;
+    struct rlimit mem;
+    int set_cpu_time;
+    struct rlimit cpu_time;
+    int set_nofile;
+    struct rlimit nofile;
+};
+
+// Helper functions
+static int parse_policy(char *name, int *policy);
+static int is_posix_policy(int policy);
+static int parse_cpus(char *list, cpu_set_t *cpus);
+static int auto_cpu(int stage, cpu_set_t *cpus);
+static int parse_number(char *word, int *n);
+static int parse_limit(char *option, char *arg, struct sched_options *o);
+static int parse_size(char *word, rlim_t *size);
+static int child_limit(int resource, rlim_t value, rlim_t max, 
+                       char *option, struct rlimit *limit);
+static const struct ulimit *find_ulimit(char option);
+static void print_ulimit(FILE *out, rlim_t value, rlim_t unit);
+static int sched_error(char *message, char *word);
+
+
+// Parse the prefixes of a command
+struct sched_options *parse_sched_prefix(char **words, int stage, 
+                                         int *length) {
+    struct sched_options *o = calloc(1, sizeof(*o));
+    int auto_cpus = 0;
+    int i = 0;
+
+    while (words[i] != NULL) {
+        if (!strcmp(words[i], "affinity")) {
+            // affinity CPUS command...
+            if (words[i+1] == NULL) {
+                sched_error("affinity: CPU list required", NULL);
+                goto invalid;
+            }
+            if (!strcmp(words[i+1], "auto")) {
+                auto_cpus = 1;
+            } else if (parse_cpus(words[i+1], &o->cpus)) {
+                sched_error("affinity: invalid CPU list", words[i+1]);
+                goto invalid;
+            }
+            o->set_cpus = 1;
+            i += 2;
+        }
+        else if (!strcmp(words[i], "sched")) {
+            // sched [-p policy] [-r priority] [-n nice] [-c cpus] command...
+            i++;
+            while (words[i] != NULL && words[i][0] == '-' && 
+                   words[i][1] != '\0' && words[i][2] == '\0') {
+                char option = words[i][1];
+                char *arg = words[i+1];
+                if (arg == NULL) {
+                    sched_error("sched: option requires an argument", 
+                                words[i]);
+                    goto invalid;
+                }
+                if (option == 'p') {
+                    if (parse_policy(arg, &o->policy)) goto invalid;
+                    o->set_policy = 1;
+                } else if (option == 'r') {
+                    if (parse_number(arg, &o->priority)) goto invalid;
+                    o->set_policy = 1;
+                } else if (option == 'n') {
+                    if (parse_number(arg, &o->nice)) goto invalid;
+                    o->set_nice = 1;
+                } else if (option == 'c') {
+                    if (!strcmp(arg, "auto")) {
+                        auto_cpus = 1;
+                    } else if (parse_cpus(arg, &o->cpus)) {
+                        sched_error("sched: invalid CPU list", arg);
+                        goto invalid;
+                    }
+                    o->set_cpus = 1;
+                } else {
+                    sched_error("sched: invalid option", words[i]);
+                    goto invalid;
+                }
+                i += 2;
+            }
+        }
+        else if (!strcmp(words[i], "limit")) {
+            // limit [--mem size] [--cpu time] [--nofile n] command...
+            i++;
+            while (words[i] != NULL && !strncmp(words[i], "--", 2) && 
+                   words[i][2] != '\0') {
+                if (words[i+1] == NULL) {
+                    sched_error("limit: option requires an argument", 
+                                words[i]);
+                    goto invalid;
+                }
+                if (parse_limit(words[i], words[i+1], o)) goto invalid;
+                i += 2;
+            }
+        }
+        else {
+            break;
+        }
+    }
+
+    if (i > 0 && words[i] == NULL) {
+        sched_error("sched: command required", NULL);
+        goto invalid;
+    }
+
+    // Stages of a pipeline without a CPU of their own are spread
+    // across the available CPUs if asked to
+    char *spread = get_var("SHUCK_SPREAD_PIPELINES");
+    if (!o->set_cpus && stage >= 0 && spread != NULL && spread[0] != '\0') {
+        auto_cpus = 1;
+        o->set_cpus = 1;
+    }
+    if (auto_cpus && auto_cpu(stage < 0 ? 0 : stage, &o->cpus)) {
+        goto invalid;
+    }
+
+    *length = i;
+    if (!o->set_policy && !o->set_nice && !o->set_cpus && !o->set_mem &&
+        !o->set_cpu_time && !o->set_nofile) {
+        free(o);
+        return NULL;
+    }
+    // Real-time policies need a priority, the others must use 0
+    if (o->set_policy && (o->policy == SCHED_FIFO || o->policy == SCHED_RR) &&
+        o->priority == 0) {
+        o->priority = sched_get_priority_min(o->policy);
+    }
+    return o;
+
+invalid:
+    free(o);
+    *length = -1;
+    return NULL;
+}
+
+// Count the prefix words of a command
+int sched_prefix_length(char **words) {
+    int i = 0;
+    while (words[i] != NULL) {
+        if (!strcmp(words[i], "affinity")) {
+            if (words[i+1] == NULL) return -1;
+            i += 2;
+        } else if (!strcmp(words[i], "sched")) {
+            i++;
+            while (words[i] != NULL && words[i][0] == '-' && 
+                   words[i][1] != '\0' && words[i][2] == '\0') {
+                if (words[i+1] == NULL) return -1;
+                i += 2;
+            }
+        } else if (!strcmp(words[i], "limit")) {
+            i++;
+            while (words[i] != NULL && !strncmp(words[i], "--", 2) && 
+                   words[i][2] != '\0') {
+                if (words[i+1] == NULL) return -1;
+                i += 2;
+            }
+        } else {
+            break;
+        }
+    }
+    return i > 0 && words[i] == NULL ? -1 : i;
+}
+
+// Set the scheduler in the spawn attributes
+int sched_spawnattr(struct sched_options *o, posix_spawnattr_t *attr) {
+    // posix_spawn only knows the POSIX policies, the others are
+    // set by `sched_after_spawn'
+    if (o == NULL || !o->set_policy || !is_posix_policy(o->policy)) {
+        return 0;
+    }
+    struct sched_param param = { .sched_priority = o->priority };
+    int error = posix_spawnattr_setschedpolicy(attr, o->policy);
+    if (error == 0) {
+        error = posix_spawnattr_setschedparam(attr, &param);
+    }
+    if (error == 0) {
+        error = posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSCHEDULER);
+    }
+    if (error != 0) {
+        fprintf(stderr, "sched: %s\n", strerror(error));
+        return 1;
+    }
+    return 0;
+}
+
+// Make the child inherit the wanted affinity
+int sched_before_spawn(struct sched_options *o) {
+    if (o == NULL || !o->set_cpus) {
+        return 0;
+    }
+    if (sched_getaffinity(0, sizeof(o->saved_cpus), &o->saved_cpus) != 0 ||
+        sched_setaffinity(0, sizeof(o->cpus), &o->cpus) != 0) {
+        perror("sched_setaffinity");
+        return 1;
+    }
+    return 0;
+}
+
+// Put the shell back the way it was. `pid' is -1 if the spawn failed
+void sched_after_spawn(struct sched_options *o, pid_t pid) {
+    if (o == NULL) {
+        return;
+    }
+    if (o->set_cpus) {
+        sched_setaffinity(0, sizeof(o->saved_cpus), &o->saved_cpus);
+    }
+    if (pid <= 0) {
+        return;
+    }
+    // Nor are there any for resource limits, which are set first, so
+    // that the child runs unlimited for as short a time as possible
+    if (o->set_mem && prlimit(pid, RLIMIT_AS, &o->mem, NULL) != 0) {
+        perror("prlimit");
+    }
+    if (o->set_cpu_time && 
+        prlimit(pid, RLIMIT_CPU, &o->cpu_time, NULL) != 0) {
+        perror("prlimit");
+    }
+    if (o->set_nofile && prlimit(pid, RLIMIT_NOFILE, &o->nofile, NULL) != 0) {
+        perror("prlimit");
+    }
+    // There are no spawn attributes for Linux's own policies or the
+    // nice value, so they are set as soon as the child exists
+    if (o->set_policy && !is_posix_policy(o->policy)) {
+        struct sched_param param = { .sched_priority = 0 };
+        if (sched_setscheduler(pid, o->policy, &param) != 0) {
+            perror("sched_setscheduler");
+        }
+    }
+    if (o->set_nice && setpriority(PRIO_PROCESS, pid, o->nice) != 0) {
+        perror("setpriority");
+    }
+}
+
+// Describe how a process ran into its limits
+char *limit_exceeded(struct sched_options *o, int status, 
+                     struct rusage *usage) {
+    if (o == NULL || !WIFSIGNALED(status)) {
+        return NULL;
+    }
+    // Past the CPU limit a program gets SIGXCPU, and a second later,
+    // at the hard limit, SIGKILL. Either can be sent for other reasons
+    // too, so the limit is only blamed if the program used all the CPU
+    // time it allowed (less a little, as the times are approximate)
+    if (o->set_cpu_time && usage != NULL &&
+        (WTERMSIG(status) == SIGXCPU || WTERMSIG(status) == SIGKILL)) {
+        long long used_ms = 
+            (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000LL + 
+            (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1000;
+        if (used_ms + CPU_TIME_SLACK_MS >= 
+            (long long) o->cpu_time.rlim_cur * 1000) {
+            return "exceeded its CPU limit";
+        }
+    }
+    // Running out of memory or file descriptors only makes calls fail,
+    // which the program may report however it likes, so a program that
+    // merely exits with an error is not blamed on them. A program that
+    // cannot grow its stack under the memory limit gets SIGSEGV, and
+    // one that gives up on a failed allocation usually aborts
+    if (o->set_mem && 
+        (WTERMSIG(status) == SIGSEGV || WTERMSIG(status) == SIGBUS ||
+         WTERMSIG(status) == SIGABRT)) {
+        return "was killed under its memory limit";
+    }
+    return NULL;
+}
+
+// Free the options
+void free_sched_options(struct sched_options *o) {
+    free(o);
+}
+
+// Show or set the shell's own limits
+int run_ulimit(char **words, FILE *out) {
+    int hard = 0;
+    int soft = 0;
+    int all = 0;
+    const struct ulimit *u = NULL;
+    int i = 1;
+    for (; words[i] != NULL && words[i][0] == '-' && words[i][1] != '\0'; 
+         i++) {
+        for (char *c = &words[i][1]; *c != '\0'; c++) {
+            if (*c == 'H') {
+                hard = 1;
+            } else if (*c == 'S') {
+                soft = 1;
+            } else if (*c == 'a') {
+                all = 1;
+            } else if ((u = find_ulimit(*c)) == NULL) {
+                fprintf(stderr, "ulimit: -%c: invalid option\n", *c);
+                fprintf(stderr, "usage: ulimit [-HS] [-a | -cdfnstuv "
+                        "[limit]]\n");
+                return 2;
+            }
+        }
+    }
+    if (u == NULL) {
+        u = find_ulimit('f');
+    }
+    if (words[i] != NULL && (all || words[i+1] != NULL)) {
+        fprintf(stderr, "ulimit: too many arguments\n");
+        return 2;
+    }
+
+    struct rlimit limit;
+    if (all) {
+        for (int j = 0; j < NUM_ULIMITS; j++) {
+            if (getrlimit(ulimits[j].resource, &limit) != 0) {
+                perror("ulimit");
+                return 1;
+            }
+            fprintf(out, "%-28s(-%c) ", ulimits[j].name, ulimits[j].option);
+            print_ulimit(out, hard ? limit.rlim_max : limit.rlim_cur, 
+                         ulimits[j].unit);
+        }
+        return 0;
+    }
+    if (getrlimit(u->resource, &limit) != 0) {
+        perror("ulimit");
+        return 1;
+    }
+    if (words[i] == NULL) {
+        print_ulimit(out, hard ? limit.rlim_max : limit.rlim_cur, u->unit);
+        return 0;
+    }
+
+    // A new limit sets both the soft and hard limits unless told which
+    rlim_t value = RLIM_INFINITY;
+    if (strcmp(words[i], "unlimited")) {
+        char *end;
+        errno = 0;
+        unsigned long long n = strtoull(words[i], &end, 10);
+        if (end == words[i] || *end != '\0' || words[i][0] == '-' || 
+            errno == ERANGE || n > (RLIM_INFINITY - 1) / u->unit) {
+            fprintf(stderr, "ulimit: %s: invalid number\n", words[i]);
+            return 1;
+        }
+        value = n * u->unit;
+    }
+    if (!hard && !soft) {
+        hard = soft = 1;
+    }
+    if (hard) {
+        limit.rlim_max = value;
+    }
+    if (soft) {
+        limit.rlim_cur = value;
+    }
+    if (setrlimit(u->resource, &limit) != 0) {
+        fprintf(stderr, "ulimit: %s: cannot modify limit: %s\n", u->name, 
+                strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Scheduler policies by name
+static int parse_policy(char *name, int *policy) {
+    if (!strcmp(name, "other")) {
+        *policy = SCHED_OTHER;
+    } else if (!strcmp(name, "batch")) {
+        *policy = SCHED_BATCH;
+    } else if (!strcmp(name, "idle")) {
+        *policy = SCHED_IDLE;
+    } else if (!strcmp(name, "fifo")) {
+        *policy = SCHED_FIFO;
+    } else if (!strcmp(name, "rr")) {
+        *policy = SCHED_RR;
+    } else {
+        return sched_error("sched: unknown policy", name);
+    }
+    return 0;
+}
+
+// Check if posix_spawn can set the policy itself
+static int is_posix_policy(int policy) {
+    return policy == SCHED_OTHER || policy == SCHED_FIFO || 
+           policy == SCHED_RR;
+}
+
+// Parse a CPU list such as `0-3,6'
+static int parse_cpus(char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    char *s = list;
+    while (*s != '\0') {
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if (end == s || first < 0) return 1;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first) return 1;
+        }
+        if (last >= CPU_SETSIZE) return 1;
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return 1;
+        s = end;
+    }
+    return CPU_COUNT(cpus) == 0;
+}
+
+// Pick one of the CPUs the shell may run on for a pipeline stage
+static int auto_cpu(int stage, cpu_set_t *cpus) {
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(available), &available) != 0) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+    int n = stage % CPU_COUNT(&available);
+    CPU_ZERO(cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &available) && n-- == 0) {
+            CPU_SET(cpu, cpus);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int parse_number(char *word, int *n) {
+    char *end;
+    *n = (int) strtol(word, &end, 10);
+    if (end == word || *end != '\0') {
+        return sched_error("sched: numeric argument required", word);
+    }
+    return 0;
+}
+
+// Parse an option of the `limit' prefix
+static int parse_limit(char *option, char *arg, struct sched_options *o) {
+    rlim_t value;
+    if (!strcmp(option, "--mem")) {
+        if (parse_size(arg, &value)) {
+            return sched_error("limit: invalid size", arg);
+        }
+        o->set_mem = 1;
+        return child_limit(RLIMIT_AS, value, value, option, &o->mem);
+    }
+    if (!strcmp(option, "--cpu")) {
+        long ms = parse_duration(arg);
+        if (ms <= 0) {
+            return sched_error("limit: invalid time", arg);
+        }
+        // Past the soft limit the process is sent SIGXCPU, which is how
+        // it is told from one killed for another reason. The hard limit
+        // a second later kills one that catches the signal
+        value = (ms + 999) / 1000;
+        o->set_cpu_time = 1;
+        return child_limit(RLIMIT_CPU, value, value + 1, option, 
+                           &o->cpu_time);
+    }
+    if (!strcmp(option, "--nofile")) {
+        char *end;
+        errno = 0;
+        unsigned long long n = strtoull(arg, &end, 10);
+        if (end == arg || *end != '\0' || arg[0] == '-' || errno == ERANGE) {
+            return sched_error("limit: numeric argument required", arg);
+        }
+        o->set_nofile = 1;
+        return child_limit(RLIMIT_NOFILE, n, n, option, &o->nofile);
+    }
+    return sched_error("limit: invalid option", option);
+}
+
+// Parse a size in bytes such as `4096', `512K', `100M' or `2G'
+static int parse_size(char *word, rlim_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(word, &end, 10);
+    rlim_t unit = 1;
+    if (*end == 'K' || *end == 'k') {
+        unit = 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        unit = 1024 * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        unit = 1024 * 1024 * 1024;
+        end++;
+    }
+    if (end == word || *end != '\0' || word[0] == '-' || errno == ERANGE || 
+        n == 0 || n > (RLIM_INFINITY - 1) / unit) {
+        return 1;
+    }
+    *size = n * unit;
+    return 0;
+}
+
+// Fill in a limit for a child, with the soft limit `value' and the
+// hard limit `max', as far as the shell's own hard limit allows, so
+// that the child cannot raise it again. The limit is checked here,
+// since once the child runs it is too late to refuse to run it
+static int child_limit(int resource, rlim_t value, rlim_t max, 
+                       char *option, struct rlimit *limit) {
+    struct rlimit shell;
+    if (getrlimit(resource, &shell) != 0) {
+        perror("getrlimit");
+        return 1;
+    }
+    if (shell.rlim_max != RLIM_INFINITY && value > shell.rlim_max) {
+        return sched_error("limit: above the shell's hard limit", option);
+    }
+    if (shell.rlim_max != RLIM_INFINITY && max > shell.rlim_max) {
+        max = shell.rlim_max;
+    }
+    limit->rlim_cur = value;
+    limit->rlim_max = max;
+    return 0;
+}
+
+// The limit `ulimit' shows or sets with an option
+static const struct ulimit *find_ulimit(char option) {
+    for (int i = 0; i < NUM_ULIMITS; i++) {
+        if (ulimits[i].option == option) {
+            return &ulimits[i];
+        }
+    }
+    return NULL;
+}
+
+// Print a limit in its unit
+static void print_ulimit(FILE *out, rlim_t value, rlim_t unit) {
+    if (value == RLIM_INFINITY) {
+        fprintf(out, "unlimited\n");
+    } else {
+        fprintf(out, "%llu\n", (unsigned long long) (value / unit));
+    }
+}
+
+static int sched_error(char *message, char *word) {
+    if (word != NULL) {
+        fprintf(stderr, "%s: %s\n", message, word);
+    } else {
+        fprintf(stderr, "%s\n", message);
+    }
+    return 1;
+}
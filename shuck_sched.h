@@ -0,0 +1,57 @@
+// Scheduling of spawned programs: the `sched' and `affinity' prefixes
+// set the CPU affinity, nice value and scheduler policy of a command
+// or of a single pipeline stage, and the `limit' prefix its memory,
+// CPU time and number of open files, e.g.
+//     sched -p batch -n 10 make
+//     affinity 0 producer | affinity 1-3 consumer
+//     limit --mem 512M --cpu 30s --nofile 256 ./convert | gzip
+// Setting $SHUCK_SPREAD_PIPELINES spreads the stages of every pipeline
+// across the CPUs the shell may run on. The shell's own limits, which
+// every program starts with, are those of `ulimit'.
+
+#include <spawn.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+struct sched_options;
+
+// Parse the scheduling prefixes at the start of a command. `stage' is
+// the command's position in its pipeline, used to pick a CPU for it
+// when stages are spread automatically (-1 if it is not in a pipeline).
+// Stores the number of prefix words in `length' and returns the
+// options, or NULL if there are none. If the prefix is invalid, an
+// error is printed and `length' is set to -1
+struct sched_options *parse_sched_prefix(char **words, int stage, 
+                                         int *length);
+
+// Number of prefix words at the start of a command, without
+// reporting errors. Returns -1 if the prefix is invalid
+int sched_prefix_length(char **words);
+
+// Set the scheduler policy and priority in the spawn attributes
+// Returns 1 on error
+int sched_spawnattr(struct sched_options *o, posix_spawnattr_t *attr);
+
+// Set the shell's CPU affinity to that wanted for the child, since
+// posix_spawn has no attribute for it. Returns 1 on error
+int sched_before_spawn(struct sched_options *o);
+
+// Restore the shell's CPU affinity, and set the child's resource limits
+// and nice value (`pid' is -1 if the child could not be spawned)
+void sched_after_spawn(struct sched_options *o, pid_t pid);
+
+// Describe how a process that finished with the wait status `status',
+// having used the resources in `usage', ran into the limits of its
+// `limit' prefix, such as "exceeded its CPU limit", or NULL if it did
+// not. `o' and `usage' may be NULL
+char *limit_exceeded(struct sched_options *o, int status, 
+                     struct rusage *usage);
+
+// Free the options, which may be NULL
+void free_sched_options(struct sched_options *o);
+
+// Run `ulimit [-HS] [-a | -cdfnstuv [limit]]', showing the shell's
+// soft (or with -H hard) limits on `out' or setting them, both unless
+// -H or -S is given. Returns the exit status
+int run_ulimit(char **words, FILE *out);
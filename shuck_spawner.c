@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shuck_spawner.h"
+#include "shuck_helper.h"
+#include "shuck_vars.h"
+
+// The most descriptors one request can pass, which is as many as the
+// kernel takes in one message (SCM_MAX_FD)
+#define MAX_REQUEST_FDS 253
+// The descriptors passed with every program: its current directory,
+// then its standard input, output and error
+#define FIXED_FDS 4
+// Arguments and environment together are far smaller than this, as
+// the kernel limits them, so a larger request is a broken one
+#define MAX_REQUEST_BYTES (64 * 1024 * 1024)
+// The stack the helper's child runs on until it execs
+#define CHILD_STACK_SIZE (64 * 1024)
+
+enum request_type {
+    // Start a program
+    REQUEST_SPAWN,
+    // Take on the shell's resource limits
+    REQUEST_LIMITS,
+};
+
+// A request to the helper. It is followed by `length' bytes: for a
+// program, the descriptor numbers the shared descriptors are passed
+// on as, then its pathname, arguments and environment, each ending
+// with a NUL; for limits, every `struct rlimit' in order
+struct request {
+    int type;
+    int num_fds;
+    int argc;
+    int envc;
+    size_t length;
+    // The signals the program starts with blocked, as the calling
+    // thread of the shell has them
+    sigset_t mask;
+};
+
+// The helper's answer to a request
+struct reply {
+    pid_t pid;
+    int error;
+};
+
+// What the helper's child needs to exec a program, and why it could
+// not if it could not
+struct child {
+    struct request *req;
+    int *fds;
+    int *targets;
+    char *pathname;
+    char **argv;
+    char **env;
+    int error;
+};
+
+// The shell's end of the socket, and the helper
+static int spawner_fd = -1;
+static pid_t spawner_pid = -1;
+// The process that started the helper, the only one its programs can
+// be children of: a child forked for a brace group starts its own
+static pid_t spawner_owner = -1;
+static pthread_mutex_t spawner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// In the helper, the stack of its child
+static char *child_stack = NULL;
+
+// Descriptors passed on to every program, in no particular order
+static int *shared_fds = NULL;
+static int num_shared_fds = 0;
+
+// Helper functions
+static int ask_spawner(struct request *req, int *fds, char *payload,
+                       struct reply *reply);
+static void lost_spawner(void);
+static void run_spawner(int sock, pid_t shell);
+static int receive_request(int sock, struct request *req, int *fds,
+                           char **payload);
+static int spawn_program(struct request *req, int *fds, char *payload,
+                         pid_t *pid);
+static int exec_program(void *arg);
+static int set_limits(struct request *req, char *payload);
+static char *take_strings(char *s, char *end, char **strings, int n);
+static int send_all(int fd, const void *buffer, size_t n);
+static int read_all(int fd, void *buffer, size_t n);
+static void close_fds(int *fds, int n);
+
+
+// FUNCTIONS FOR SHUCK_SPAWNER
+
+// Start the helper
+int start_spawner(void) {
+    char *wanted = get_var("SHUCK_SPAWN_HELPER");
+    if (wanted == NULL || wanted[0] == '\0') {
+        return 0;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    pid_t shell = getpid();
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return 1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        run_spawner(sv[1], shell);
+    }
+    close(sv[1]);
+    spawner_fd = sv[0];
+    spawner_pid = pid;
+    spawner_owner = shell;
+    return 0;
+}
+
+// Start a program through the helper
+int spawner_spawn(pid_t *pid, char *pathname, int in, int out,
+                  char **argv, char **env) {
+    if (!spawner_running() || num_shared_fds > MAX_REQUEST_FDS - FIXED_FDS) {
+        return -1;
+    }
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd == -1) {
+        return -1;
+    }
+
+    struct request req = {
+        .type = REQUEST_SPAWN,
+        .num_fds = FIXED_FDS + num_shared_fds,
+        .argc = array_size(argv),
+        .envc = array_size(env),
+    };
+    pthread_sigmask(SIG_SETMASK, NULL, &req.mask);
+    req.length = num_shared_fds*sizeof(int) + strlen(pathname) + 1;
+    for (int i = 0; i < req.argc; i++) {
+        req.length += strlen(argv[i]) + 1;
+    }
+    for (int i = 0; i < req.envc; i++) {
+        req.length += strlen(env[i]) + 1;
+    }
+
+    char *payload = malloc(req.length);
+    if (num_shared_fds > 0) {
+        memcpy(payload, shared_fds, num_shared_fds*sizeof(int));
+    }
+    char *s = stpcpy(payload + num_shared_fds*sizeof(int), pathname) + 1;
+    for (int i = 0; i < req.argc; i++) {
+        s = stpcpy(s, argv[i]) + 1;
+    }
+    for (int i = 0; i < req.envc; i++) {
+        s = stpcpy(s, env[i]) + 1;
+    }
+
+    int fds[MAX_REQUEST_FDS] = { cwd, in, out, STDERR_FILENO };
+    if (num_shared_fds > 0) {
+        memcpy(&fds[FIXED_FDS], shared_fds, num_shared_fds*sizeof(int));
+    }
+
+    struct reply reply;
+    int result = ask_spawner(&req, fds, payload, &reply);
+    close(cwd);
+    free(payload);
+    if (result != 0) {
+        return result;
+    }
+
+    // If the helper could not even clone itself, the shell may still
+    // manage to start the program. One that could not be run has
+    // still been started, to find that out, and is the shell's to reap
+    if (reply.pid == -1) {
+        return -1;
+    }
+    *pid = reply.pid;
+    if (reply.error != 0 && reply.pid > 0) {
+        while (waitpid(reply.pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+    }
+    return reply.error;
+}
+
+// Check if the helper is running
+int spawner_running(void) {
+    return spawner_fd != -1 && getpid() == spawner_owner;
+}
+
+// Pass a descriptor on to the programs the helper starts
+void share_spawn_fd(int fd) {
+    shared_fds = realloc(shared_fds,
+                         (num_shared_fds + 1)*sizeof(*shared_fds));
+    shared_fds[num_shared_fds++] = fd;
+}
+
+// Stop passing a descriptor on
+void unshare_spawn_fd(int fd) {
+    for (int i = 0; i < num_shared_fds; i++) {
+        if (shared_fds[i] == fd) {
+            shared_fds[i] = shared_fds[--num_shared_fds];
+            break;
+        }
+    }
+    if (num_shared_fds == 0) {
+        free(shared_fds);
+        shared_fds = NULL;
+    }
+}
+
+// Give the helper the shell's resource limits
+void sync_spawner_limits(void) {
+    if (!spawner_running()) {
+        return;
+    }
+    struct rlimit limits[RLIM_NLIMITS];
+    for (int i = 0; i < RLIM_NLIMITS; i++) {
+        if (getrlimit(i, &limits[i]) != 0) {
+            limits[i].rlim_cur = limits[i].rlim_max = RLIM_INFINITY;
+        }
+    }
+    struct request req = {
+        .type = REQUEST_LIMITS, .length = sizeof(limits)
+    };
+    struct reply reply;
+    ask_spawner(&req, NULL, (char *) limits, &reply);
+}
+
+// Stop the helper
+void stop_spawner(void) {
+    if (spawner_running()) {
+        lost_spawner();
+    }
+    free(shared_fds);
+    shared_fds = NULL;
+    num_shared_fds = 0;
+}
+
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Send a request to the helper, with its descriptors and payload, and
+// read its reply. Returns 0 if there was a reply, -1 if the request
+// could not be sent, or EIO if the helper stopped while handling it,
+// after which the helper is no longer used
+static int ask_spawner(struct request *req, int *fds, char *payload,
+                       struct reply *reply) {
+    union {
+        char buffer[CMSG_SPACE(MAX_REQUEST_FDS*sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (req->num_fds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(req->num_fds*sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(req->num_fds*sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, req->num_fds*sizeof(int));
+    }
+
+    pthread_mutex_lock(&spawner_lock);
+    int result = 0;
+    ssize_t n;
+    while ((n = sendmsg(spawner_fd, &msg, MSG_NOSIGNAL)) == -1 &&
+           errno == EINTR) {
+    }
+    if (n == -1 ||
+        send_all(spawner_fd, (char *) req + n, sizeof(*req) - n) ||
+        send_all(spawner_fd, payload, req->length)) {
+        result = -1;
+    } else if (read_all(spawner_fd, reply, sizeof(*reply))) {
+        result = EIO;
+    }
+    if (result != 0) {
+        lost_spawner();
+    }
+    pthread_mutex_unlock(&spawner_lock);
+    return result;
+}
+
+// Stop using the helper, and make sure it has stopped
+static void lost_spawner(void) {
+    close(spawner_fd);
+    spawner_fd = -1;
+    kill(spawner_pid, SIGKILL);
+    while (waitpid(spawner_pid, NULL, 0) == -1 && errno == EINTR) {
+    }
+    spawner_pid = -1;
+}
+
+// The helper: handle requests from the shell until it goes away
+static void run_spawner(int sock, pid_t shell) {
+    // It holds on to none of the shell's descriptors, which could keep
+    // a pipe the shell writes to from ever being closed, and goes when
+    // the shell does
+    int null = open("/dev/null", O_RDWR);
+    for (int fd = 0; fd < 3; fd++) {
+        if (null != -1) dup2(null, fd);
+    }
+    if (sock > 3) close_range(3, sock - 1, 0);
+    close_range(sock + 1, ~0U, 0);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != shell) {
+        _exit(0);
+    }
+    child_stack = mmap(NULL, CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (child_stack == MAP_FAILED) {
+        _exit(1);
+    }
+
+    struct request req;
+    int fds[MAX_REQUEST_FDS];
+    char *payload;
+    while (!receive_request(sock, &req, fds, &payload)) {
+        struct reply reply = { .pid = -1, .error = 0 };
+        if (req.type == REQUEST_SPAWN) {
+            reply.error = spawn_program(&req, fds, payload, &reply.pid);
+        } else {
+            reply.error = set_limits(&req, payload);
+        }
+        close_fds(fds, req.num_fds);
+        free(payload);
+        if (send_all(sock, &reply, sizeof(reply))) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+// Read a request, its descriptors and its payload. Returns 1 if the
+// shell has gone, or sent something that is not a request
+static int receive_request(int sock, struct request *req, int *fds,
+                           char **payload) {
+    union {
+        char buffer[CMSG_SPACE(MAX_REQUEST_FDS*sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buffer, .msg_controllen = sizeof(control)
+    };
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 &&
+           errno == EINTR) {
+    }
+    if (n <= 0) {
+        return 1;
+    }
+
+    int num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), num_fds*sizeof(int));
+        }
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) ||
+        read_all(sock, (char *) req + n, sizeof(*req) - n) ||
+        req->num_fds != num_fds || req->length > MAX_REQUEST_BYTES) {
+        close_fds(fds, num_fds);
+        return 1;
+    }
+
+    // The payload is given a NUL of its own, so that its last string
+    // ends even if the shell sent a broken one
+    *payload = malloc(req->length + 1);
+    (*payload)[req->length] = '\0';
+    if (read_all(sock, *payload, req->length)) {
+        close_fds(fds, num_fds);
+        free(*payload);
+        return 1;
+    }
+    return 0;
+}
+
+// Start the program of a request as a child of the shell. Returns 0,
+// or an errno value if it could not be run
+static int spawn_program(struct request *req, int *fds, char *payload,
+                         pid_t *pid) {
+    int num_shared = req->num_fds - FIXED_FDS;
+    if (num_shared < 0 || req->argc < 1 || req->envc < 0 ||
+        req->length < num_shared*sizeof(int)) {
+        return EINVAL;
+    }
+    struct child child = {
+        .req = req, .fds = fds, .targets = (int *) payload,
+        .pathname = payload + num_shared*sizeof(int),
+        .argv = malloc((req->argc + 1)*sizeof(char *)),
+        .env = malloc((req->envc + 1)*sizeof(char *)),
+    };
+    char *end = payload + req->length;
+    char *s = take_strings(child.pathname, end, NULL, 1);
+    s = s != NULL ? take_strings(s, end, child.argv, req->argc) : NULL;
+    s = s != NULL ? take_strings(s, end, child.env, req->envc) : NULL;
+    if (s == NULL) {
+        free(child.argv);
+        free(child.env);
+        return EINVAL;
+    }
+
+    // As posix_spawn does, the child shares the helper's memory until
+    // it has exec'd, while the helper waits, so that nothing is copied
+    // and why the child could not exec is simply left in `child'. No
+    // signal may be handled in between
+    sigset_t all, mask;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &mask);
+    pid_t child_pid = clone(exec_program, child_stack + CHILD_STACK_SIZE,
+                            CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD,
+                            &child);
+    int error = child_pid == -1 ? errno : child.error;
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    free(child.argv);
+    free(child.env);
+    *pid = child_pid;
+    return error;
+}
+
+// In the child: set up the program's directory, descriptors and
+// signal mask and exec it. If it cannot be, why is left in the
+// `struct child' at `arg'
+static int exec_program(void *arg) {
+    struct child *child = arg;
+    struct request *req = child->req;
+    int num_shared = req->num_fds - FIXED_FDS;
+    // The descriptors are moved in a copy, since the helper closes the
+    // ones it was sent
+    int fds[MAX_REQUEST_FDS];
+    memcpy(fds, child->fds, req->num_fds*sizeof(int));
+    if (fchdir(fds[0]) != 0) {
+        goto failed;
+    }
+
+    // Every descriptor is moved above those it is to become first, so
+    // that none is overwritten before it has been put in place
+    int top = 2;
+    for (int i = 0; i < num_shared; i++) {
+        if (child->targets[i] > top) top = child->targets[i];
+    }
+    for (int i = 1; i < req->num_fds; i++) {
+        if (fds[i] <= top && (fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC,
+                                             top + 1)) == -1) {
+            goto failed;
+        }
+    }
+    for (int i = 1; i < req->num_fds; i++) {
+        int target = i < FIXED_FDS ? i - 1 : child->targets[i - FIXED_FDS];
+        if (dup2(fds[i], target) == -1) {
+            goto failed;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &req->mask, NULL);
+    execve(child->pathname, child->argv, child->env);
+
+failed:
+    child->error = errno;
+    _exit(127);
+}
+
+// Take on the resource limits of a request. Returns 0 or an errno value
+static int set_limits(struct request *req, char *payload) {
+    if (req->length != RLIM_NLIMITS*sizeof(struct rlimit)) {
+        return EINVAL;
+    }
+    struct rlimit *limits = (struct rlimit *) payload;
+    int error = 0;
+    for (int i = 0; i < RLIM_NLIMITS; i++) {
+        if (setrlimit(i, &limits[i]) != 0) {
+            error = errno;
+        }
+    }
+    return error;
+}
+
+// Point `strings' (if not NULL) at the `n' strings starting at `s',
+// NULL-terminated. Returns where the strings after them start, or NULL
+// if there are not `n' of them before `end'
+static char *take_strings(char *s, char *end, char **strings, int n) {
+    for (int i = 0; i < n; i++) {
+        if (s >= end) {
+            return NULL;
+        }
+        if (strings != NULL) strings[i] = s;
+        s += strlen(s) + 1;
+    }
+    if (strings != NULL) strings[n] = NULL;
+    return s <= end ? s : NULL;
+}
+
+// Write all of a buffer to a socket. Returns 1 on error
+static int send_all(int fd, const void *buffer, size_t n) {
+    const char *p = buffer;
+    while (n > 0) {
+        ssize_t written = send(fd, p, n, MSG_NOSIGNAL);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) return 1;
+        p += written;
+        n -= written;
+    }
+    return 0;
+}
+
+// Read all of a buffer from a socket. Returns 1 on error or if it
+// ends first
+static int read_all(int fd, void *buffer, size_t n) {
+    char *p = buffer;
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+static void close_fds(int *fds, int n) {
+    for (int i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+}
@@ -0,0 +1,58 @@
+// The spawn helper: a small process forked when the shell starts,
+// before its history, glob and executable caches have grown, which
+// starts programs for the shell. It is turned on by setting
+// `$SHUCK_SPAWN_HELPER' in the shell's environment.
+//
+// The shell sends the helper each program's pathname, arguments and
+// environment over a socket, with its standard input, output and error,
+// its current directory, and any descriptors of process substitutions
+// as SCM_RIGHTS. The helper clones itself with CLONE_PARENT, so each
+// program is still the shell's child: the shell waits for it, times it
+// out and stops it exactly as it would one it had spawned itself, and
+// only the program's pid (or why it could not be run) is sent back.
+//
+// Programs the shell must set up itself, those with a `sched',
+// `affinity' or `limit' prefix (shuck_sched.h), are still spawned by
+// the shell, and so is everything if the helper is not running.
+
+#ifndef SHUCK_SPAWNER_H
+#define SHUCK_SPAWNER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+// Start the helper, if `$SHUCK_SPAWN_HELPER' is set and not empty.
+// Must be called before the shell starts any threads. Returns 1 if it
+// was wanted but could not be started
+int start_spawner(void);
+
+// Start `pathname' with the arguments `argv' and environment `env'
+// through the helper, with `in' and `out' as its standard input and
+// output, and the shell's standard error. Stores its pid in `pid'.
+// Returns 0 if it was started, an errno value (as posix_spawn does)
+// if it could not be, or -1 if there is no helper to start it (or it
+// failed to), in which case the caller must start it itself
+int spawner_spawn(pid_t *pid, char *pathname, int in, int out,
+                  char **argv, char **env);
+
+// Whether the helper is running, for this process
+int spawner_running(void);
+
+// Pass `fd' on, as the same descriptor, to every program the helper
+// starts until `unshare_spawn_fd', as the shell's own children
+// inherit it
+void share_spawn_fd(int fd);
+
+// Stop passing on `fd'
+void unshare_spawn_fd(int fd);
+
+// Give the helper the shell's resource limits, after `ulimit' has
+// changed them, so that the programs it starts have them too
+void sync_spawner_limits(void);
+
+// Stop the helper
+void stop_spawner(void);
+
+#endif
@@ -0,0 +1,161 @@
+#include "shuck_table.h"
+
+#define INITIAL_BUCKETS 64
+
+struct entry {
+    char *key;
+    void *value;
+    unsigned long hash;
+    struct entry *next;
+};
+
+struct table {
+    struct entry **buckets;
+    int num_buckets;
+    int size;
+};
+
+// Helper functions
+static unsigned long hash_key(const char *key);
+static struct entry **find_entry(struct table *t, const char *key, 
+                                 unsigned long hash);
+static void grow_table(struct table *t);
+
+
+// Create an empty table
+struct table *table_new(void) {
+    struct table *t = malloc(sizeof(*t));
+    t->num_buckets = INITIAL_BUCKETS;
+    t->buckets = calloc(t->num_buckets, sizeof(*t->buckets));
+    t->size = 0;
+    return t;
+}
+
+// Free the table and everything in it
+void table_free(struct table *t, void (*free_value)(void *)) {
+    if (t == NULL) return;
+    table_clear(t, free_value);
+    free(t->buckets);
+    free(t);
+}
+
+// Look up a key
+void *table_get(struct table *t, const char *key) {
+    struct entry *e = *find_entry(t, key, hash_key(key));
+    return e != NULL ? e->value : NULL;
+}
+
+// Insert or replace a key
+void *table_set(struct table *t, const char *key, void *value) {
+    unsigned long hash = hash_key(key);
+    struct entry **slot = find_entry(t, key, hash);
+    if (*slot != NULL) {
+        void *old = (*slot)->value;
+        (*slot)->value = value;
+        return old;
+    }
+
+    struct entry *e = malloc(sizeof(*e));
+    e->key = strdup(key);
+    e->value = value;
+    e->hash = hash;
+    e->next = NULL;
+    *slot = e;
+    t->size++;
+
+    // Keep chains short so lookups stay constant time
+    if (t->size > t->num_buckets) {
+        grow_table(t);
+    }
+    return NULL;
+}
+
+// Remove a key
+void *table_remove(struct table *t, const char *key) {
+    struct entry **slot = find_entry(t, key, hash_key(key));
+    struct entry *e = *slot;
+    if (e == NULL) return NULL;
+
+    void *value = e->value;
+    *slot = e->next;
+    free(e->key);
+    free(e);
+    t->size--;
+    return value;
+}
+
+// Remove every entry
+void table_clear(struct table *t, void (*free_value)(void *)) {
+    for (int i = 0; i < t->num_buckets; i++) {
+        struct entry *e = t->buckets[i];
+        while (e != NULL) {
+            struct entry *next = e->next;
+            if (free_value != NULL) free_value(e->value);
+            free(e->key);
+            free(e);
+            e = next;
+        }
+        t->buckets[i] = NULL;
+    }
+    t->size = 0;
+}
+
+// Number of entries
+int table_size(struct table *t) {
+    return t->size;
+}
+
+// Visit every entry
+void table_foreach(struct table *t, 
+                   void (*fn)(const char *key, void *value, void *ctx), 
+                   void *ctx) {
+    for (int i = 0; i < t->num_buckets; i++) {
+        for (struct entry *e = t->buckets[i]; e != NULL; e = e->next) {
+            fn(e->key, e->value, ctx);
+        }
+    }
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// djb2 string hash
+static unsigned long hash_key(const char *key) {
+    unsigned long hash = 5381;
+    for (; *key != '\0'; key++) {
+        hash = hash * 33 + (unsigned char) *key;
+    }
+    return hash;
+}
+
+// Find the link that points to the entry with the key, or the
+// NULL link at the end of its chain if there is no such entry
+static struct entry **find_entry(struct table *t, const char *key, 
+                                 unsigned long hash) {
+    struct entry **slot = &t->buckets[hash % t->num_buckets];
+    while (*slot != NULL) {
+        if ((*slot)->hash == hash && !strcmp((*slot)->key, key)) {
+            break;
+        }
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Double the number of buckets and rehash every entry
+static void grow_table(struct table *t) {
+    int num_buckets = t->num_buckets * 2;
+    struct entry **buckets = calloc(num_buckets, sizeof(*buckets));
+
+    for (int i = 0; i < t->num_buckets; i++) {
+        struct entry *e = t->buckets[i];
+        while (e != NULL) {
+            struct entry *next = e->next;
+            e->next = buckets[e->hash % num_buckets];
+            buckets[e->hash % num_buckets] = e;
+            e = next;
+        }
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->num_buckets = num_buckets;
+}
@@ -0,0 +1,36 @@
+// A hash table mapping strings to values, used for the shell's
+// variables, cached executable paths and other name lookups
+
+#include <stdlib.h>
+#include <string.h>
+
+struct table;
+
+// Create an empty table
+struct table *table_new(void);
+
+// Free the table and its keys, calling `free_value' on every value
+// if it is not NULL
+void table_free(struct table *t, void (*free_value)(void *));
+
+// Return the value stored under `key', or NULL if there is none
+void *table_get(struct table *t, const char *key);
+
+// Store `value' under `key', returning the value it replaces
+// (or NULL) so that the caller can free it
+void *table_set(struct table *t, const char *key, void *value);
+
+// Remove `key' from the table, returning its value (or NULL)
+void *table_remove(struct table *t, const char *key);
+
+// Remove every entry, calling `free_value' on every value
+// if it is not NULL
+void table_clear(struct table *t, void (*free_value)(void *));
+
+// Number of entries in the table
+int table_size(struct table *t);
+
+// Call `fn' on every entry in the table, in no particular order
+void table_foreach(struct table *t, 
+                   void (*fn)(const char *key, void *value, void *ctx), 
+                   void *ctx);
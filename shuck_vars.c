@@ -0,0 +1,531 @@
+#include "shuck_vars.h"
+#include "shuck_io.h"
+#include "shuck_lex.h"
+
+#define MAX_NUMBER_CHARS 32
+
+// Variables set by the shell that are not in the environment
+static struct table *vars = NULL;
+static pthread_mutex_t vars_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Arguments of the function being run, if any
+static char **positional = NULL;
+// Value of the last `$#', `$@' or `$*' expanded
+static char *positional_value = NULL;
+
+// An expression being evaluated by `arith_eval'
+struct arith {
+    char *s;
+    int error;
+};
+
+// Helper functions
+static int is_name_start(char c);
+static int is_name_char(char c);
+static char *get_positional(char *name);
+static char *expand_word(char *word, int *expanded, int *error);
+static void append(char **buf, size_t *len, size_t *cap, 
+                   const char *s, size_t n);
+static void append_value(char **buf, size_t *len, size_t *cap,
+                         const char *s, size_t n, int quoted);
+static char *find_arith_end(char *s);
+static void skip_spaces(struct arith *a);
+static int accept(struct arith *a, const char *op);
+static long arith_or(struct arith *a);
+static long arith_and(struct arith *a);
+static long arith_equality(struct arith *a);
+static long arith_relational(struct arith *a);
+static long arith_additive(struct arith *a);
+static long arith_multiplicative(struct arith *a);
+static long arith_unary(struct arith *a);
+static long arith_primary(struct arith *a);
+
+
+// Get a variable
+char *get_var(char *name) {
+    // Exit status of the last command
+    if (!strcmp(name, "?")) {
+        static char status[MAX_NUMBER_CHARS];
+        snprintf(status, sizeof status, "%d", get_exit_status());
+        return status;
+    }
+
+    // Positional parameters
+    if (isdigit((unsigned char) name[0]) || !strcmp(name, "#") || 
+        !strcmp(name, "@") || !strcmp(name, "*")) {
+        return get_positional(name);
+    }
+
+    char *value = NULL;
+    if (vars != NULL) {
+        value = table_get(vars, name);
+    }
+    if (value == NULL) {
+        value = getenv(name);
+    }
+    return value;
+}
+
+// Set the positional parameters
+char **set_positional(char **args) {
+    char **previous = positional;
+    positional = args;
+    return previous;
+}
+
+// Set a variable
+void set_var(char *name, char *value) {
+    if (getenv(name) != NULL) {
+        setenv(name, value, 1);
+        return;
+    }
+    if (vars == NULL) {
+        vars = table_new();
+    }
+    free(table_set(vars, name, strdup(value)));
+}
+
+// Lock the variables for a builtin run on a thread
+void lock_vars(void) {
+    pthread_mutex_lock(&vars_lock);
+}
+
+void unlock_vars(void) {
+    pthread_mutex_unlock(&vars_lock);
+}
+
+// Check if word is an assignment
+int is_assignment(char *word) {
+    if (!is_name_start(word[0])) {
+        return 0;
+    }
+    int i = 1;
+    while (is_name_char(word[i])) {
+        i++;
+    }
+    return word[i] == '=';
+}
+
+// Set every assignment in the array
+void assign_words(char **words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        char *equals = strchr(words[i], '=');
+        *equals = '\0';
+        set_var(words[i], equals + 1);
+        *equals = '=';
+    }
+}
+
+// Expand every word in the array
+char **expand_words(char **words) {
+    char **expanded_words = malloc((array_size(words)+1)*sizeof(*words));
+    int k = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        // Each positional parameter stays a word of its own, quoted
+        // if `$@' was
+        int quoted = !strcmp(words[i], "\"$@\"");
+        if (quoted || !strcmp(words[i], "$@")) {
+            // Room for the words so far, the parameters and the words
+            // still to come
+            int num_args = positional == NULL ? 0 : array_size(positional);
+            expanded_words = realloc(expanded_words, 
+                (k + num_args + array_size(&words[i+1]) + 1)*sizeof(*words));
+            for (int j = 1; j < num_args; j++) {
+                size_t len = 0;
+                size_t cap = strlen(positional[j]) + 2;
+                char *arg = malloc(cap);
+                arg[0] = '\0';
+                append_value(&arg, &len, &cap, positional[j], 
+                             strlen(positional[j]), quoted);
+                if (quoted && len == 0) {
+                    append(&arg, &len, &cap, (char []) { QUOTE_MARK }, 1);
+                }
+                expanded_words[k++] = arg;
+            }
+            continue;
+        }
+
+        int expanded = 0;
+        int error = 0;
+        char *word = expand_word(words[i], &expanded, &error);
+        if (error) {
+            free(word);
+            expanded_words[k] = NULL;
+            free_array(expanded_words);
+            return NULL;
+        }
+        // Unset variables do not leave an empty word behind
+        if (expanded && word[0] == '\0') {
+            free(word);
+            continue;
+        }
+        expanded_words[k] = word;
+        k++;
+    }
+    expanded_words[k] = NULL;
+    return expanded_words;
+}
+
+// Evaluate an arithmetic expression
+int arith_eval(char *expr, long *result) {
+    struct arith a = { .s = expr, .error = 0 };
+    *result = arith_or(&a);
+    skip_spaces(&a);
+    if (!a.error && *a.s != '\0') {
+        fprintf(stderr, "%s: syntax error in expression\n", expr);
+        a.error = 1;
+    }
+    return a.error;
+}
+
+// Free all the variables
+void free_vars(void) {
+    table_free(vars, free);
+    vars = NULL;
+    free(positional_value);
+    positional_value = NULL;
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+static int is_name_start(char c) {
+    return isalpha((unsigned char) c) || c == '_';
+}
+
+static int is_name_char(char c) {
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+// Expand the `$'s in a single word, setting `expanded' if the
+// word contained any expansions
+static char *expand_word(char *word, int *expanded, int *error) {
+    size_t len = 0;
+    size_t cap = strlen(word) + 1;
+    char *buf = malloc(cap);
+    buf[0] = '\0';
+
+    // Process substitutions are expanded by the shell that runs them
+    if (((word[0] == '<' || word[0] == '>') && word[1] == '(')) {
+        append(&buf, &len, &cap, word, strlen(word));
+        return buf;
+    }
+
+    // Inside double quotes, and whether there were any quotes at all
+    int quoted = 0;
+    int had_quotes = 0;
+
+    char *s = word;
+    while (*s != '\0') {
+        size_t n = strcspn(s, quoted ? "$\"\\\001" : "$'\"\\\001");
+        append_value(&buf, &len, &cap, s, n, quoted);
+        s += n;
+        if (*s == '\0') {
+            break;
+        }
+
+        if (*s == '\'') {
+            // Single quotes keep everything up to the next `'' as it is
+            char *close = strchr(s + 1, '\'');
+            n = close != NULL ? (size_t) (close - (s + 1)) : strlen(s + 1);
+            append_value(&buf, &len, &cap, s + 1, n, 1);
+            s += n + (close != NULL ? 2 : 1);
+            had_quotes = 1;
+            continue;
+        }
+        if (*s == '"') {
+            quoted = !quoted;
+            had_quotes = 1;
+            s++;
+            continue;
+        }
+        if (*s == '\\') {
+            // Inside double quotes, a backslash only escapes
+            // characters that are special there
+            if (s[1] == '\0' || (quoted && strchr("$\"\\`", s[1]) == NULL)) {
+                append_value(&buf, &len, &cap, s, 1, 1);
+                s++;
+            } else {
+                append_value(&buf, &len, &cap, s + 1, 1, 1);
+                s += 2;
+            }
+            continue;
+        }
+        if (*s == QUOTE_MARK) {
+            append_value(&buf, &len, &cap, s, 1, 1);
+            s++;
+            continue;
+        }
+        s++;
+
+        char *end;
+        if (!strncmp(s, "((", 2) && (end = find_arith_end(s + 2)) != NULL) {
+            // $(( expression )), whose variables are expanded first
+            char *expr = strndup(s + 2, end - (s + 2));
+            int inner_expanded;
+            char *inner = expand_word(expr, &inner_expanded, error);
+            unquote_word(inner);
+            long value = 0;
+            if (!*error) {
+                *error = arith_eval(inner, &value);
+            }
+            free(inner);
+            free(expr);
+            if (*error) break;
+
+            char number[MAX_NUMBER_CHARS];
+            snprintf(number, sizeof number, "%ld", value);
+            append(&buf, &len, &cap, number, strlen(number));
+            s = end + 2;
+            *expanded = 1;
+            continue;
+        }
+
+        char *name = NULL;
+        if (*s == '{' && (end = strchr(s, '}')) != NULL) {
+            // ${NAME}
+            name = strndup(s + 1, end - (s + 1));
+            s = end + 1;
+        } 
+        else if (*s == '?' || *s == '#' || *s == '@' || *s == '*' || 
+                 isdigit((unsigned char) *s)) {
+            // Special parameters, and `$0' to `$9'
+            name = strndup(s, 1);
+            s++;
+        }
+        else if (is_name_start(*s)) {
+            end = s;
+            while (is_name_char(*end)) end++;
+            name = strndup(s, end - s);
+            s = end;
+        }
+
+        if (name == NULL) {
+            // Not an expansion, so keep the `$'
+            append(&buf, &len, &cap, "$", 1);
+            continue;
+        }
+
+        // A value in double quotes is taken literally, and one that
+        // is not may still be a pattern
+        char *value = get_var(name);
+        if (value != NULL) {
+            append_value(&buf, &len, &cap, value, strlen(value), quoted);
+        }
+        free(name);
+        *expanded = 1;
+    }
+
+    // An empty quoted word is still a word
+    if (had_quotes && len == 0) {
+        append(&buf, &len, &cap, (char []) { QUOTE_MARK }, 1);
+    }
+    return buf;
+}
+
+// Get a positional parameter, the number of them (`#'), or all of
+// them joined by spaces (`@' and `*')
+static char *get_positional(char *name) {
+    char *value = positional_value;
+    int num_args = positional == NULL ? 0 : array_size(positional);
+
+    if (!strcmp(name, "#")) {
+        free(value);
+        value = malloc(MAX_NUMBER_CHARS);
+        snprintf(value, MAX_NUMBER_CHARS, "%d", 
+                 num_args > 0 ? num_args-1 : 0);
+        positional_value = value;
+        return value;
+    }
+    if (!strcmp(name, "@") || !strcmp(name, "*")) {
+        size_t len = 0;
+        size_t cap = 1;
+        free(value);
+        value = malloc(cap);
+        value[0] = '\0';
+        for (int i = 1; i < num_args; i++) {
+            if (i > 1) append(&value, &len, &cap, " ", 1);
+            append(&value, &len, &cap, positional[i], strlen(positional[i]));
+        }
+        positional_value = value;
+        return value;
+    }
+
+    char *end;
+    long n = strtol(name, &end, 10);
+    if (*end != '\0' || n >= num_args) {
+        return NULL;
+    }
+    return positional[n];
+}
+
+// Append n characters of s to a growing string
+static void append(char **buf, size_t *len, size_t *cap, 
+                   const char *s, size_t n) {
+    if (*len + n + 1 > *cap) {
+        while (*len + n + 1 > *cap) *cap *= 2;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+// Append n characters of s, marking each one as quoted if `quoted'
+// is set. Unquoted characters that are quote marks are marked too,
+// so that they are kept
+static void append_value(char **buf, size_t *len, size_t *cap,
+                         const char *s, size_t n, int quoted) {
+    if (!quoted && memchr(s, QUOTE_MARK, n) == NULL) {
+        append(buf, len, cap, s, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (quoted || s[i] == QUOTE_MARK) {
+            append(buf, len, cap, (char []) { QUOTE_MARK }, 1);
+        }
+        append(buf, len, cap, &s[i], 1);
+    }
+}
+
+// Given the text after `$((', find the `))' that closes it
+static char *find_arith_end(char *s) {
+    int depth = 0;
+    for (; *s != '\0'; s++) {
+        if (*s == '(') {
+            depth++;
+        } else if (*s == ')') {
+            if (depth == 0) {
+                return s[1] == ')' ? s : NULL;
+            }
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+static void skip_spaces(struct arith *a) {
+    while (isspace((unsigned char) *a->s)) a->s++;
+}
+
+// Consume the operator if it is next in the expression. Callers try
+// longer operators first, so `<=' is never mistaken for `<'
+static int accept(struct arith *a, const char *op) {
+    skip_spaces(a);
+    size_t n = strlen(op);
+    if (strncmp(a->s, op, n) != 0) {
+        return 0;
+    }
+    a->s += n;
+    return 1;
+}
+
+static long arith_or(struct arith *a) {
+    long value = arith_and(a);
+    while (accept(a, "||")) {
+        long rhs = arith_and(a);
+        value = value || rhs;
+    }
+    return value;
+}
+
+static long arith_and(struct arith *a) {
+    long value = arith_equality(a);
+    while (accept(a, "&&")) {
+        long rhs = arith_equality(a);
+        value = value && rhs;
+    }
+    return value;
+}
+
+static long arith_equality(struct arith *a) {
+    long value = arith_relational(a);
+    while (1) {
+        if (accept(a, "==")) value = value == arith_relational(a);
+        else if (accept(a, "!=")) value = value != arith_relational(a);
+        else return value;
+    }
+}
+
+static long arith_relational(struct arith *a) {
+    long value = arith_additive(a);
+    while (1) {
+        if (accept(a, "<=")) value = value <= arith_additive(a);
+        else if (accept(a, ">=")) value = value >= arith_additive(a);
+        else if (accept(a, "<")) value = value < arith_additive(a);
+        else if (accept(a, ">")) value = value > arith_additive(a);
+        else return value;
+    }
+}
+
+static long arith_additive(struct arith *a) {
+    long value = arith_multiplicative(a);
+    while (1) {
+        if (accept(a, "+")) value += arith_multiplicative(a);
+        else if (accept(a, "-")) value -= arith_multiplicative(a);
+        else return value;
+    }
+}
+
+static long arith_multiplicative(struct arith *a) {
+    long value = arith_unary(a);
+    while (1) {
+        int op;
+        if (accept(a, "*")) op = '*';
+        else if (accept(a, "/")) op = '/';
+        else if (accept(a, "%")) op = '%';
+        else return value;
+
+        long rhs = arith_unary(a);
+        if (rhs == 0) {
+            if (!a->error) fprintf(stderr, "division by 0\n");
+            a->error = 1;
+            return 0;
+        }
+        if (op != '*' && rhs == -1) {
+            // The smallest long divided by -1 does not fit in a long,
+            // and traps rather than overflowing, so it wraps round to
+            // itself here as the other operators' overflows do
+            value = op == '/' ? (long) (0UL - (unsigned long) value) : 0;
+            continue;
+        }
+        value = op == '*' ? value * rhs : op == '/' ? value / rhs : value % rhs;
+    }
+}
+
+static long arith_unary(struct arith *a) {
+    if (accept(a, "-")) return -arith_unary(a);
+    if (accept(a, "+")) return arith_unary(a);
+    if (accept(a, "!")) return !arith_unary(a);
+    return arith_primary(a);
+}
+
+// A number, a variable name or a bracketed expression
+static long arith_primary(struct arith *a) {
+    skip_spaces(a);
+    if (accept(a, "(")) {
+        long value = arith_or(a);
+        if (!accept(a, ")") && !a->error) {
+            fprintf(stderr, "missing `)' in expression\n");
+            a->error = 1;
+        }
+        return value;
+    }
+    if (isdigit((unsigned char) *a->s)) {
+        return strtol(a->s, &a->s, 0);
+    }
+    if (is_name_start(*a->s)) {
+        char *end = a->s;
+        while (is_name_char(*end)) end++;
+        char *name = strndup(a->s, end - a->s);
+        char *value = get_var(name);
+        free(name);
+        a->s = end;
+        // Unset and non-numeric variables count as 0
+        return value != NULL ? strtol(value, NULL, 0) : 0;
+    }
+    if (!a->error) {
+        fprintf(stderr, "%s: syntax error: operand expected\n", a->s);
+    }
+    a->error = 1;
+    return 0;
+}
@@ -0,0 +1,55 @@
+// Shell variables, and the `$' expansions that use them:
+// `$NAME', `${NAME}', `$?', the positional parameters `$1'..., `$#',
+// `$@' and `$*', and `$(( arithmetic ))'
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shuck_helper.h"
+#include "shuck_table.h"
+
+// Get the value of a variable, looking in the shell's own variables
+// and then the environment. Returns NULL if the variable is not set
+char *get_var(char *name);
+
+// Set the positional parameters to `args', where args[0] is `$0'.
+// The array is not copied, and NULL means there are none. Returns
+// the previous parameters so that they can be restored
+char **set_positional(char **args);
+
+// Set a variable. Variables that came from the environment are
+// updated in the environment, so child processes see the change
+void set_var(char *name, char *value);
+
+// Builtins that are stages of one pipeline may run on threads of
+// their own (BUILTIN_PIPES), and the variables are not made to be
+// used by several at once, so those builtins hold this lock while
+// they get and set them
+void lock_vars(void);
+void unlock_vars(void);
+
+// Check if word has the form NAME=value
+int is_assignment(char *word);
+
+// Set every NAME=value word in the array
+void assign_words(char **words);
+
+// Return a copy of the words with all `$' expansions done and their
+// quotes taken off, leaving every quoted character marked (see
+// shuck_lex.h). `$' is not expanded in single quotes, and values
+// expanded in double quotes are marked too. Words that expand to
+// nothing are removed, and a word that is exactly `$@' or `"$@"'
+// becomes one word per positional parameter. Returns NULL (having
+// printed an error) if an arithmetic expansion is invalid
+char **expand_words(char **words);
+
+// Evaluate an arithmetic expression, storing its value in `result'.
+// Returns 0 on success, or 1 (having printed an error) if the
+// expression is invalid
+int arith_eval(char *expr, long *result);
+
+// Free all the shell's variables
+void free_vars(void);
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shuck_wait.h"
+
+// Helper functions
+static long now_ms(void);
+static void signal_remaining(pid_t *pids, int *done, int n, int sig);
+
+
+// Wait for processes, with an optional time limit
+int wait_processes(pid_t *pids, int n, int *statuses, 
+                   long timeout_ms, long kill_after_ms, int flags) {
+    return wait_processes_usage(pids, n, statuses, NULL, timeout_ms, 
+                                kill_after_ms, flags);
+}
+
+// Wait for processes, recording what they used
+int wait_processes_usage(pid_t *pids, int n, int *statuses, 
+                         struct rusage *usages, long timeout_ms, 
+                         long kill_after_ms, int flags) {
+    struct pollfd *fds = malloc(n*sizeof(*fds));
+    int *done = calloc(n, sizeof(*done));
+    int remaining = n;
+    int timed_out = 0;
+    int torn_down = 0;
+    int result = 0;
+
+    for (int i = 0; i < n; i++) {
+        fds[i].fd = process_fd(pids[i]);
+        fds[i].events = POLLIN;
+    }
+
+    long deadline = timeout_ms > 0 ? now_ms() + timeout_ms : -1;
+    while (remaining > 0) {
+        int wait_ms = -1;
+        if (deadline >= 0) {
+            long left = deadline - now_ms();
+            wait_ms = left > 0 ? (int) left : 0;
+        }
+
+        // Without pidfds there is no way to time out, so just wait
+        int ready = 0;
+        for (int i = 0; i < n; i++) {
+            if (!done[i] && fds[i].fd == -1) {
+                ready = 1;
+                fds[i].revents = POLLIN;
+            }
+        }
+        if (!ready) {
+            ready = poll(fds, n, wait_ms);
+            if (ready == -1 && errno != EINTR) {
+                perror("poll");
+                result = -1;
+                break;
+            }
+        }
+
+        if (ready == 0) {
+            // Out of time: ask nicely first, then insist
+            if (!timed_out) {
+                timed_out = 1;
+                signal_remaining(pids, done, n, SIGTERM);
+                deadline = kill_after_ms > 0 ? now_ms() + kill_after_ms : -1;
+            } else {
+                signal_remaining(pids, done, n, SIGKILL);
+                deadline = -1;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (done[i] || !(fds[i].revents & (POLLIN|POLLHUP|POLLERR))) {
+                continue;
+            }
+            if (wait4(pids[i], &statuses[i], 0, 
+                      usages != NULL ? &usages[i] : NULL) == -1) {
+                perror("wait4");
+                statuses[i] = 0;
+                result = -1;
+            }
+            done[i] = 1;
+            remaining--;
+            // poll ignores negative fds, so finished processes stop
+            // being watched
+            if (fds[i].fd != -1) close(fds[i].fd);
+            fds[i].fd = -1;
+            fds[i].revents = 0;
+
+            // Stop the rest of a pipeline that can no longer succeed.
+            // A stage killed by SIGPIPE is a symptom rather than a cause
+            int broken_pipe = WIFSIGNALED(statuses[i]) && 
+                              WTERMSIG(statuses[i]) == SIGPIPE;
+            if ((flags & WAIT_TEARDOWN) && !torn_down && remaining > 0 &&
+                exit_code(statuses[i]) != 0 && !broken_pipe) {
+                torn_down = 1;
+                signal_remaining(pids, done, n, SIGTERM);
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (fds[i].fd != -1) close(fds[i].fd);
+    }
+    free(fds);
+    free(done);
+    return result == -1 ? -1 : timed_out;
+}
+
+// Convert a wait status to an exit status
+int exit_code(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// Parse a duration into milliseconds
+long parse_duration(char *duration) {
+    char *end;
+    double value = strtod(duration, &end);
+    if (end == duration || value < 0) {
+        return -1;
+    }
+
+    double scale;
+    if (*end == '\0' || !strcmp(end, "s")) {
+        scale = 1000;
+    } else if (!strcmp(end, "ms")) {
+        scale = 1;
+    } else if (!strcmp(end, "m")) {
+        scale = 60 * 1000;
+    } else if (!strcmp(end, "h")) {
+        scale = 60 * 60 * 1000;
+    } else {
+        return -1;
+    }
+    return (long) (value * scale);
+}
+
+// Get a pidfd for the process
+int process_fd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    return -1;
+#endif
+}
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Milliseconds on a clock that never goes backwards
+static long now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// Send a signal to every process that has not finished
+static void signal_remaining(pid_t *pids, int *done, int n, int sig) {
+    for (int i = 0; i < n; i++) {
+        if (!done[i]) kill(pids[i], sig);
+    }
+}
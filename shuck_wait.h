@@ -0,0 +1,44 @@
+// Waiting for spawned processes. Each process is watched through a
+// pidfd, so that a whole pipeline can be waited on with poll(2) and
+// given a time limit, after which it is sent SIGTERM and, if it still
+// has not finished, SIGKILL.
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Exit status of a command that ran out of time, as for timeout(1)
+#define TIMEOUT_EXIT_STATUS 124
+
+// Flags for `wait_processes':
+// Send SIGTERM to the other processes as soon as one of them fails
+#define WAIT_TEARDOWN 1
+
+// Wait for all the processes to finish, storing their wait statuses.
+// Processes are reaped in whatever order they finish.
+// If `timeout_ms' is positive and the processes are still running
+// after that long, they are sent SIGTERM, then SIGKILL `kill_after_ms'
+// later. Returns 1 if the processes timed out, 0 if they all finished
+// in time, or -1 if they could not be waited for
+int wait_processes(pid_t *pids, int n, int *statuses, 
+                   long timeout_ms, long kill_after_ms, int flags);
+
+// Wait for the processes as `wait_processes' does, also storing the
+// resources each one used, as wait4(2) reports them, in `usages'
+int wait_processes_usage(pid_t *pids, int n, int *statuses, 
+                         struct rusage *usages, long timeout_ms, 
+                         long kill_after_ms, int flags);
+
+// Get a pidfd for the process, which is readable once it has finished
+// (and can then be reaped without blocking), or -1 if the kernel has
+// no pidfds
+int process_fd(pid_t pid);
+
+// Convert a wait status to an exit status, where a process killed
+// by a signal has the status 128 + the signal number
+int exit_code(int status);
+
+// Parse a duration such as `10', `1.5', `500ms', `2m' or `1h' into
+// milliseconds. Returns -1 if the duration is invalid
+long parse_duration(char *duration);
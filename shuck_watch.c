@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shuck_watch.h"
+#include "shuck_helper.h"
+#include "shuck_io.h"
+#include "shuck_lex.h"
+#include "shuck_table.h"
+#include "shuck_wait.h"
+
+// Room for many events per read(2), however long their names
+#define EVENT_BUFFER_SIZE 65536
+
+// Every kind of change to a directory or the entries in it
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | \
+                      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+
+// A directory being watched: either for changes to anything in it
+// (`whole'), or only to the entries named in `names'
+struct watched_dir {
+    char *path;
+    int whole;
+    struct table *names;
+};
+
+// The inotify instance and its directories, by watch descriptor
+struct watcher {
+    int fd;
+    struct watched_dir **dirs;
+    int max_dirs;
+    int num_dirs;
+};
+
+// The command, and its processes while it runs
+struct run {
+    char **command;
+    char **path;
+    char **env;
+    pid_t *pids;
+    int num_pids;
+    // The pathname of its last program, whose exit status is reported
+    char *pathname;
+    // A pidfd for each process still running, or -1
+    int *fds;
+    int num_running;
+    // Set if the processes could not be given pidfds, so the command
+    // can only be waited for
+    int blocking;
+    int status;
+};
+
+// Helper functions
+static int parse_watch_words(char **words, long *debounce_ms, int *cancel,
+                             char ***paths, char ***command);
+static int watch_path(struct watcher *w, char *path);
+static void watch_tree(struct watcher *w, char *path);
+static int add_watch(struct watcher *w, char *dir, char *name);
+static int read_events(struct watcher *w);
+static void forget_dir(struct watcher *w, int wd);
+static void free_watcher(struct watcher *w);
+static void start_run(struct run *r);
+static void finish_run(struct run *r, int cancelled);
+static void reap_finished(struct run *r, struct pollfd *fds);
+static char **copy_words(char **words);
+static long now_ms(void);
+
+
+// FUNCTIONS FOR SHUCK_WATCH
+
+// Run a command whenever the paths change
+int run_on_change(char **words, char **path, char **env) {
+    long debounce_ms = DEFAULT_DEBOUNCE_MS;
+    int cancel = 0;
+    char **paths = NULL;
+    char **command = NULL;
+    if (parse_watch_words(words, &debounce_ms, &cancel, &paths, &command)) {
+        return 2;
+    }
+
+    struct watcher w = { .fd = -1 };
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd == -1) {
+        perror("on-change: inotify_init1");
+        free_array(paths);
+        return 2;
+    }
+    int failed = 0;
+    for (int i = 0; paths[i] != NULL && !failed; i++) {
+        failed = watch_path(&w, paths[i]);
+    }
+    free_array(paths);
+    if (failed || w.num_dirs == 0) {
+        free_watcher(&w);
+        return 2;
+    }
+
+    // The command is run once to start with, and then for every
+    // burst of changes
+    struct run r = { .command = command, .path = path, .env = env };
+    start_run(&r);
+
+    int pending = 0;
+    int queued = 0;
+    long deadline = 0;
+    while (w.num_dirs > 0 || r.num_pids > 0) {
+        int num_fds = 1 + (r.num_pids > 0 ? r.num_pids : 0);
+        struct pollfd fds[1 + r.num_pids];
+        fds[0].fd = w.num_dirs > 0 ? w.fd : -1;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < r.num_pids; i++) {
+            fds[1+i].fd = r.fds[i];
+            fds[1+i].events = POLLIN;
+        }
+
+        int wait_ms = -1;
+        if (pending) {
+            long left = deadline - now_ms();
+            wait_ms = left > 0 ? (int) left : 0;
+        }
+        int ready = poll(fds, num_fds, wait_ms);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("on-change: poll");
+            break;
+        }
+
+        // Every change starts the quiet period again
+        if (fds[0].revents & POLLIN) {
+            if (read_events(&w)) {
+                pending = 1;
+                deadline = now_ms() + debounce_ms;
+            }
+            if (w.num_dirs == 0) {
+                fprintf(stderr, "on-change: nothing left to watch\n");
+                pending = 0;
+                queued = 0;
+            }
+        }
+
+        if (r.num_pids > 0) {
+            reap_finished(&r, &fds[1]);
+            if (r.num_pids == 0 && queued) {
+                queued = 0;
+                start_run(&r);
+            }
+        }
+
+        if (pending && now_ms() >= deadline) {
+            pending = 0;
+            if (r.num_pids == 0) {
+                start_run(&r);
+            } else if (cancel) {
+                finish_run(&r, 1);
+                start_run(&r);
+            } else {
+                queued = 1;
+            }
+        }
+    }
+    if (r.num_pids > 0) {
+        finish_run(&r, 1);
+    }
+
+    free_watcher(&w);
+    return r.status;
+}
+
+
+// HELPER FUNCTIONS FOR ABOVE FUNCTIONS
+
+// Split the words of `on-change' into its options, the paths and the
+// command. The paths are unquoted copies; the command is part of
+// `words'. Returns 1 (having printed an error) if they are invalid
+static int parse_watch_words(char **words, long *debounce_ms, int *cancel,
+                             char ***paths, char ***command) {
+    int i = 1;
+    while (words[i] != NULL && !strncmp(words[i], "--", 2) &&
+           words[i][2] != '\0') {
+        if (!strcmp(words[i], "--cancel")) {
+            *cancel = 1;
+        } else if (!strcmp(words[i], "--queue")) {
+            *cancel = 0;
+        } else if (!strcmp(words[i], "--debounce") && words[i+1] != NULL) {
+            // A bare number is milliseconds
+            char *end;
+            *debounce_ms = strtol(words[i+1], &end, 10);
+            if (*end != '\0') {
+                *debounce_ms = parse_duration(words[i+1]);
+            }
+            if (*debounce_ms < 0) {
+                fprintf(stderr, "on-change: --debounce: invalid time\n");
+                return 1;
+            }
+            i++;
+        } else {
+            fprintf(stderr, "on-change: %s: invalid option\n", words[i]);
+            return 1;
+        }
+        i++;
+    }
+
+    int separator = i;
+    while (words[separator] != NULL && strcmp(words[separator], "--")) {
+        separator++;
+    }
+    if (separator == i || words[separator] == NULL ||
+        words[separator+1] == NULL) {
+        fprintf(stderr, "usage: on-change [--debounce time] "
+                "[--cancel | --queue] path... -- command\n");
+        return 1;
+    }
+
+    // The command's input and output are the shell's, so only pipes
+    // are allowed
+    *command = &words[separator+1];
+    for (int j = 0; (*command)[j] != NULL; j++) {
+        if (!strcmp((*command)[j], "<") || !strcmp((*command)[j], ">") ||
+            !strcmp((*command)[j], ">>")) {
+            fprintf(stderr, "on-change: I/O redirection not permitted\n");
+            return 1;
+        }
+    }
+    if (validate_command(*command)) {
+        return 1;
+    }
+
+    *paths = calloc(separator - i + 1, sizeof(**paths));
+    for (int j = i; j < separator; j++) {
+        (*paths)[j-i] = strdup(words[j]);
+        unquote_word((*paths)[j-i]);
+    }
+    return 0;
+}
+
+// Watch a file, through its directory, or a directory and everything
+// below it. Returns 1 (having printed an error) if it cannot be
+static int watch_path(struct watcher *w, char *path) {
+    struct stat s;
+    if (stat(path, &s) == -1) {
+        fprintf(stderr, "on-change: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (S_ISDIR(s.st_mode)) {
+        if (add_watch(w, path, NULL)) {
+            return 1;
+        }
+        watch_tree(w, path);
+        return 0;
+    }
+
+    char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        return add_watch(w, ".", path);
+    }
+    char *dir = slash == path ? strdup("/") : strndup(path, slash - path);
+    int result = add_watch(w, dir, slash + 1);
+    free(dir);
+    return result;
+}
+
+// Watch every directory below `path', which is watched already,
+// except those starting with `.'. Directories that cannot be watched
+// are reported and left out
+static void watch_tree(struct watcher *w, char *path) {
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char *child;
+        if (asprintf(&child, "%s/%s", path, entry->d_name) == -1) {
+            break;
+        }
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat s;
+            is_dir = lstat(child, &s) == 0 && S_ISDIR(s.st_mode);
+        }
+        if (is_dir && !add_watch(w, child, NULL)) {
+            watch_tree(w, child);
+        }
+        free(child);
+    }
+    closedir(d);
+}
+
+// Watch the directory for changes to the entry `name', or to anything
+// in it if `name' is NULL. Returns 1 (having printed an error) if it
+// cannot be watched
+static int add_watch(struct watcher *w, char *dir, char *name) {
+    // A directory watched twice keeps its watch descriptor
+    int wd = inotify_add_watch(w->fd, dir, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd == -1) {
+        fprintf(stderr, "on-change: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if (wd >= w->max_dirs) {
+        int max_dirs = w->max_dirs > 0 ? w->max_dirs : 16;
+        while (max_dirs <= wd) {
+            max_dirs *= 2;
+        }
+        w->dirs = realloc(w->dirs, max_dirs*sizeof(*w->dirs));
+        memset(&w->dirs[w->max_dirs], 0,
+               (max_dirs - w->max_dirs)*sizeof(*w->dirs));
+        w->max_dirs = max_dirs;
+    }
+
+    struct watched_dir *d = w->dirs[wd];
+    if (d == NULL) {
+        d = calloc(1, sizeof(*d));
+        d->path = strdup(dir);
+        w->dirs[wd] = d;
+        w->num_dirs++;
+    }
+    if (name == NULL) {
+        d->whole = 1;
+    } else {
+        if (d->names == NULL) {
+            d->names = table_new();
+        }
+        table_set(d->names, name, d);
+    }
+    return 0;
+}
+
+// Read the events that have come in, watching any directories created
+// in a directory watched whole. Returns 1 if any of them changed
+// something being watched
+static int read_events(struct watcher *w) {
+    char buffer[EVENT_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    while (1) {
+        ssize_t n = read(w->fd, buffer, sizeof(buffer));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        struct inotify_event *event;
+        for (char *p = buffer; p < buffer + n;
+             p += sizeof(*event) + event->len) {
+            event = (struct inotify_event *) p;
+
+            // Events were lost, so anything may have changed
+            if (event->mask & IN_Q_OVERFLOW) {
+                changed = 1;
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= w->max_dirs ||
+                w->dirs[event->wd] == NULL) {
+                continue;
+            }
+            struct watched_dir *d = w->dirs[event->wd];
+
+            // The directory itself has gone
+            if (event->mask & IN_IGNORED) {
+                forget_dir(w, event->wd);
+                continue;
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                changed |= d->whole;
+                continue;
+            }
+
+            if (d->whole) {
+                changed = 1;
+                if ((event->mask & IN_ISDIR) &&
+                    (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                    event->name[0] != '.') {
+                    char *child;
+                    if (asprintf(&child, "%s/%s", d->path,
+                                 event->name) != -1) {
+                        if (!add_watch(w, child, NULL)) {
+                            watch_tree(w, child);
+                        }
+                        free(child);
+                    }
+                }
+            } else if (event->len > 0 &&
+                       table_get(d->names, event->name) != NULL) {
+                changed = 1;
+            }
+        }
+    }
+    return changed;
+}
+
+// Stop keeping a directory whose watch has been removed
+static void forget_dir(struct watcher *w, int wd) {
+    struct watched_dir *d = w->dirs[wd];
+    free(d->path);
+    table_free(d->names, NULL);
+    free(d);
+    w->dirs[wd] = NULL;
+    w->num_dirs--;
+}
+
+// Close the inotify instance and free its directories
+static void free_watcher(struct watcher *w) {
+    for (int wd = 0; wd < w->max_dirs; wd++) {
+        if (w->dirs[wd] != NULL) {
+            forget_dir(w, wd);
+        }
+    }
+    free(w->dirs);
+    if (w->fd != -1) close(w->fd);
+}
+
+// Start the command, with /dev/null as its standard input. The words
+// are copied, since starting a command takes the quotes off its words
+static void start_run(struct run *r) {
+    int in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    char **command = copy_words(r->command);
+    r->num_pids = start_command(command, r->path, r->env,
+                                in != -1 ? in : 0, 0, &r->pids, 
+                                &r->pathname);
+    free_array(command);
+    if (r->num_pids < 0) {
+        r->num_pids = 0;
+        r->status = 127;
+        return;
+    }
+
+    r->fds = malloc(r->num_pids*sizeof(*r->fds));
+    r->num_running = r->num_pids;
+    r->blocking = 0;
+    for (int i = 0; i < r->num_pids; i++) {
+        r->fds[i] = process_fd(r->pids[i]);
+        r->blocking |= r->fds[i] == -1;
+    }
+
+    // Without pidfds the command's end cannot be polled for, so it is
+    // waited for here, and changes while it runs are seen afterwards
+    if (r->blocking) {
+        finish_run(r, 0);
+    }
+}
+
+// Wait for the command to finish, stopping it first if `cancelled',
+// and report the exit status of its last program as a program's is
+static void finish_run(struct run *r, int cancelled) {
+    for (int i = 0; i < r->num_pids; i++) {
+        if (cancelled && r->fds[i] != -1) {
+            kill(r->pids[i], SIGTERM);
+        }
+    }
+    int *statuses = calloc(r->num_pids, sizeof(*statuses));
+    wait_processes(r->pids, r->num_pids, statuses,
+                   cancelled ? CANCEL_KILL_AFTER_MS : 0,
+                   CANCEL_KILL_AFTER_MS, 0);
+    r->status = exit_code(statuses[r->num_pids - 1]);
+    if (cancelled) {
+        printf("%s cancelled, exit status = %d\n", r->pathname, r->status);
+    } else {
+        report_exit_status(r->pathname, statuses[r->num_pids - 1], 0, NULL, 
+                           NULL);
+    }
+    fflush(stdout);
+    free(statuses);
+
+    for (int i = 0; i < r->num_pids; i++) {
+        if (r->fds[i] != -1) close(r->fds[i]);
+    }
+    free(r->fds);
+    free(r->pids);
+    free(r->pathname);
+    r->fds = NULL;
+    r->pids = NULL;
+    r->pathname = NULL;
+    r->num_pids = 0;
+    r->num_running = 0;
+}
+
+// Note which of the command's processes have finished, given their
+// pidfds' poll results, and reap them all once every one has
+static void reap_finished(struct run *r, struct pollfd *fds) {
+    for (int i = 0; i < r->num_pids; i++) {
+        if (r->fds[i] != -1 && (fds[i].revents & (POLLIN | POLLHUP))) {
+            close(r->fds[i]);
+            r->fds[i] = -1;
+            r->num_running--;
+        }
+    }
+    if (r->num_running == 0) {
+        finish_run(r, 0);
+    }
+}
+
+// Copy an array of words
+static char **copy_words(char **words) {
+    int n = array_size(words);
+    char **copy = malloc((n+1)*sizeof(*copy));
+    for (int i = 0; i < n; i++) {
+        copy[i] = strdup(words[i]);
+    }
+    copy[n] = NULL;
+    return copy;
+}
+
+// Milliseconds on a clock that never goes backwards
+static long now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
@@ -0,0 +1,47 @@
+// The `on-change' builtin: run a command, then run it again whenever
+// the files it depends on change, without polling.
+//
+//     on-change [--debounce TIME] [--cancel | --queue] path... -- command
+//
+// The paths have been expanded like any command's words (by
+// init_glob_words in shuck_helper.h), so `src/*.c' watches every file
+// it matched. A directory is watched with everything below it,
+// except directories starting with `.' (such as `.git'), including
+// directories created in it later. A file is watched through the
+// directory it is in, so that an editor replacing it by renaming a
+// new file over it is still seen.
+//
+// Changes are watched for with inotify(7). Every change restarts a
+// quiet period of TIME (in milliseconds, or with a unit as for
+// parse_duration in shuck_wait.h; 100ms by default), and the command
+// is run once that has passed, so a burst of changes, such as a `git
+// checkout', runs it once. If the command is still running then, it
+// is run again as soon as it finishes (`--queue', the default), or
+// stopped and started again (`--cancel').
+//
+// The command is started as a pipeline is (start_command in
+// shuck_io.h), with /dev/null as its standard input, and its exit
+// status is reported after every run. A command writing into a
+// watched directory is seen changing it. `on-change' runs until it is
+// interrupted, or until everything it watched has been removed.
+
+#ifndef SHUCK_WATCH_H
+#define SHUCK_WATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_DEBOUNCE_MS 100
+// How long a cancelled command is given to stop after SIGTERM,
+// before it is sent SIGKILL
+#define CANCEL_KILL_AFTER_MS 2000
+
+// Run the `on-change' command given by `words', which are still
+// quoted (BUILTIN_REDIRECTS) so that a `|' reaches the command.
+// Returns the exit status of the last run of the command, or 2
+// (having printed an error) if the words are not a valid `on-change'
+// or nothing could be watched
+int run_on_change(char **words, char **path, char **env);
+
+#endif
@@ -0,0 +1,3 @@
+batch echo one two three
+batch -P 2 echo four five
+batch sh -c 'kill -9 $$' x
@@ -0,0 +1,3 @@
+echo one
+false
+echo two
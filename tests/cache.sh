@@ -0,0 +1,4 @@
+cache echo cached
+cache echo cached
+cache sh -c 'exit 3'
+cache sh -c 'exit 3'
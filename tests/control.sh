@@ -0,0 +1,7 @@
+if false; then echo no; elif true; then echo elif; else echo else; fi
+for x in a b c; do echo item $x; done
+i=0; while [ $i -lt 3 ]; do echo loop $i; i=$((i + 1)); done
+echo $(( (2 + 3) * 4 % 7 ))
+echo $(( (-9223372036854775807-1) / -1 )) $(( (-9223372036854775807-1) % -1 )) $(( 7 / -1 )) $(( -7 % -1 ))
+echo $(( 1 / 0 ))
+echo still running
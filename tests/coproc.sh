@@ -0,0 +1,15 @@
+coproc ed sed -u s/a/b/
+cowrite ed abc
+coread ed
+cowrite ed cat
+coread ed line
+echo $line
+coclose ed
+coproc c cat
+( exit )
+( exit ) | true
+( coclose c; echo closed in subshell $? )
+cowrite c hello
+coread c
+coclose c
+echo $?
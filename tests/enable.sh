@@ -0,0 +1,5 @@
+enable -f ./libup.so up
+up hello world
+enable | grep up
+enable -d up
+up hello
@@ -0,0 +1,2 @@
+echo hi > a > b
+cat a b
@@ -0,0 +1,8 @@
+args() { echo $# "$@"; }
+args a b
+many() { args "$@" "$@" "$@"; }
+many one two three four
+many
+greet() { echo hello $1; return 3; echo never; }
+greet world
+echo status $?
@@ -0,0 +1,22 @@
+mkdir d; touch d/a.c d/b.c d/c.h d/.hidden.c
+echo d/*.c
+echo d/?.h
+echo d/*.none
+mkdir -p a/b/c a/.hidden e; touch a/y.c a/b/z.c a/b/c/x.c a/b/c/x.h a/.hidden/w.c
+echo a/**/*.c
+echo a/**/
+echo ./a/**/
+echo e/**/ e/**/*.c nosuch/**/
+echo **/x.?
+echo a/**/c
+SHUCK_GLOB_THREADS=1
+echo a/**/*.c
+SHUCK_GLOB_THREADS=
+touch u1 u2 u3 u4 u5 u6 u7 u8
+SHUCK_GLOB_UNSORTED=1
+printf '%s\n' u* a/**/*.c | sort
+SHUCK_GLOB_UNSORTED=
+echo u*
+echo ~root ~root/bin ~no-such-user ~no-such-user/x
+[ ~ = $HOME ] && echo tilde is home
+echo ~/a/b/*.c | sed "s|^$HOME|HOME|"
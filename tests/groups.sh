@@ -0,0 +1,3 @@
+{ echo one; echo two; } | cat
+cd /usr; (cd /; pwd); pwd
+(echo sub; false); echo $?
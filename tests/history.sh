@@ -0,0 +1,4 @@
+echo first
+false
+history
+history --failed
@@ -0,0 +1,3 @@
+echo 'single  $HOME' "double  quoted"
+echo back\ slash "a\"b" 'it'"'"'s'
+echo a#b
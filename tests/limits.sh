@@ -0,0 +1,10 @@
+limit --mem 1G false
+limit --mem 1G echo fine
+limit --cpu 1 sh -c 'while :; do :; done'
+limit --cpu 1 sh -c 'kill -9 $$'
+limit --cpu 1 sh -c 'kill -XCPU $$'
+set -o pipefail
+limit --cpu 1 sh -c 'while :; do :; done' | true
+set +o pipefail
+ulimit -n 64
+ulimit -n
@@ -0,0 +1,3 @@
+true && echo and-ran; false || echo or-ran; false && echo never
+echo one; echo two
+false; echo after $?
@@ -0,0 +1,2 @@
+memstats extra
+memstats | grep -c rss
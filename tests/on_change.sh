@@ -0,0 +1,2 @@
+mkdir w
+on-change w -- rmdir w
@@ -0,0 +1,19 @@
+pwd | grep -c current
+set -o | grep pipefail
+enable -f ./libup.so up
+echo abc | up
+echo def > f
+< f up | cat
+up x y | cat
+set -o pipefail | true
+set -o | grep pipefail
+set -o pipefail > /dev/null
+set -o | grep pipefail
+set +o pipefail
+ulimit -n 100 | cat
+ulimit -n | grep -c 100
+enable -d up | cat
+up z
+coproc c sed -u s/a/b/
+cowrite c abc
+coread c | up
@@ -0,0 +1,6 @@
+true | false | true
+echo $PIPESTATUS
+set -o pipefail
+true | false | true
+set +o pipefail
+true | false | true
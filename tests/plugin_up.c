@@ -0,0 +1,50 @@
+// A loaded builtin for the tests: `up' writes its arguments, one a
+// line, or with no arguments its input, in upper case
+
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shuck_plugin.h"
+
+static void write_upper(int fd, const char *data, size_t n) {
+    char upper[4096];
+    while (n > 0) {
+        size_t length = n < sizeof(upper) ? n : sizeof(upper);
+        for (size_t i = 0; i < length; i++) {
+            upper[i] = toupper((unsigned char) data[i]);
+        }
+        size_t written = 0;
+        while (written < length) {
+            ssize_t w = write(fd, upper + written, length - written);
+            if (w <= 0) {
+                return;
+            }
+            written += w;
+        }
+        data += length;
+        n -= length;
+    }
+}
+
+static int run_up(int argc, char **argv, struct shuck_env *env,
+                  int in_fd, int out_fd) {
+    (void) env;
+    for (int i = 1; i < argc; i++) {
+        write_upper(out_fd, argv[i], strlen(argv[i]));
+        write(out_fd, "\n", 1);
+    }
+    if (argc > 1) {
+        return 0;
+    }
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(in_fd, buffer, sizeof(buffer))) > 0) {
+        write_upper(out_fd, buffer, n);
+    }
+    return n == 0 ? 0 : 1;
+}
+
+struct shuck_builtin up_builtin = {
+    SHUCK_PLUGIN_VERSION, run_up, "up [word...]"
+};
@@ -0,0 +1,2 @@
+cat <(echo hi)
+diff <(echo a) <(echo a) && echo same
@@ -0,0 +1,4 @@
+echo one two > f
+< f read a b
+echo $b $a
+printf 'x\ny\n' | { read l; echo got $l; }
@@ -0,0 +1,84 @@
+#!/bin/sh
+# Run scripts through shuck and compare what it prints with what it
+# should print.
+#
+#     tests/run.sh [shuck] [name...]
+#
+# Every tests/NAME.sh is fed to the shell (./shuck by default) on its
+# standard input, and its standard output and error are compared with
+# tests/NAME.out. Each script runs in an empty directory of its own,
+# which is also `$HOME', so it starts with no history, and with
+# nothing else in its environment but `$PATH', set to /usr/bin:/bin
+# so that programs are reported by the same pathnames everywhere. If
+# they exist, tests/NAME.rc is its `~/.shuckrc', tests/NAME.args
+# holds the shell's arguments and tests/NAME.env variables to set,
+# one VAR=value a line. Every
+# tests/plugin_NAME.c is built into each directory as `libNAME.so',
+# for `enable -f'.
+#
+# With UPDATE=1 set, the .out files are written instead of compared.
+
+tests=$(cd "$(dirname "$0")" && pwd)
+shuck=${1:-./shuck}
+[ $# -gt 0 ] && shift
+case $shuck in
+    /*) ;;
+    *) shuck=$(pwd)/$shuck ;;
+esac
+if [ ! -x "$shuck" ]; then
+    echo "$0: $shuck: not executable" >&2
+    exit 2
+fi
+
+scratch=$(mktemp -d "${TMPDIR:-/tmp}/shuck-tests.XXXXXX") || exit 2
+trap 'rm -rf "$scratch"' EXIT
+for plugin in "$tests"/plugin_*.c; do
+    [ -f "$plugin" ] || continue
+    library=lib$(basename "$plugin" .c | sed 's/^plugin_//').so
+    if ! ${CC:-cc} -shared -fPIC -I "$tests/.." -o "$scratch/$library" \
+            "$plugin"; then
+        echo "$0: cannot build $plugin" >&2
+        exit 2
+    fi
+done
+
+if [ $# -eq 0 ]; then
+    set -- $(cd "$tests" && ls *.sh | sed 's/\.sh$//' | grep -v '^run$')
+fi
+
+passed=0
+failed=0
+for name in "$@"; do
+    dir=$scratch/$name
+    mkdir "$dir"
+    for library in "$scratch"/lib*.so; do
+        [ -f "$library" ] && cp "$library" "$dir/"
+    done
+    [ -f "$tests/$name.rc" ] && cp "$tests/$name.rc" "$dir/.shuckrc"
+    (
+        cd "$dir" || exit 2
+        args=
+        [ -f "$tests/$name.args" ] && args=$(cat "$tests/$name.args")
+        set -- HOME="$dir" PATH=/usr/bin:/bin
+        if [ -f "$tests/$name.env" ]; then
+            while IFS= read -r assignment; do
+                set -- "$@" "$assignment"
+            done < "$tests/$name.env"
+        fi
+        env -i "$@" timeout 60 "$shuck" $args < "$tests/$name.sh"
+    ) > "$dir.actual" 2>&1
+
+    if [ -n "$UPDATE" ]; then
+        cp "$dir.actual" "$tests/$name.out"
+    elif diff -u "$tests/$name.out" "$dir.actual" > "$dir.diff"; then
+        passed=$((passed + 1))
+    else
+        echo "FAIL $name"
+        cat "$dir.diff"
+        failed=$((failed + 1))
+    fi
+done
+
+[ -n "$UPDATE" ] && exit 0
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]
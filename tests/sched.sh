@@ -0,0 +1,4 @@
+affinity 0 echo pinned
+sched -n 5 echo niced
+affinity nope echo never
+sched -p
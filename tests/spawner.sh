@@ -0,0 +1,3 @@
+echo spawned
+sh -c 'exit 4'
+echo $?
@@ -0,0 +1,2 @@
+greet
+echo $GREETING
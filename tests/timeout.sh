@@ -0,0 +1,3 @@
+timeout 100ms sleep 5
+timeout 5s echo quick
+timeout nope echo never